@@ -21,6 +21,7 @@ import android.content.Context;
 import android.os.Build;
 import android.os.Environment;
 import android.os.Parcel;
+import android.os.ParcelFileDescriptor;
 import android.os.Parcelable;
 import android.support.annotation.NonNull;
 import android.support.annotation.Nullable;
@@ -39,6 +40,7 @@ import java.io.File;
 import java.io.FileNotFoundException;
 import java.io.FileOutputStream;
 import java.io.IOException;
+import java.io.InputStream;
 import java.nio.ByteBuffer;
 
 import mbtool.daemon.v3.FileOpenFlag;
@@ -405,6 +407,8 @@ public class RomUtils {
 
         String wallpaperPath = info.getDataPath() + "/system/users/0/wallpaper";
         File wallpaperCacheFile = new File(info.getWallpaperPath());
+        ParcelFileDescriptor pfd = null;
+        InputStream is = null;
         FileOutputStream fos = null;
 
         int id = -1;
@@ -426,25 +430,40 @@ public class RomUtils {
                 return CacheWallpaperResult.FAILED;
             }
 
-            // Read file into memory
-            byte[] data = new byte[(int) sb.st_size];
-            int nWritten = 0;
-            while (nWritten < data.length) {
-                ByteBuffer newData = iface.fileRead(id, 10240);
-
-                int nRead = newData.limit() - newData.position();
-                newData.get(data, nWritten, nRead);
-                nWritten += nRead;
-            }
-
             iface.fileClose(id);
             id = -1;
 
-            fos = new FileOutputStream(wallpaperCacheFile);
-
             // Compression can be very slow (more than 10 seconds) for a large wallpaper, so we'll
             // just cache the actual file instead
-            fos.write(data);
+
+            // Copy the file directly if the daemon can give us the file descriptor
+            pfd = iface.fileOpenFd(wallpaperPath, new short[]{ FileOpenFlag.RDONLY }, 0);
+            if (pfd != null) {
+                is = new ParcelFileDescriptor.AutoCloseInputStream(pfd);
+                pfd = null;
+
+                fos = new FileOutputStream(wallpaperCacheFile);
+                IOUtils.copy(is, fos);
+            } else {
+                id = iface.fileOpen(wallpaperPath, new short[]{ FileOpenFlag.RDONLY }, 0);
+
+                // Read file into memory
+                byte[] data = new byte[(int) sb.st_size];
+                int nWritten = 0;
+                while (nWritten < data.length) {
+                    ByteBuffer newData = iface.fileRead(id, 10240);
+
+                    int nRead = newData.limit() - newData.position();
+                    newData.get(data, nWritten, nRead);
+                    nWritten += nRead;
+                }
+
+                iface.fileClose(id);
+                id = -1;
+
+                fos = new FileOutputStream(wallpaperCacheFile);
+                fos.write(data);
+            }
 
             // Load into bitmap
             //Bitmap bitmap = BitmapFactory.decodeByteArray(data, 0, data.length);
@@ -467,6 +486,8 @@ public class RomUtils {
                     // Ignore
                 }
             }
+            IOUtils.closeQuietly(pfd);
+            IOUtils.closeQuietly(is);
             IOUtils.closeQuietly(fos);
         }
     }
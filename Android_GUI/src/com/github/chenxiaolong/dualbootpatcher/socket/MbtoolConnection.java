@@ -178,10 +178,11 @@ public class MbtoolConnection implements Closeable {
     }
 
     @Nullable
-    private static MbtoolInterface createInterface(InputStream is, OutputStream os, int version) {
+    private static MbtoolInterface createInterface(LocalSocket socket, InputStream is,
+                                                   OutputStream os, int version) {
         switch (version) {
         case 3:
-            return new MbtoolInterfaceV3(is, os);
+            return new MbtoolInterfaceV3(socket, is, os);
         default:
             return null;
         }
@@ -201,7 +202,7 @@ public class MbtoolConnection implements Closeable {
         initRequestInterface(mSocketIS, mSocketOS, PROTOCOL_VERSION);
 
         // Set up interface
-        mInterface = createInterface(mSocketIS, mSocketOS, PROTOCOL_VERSION);
+        mInterface = createInterface(mSocket, mSocketIS, mSocketOS, PROTOCOL_VERSION);
 
         // Check version
         initVerifyVersion(mInterface, MbtoolUtils.getMinimumRequiredVersion(Feature.DAEMON));
@@ -350,7 +351,7 @@ public class MbtoolConnection implements Closeable {
                 initRequestInterface(socketIS, socketOS, i);
 
                 // Create interface
-                MbtoolInterface iface = createInterface(socketIS, socketOS, i);
+                MbtoolInterface iface = createInterface(socket, socketIS, socketOS, i);
                 if (iface == null) {
                     throw new IllegalStateException("Failed to create interface for version: " + i);
                 }
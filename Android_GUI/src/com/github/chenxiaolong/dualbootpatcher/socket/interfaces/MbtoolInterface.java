@@ -18,7 +18,9 @@
 package com.github.chenxiaolong.dualbootpatcher.socket.interfaces;
 
 import android.content.Context;
+import android.os.ParcelFileDescriptor;
 import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
 
 import com.github.chenxiaolong.dualbootpatcher.RomUtils.RomInformation;
 import com.github.chenxiaolong.dualbootpatcher.Version;
@@ -70,6 +72,25 @@ public interface MbtoolInterface {
     int fileOpen(String path, short[] flags, int perms) throws IOException, MbtoolException,
             MbtoolCommandException;
 
+    /**
+     * Open a file and receive its file descriptor from the daemon
+     *
+     * The file can then be read or written directly instead of through {@link #fileRead} and
+     * {@link #fileWrite}. The daemon's copy of the file descriptor is closed before returning.
+     *
+     * @param path Path to file
+     * @param flags Flags (see {@link FileOpenFlag})
+     * @param perms File mode (ignored unless {@link FileOpenFlag#CREAT} is provided)
+     * @return File descriptor or null if the daemon or Android version does not support passing
+     *         file descriptors
+     * @throws IOException
+     * @throws MbtoolException
+     * @throws MbtoolCommandException
+     */
+    @Nullable
+    ParcelFileDescriptor fileOpenFd(String path, short[] flags, int perms) throws IOException,
+            MbtoolException, MbtoolCommandException;
+
     /**
      * Read data from an opened file
      *
@@ -17,8 +17,15 @@
 
 package com.github.chenxiaolong.dualbootpatcher.socket.interfaces;
 
+import android.annotation.TargetApi;
 import android.content.Context;
+import android.net.LocalSocket;
+import android.os.Build;
+import android.os.ParcelFileDescriptor;
 import android.support.annotation.NonNull;
+import android.support.annotation.Nullable;
+import android.system.ErrnoException;
+import android.system.Os;
 import android.util.Log;
 
 import com.github.chenxiaolong.dualbootpatcher.RomUtils.RomInformation;
@@ -33,6 +40,8 @@ import com.github.chenxiaolong.dualbootpatcher.switcher.SwitcherUtils;
 import com.google.flatbuffers.FlatBufferBuilder;
 import com.google.flatbuffers.Table;
 
+import java.io.EOFException;
+import java.io.FileDescriptor;
 import java.io.IOException;
 import java.io.InputStream;
 import java.io.OutputStream;
@@ -132,10 +141,12 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
     /** Flatbuffers buffer size (same as the C++ default) */
     private static final int FBB_SIZE = 1024;
 
+    private LocalSocket mSocket;
     private InputStream mIS;
     private OutputStream mOS;
 
-    public MbtoolInterfaceV3(InputStream is, OutputStream os) {
+    public MbtoolInterfaceV3(LocalSocket socket, InputStream is, OutputStream os) {
+        mSocket = socket;
         mIS = is;
         mOS = os;
     }
@@ -349,6 +360,83 @@ public class MbtoolInterfaceV3 implements MbtoolInterface {
         return response.id();
     }
 
+    @Nullable
+    public synchronized ParcelFileDescriptor fileOpenFd(String path, short[] flags, int perms)
+            throws IOException, MbtoolException, MbtoolCommandException {
+        // Received file descriptors can only be closed with Os.close()
+        if (Build.VERSION.SDK_INT < Build.VERSION_CODES.LOLLIPOP) {
+            return null;
+        }
+
+        // Create request
+        FlatBufferBuilder builder = new FlatBufferBuilder(FBB_SIZE);
+
+        int fbPath = builder.createString(path);
+        int fbFlags = FileOpenRequest.createFlagsVector(builder, flags);
+
+        FileOpenRequest.startFileOpenRequest(builder);
+        FileOpenRequest.addPath(builder, fbPath);
+        FileOpenRequest.addFlags(builder, fbFlags);
+        FileOpenRequest.addPerms(builder, perms);
+        FileOpenRequest.addSendFd(builder, true);
+        int fbRequest = FileOpenRequest.endFileOpenRequest(builder);
+
+        // Send request
+        FileOpenResponse response = (FileOpenResponse)
+                sendRequest(builder, fbRequest, RequestType.FileOpenRequest,
+                        ResponseType.FileOpenResponse);
+
+        FileOpenError error = response.error();
+        if (error != null) {
+            throw new MbtoolCommandException(
+                    error.errnoValue(), "[" + path + "]: open failed: " + error.msg());
+        }
+
+        try {
+            // Older daemons ignore send_fd
+            return response.hasFd() ? receiveFd() : null;
+        } finally {
+            // We have our own copy of the file descriptor if it was sent
+            fileClose(response.id());
+        }
+    }
+
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    @NonNull
+    private ParcelFileDescriptor receiveFd() throws IOException, MbtoolException {
+        // The file descriptor is attached to a single byte sent after the response
+        if (mIS.read() < 0) {
+            throw new EOFException();
+        }
+
+        FileDescriptor[] fds = mSocket.getAncillaryFileDescriptors();
+        if (fds == null || fds.length != 1) {
+            closeFds(fds);
+            throw new MbtoolException(Reason.PROTOCOL_ERROR,
+                    "Expected 1 file descriptor from daemon");
+        }
+
+        try {
+            return ParcelFileDescriptor.dup(fds[0]);
+        } finally {
+            closeFds(fds);
+        }
+    }
+
+    @TargetApi(Build.VERSION_CODES.LOLLIPOP)
+    private static void closeFds(@Nullable FileDescriptor[] fds) {
+        if (fds == null) {
+            return;
+        }
+        for (FileDescriptor fd : fds) {
+            try {
+                Os.close(fd);
+            } catch (ErrnoException e) {
+                Log.w(TAG, "Failed to close received file descriptor", e);
+            }
+        }
+    }
+
     @NonNull
     public synchronized ByteBuffer fileRead(int id, long size) throws IOException, MbtoolException,
             MbtoolCommandException {
@@ -19,25 +19,29 @@ public final class FileOpenResponse extends Table {
   public int id() { int o = __offset(8); return o != 0 ? bb.getInt(o + bb_pos) : 0; }
   public FileOpenError error() { return error(new FileOpenError()); }
   public FileOpenError error(FileOpenError obj) { int o = __offset(10); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
+  public boolean hasFd() { int o = __offset(12); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
 
   public static int createFileOpenResponse(FlatBufferBuilder builder,
       boolean success,
       int error_msgOffset,
       int id,
-      int errorOffset) {
-    builder.startObject(4);
+      int errorOffset,
+      boolean has_fd) {
+    builder.startObject(5);
     FileOpenResponse.addError(builder, errorOffset);
     FileOpenResponse.addId(builder, id);
     FileOpenResponse.addErrorMsg(builder, error_msgOffset);
+    FileOpenResponse.addHasFd(builder, has_fd);
     FileOpenResponse.addSuccess(builder, success);
     return FileOpenResponse.endFileOpenResponse(builder);
   }
 
-  public static void startFileOpenResponse(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void startFileOpenResponse(FlatBufferBuilder builder) { builder.startObject(5); }
   public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
   public static void addErrorMsg(FlatBufferBuilder builder, int errorMsgOffset) { builder.addOffset(1, errorMsgOffset, 0); }
   public static void addId(FlatBufferBuilder builder, int id) { builder.addInt(2, id, 0); }
   public static void addError(FlatBufferBuilder builder, int errorOffset) { builder.addOffset(3, errorOffset, 0); }
+  public static void addHasFd(FlatBufferBuilder builder, boolean hasFd) { builder.addBoolean(4, hasFd, false); }
   public static int endFileOpenResponse(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -55,6 +55,7 @@ elseif(${MBP_BUILD_TARGET} STREQUAL android-system)
     include(cmake/dependencies/procps-ng.cmake)
     include(cmake/dependencies/safe-iop.cmake)
     include(cmake/dependencies/zlib.cmake)
+    include(cmake/dependencies/zstd.cmake)
 
     set(CMAKE_FIND_LIBRARY_SUFFIXES ${CMAKE_FIND_LIBRARY_SUFFIXES_OLD})
     unset(CMAKE_FIND_LIBRARY_SUFFIXES_OLD)
@@ -0,0 +1,18 @@
+# zstd is optional until prebuilts are available for all ABIs. If it is not
+# found, mbtool's backups will not support zstd compression.
+if(ANDROID AND EXISTS ${THIRD_PARTY_ZSTD_DIR}/${ANDROID_ABI})
+    set(ZSTD_INCLUDE_DIR
+        ${THIRD_PARTY_ZSTD_DIR}/${ANDROID_ABI}/include)
+    set(ZSTD_LIBRARY
+        ${THIRD_PARTY_ZSTD_DIR}/${ANDROID_ABI}/lib/libzstd.a)
+endif()
+
+find_package(Zstd)
+
+if(ZSTD_FOUND)
+    set(MBP_ZSTD_FOUND TRUE)
+    set(MBP_ZSTD_INCLUDES ${ZSTD_INCLUDE_DIR})
+    set(MBP_ZSTD_LIBRARIES ${ZSTD_LIBRARIES})
+else()
+    set(MBP_ZSTD_FOUND FALSE)
+endif()
@@ -0,0 +1,22 @@
+# Find the zstd include directory and library
+#
+# ZSTD_INCLUDE_DIR - Where to find <zstd.h>
+# ZSTD_LIBRARIES   - List of zstd libraries
+# ZSTD_FOUND       - True if zstd found
+
+# Find include directory
+find_path(ZSTD_INCLUDE_DIR NAMES zstd.h)
+
+# Find library
+find_library(ZSTD_LIBRARY NAMES zstd libzstd)
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(
+    Zstd DEFAULT_MSG ZSTD_INCLUDE_DIR ZSTD_LIBRARY
+)
+
+if(ZSTD_FOUND)
+    set(ZSTD_LIBRARIES ${ZSTD_LIBRARY})
+endif()
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
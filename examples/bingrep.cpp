@@ -19,8 +19,11 @@
 
 #include "mbcommon/file_util.h"
 
+#include <chrono>
 #include <limits>
+#include <string>
 #include <type_traits>
+#include <vector>
 
 #include <cerrno>
 #include <cinttypes>
@@ -36,18 +39,24 @@
 
 static void usage(FILE *stream, const char *prog_name)
 {
-    fprintf(stream, "Usage: %s {-p <hex> | -t <text>} [option...] [<file>...]\n"
+    fprintf(stream, "Usage: %s {-p <hex> | -t <text>}... [option...] [<file>...]\n"
                     "\n"
                     "Options:\n"
                     "  -p, --hex <hex pattern>\n"
                     "                  Search file for hex pattern\n"
                     "  -t, --text <text pattern>\n"
+                    "  -e <text pattern>\n"
                     "                  Search file for text pattern\n"
                     "  -n, --num-matches\n"
                     "                  Maximum number of matches\n"
                     "  --start-offset  Starting boundary offset for search\n"
                     "  --end-offset    Ending boundary offset for search\n"
-                    "  --buffer-size   Buffer size\n",
+                    "  --buffer-size   Buffer size\n"
+                    "  --benchmark     Print search throughput instead of matches\n"
+                    "\n"
+                    "Patterns can be specified multiple times. All patterns are searched\n"
+                    "for in a single pass and each match is printed along with the pattern\n"
+                    "that matched.\n",
                     prog_name);
 }
 
@@ -146,34 +155,87 @@ static bool hex_to_binary(const char *hex, void **data, size_t *data_size)
     return true;
 }
 
+struct Pattern
+{
+    // Pattern as specified on the command line
+    const char *arg;
+    std::string data;
+};
+
+struct SearchCtx
+{
+    const char *name;
+    const std::vector<Pattern> *patterns;
+    bool print_matches;
+};
+
 static int search_result_cb(struct MbFile *file, void *userdata,
-                            uint64_t offset)
+                            size_t index, uint64_t offset)
 {
     (void) file;
-    const char *name = static_cast<char *>(userdata);
-    printf("%s: 0x%016" PRIx64 "\n", name, offset);
+    SearchCtx *ctx = static_cast<SearchCtx *>(userdata);
+
+    if (!ctx->print_matches) {
+        // Benchmark mode
+    } else if (ctx->patterns->size() == 1) {
+        printf("%s: 0x%016" PRIx64 "\n", ctx->name, offset);
+    } else {
+        printf("%s: 0x%016" PRIx64 ": %s\n", ctx->name, offset,
+               (*ctx->patterns)[index].arg);
+    }
     return MB_FILE_OK;
 }
 
 static bool search(const char *name, struct MbFile *file,
-                   int64_t start, int64_t end,
-                   size_t bsize, const void *pattern,
-                   size_t pattern_size, int64_t max_matches)
+                   int64_t start, int64_t end, size_t bsize,
+                   const std::vector<Pattern> &patterns, int64_t max_matches,
+                   bool benchmark)
 {
-    int ret = mb_file_search(file, start, end, bsize, pattern, pattern_size,
-                             max_matches, &search_result_cb,
-                             const_cast<char *>(name));
+    std::vector<MbFileSearchPattern> mb_patterns;
+    for (auto const &p : patterns) {
+        mb_patterns.push_back({ p.data.data(), p.data.size() });
+    }
+
+    SearchCtx ctx{ name, &patterns, !benchmark };
+    uint64_t file_size = 0;
+    bool have_file_size = false;
+
+    if (benchmark) {
+        have_file_size =
+                mb_file_seek(file, 0, SEEK_END, &file_size) == MB_FILE_OK
+                && mb_file_seek(file, 0, SEEK_SET, nullptr) == MB_FILE_OK;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+
+    int ret = mb_file_search_multi(file, start, end, bsize,
+                                   mb_patterns.data(), mb_patterns.size(),
+                                   max_matches, &search_result_cb, &ctx);
     if (ret != MB_FILE_OK) {
         fprintf(stderr, "%s: Search failed: %s\n",
                 name, mb_file_error_string(file));
         return false;
     }
+
+    if (benchmark) {
+        double seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - begin).count();
+
+        if (have_file_size && seconds > 0) {
+            printf("%s: %" PRIu64 " bytes in %.3f s (%.1f MiB/s)\n",
+                   name, file_size, seconds,
+                   file_size / seconds / 1024 / 1024);
+        } else {
+            printf("%s: %.3f s\n", name, seconds);
+        }
+    }
+
     return true;
 }
 
-static bool search_stdin(int64_t start, int64_t end,
-                         size_t bsize, const void *pattern,
-                         size_t pattern_size, int64_t max_matches)
+static bool search_stdin(int64_t start, int64_t end, size_t bsize,
+                         const std::vector<Pattern> &patterns,
+                         int64_t max_matches, bool benchmark)
 {
     MbFile *file = mb_file_new();
     if (!file) {
@@ -188,16 +250,16 @@ static bool search_stdin(int64_t start, int64_t end,
         return false;
     }
 
-    bool ret = search("stdin", file, start, end, bsize, pattern, pattern_size,
-                      max_matches);
+    bool ret = search("stdin", file, start, end, bsize, patterns,
+                      max_matches, benchmark);
 
     mb_file_free(file);
     return ret;
 }
 
 static bool search_file(const char *path, int64_t start, int64_t end,
-                        size_t bsize, const void *pattern,
-                        size_t pattern_size, int64_t max_matches)
+                        size_t bsize, const std::vector<Pattern> &patterns,
+                        int64_t max_matches, bool benchmark)
 {
     MbFile *file = mb_file_new();
     if (!file) {
@@ -212,8 +274,8 @@ static bool search_file(const char *path, int64_t start, int64_t end,
         return false;
     }
 
-    bool ret = search(path, file, start, end, bsize, pattern, pattern_size,
-                      max_matches);
+    bool ret = search(path, file, start, end, bsize, patterns, max_matches,
+                      benchmark);
 
     mb_file_free(file);
     return ret;
@@ -226,11 +288,8 @@ int main(int argc, char *argv[])
     size_t bsize = 0;
     int64_t max_matches = -1;
 
-    const char *text_pattern = nullptr;
-    const char *hex_pattern = nullptr;
-    void *pattern = nullptr;
-    size_t pattern_size = 0;
-    bool pattern_needs_free = false;
+    std::vector<Pattern> patterns;
+    bool benchmark = false;
 
     int opt;
 
@@ -240,9 +299,10 @@ int main(int argc, char *argv[])
         OPT_START_OFFSET         = CHAR_MAX + 1,
         OPT_END_OFFSET           = CHAR_MAX + 2,
         OPT_BUFFER_SIZE          = CHAR_MAX + 3,
+        OPT_BENCHMARK            = CHAR_MAX + 4,
     };
 
-    static const char short_options[] = "hn:p:t:";
+    static const char short_options[] = "e:hn:p:t:";
 
     static struct option long_options[] = {
         // Arguments with short versions
@@ -254,6 +314,7 @@ int main(int argc, char *argv[])
         {"start-offset", required_argument, 0, OPT_START_OFFSET},
         {"end-offset",   required_argument, 0, OPT_END_OFFSET},
         {"buffer-size",  required_argument, 0, OPT_BUFFER_SIZE},
+        {"benchmark",    no_argument,       0, OPT_BENCHMARK},
         {0, 0, 0, 0}
     };
 
@@ -270,12 +331,25 @@ int main(int argc, char *argv[])
             }
             break;
 
-        case 'p':
-            hex_pattern = optarg;
+        case 'p': {
+            void *data;
+            size_t size;
+
+            if (!hex_to_binary(optarg, &data, &size)) {
+                fprintf(stderr, "Invalid hex pattern: %s: %s\n",
+                        optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+
+            patterns.push_back({ optarg, std::string(
+                    static_cast<char *>(data), size) });
+            free(data);
             break;
+        }
 
+        case 'e':
         case 't':
-            text_pattern = optarg;
+            patterns.push_back({ optarg, optarg });
             break;
 
         case OPT_START_OFFSET:
@@ -302,6 +376,10 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case OPT_BENCHMARK:
+            benchmark = true;
+            break;
+
         case 'h':
             usage(stdout, argv[0]);
             return EXIT_SUCCESS;
@@ -312,38 +390,32 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!hex_pattern && !text_pattern) {
+    if (patterns.empty()) {
         fprintf(stderr, "No pattern provided\n");
         return EXIT_FAILURE;
-    } else if (hex_pattern) {
-        if (!hex_to_binary(hex_pattern, &pattern, &pattern_size)) {
-            fprintf(stderr, "Invalid hex pattern: %s\n", strerror(errno));
+    }
+
+    for (auto const &p : patterns) {
+        if (p.data.empty()) {
+            fprintf(stderr, "Empty pattern provided\n");
             return EXIT_FAILURE;
         }
-        pattern_needs_free = true;
-    } else if (text_pattern) {
-        pattern = const_cast<char *>(text_pattern);
-        pattern_size = strlen(text_pattern);
     }
 
     bool ret = true;
 
     if (optind == argc) {
-        ret = search_stdin(start, end, bsize, pattern, pattern_size,
-                           max_matches);
+        ret = search_stdin(start, end, bsize, patterns, max_matches,
+                           benchmark);
     } else {
         for (int i = optind; i < argc; ++i) {
-            bool ret2 = search_file(argv[i], start, end, bsize, pattern,
-                                    pattern_size, max_matches);
+            bool ret2 = search_file(argv[i], start, end, bsize, patterns,
+                                    max_matches, benchmark);
             if (!ret2) {
                 ret = false;
             }
         }
     }
 
-    if (pattern_needs_free) {
-        free(pattern);
-    }
-
     return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
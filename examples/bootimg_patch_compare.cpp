@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Check that MultiBootPatcher::patchBootImage(), which streams Android, bump,
+// and loki images through libmbbootimg, produces the same boot image as
+// patching the ramdisk of a BootImage and calling BootImage::create().
+
+#include <memory>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <mbdevice/json.h>
+#include <mbdevice/validate.h>
+#include <mblog/logging.h>
+#include <mbp/bootimage.h>
+#include <mbp/fileinfo.h>
+#include <mbp/patcherconfig.h>
+#include <mbp/patchers/multibootpatcher.h>
+
+
+typedef std::unique_ptr<Device, void (*)(Device *)> ScopedDevice;
+
+// Used to detect when patchBootImage() fell back to BootImage
+#define FALLBACK_MESSAGE "Falling back to BootImage"
+
+class FallbackLogger : public mb::log::BaseLogger
+{
+public:
+    bool fell_back = false;
+
+    virtual void log(mb::log::LogLevel prio, const char *fmt, va_list ap) override
+    {
+        (void) prio;
+
+        char buf[1024];
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+
+        if (strstr(buf, FALLBACK_MESSAGE)) {
+            fell_back = true;
+        }
+    }
+};
+
+static bool file_read_all(const std::string &path,
+                          std::vector<unsigned char> *data_out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    auto size = ftell(fp);
+    rewind(fp);
+
+    std::vector<unsigned char> data(size);
+    if (fread(data.data(), size, 1, fp) != 1) {
+        fclose(fp);
+        return false;
+    }
+
+    data_out->swap(data);
+
+    fclose(fp);
+    return true;
+}
+
+static Device * get_device(const char *path)
+{
+    std::vector<unsigned char> contents;
+    if (!file_read_all(path, &contents)) {
+        fprintf(stderr, "%s: Failed to read file: %s\n", path, strerror(errno));
+        return nullptr;
+    }
+    contents.push_back('\0');
+
+    MbDeviceJsonError error;
+    Device *device = mb_device_new_from_json(
+            (const char *) contents.data(), &error);
+    if (!device) {
+        fprintf(stderr, "%s: Failed to load devices\n", path);
+        return nullptr;
+    }
+
+    if (mb_device_validate(device) != 0) {
+        fprintf(stderr, "%s: Validation failed\n", path);
+        mb_device_free(device);
+        return nullptr;
+    }
+
+    return device;
+}
+
+static bool patch_with_bootimage(mbp::PatcherConfig *pc,
+                                 const mbp::FileInfo *fi,
+                                 const std::vector<unsigned char> &input,
+                                 std::vector<unsigned char> *output,
+                                 mbp::BootImage::Type *type)
+{
+    mbp::BootImage bi;
+    if (!bi.load(input)) {
+        return false;
+    }
+
+    *type = bi.wasType();
+
+    std::vector<unsigned char> ramdisk = bi.ramdiskImage();
+    if (!mbp::MultiBootPatcher::patchRamdisk(pc, fi, &ramdisk, nullptr)) {
+        return false;
+    }
+    bi.setRamdiskImage(std::move(ramdisk));
+
+    return bi.create(output);
+}
+
+static bool compare_image(mbp::PatcherConfig *pc, const mbp::FileInfo *fi,
+                          FallbackLogger *logger, const char *path)
+{
+    std::vector<unsigned char> input;
+    if (!file_read_all(path, &input)) {
+        fprintf(stderr, "%s: Failed to read file: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    std::vector<unsigned char> expected;
+    mbp::BootImage::Type type;
+    if (!patch_with_bootimage(pc, fi, input, &expected, &type)) {
+        fprintf(stderr, "%s: Failed to patch with BootImage\n", path);
+        return false;
+    }
+
+    logger->fell_back = false;
+
+    std::vector<unsigned char> actual(std::move(input));
+    mbp::ErrorCode error;
+    if (!mbp::MultiBootPatcher::patchBootImage(pc, fi, &actual, &error)) {
+        fprintf(stderr, "%s: Failed to patch boot image: %d\n",
+                path, static_cast<int>(error));
+        return false;
+    }
+
+    bool streamable = type == mbp::BootImage::Type::Android
+            || type == mbp::BootImage::Type::Bump
+            || type == mbp::BootImage::Type::Loki;
+
+    if (streamable && logger->fell_back) {
+        fprintf(stderr, "%s: Boot image was not patched by streaming\n", path);
+        return false;
+    }
+
+    if (actual != expected) {
+        fprintf(stderr, "%s: Output differs from BootImage::create()\n", path);
+        return false;
+    }
+
+    printf("%s: %s\n", path, streamable
+           ? "Streamed output matches BootImage::create()"
+           : "Not streamable; patched with BootImage");
+
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <device file> <rom id> <boot image>...\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    const char *device_file = argv[1];
+    const char *rom_id = argv[2];
+
+    auto logger = std::make_shared<FallbackLogger>();
+    mb::log::log_set_logger(logger);
+
+    ScopedDevice device(get_device(device_file), mb_device_free);
+    if (!device) {
+        return EXIT_FAILURE;
+    }
+
+    mbp::PatcherConfig pc;
+    pc.setDataDirectory("data");
+
+    mbp::FileInfo fi;
+    fi.setDevice(device.get());
+    fi.setRomId(rom_id);
+
+    bool ret = true;
+
+    for (int i = 3; i < argc; ++i) {
+        ret = compare_image(&pc, &fi, logger.get(), argv[i]) && ret;
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
+}
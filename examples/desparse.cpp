@@ -17,13 +17,24 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <string>
 
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "mbcommon/file/filename.h"
+#include "mbcommon/file_util.h"
 #include "mbsparse/sparse.h"
 
 typedef std::unique_ptr<MbFile, int (*)(MbFile *)> ScopedMbFile;
@@ -88,71 +99,316 @@ bool cbSeek(int64_t offset, int whence, void *userData)
     return true;
 }
 
-int main(int argc, char *argv[])
+// Output file and positional I/O state for parallel extraction
+struct ParallelContext
 {
-    if (argc != 3) {
-        std::fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    const char *inputFile = argv[1];
-    const char *outputFile = argv[2];
+    const char *inputPath;
+    const char *outputPath;
+    int inputFd;
+    int outputFd;
+    // Cleared if copy_file_range() is not supported
+    std::atomic<bool> canCopy;
+};
 
-    Context ctx;
-    ctx.path = inputFile;
-    ctx.file.reset(mb_file_new());
+static bool cbReadAt(void *buf, uint64_t size, uint64_t offset, void *userData)
+{
+    ParallelContext *ctx = static_cast<ParallelContext *>(userData);
+    char *ptr = static_cast<char *>(buf);
+    while (size > 0) {
+        ssize_t n = pread64(ctx->inputFd, ptr, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            fprintf(stderr, "%s: Failed to read: %s\n", ctx->inputPath,
+                    n == 0 ? "Unexpected EOF" : strerror(errno));
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
 
-    if (!ctx.file) {
-        fprintf(stderr, "Out of memory\n");
-        return EXIT_FAILURE;
+static bool cbWriteAt(const void *buf, uint64_t size, uint64_t offset,
+                      void *userData)
+{
+    ParallelContext *ctx = static_cast<ParallelContext *>(userData);
+    const char *ptr = static_cast<const char *>(buf);
+    while (size > 0) {
+        ssize_t n = pwrite64(ctx->outputFd, ptr, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            fprintf(stderr, "%s: Failed to write: %s\n",
+                    ctx->outputPath, strerror(errno));
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
     }
+    return true;
+}
 
-    ScopedSparseCtx sparseCtx(sparseCtxNew(), &sparseCtxFree);
-    if (!sparseCtx) {
-        fprintf(stderr, "Out of memory\n");
-        return EXIT_FAILURE;
+static bool copyBuffered(uint64_t srcOffset, uint64_t dstOffset, uint64_t size,
+                         void *userData)
+{
+    char buf[1024 * 1024];
+    while (size > 0) {
+        uint64_t n = std::min<uint64_t>(sizeof(buf), size);
+        if (!cbReadAt(buf, n, srcOffset, userData)
+                || !cbWriteAt(buf, n, dstOffset, userData)) {
+            return false;
+        }
+        srcOffset += n;
+        dstOffset += n;
+        size -= n;
     }
+    return true;
+}
 
-    if (!sparseOpen(sparseCtx.get(), &cbOpen, &cbClose, &cbRead, &cbSeek,
-                    nullptr, &ctx)) {
-        return EXIT_FAILURE;
+static bool cbCopy(uint64_t srcOffset, uint64_t dstOffset, uint64_t size,
+                   void *userData)
+{
+#ifdef __NR_copy_file_range
+    ParallelContext *ctx = static_cast<ParallelContext *>(userData);
+
+    while (size > 0 && ctx->canCopy) {
+        loff_t srcOff = srcOffset;
+        loff_t dstOff = dstOffset;
+        long n = syscall(__NR_copy_file_range, ctx->inputFd, &srcOff,
+                         ctx->outputFd, &dstOff, size, 0u);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == ENOSYS || errno == EXDEV
+                || errno == EINVAL || errno == EOPNOTSUPP)) {
+            // Kernel or filesystem does not support it
+            ctx->canCopy = false;
+            break;
+        } else if (n <= 0) {
+            fprintf(stderr, "%s: Failed to copy data: %s\n", ctx->outputPath,
+                    n == 0 ? "Unexpected EOF" : strerror(errno));
+            return false;
+        }
+        srcOffset += n;
+        dstOffset += n;
+        size -= n;
     }
+#endif
 
+    return copyBuffered(srcOffset, dstOffset, size, userData);
+}
+
+static bool extractSequential(SparseCtx *sparseCtx, const char *outputFile)
+{
     ScopedMbFile file(mb_file_new(), &mb_file_free);
-    if (!ctx.file) {
+    if (!file) {
         fprintf(stderr, "Out of memory\n");
-        return EXIT_FAILURE;
+        return false;
     }
 
     if (mb_file_open_filename(file.get(), outputFile, MB_FILE_OPEN_WRITE_ONLY)
             != MB_FILE_OK) {
         fprintf(stderr, "%s: Failed to open for writing: %s\n",
                 outputFile, mb_file_error_string(file.get()));
-        return EXIT_FAILURE;
+        return false;
+    }
+
+    uint64_t fileSize;
+    if (!sparseSize(sparseCtx, &fileSize)) {
+        return false;
     }
 
     uint64_t bytesRead;
     char buf[10240];
-    bool ret;
-    while ((ret = sparseRead(sparseCtx.get(), buf, sizeof(buf), &bytesRead))
-            && bytesRead > 0) {
-        char *ptr = buf;
-        size_t bytesWritten;
-        while (bytesRead > 0) {
-            if (mb_file_write(file.get(), buf, bytesRead, &bytesWritten)
-                    != MB_FILE_OK) {
-                fprintf(stderr, "%s: Failed to write: %s\n",
+    SparseChunk chunk;
+
+    while (true) {
+        if (!sparseGetChunk(sparseCtx, &chunk)) {
+            return false;
+        } else if (chunk.begin == chunk.end) {
+            // EOF
+            break;
+        }
+
+        // Leave holes for zero-filled and don't care ranges. The output file
+        // was truncated when it was opened, so they will read back as zeros.
+        if (chunk.type == CHUNK_TYPE_DONT_CARE
+                || (chunk.type == CHUNK_TYPE_FILL && chunk.fillVal == 0)) {
+            if (!sparseSkipChunk(sparseCtx)) {
+                return false;
+            }
+            if (mb_file_seek(file.get(), chunk.end - chunk.begin, SEEK_CUR,
+                             nullptr) != MB_FILE_OK) {
+                fprintf(stderr, "%s: Failed to seek: %s\n",
                         outputFile, mb_file_error_string(file.get()));
+                return false;
+            }
+            continue;
+        }
+
+        if (!sparseRead(sparseCtx, buf, std::min<uint64_t>(
+                sizeof(buf), chunk.end - chunk.begin), &bytesRead)) {
+            return false;
+        } else if (bytesRead == 0) {
+            break;
+        }
+
+        size_t bytesWritten;
+        if (mb_file_write_fully(file.get(), buf, bytesRead, &bytesWritten)
+                != MB_FILE_OK || bytesWritten != bytesRead) {
+            fprintf(stderr, "%s: Failed to write: %s\n",
+                    outputFile, mb_file_error_string(file.get()));
+            return false;
+        }
+    }
+
+    // Extend the file if it ends with a hole
+    if (mb_file_truncate(file.get(), fileSize) != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to set file size: %s\n",
+                outputFile, mb_file_error_string(file.get()));
+        return false;
+    }
+
+    return mb_file_close(file.get()) == MB_FILE_OK;
+}
+
+static bool extractParallel(SparseCtx *sparseCtx, const char *inputFile,
+                            const char *outputFile, unsigned int jobs)
+{
+    ParallelContext ctx;
+    ctx.inputPath = inputFile;
+    ctx.outputPath = outputFile;
+    ctx.canCopy = true;
+
+    uint64_t fileSize;
+    if (!sparseSize(sparseCtx, &fileSize)) {
+        return false;
+    }
+
+    ctx.inputFd = open(inputFile, O_RDONLY | O_CLOEXEC);
+    if (ctx.inputFd < 0) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                inputFile, strerror(errno));
+        return false;
+    }
+
+    ctx.outputFd = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        0666);
+    if (ctx.outputFd < 0) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                outputFile, strerror(errno));
+        close(ctx.inputFd);
+        return false;
+    }
+
+    bool ret = true;
+
+    // Zero-filled and don't care ranges are left as holes
+    if (ftruncate64(ctx.outputFd, fileSize) < 0) {
+        fprintf(stderr, "%s: Failed to set file size: %s\n",
+                outputFile, strerror(errno));
+        ret = false;
+    } else if (!sparseExtractParallel(sparseCtx, &cbReadAt, &cbWriteAt,
+                                      &cbCopy, &ctx, jobs)) {
+        ret = false;
+    }
+
+    if (close(ctx.outputFd) < 0) {
+        fprintf(stderr, "%s: Failed to close: %s\n",
+                outputFile, strerror(errno));
+        ret = false;
+    }
+    close(ctx.inputFd);
+
+    return ret;
+}
+
+static void usage(FILE *stream, const char *progName)
+{
+    fprintf(stream, "Usage: %s [option...] <input file> <output file>\n"
+                    "\n"
+                    "Options:\n"
+                    "  -j, --jobs <N>  Extract using N threads (0 = number of"
+                    " CPUs)\n",
+                    progName);
+}
+
+int main(int argc, char *argv[])
+{
+    long jobs = -1;
+    char *end;
+    int opt;
+
+    static const char shortOptions[] = "hj:";
+
+    static struct option longOptions[] = {
+        {"help", no_argument,       0, 'h'},
+        {"jobs", required_argument, 0, 'j'},
+        {0, 0, 0, 0}
+    };
+
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, shortOptions,
+                              longOptions, &longIndex)) != -1) {
+        switch (opt) {
+        case 'j':
+            errno = 0;
+            jobs = strtol(optarg, &end, 10);
+            if (errno != 0 || *optarg == '\0' || *end != '\0' || jobs < 0
+                    || jobs > UINT_MAX) {
+                fprintf(stderr, "Invalid value for -j/--jobs: %s\n", optarg);
                 return EXIT_FAILURE;
             }
-            bytesRead -= bytesWritten;
-            ptr += bytesWritten;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
         }
     }
-    if (!ret) {
+
+    if (argc - optind != 2) {
+        usage(stderr, argv[0]);
         return EXIT_FAILURE;
     }
 
-    return mb_file_close(file.get()) == MB_FILE_OK
-            ? EXIT_SUCCESS : EXIT_FAILURE;
+    const char *inputFile = argv[optind];
+    const char *outputFile = argv[optind + 1];
+
+    Context ctx;
+    ctx.path = inputFile;
+    ctx.file.reset(mb_file_new());
+
+    if (!ctx.file) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    ScopedSparseCtx sparseCtx(sparseCtxNew(), &sparseCtxFree);
+    if (!sparseCtx) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!sparseOpen(sparseCtx.get(), &cbOpen, &cbClose, &cbRead, &cbSeek,
+                    nullptr, &ctx)) {
+        return EXIT_FAILURE;
+    }
+
+    bool ret;
+    if (jobs >= 0) {
+        ret = extractParallel(sparseCtx.get(), inputFile, outputFile,
+                              static_cast<unsigned int>(jobs));
+    } else {
+        ret = extractSequential(sparseCtx.get(), outputFile);
+    }
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "mblog/logging.h"
+#include "mblog/stdio_logger.h"
+#include "mbsparse/sparse.h"
+
+#define DEFAULT_BLOCK_SIZE      4096
+#define READ_BUFFER_SIZE        (1024 * 1024)
+
+typedef std::unique_ptr<SparseWriterCtx, bool (*)(SparseWriterCtx *)>
+        ScopedSparseWriterCtx;
+
+struct Context
+{
+    const char *inputPath;
+    const char *outputPath;
+    int inputFd;
+    int outputFd;
+    uint64_t inputSize;
+    uint32_t blockSize;
+    bool skipZeros;
+};
+
+static bool cbWrite(const void *buf, uint64_t size, void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    const char *ptr = static_cast<const char *>(buf);
+    while (size > 0) {
+        ssize_t n = write(ctx->outputFd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            fprintf(stderr, "%s: Failed to write: %s\n",
+                    ctx->outputPath, strerror(errno));
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool cbSeek(int64_t offset, int whence, void *userData)
+{
+    Context *ctx = static_cast<Context *>(userData);
+    if (lseek64(ctx->outputFd, offset, whence) < 0) {
+        fprintf(stderr, "%s: Failed to seek: %s\n",
+                ctx->outputPath, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool readFully(Context *ctx, void *buf, size_t size)
+{
+    char *ptr = static_cast<char *>(buf);
+    while (size > 0) {
+        ssize_t n = read(ctx->inputFd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            fprintf(stderr, "%s: Failed to read: %s\n", ctx->inputPath,
+                    n == 0 ? "Unexpected EOF" : strerror(errno));
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*!
+ * \brief Find the end of the data or hole that \p offset is in
+ *
+ * Holes are reported in whole blocks only. If the input does not support
+ * SEEK_DATA/SEEK_HOLE, it is treated as data.
+ */
+static uint64_t findExtentEnd(Context *ctx, uint64_t offset, bool *isData)
+{
+    off64_t data = lseek64(ctx->inputFd, offset, SEEK_DATA);
+    off64_t end;
+
+    if (data < 0 && errno == ENXIO) {
+        // Hole until EOF
+        *isData = false;
+        end = ctx->inputSize;
+    } else if (data < 0) {
+        *isData = true;
+        return ctx->inputSize;
+    } else if (static_cast<uint64_t>(data) > offset) {
+        *isData = false;
+        end = data;
+    } else {
+        off64_t hole = lseek64(ctx->inputFd, offset, SEEK_HOLE);
+        *isData = true;
+        return hole < 0 ? ctx->inputSize
+                : std::min<uint64_t>(hole, ctx->inputSize);
+    }
+
+    // Partial blocks at either end of a hole are read as data
+    uint64_t alignedStart = offset + (ctx->blockSize - offset % ctx->blockSize)
+            % ctx->blockSize;
+    uint64_t alignedEnd = end - end % ctx->blockSize;
+    if (alignedStart != offset || alignedEnd <= offset) {
+        *isData = true;
+        return std::min<uint64_t>(
+                offset + ctx->blockSize - offset % ctx->blockSize,
+                ctx->inputSize);
+    }
+    return alignedEnd;
+}
+
+static bool convert(Context *ctx, SparseWriterCtx *writer)
+{
+    std::vector<unsigned char> buf(READ_BUFFER_SIZE);
+    uint64_t offset = 0;
+
+    while (offset < ctx->inputSize) {
+        bool isData;
+        uint64_t end = findExtentEnd(ctx, offset, &isData);
+
+        if (!isData) {
+            bool ret = ctx->skipZeros
+                    ? sparseWriterAddDontCare(writer, end - offset)
+                    : sparseWriterAddFill(writer, 0, end - offset);
+            if (!ret) {
+                return false;
+            }
+            offset = end;
+            continue;
+        }
+
+        if (lseek64(ctx->inputFd, offset, SEEK_SET) < 0) {
+            fprintf(stderr, "%s: Failed to seek: %s\n",
+                    ctx->inputPath, strerror(errno));
+            return false;
+        }
+
+        while (offset < end) {
+            size_t n = std::min<uint64_t>(buf.size(), end - offset);
+            if (!readFully(ctx, buf.data(), n)
+                    || !sparseWriterWrite(writer, buf.data(), n)) {
+                return false;
+            }
+            offset += n;
+        }
+    }
+
+    // Pad the last block with zeros
+    uint64_t remainder = ctx->inputSize % ctx->blockSize;
+    if (remainder != 0) {
+        std::fill(buf.begin(), buf.end(), 0);
+        if (!sparseWriterWrite(writer, buf.data(),
+                               ctx->blockSize - remainder)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool writeSparseFile(Context *ctx, SparseWriterCtx *writer,
+                            bool sequential)
+{
+    uint64_t size = (ctx->inputSize + ctx->blockSize - 1)
+            / ctx->blockSize * ctx->blockSize;
+
+    if (sequential) {
+        // Count the chunks first since the header must be written before the
+        // chunks
+        uint32_t count;
+
+        if (!sparseWriterOpen(writer, ctx->blockSize, size, nullptr, nullptr,
+                              nullptr, nullptr, nullptr)) {
+            return false;
+        }
+        if (!convert(ctx, writer)) {
+            sparseWriterClose(writer);
+            return false;
+        }
+        if (!sparseWriterClose(writer)
+                || !sparseWriterGetChunkCount(writer, &count)
+                || !sparseWriterSetChunkCount(writer, count)) {
+            return false;
+        }
+    }
+
+    if (!sparseWriterOpen(writer, ctx->blockSize, size, nullptr, nullptr,
+                          &cbWrite, sequential ? nullptr : &cbSeek, ctx)) {
+        return false;
+    }
+    if (!convert(ctx, writer)) {
+        sparseWriterClose(writer);
+        return false;
+    }
+    return sparseWriterClose(writer);
+}
+
+static void usage(FILE *stream, const char *progName)
+{
+    fprintf(stream, "Usage: %s [option...] <input file> <output file>\n"
+                    "\n"
+                    "Options:\n"
+                    "  -b, --block-size <N>  Block size (default: %d)\n"
+                    "  -c, --crc32           Write CRC32 chunk\n"
+                    "  -z, --skip-zeros      Store zero blocks as \"don't"
+                    " care\"\n"
+                    "  -s, --sequential      Write output sequentially"
+                    " (implied if output\n"
+                    "                        file is '-' for stdout)\n",
+                    progName, DEFAULT_BLOCK_SIZE);
+}
+
+int main(int argc, char *argv[])
+{
+    long blockSize = DEFAULT_BLOCK_SIZE;
+    bool crc32 = false;
+    bool skipZeros = false;
+    bool sequential = false;
+    char *end;
+    int opt;
+
+    static const char shortOptions[] = "hb:czs";
+
+    static struct option longOptions[] = {
+        {"help",       no_argument,       0, 'h'},
+        {"block-size", required_argument, 0, 'b'},
+        {"crc32",      no_argument,       0, 'c'},
+        {"skip-zeros", no_argument,       0, 'z'},
+        {"sequential", no_argument,       0, 's'},
+        {0, 0, 0, 0}
+    };
+
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, shortOptions,
+                              longOptions, &longIndex)) != -1) {
+        switch (opt) {
+        case 'b':
+            errno = 0;
+            blockSize = strtol(optarg, &end, 10);
+            if (errno != 0 || *optarg == '\0' || *end != '\0'
+                    || blockSize <= 0 || blockSize % 4 != 0
+                    || blockSize > INT_MAX) {
+                fprintf(stderr, "Invalid value for -b/--block-size: %s\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'c':
+            crc32 = true;
+            break;
+
+        case 'z':
+            skipZeros = true;
+            break;
+
+        case 's':
+            sequential = true;
+            break;
+
+        case 'h':
+            usage(stdout, argv[0]);
+            return EXIT_SUCCESS;
+
+        default:
+            usage(stderr, argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(stderr, argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // Keep stdout clean for the sparse file
+    mb::log::log_set_logger(
+            std::make_shared<mb::log::StdioLogger>(stderr, false));
+
+    Context ctx;
+    ctx.inputPath = argv[optind];
+    ctx.outputPath = argv[optind + 1];
+    ctx.blockSize = static_cast<uint32_t>(blockSize);
+    ctx.skipZeros = skipZeros;
+
+    ScopedSparseWriterCtx writer(sparseWriterCtxNew(), &sparseWriterCtxFree);
+    if (!writer) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    sparseWriterSetCrc32(writer.get(), crc32);
+    sparseWriterSetSkipZeros(writer.get(), skipZeros);
+
+    ctx.inputFd = open(ctx.inputPath, O_RDONLY | O_CLOEXEC);
+    if (ctx.inputFd < 0) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                ctx.inputPath, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Works for both regular files and block devices
+    off64_t inputSize = lseek64(ctx.inputFd, 0, SEEK_END);
+    if (inputSize < 0) {
+        fprintf(stderr, "%s: Failed to get size: %s\n",
+                ctx.inputPath, strerror(errno));
+        close(ctx.inputFd);
+        return EXIT_FAILURE;
+    }
+    ctx.inputSize = inputSize;
+
+    if (ctx.inputSize % ctx.blockSize != 0) {
+        fprintf(stderr, "%s: Size is not a multiple of the block size;"
+                " padding with zeros\n", ctx.inputPath);
+    }
+
+    if (strcmp(ctx.outputPath, "-") == 0) {
+        ctx.outputPath = "<stdout>";
+        ctx.outputFd = STDOUT_FILENO;
+        sequential = true;
+    } else {
+        ctx.outputFd = open(ctx.outputPath,
+                            O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (ctx.outputFd < 0) {
+            fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                    ctx.outputPath, strerror(errno));
+            close(ctx.inputFd);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ret = writeSparseFile(&ctx, writer.get(), sequential);
+
+    if (ctx.outputFd != STDOUT_FILENO && close(ctx.outputFd) < 0) {
+        fprintf(stderr, "%s: Failed to close: %s\n",
+                ctx.outputPath, strerror(errno));
+        ret = false;
+    }
+    close(ctx.inputFd);
+
+    if (!ret) {
+        fprintf(stderr, "Failed to write sparse file\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
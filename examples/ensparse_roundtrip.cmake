@@ -0,0 +1,86 @@
+# Round-trip test for ensparse and desparse
+#
+# Usage:
+#   cmake -DENSPARSE=<path> -DDESPARSE=<path> -DWORK_DIR=<dir>
+#         -P ensparse_roundtrip.cmake
+
+foreach(var ENSPARSE DESPARSE WORK_DIR)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "${var} is not defined")
+    endif()
+endforeach()
+
+set(block_size 4096)
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+# Build a block consisting of a repeated 4-byte pattern
+function(make_fill_block pattern out_var)
+    set(block "${pattern}")
+    string(LENGTH "${block}" length)
+    while(length LESS block_size)
+        set(block "${block}${block}")
+        string(LENGTH "${block}" length)
+    endwhile()
+    string(SUBSTRING "${block}" 0 ${block_size} block)
+    set(${out_var} "${block}" PARENT_SCOPE)
+endfunction()
+
+make_fill_block("abcd" fill_a)
+make_fill_block("wxyz" fill_w)
+
+# Mix of raw blocks and runs of fill blocks with different values
+set(input "${WORK_DIR}/input.img")
+file(WRITE "${input}" "")
+foreach(segment raw fill_a fill_a raw raw fill_w fill_a raw fill_w fill_w)
+    if(segment STREQUAL raw)
+        string(RANDOM LENGTH ${block_size} data)
+    else()
+        set(data "${${segment}}")
+    endif()
+    file(APPEND "${input}" "${data}")
+endforeach()
+
+function(check_roundtrip name)
+    set(sparse "${WORK_DIR}/${name}.sparse.img")
+    set(output "${WORK_DIR}/${name}.img")
+
+    if(name STREQUAL "stdout")
+        execute_process(
+            COMMAND "${ENSPARSE}" ${ARGN} "${input}" -
+            OUTPUT_FILE "${sparse}"
+            RESULT_VARIABLE ret
+        )
+    else()
+        execute_process(
+            COMMAND "${ENSPARSE}" ${ARGN} "${input}" "${sparse}"
+            RESULT_VARIABLE ret
+        )
+    endif()
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "${name}: ensparse failed: ${ret}")
+    endif()
+
+    execute_process(
+        COMMAND "${DESPARSE}" "${sparse}" "${output}"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "${name}: desparse failed: ${ret}")
+    endif()
+
+    execute_process(
+        COMMAND "${CMAKE_COMMAND}" -E compare_files "${input}" "${output}"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "${name}: Round-tripped file differs from input")
+    endif()
+endfunction()
+
+check_roundtrip(default)
+check_roundtrip(crc32 -c)
+check_roundtrip(small_blocks -b 1024)
+check_roundtrip(sequential -s -c)
+check_roundtrip(stdout)
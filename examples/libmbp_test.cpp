@@ -17,15 +17,26 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
 #include <memory>
+#include <string>
 
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #include <mbdevice/json.h>
 #include <mbdevice/validate.h>
 #include <mblog/logging.h>
 #include <mbp/patcherconfig.h>
 #include <mbp/patcherinterface.h>
+#include <mbp/patchers/odinpatcher.h>
 
 
 typedef std::unique_ptr<Device, void (*)(Device *)> ScopedDevice;
@@ -91,6 +102,22 @@ static Device * get_device(const char *path)
     return device;
 }
 
+static bool parse_compression_level(const char *str, mbp::CompressionLevel *out)
+{
+    if (strcmp(str, "store") == 0) {
+        *out = mbp::CompressionLevel::Store;
+    } else if (strcmp(str, "fast") == 0) {
+        *out = mbp::CompressionLevel::Fast;
+    } else if (strcmp(str, "default") == 0) {
+        *out = mbp::CompressionLevel::Default;
+    } else if (strcmp(str, "max") == 0) {
+        *out = mbp::CompressionLevel::Max;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 static void mbp_progress_cb(uint64_t bytes, uint64_t maxBytes, void *userdata)
 {
     (void) userdata;
@@ -98,9 +125,12 @@ static void mbp_progress_cb(uint64_t bytes, uint64_t maxBytes, void *userdata)
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 6) {
+    if (argc < 6) {
         fprintf(stderr, "Usage: %s <patcher id> <device file> <rom id> "
-                "<input path> <output path>\n", argv[0]);
+                "<input path> <output path> [threads [level "
+                "[<suffix>=<level>...]]]\n"
+                "\n"
+                "Compression levels: store, fast, default, max\n", argv[0]);
         return EXIT_FAILURE;
     }
 
@@ -109,6 +139,19 @@ int main(int argc, char *argv[]) {
     const char *rom_id = argv[3];
     const char *input_path = argv[4];
     const char *output_path = argv[5];
+    unsigned int threads = 0;
+
+    if (argc >= 7) {
+        char *end;
+        errno = 0;
+        unsigned long value = strtoul(argv[6], &end, 10);
+        if (errno != 0 || *argv[6] == '\0' || *end != '\0'
+                || value > UINT_MAX) {
+            fprintf(stderr, "Invalid thread count: %s\n", argv[6]);
+            return EXIT_FAILURE;
+        }
+        threads = static_cast<unsigned int>(value);
+    }
 
     mb::log::log_set_logger(std::make_shared<BasicLogger>());
 
@@ -119,6 +162,28 @@ int main(int argc, char *argv[]) {
 
     mbp::PatcherConfig pc;
     pc.setDataDirectory("data");
+    pc.setThreads(threads);
+
+    if (argc >= 8) {
+        mbp::CompressionLevel level;
+        if (!parse_compression_level(argv[7], &level)) {
+            fprintf(stderr, "Invalid compression level: %s\n", argv[7]);
+            return EXIT_FAILURE;
+        }
+        pc.setCompressionLevel(level);
+    }
+
+    for (int i = 8; i < argc; ++i) {
+        const char *sep = strrchr(argv[i], '=');
+        mbp::CompressionLevel level;
+        if (!sep || sep == argv[i]
+                || !parse_compression_level(sep + 1, &level)) {
+            fprintf(stderr, "Invalid suffix compression level: %s\n",
+                    argv[i]);
+            return EXIT_FAILURE;
+        }
+        pc.setCompressionLevel(std::string(argv[i], sep - argv[i]), level);
+    }
 
     mbp::FileInfo fi;
     fi.setDevice(device.get());
@@ -133,7 +198,26 @@ int main(int argc, char *argv[]) {
     }
 
     patcher->setFileInfo(&fi);
+
+    if (patcher->id() == mbp::OdinPatcher::Id) {
+        static_cast<mbp::OdinPatcher *>(patcher)->setThreads(threads);
+    }
+
+    auto start = std::chrono::steady_clock::now();
     bool ret = patcher->patchFile(&mbp_progress_cb, nullptr, nullptr, nullptr);
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+
+    printf("Patched with %u threads in %.3f seconds\n",
+           pc.threads(), elapsed.count() / 1000.0);
+
+#ifndef _WIN32
+    // ru_maxrss is in kilobytes on Linux
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("Peak RSS: %.1f MiB\n", usage.ru_maxrss / 1024.0);
+    }
+#endif
 
     if (!ret) {
         fprintf(stderr, "Error: %d\n", static_cast<int>(patcher->error()));
@@ -0,0 +1,62 @@
+# Check that patching a zip with one thread and with multiple threads produces
+# the same zip as REFERENCE, which must be the output of a build from before
+# the first pass was parallelized. The zips are compared byte for byte. Their
+# contents do not depend on when they were patched. Copied entries keep the
+# input's timestamps, entries generated in memory have a zeroed zip_fileinfo,
+# and files added from the data directory use their modification times, so
+# REFERENCE must have been patched with the same DATA_PARENT.
+#
+# Usage:
+#   cmake -DLIBMBP_TEST=<path> -DDEVICE_FILE=<path> -DINPUT=<path>
+#         -DREFERENCE=<path> -DDATA_PARENT=<dir> -DWORK_DIR=<dir>
+#         [-DPATCHER_ID=<id>] [-DROM_ID=<id>] [-DTHREADS=<count>]
+#         -P libmbp_threads_compare.cmake
+#
+# DATA_PARENT is the directory containing the patcher's "data" directory.
+
+foreach(var LIBMBP_TEST DEVICE_FILE INPUT REFERENCE DATA_PARENT WORK_DIR)
+    if(NOT DEFINED ${var} OR "${${var}}" STREQUAL "")
+        message(FATAL_ERROR "${var} is not defined")
+    endif()
+endforeach()
+
+if(NOT DEFINED PATCHER_ID)
+    set(PATCHER_ID MultiBootPatcher)
+endif()
+if(NOT DEFINED ROM_ID)
+    set(ROM_ID dual)
+endif()
+if(NOT DEFINED THREADS)
+    set(THREADS 4)
+endif()
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+
+function(patch_zip name threads)
+    execute_process(
+        COMMAND "${LIBMBP_TEST}" "${PATCHER_ID}" "${DEVICE_FILE}" "${ROM_ID}"
+                "${INPUT}" "${WORK_DIR}/${name}.zip" ${threads}
+        WORKING_DIRECTORY "${DATA_PARENT}"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "${name}: libmbp_test failed: ${ret}")
+    endif()
+endfunction()
+
+function(compare_zip expected actual)
+    execute_process(
+        COMMAND "${CMAKE_COMMAND}" -E compare_files "${expected}" "${actual}"
+        RESULT_VARIABLE ret
+    )
+    if(NOT ret EQUAL 0)
+        message(FATAL_ERROR "${actual} differs from ${expected}")
+    endif()
+endfunction()
+
+patch_zip(single 1)
+patch_zip(multi ${THREADS})
+
+compare_zip("${REFERENCE}" "${WORK_DIR}/single.zip")
+compare_zip("${REFERENCE}" "${WORK_DIR}/multi.zip")
@@ -45,9 +45,27 @@ struct MtkWriterCtx
     bool have_file_size;
     uint64_t file_size;
 
+    SHA_CTX sha_ctx;
+    // Whether sha_ctx covers every entry so far. If not, the SHA1 is computed
+    // by rereading the entries when the writer is closed.
+    bool sha_valid;
+    // Index of the next entry to be included in the hash
+    size_t sha_next_entry;
+    // Number of bytes written for the current entry
+    uint64_t sha_entry_size;
+    // MTK header waiting for its image size to be known before being hashed
+    unsigned char sha_mtkhdr[sizeof(struct MtkHeader)];
+    bool sha_have_mtkhdr;
+    uint32_t sha_kernel_mtkhdr_size;
+    uint32_t sha_ramdisk_mtkhdr_size;
+
     struct SegmentWriterCtx segctx;
 };
 
+int _mtk_compute_sha1(struct MbBiWriter *biw, struct SegmentWriterCtx *segctx,
+                      struct MbFile *file,
+                      unsigned char digest[SHA_DIGEST_LENGTH]);
+
 int mtk_writer_get_header(struct MbBiWriter *biw, void *userdata,
                           struct MbBiHeader **header);
 int mtk_writer_write_header(struct MbBiWriter *biw, void *userdata,
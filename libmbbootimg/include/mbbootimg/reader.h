@@ -22,10 +22,12 @@
 #ifdef __cplusplus
 #  include <cstdarg>
 #  include <cstddef>
+#  include <cstdint>
 #  include <cwchar>
 #else
 #  include <stdarg.h>
 #  include <stddef.h>
+#  include <stdint.h>
 #  include <wchar.h>
 #endif
 
@@ -68,6 +70,8 @@ MB_EXPORT int mb_bi_reader_read_data(struct MbBiReader *bir, void *buf,
 // Format operations
 MB_EXPORT int mb_bi_reader_format_code(struct MbBiReader *bir);
 MB_EXPORT const char * mb_bi_reader_format_name(struct MbBiReader *bir);
+MB_EXPORT int mb_bi_reader_bid_stats(struct MbBiReader *bir, size_t index,
+                                     int *code, int *bid, uint64_t *time_ns);
 MB_EXPORT int mb_bi_reader_set_format_by_code(struct MbBiReader *bir,
                                               int code);
 MB_EXPORT int mb_bi_reader_set_format_by_name(struct MbBiReader *bir,
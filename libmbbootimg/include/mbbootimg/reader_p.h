@@ -23,8 +23,10 @@
 
 #ifdef __cplusplus
 #  include <cstddef>
+#  include <cstdint>
 #else
 #  include <stddef.h>
+#  include <stdint.h>
 #endif
 
 #include "mbcommon/common.h"
@@ -58,6 +60,13 @@
 
 #define MAX_FORMATS     10
 
+// Minimum number of bytes read into the probe cache at once
+#define PROBE_MIN_READ_SIZE     (8 * 1024)
+// Maximum size of the cached prefix of the file
+#define PROBE_MAX_PREFIX_SIZE   (1024 * 1024)
+// Minimum size of the window used for reads past the cached prefix
+#define PROBE_WINDOW_SIZE       4096
+
 MB_BEGIN_C_DECLS
 
 struct MbBiReader;
@@ -91,6 +100,10 @@ struct FormatReader
     FormatReaderReadData read_data_cb;
     FormatReaderFree free_cb;
     void *userdata;
+
+    // Bid statistics from the last call to mb_bi_reader_open()
+    int bid;
+    uint64_t bid_time_ns;
 };
 
 enum ReaderState : unsigned short
@@ -125,6 +138,25 @@ struct MbBiReader
 
     struct MbBiHeader *header;
     struct MbBiEntry *entry;
+
+    // Probe cache for the bidders. Freed once bidding finishes.
+
+    // File contents if they are already in memory
+    bool probe_have_file_data;
+    const unsigned char *probe_file_data;
+    size_t probe_file_size;
+
+    // Cached prefix of the file shared by the format readers
+    unsigned char *probe_buf;
+    size_t probe_size;
+    size_t probe_capacity;
+    bool probe_eof;
+
+    // Cached window for reads past the prefix
+    unsigned char *probe_window;
+    uint64_t probe_window_offset;
+    size_t probe_window_size;
+    size_t probe_window_capacity;
 };
 
 int _mb_bi_reader_register_format(struct MbBiReader *bir,
@@ -141,4 +173,9 @@ int _mb_bi_reader_register_format(struct MbBiReader *bir,
 int _mb_bi_reader_free_format(struct MbBiReader *bir,
                               struct FormatReader *format);
 
+int _mb_bi_reader_probe_read(struct MbBiReader *bir, struct MbFile *file,
+                             uint64_t offset, void *buf, size_t size,
+                             size_t *bytes_read);
+void _mb_bi_reader_probe_clear(struct MbBiReader *bir);
+
 MB_END_C_DECLS
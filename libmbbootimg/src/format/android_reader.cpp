@@ -84,16 +84,9 @@ int find_android_header(MbBiReader *bir, MbFile *file,
         return MB_BI_WARN;
     }
 
-    ret = mb_file_seek(file, 0, SEEK_SET, nullptr);
-    if (ret != MB_FILE_OK) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Failed to seek to beginning: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    ret = mb_file_read_fully(
-            file, buf, max_header_offset + sizeof(AndroidHeader), &n);
+    ret = _mb_bi_reader_probe_read(bir, file, 0, buf,
+                                   max_header_offset + sizeof(AndroidHeader),
+                                   &n);
     if (ret != MB_FILE_OK) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read header: %s",
@@ -172,15 +165,7 @@ int find_samsung_seandroid_magic(MbBiReader *bir, MbFile *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    ret = mb_file_seek(file, pos, SEEK_SET, nullptr);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "SEAndroid magic not found: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    ret = mb_file_read_fully(file, buf, sizeof(buf), &n);
+    ret = _mb_bi_reader_probe_read(bir, file, pos, buf, sizeof(buf), &n);
     if (ret < 0) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read SEAndroid magic: %s",
@@ -246,15 +231,7 @@ int find_bump_magic(MbBiReader *bir, MbFile *file,
     pos += hdr->dt_size;
     pos += align_page_size<uint64_t>(pos, hdr->page_size);
 
-    ret = mb_file_seek(file, pos, SEEK_SET, nullptr);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "SEAndroid magic not found: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    ret = mb_file_read_fully(file, buf, sizeof(buf), &n);
+    ret = _mb_bi_reader_probe_read(bir, file, pos, buf, sizeof(buf), &n);
     if (ret < 0) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read SEAndroid magic: %s",
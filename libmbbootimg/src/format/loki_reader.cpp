@@ -70,15 +70,8 @@ int find_loki_header(MbBiReader *bir, MbFile *file,
     size_t n;
     int ret;
 
-    ret = mb_file_seek(file, LOKI_MAGIC_OFFSET, SEEK_SET, nullptr);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Loki magic not found: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_WARN;
-    }
-
-    ret = mb_file_read_fully(file, &header, sizeof(header), &n);
+    ret = _mb_bi_reader_probe_read(bir, file, LOKI_MAGIC_OFFSET,
+                                   &header, sizeof(header), &n);
     if (ret < 0) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read header: %s",
@@ -103,64 +96,163 @@ int find_loki_header(MbBiReader *bir, MbFile *file,
     return MB_BI_OK;
 }
 
+// gzip header:
+// byte 0-1 : magic bytes 0x1f, 0x8b
+// byte 2   : compression (0x08 = deflate)
+// byte 3   : flags
+// byte 4-7 : modification timestamp
+// byte 8   : compression flags
+// byte 9   : operating system
+
+static const unsigned char gzip_deflate_magic[] = { 0x1f, 0x8b, 0x08 };
+
+enum LokiScanPattern
+{
+    LOKI_SCAN_SHELLCODE,
+    LOKI_SCAN_GZIP,
+};
+
+struct LokiScanResult
+{
+    // Patterns to search for
+    bool want_shellcode;
+    bool want_gzip;
+    uint64_t gzip_start;
+
+    // Pattern for each index passed to mb_file_search_multi()
+    LokiScanPattern kinds[2];
+
+    // First shellcode match
+    bool have_shellcode;
+    uint64_t shellcode_offset;
+
+    // First gzip headers with flags == 0x00 and flags == 0x08
+    bool have_flag0;
+    bool have_flag8;
+    uint64_t flag0_offset;
+    uint64_t flag8_offset;
+};
+
+static int loki_scan_result_cb(MbFile *file, void *userdata, size_t index,
+                               uint64_t offset)
+{
+    LokiScanResult *result = static_cast<LokiScanResult *>(userdata);
+    unsigned char flags;
+    size_t n;
+    int ret;
+
+    if (result->kinds[index] == LOKI_SCAN_SHELLCODE) {
+        if (!result->have_shellcode) {
+            result->have_shellcode = true;
+            result->shellcode_offset = offset;
+        }
+    } else if (offset >= result->gzip_start) {
+        // Read flags byte without disturbing the search position
+        do {
+            ret = mb_file_read_at(file, &flags, sizeof(flags), offset + 3, &n);
+        } while (ret == MB_FILE_RETRY);
+        if (ret != MB_FILE_OK) {
+            return ret;
+        } else if (n != sizeof(flags)) {
+            // EOF
+            return MB_FILE_WARN;
+        }
+
+        if (!result->have_flag0 && flags == 0x00) {
+            result->have_flag0 = true;
+            result->flag0_offset = offset;
+        } else if (!result->have_flag8 && flags == 0x08) {
+            result->have_flag8 = true;
+            result->flag8_offset = offset;
+        }
+    }
+
+    // Stop early if possible
+    if ((!result->want_shellcode || result->have_shellcode)
+            && (!result->want_gzip
+                    || (result->have_flag0 && result->have_flag8))) {
+        return MB_FILE_WARN;
+    }
+
+    return MB_FILE_OK;
+}
+
 /*!
- * \brief Find and read Loki ramdisk address
- *
- * \pre The file position can be at any offset prior to calling this function.
- *
- * \post The file pointer position is undefined after this function returns.
- *       Use mb_file_seek() to return to a known position.
+ * \brief Search for Loki shellcode and gzip headers in a single pass
  *
  * \param[in] bir MbBiReader to set error message
  * \param[in] file MbFile handle
- * \param[in] hdr Android header
- * \param[in] loki_hdr Loki header
- * \param[out] ramdisk_addr_out Pointer to store ramdisk address
+ * \param[in,out] result Patterns to search for and results of the search
  *
  * \return
- *   * #MB_BI_OK if the ramdisk address is found
- *   * #MB_BI_WARN if the ramdisk address is not found
+ *   * #MB_BI_OK if the search completes successfully
  *   * #MB_BI_FAILED if any file operation fails non-fatally
  *   * #MB_BI_FATAL if any file operation fails fatally
  */
-int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
-                              const AndroidHeader *hdr,
-                              const LokiHeader *loki_hdr,
-                              uint32_t *ramdisk_addr_out)
+static int loki_scan(MbBiReader *bir, MbFile *file, LokiScanResult *result)
 {
-    // If the boot image was patched with a newer version of loki, find the
-    // ramdisk offset in the shell code
-    uint32_t ramdisk_addr = 0;
+    MbFileSearchPattern patterns[2];
+    size_t count = 0;
+    int64_t start = -1;
     int ret;
-    size_t n;
 
-    if (loki_hdr->ramdisk_addr != 0) {
-        uint64_t offset = 0;
-
-        auto result_cb = [](MbFile *file, void *userdata,
-                            uint64_t offset) -> int {
-            (void) file;
-            uint64_t *offset_ptr = static_cast<uint64_t *>(userdata);
-            *offset_ptr = offset;
-            return MB_FILE_OK;
-        };
-
-        ret = mb_file_search(file, -1, -1, 0, LOKI_SHELLCODE,
-                             LOKI_SHELLCODE_SIZE - 9, 1, result_cb, &offset);
-        if (ret < 0) {
-            mb_bi_reader_set_error(bir, mb_file_error(file),
-                                   "Failed to search for Loki shellcode: %s",
-                                   mb_file_error_string(file));
-            return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
+    if (result->want_shellcode) {
+        result->kinds[count] = LOKI_SCAN_SHELLCODE;
+        patterns[count].data = LOKI_SHELLCODE;
+        patterns[count].size = LOKI_SHELLCODE_SIZE - 9;
+        ++count;
+    }
+    if (result->want_gzip) {
+        result->kinds[count] = LOKI_SCAN_GZIP;
+        patterns[count].data = gzip_deflate_magic;
+        patterns[count].size = sizeof(gzip_deflate_magic);
+        ++count;
+
+        // The shellcode can be anywhere, but the gzip headers can't
+        if (!result->want_shellcode) {
+            start = result->gzip_start;
         }
+    }
+
+    ret = mb_file_search_multi(file, start, -1, 0, patterns, count, -1,
+                               &loki_scan_result_cb, result);
+    if (ret < 0) {
+        mb_bi_reader_set_error(bir, mb_file_error(file),
+                               "Failed to search for %s: %s",
+                               result->want_shellcode && result->want_gzip
+                                       ? "Loki shellcode and gzip magic"
+                                       : result->want_shellcode
+                                       ? "Loki shellcode" : "gzip magic",
+                               mb_file_error_string(file));
+        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Get Loki ramdisk address from the results of loki_scan()
+ *
+ * If the shellcode was searched for, the address is read from the shellcode.
+ * Otherwise, the default for jflte is used.
+ */
+static int loki_ramdisk_address_from_scan(MbBiReader *bir, MbFile *file,
+                                          const AndroidHeader *hdr,
+                                          const LokiScanResult *scan,
+                                          uint32_t *ramdisk_addr_out)
+{
+    uint32_t ramdisk_addr = 0;
+    int ret;
+    size_t n;
 
-        if (offset == 0) {
+    if (scan->want_shellcode) {
+        if (!scan->have_shellcode) {
             mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
                                    "Loki shellcode not found");
-            return MB_FILE_WARN;
+            return MB_BI_WARN;
         }
 
-        offset += LOKI_SHELLCODE_SIZE - 5;
+        uint64_t offset = scan->shellcode_offset + LOKI_SHELLCODE_SIZE - 5;
 
         ret = mb_file_seek(file, offset, SEEK_SET, nullptr);
         if (ret < 0) {
@@ -201,6 +293,71 @@ int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
     return MB_BI_OK;
 }
 
+/*!
+ * \brief Get gzip ramdisk offset from the results of loki_scan()
+ */
+static int loki_gzip_offset_from_scan(MbBiReader *bir,
+                                      const LokiScanResult *scan,
+                                      uint64_t *gzip_offset_out)
+{
+    // Prefer gzip header with original filename flag since most loki'd boot
+    // images will have been compressed manually with the gzip tool
+    if (scan->have_flag8) {
+        *gzip_offset_out = scan->flag8_offset;
+    } else if (scan->have_flag0) {
+        *gzip_offset_out = scan->flag0_offset;
+    } else {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
+                               "No gzip headers found");
+        return MB_BI_WARN;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Find and read Loki ramdisk address
+ *
+ * \pre The file position can be at any offset prior to calling this function.
+ *
+ * \post The file pointer position is undefined after this function returns.
+ *       Use mb_file_seek() to return to a known position.
+ *
+ * \param[in] bir MbBiReader to set error message
+ * \param[in] file MbFile handle
+ * \param[in] hdr Android header
+ * \param[in] loki_hdr Loki header
+ * \param[out] ramdisk_addr_out Pointer to store ramdisk address
+ *
+ * \return
+ *   * #MB_BI_OK if the ramdisk address is found
+ *   * #MB_BI_WARN if the ramdisk address is not found
+ *   * #MB_BI_FAILED if any file operation fails non-fatally
+ *   * #MB_BI_FATAL if any file operation fails fatally
+ */
+int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
+                              const AndroidHeader *hdr,
+                              const LokiHeader *loki_hdr,
+                              uint32_t *ramdisk_addr_out)
+{
+    LokiScanResult scan = {};
+    int ret;
+
+    // If the boot image was patched with a newer version of loki, find the
+    // ramdisk offset in the shell code
+    if (loki_hdr->ramdisk_addr != 0) {
+        scan.want_shellcode = true;
+
+        ret = loki_scan(bir, file, &scan);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    return loki_ramdisk_address_from_scan(bir, file, hdr, &scan,
+                                          ramdisk_addr_out);
+}
+
 /*!
  * \brief Find gzip ramdisk offset in old-style Loki image
  *
@@ -229,100 +386,18 @@ int loki_find_ramdisk_address(MbBiReader *bir, MbFile *file,
 int loki_old_find_gzip_offset(MbBiReader *bir, MbFile *file,
                               uint32_t start_offset, uint64_t *gzip_offset_out)
 {
-    struct SearchResult
-    {
-        bool have_flag0 = false;
-        bool have_flag8 = false;
-        uint64_t flag0_offset;
-        uint64_t flag8_offset;
-    };
-
-    // gzip header:
-    // byte 0-1 : magic bytes 0x1f, 0x8b
-    // byte 2   : compression (0x08 = deflate)
-    // byte 3   : flags
-    // byte 4-7 : modification timestamp
-    // byte 8   : compression flags
-    // byte 9   : operating system
-
-    static const unsigned char gzip_deflate_magic[] = { 0x1f, 0x8b, 0x08 };
-
-    SearchResult result = {};
+    LokiScanResult scan = {};
     int ret;
 
-    // Find first result with flags == 0x00 and flags == 0x08
-    auto result_cb = [](MbFile *file, void *userdata, uint64_t offset) -> int {
-        SearchResult *result = static_cast<SearchResult *>(userdata);
-        uint64_t orig_offset;
-        unsigned char flags;
-        size_t n;
-        int ret;
-
-        // Stop early if possible
-        if (result->have_flag0 && result->have_flag8) {
-            return MB_FILE_WARN;
-        }
-
-        // Save original position
-        ret = mb_file_seek(file, 0, SEEK_CUR, &orig_offset);
-        if (ret != MB_FILE_OK) {
-            return ret;
-        }
+    scan.want_gzip = true;
+    scan.gzip_start = start_offset;
 
-        // Seek to flags byte
-        ret = mb_file_seek(file, offset + 3, SEEK_SET, nullptr);
-        if (ret != MB_FILE_OK) {
-            return ret;
-        }
-
-        // Read next bytes for flags
-        ret = mb_file_read_fully(file, &flags, sizeof(flags), &n);
-        if (ret != MB_FILE_OK) {
-            return ret;
-        } else if (n != sizeof(flags)) {
-            // EOF
-            return MB_FILE_WARN;
-        }
-
-        if (!result->have_flag0 && flags == 0x00) {
-            result->have_flag0 = true;
-            result->flag0_offset = offset;
-        } else if (!result->have_flag8 && flags == 0x08) {
-            result->have_flag8 = true;
-            result->flag8_offset = offset;
-        }
-
-        // Restore original position as per contract
-        ret = mb_file_seek(file, orig_offset, SEEK_SET, nullptr);
-        if (ret != MB_FILE_OK) {
-            return ret;
-        }
-
-        return MB_FILE_OK;
-    };
-
-    ret = mb_file_search(file, start_offset, -1, 0, gzip_deflate_magic,
-                         sizeof(gzip_deflate_magic), -1, result_cb, &result);
-    if (ret < 0) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Failed to search for gzip magic: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    // Prefer gzip header with original filename flag since most loki'd boot
-    // images will have been compressed manually with the gzip tool
-    if (result.have_flag8) {
-        *gzip_offset_out = result.flag8_offset;
-    } else if (result.have_flag0) {
-        *gzip_offset_out = result.flag0_offset;
-    } else {
-        mb_bi_reader_set_error(bir, MB_BI_ERROR_FILE_FORMAT,
-                               "No gzip headers found");
-        return MB_BI_WARN;
+    ret = loki_scan(bir, file, &scan);
+    if (ret != MB_BI_OK) {
+        return ret;
     }
 
-    return MB_BI_OK;
+    return loki_gzip_offset_from_scan(bir, &scan, gzip_offset_out);
 }
 
 /*!
@@ -519,6 +594,7 @@ int loki_read_old_header(MbBiReader *bir, MbFile *file,
     uint32_t ramdisk_size;
     uint32_t ramdisk_addr;
     uint64_t gzip_offset;
+    LokiScanResult scan = {};
     int ret;
 
     if (hdr->page_size == 0) {
@@ -538,11 +614,19 @@ int loki_read_old_header(MbBiReader *bir, MbFile *file,
         return ret;
     }
 
-    // Look for gzip offset for the ramdisk
-    ret = loki_old_find_gzip_offset(
-            bir, file, hdr->page_size + kernel_size
-            + align_page_size<uint64_t>(kernel_size, hdr->page_size),
-            &gzip_offset);
+    // Look for the gzip offset for the ramdisk and, if needed, the shellcode
+    // containing the original ramdisk address in a single pass
+    scan.want_gzip = true;
+    scan.gzip_start = hdr->page_size + kernel_size
+            + align_page_size<uint64_t>(kernel_size, hdr->page_size);
+    scan.want_shellcode = loki_hdr->ramdisk_addr != 0;
+
+    ret = loki_scan(bir, file, &scan);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ret = loki_gzip_offset_from_scan(bir, &scan, &gzip_offset);
     if (ret != MB_BI_OK) {
         return ret;
     }
@@ -555,7 +639,7 @@ int loki_read_old_header(MbBiReader *bir, MbFile *file,
     }
 
     // Guess original ramdisk address
-    ret = loki_find_ramdisk_address(bir, file, hdr, loki_hdr, &ramdisk_addr);
+    ret = loki_ramdisk_address_from_scan(bir, file, hdr, &scan, &ramdisk_addr);
     if (ret != MB_BI_OK) {
         return ret;
     }
@@ -78,9 +78,24 @@ static int _mtk_header_update_size(MbBiWriter *biw, MbFile *file,
     return MB_BI_OK;
 }
 
-static int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
-                             MbFile *file,
-                             unsigned char digest[SHA_DIGEST_LENGTH])
+/*!
+ * \brief Compute the SHA1 of an MTK boot image by rereading its entries
+ *
+ * This is only used if the hash could not be computed while the entries were
+ * written.
+ *
+ * \param[in] biw MbBiWriter for setting error messages
+ * \param[in] segctx Segment writer context containing the written entries
+ * \param[in] file MbFile handle
+ * \param[out] digest Output SHA1 digest
+ *
+ * \return
+ *   * #MB_BI_OK if the digest is successfully computed
+ *   * \<= #MB_BI_WARN if an error occurs
+ */
+int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
+                      MbFile *file,
+                      unsigned char digest[SHA_DIGEST_LENGTH])
 {
     SHA_CTX sha_ctx;
     char buf[10240];
@@ -98,27 +113,22 @@ static int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
 
     for (size_t i = 0; i < _segment_writer_entries_size(segctx); ++i) {
         SegmentWriterEntry *entry = _segment_writer_entries_get(segctx, i);
+        uint64_t offset = entry->offset;
         uint64_t remain = entry->size;
 
-        ret = mb_file_seek(file, entry->offset, SEEK_SET, nullptr);
-        if (ret != MB_FILE_OK) {
-            mb_bi_writer_set_error(biw, mb_file_error(file),
-                                   "Failed to seek to entry %" MB_PRIzu ": %s",
-                                   i, mb_file_error_string(file));
-            return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-        }
-
         // Update checksum with data
         while (remain > 0) {
             size_t to_read = std::min<uint64_t>(remain, sizeof(buf));
 
-            ret = mb_file_read_fully(file, buf, to_read, &n);
-            if (ret != MB_FILE_OK) {
+            ret = mb_file_read_at(file, buf, to_read, offset, &n);
+            if (ret == MB_FILE_RETRY) {
+                continue;
+            } else if (ret != MB_FILE_OK) {
                 mb_bi_writer_set_error(biw, mb_file_error(file),
                                        "Failed to read entry %" MB_PRIzu ": %s",
                                        i, mb_file_error_string(file));
                 return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-            } else if (n != to_read) {
+            } else if (n == 0) {
                 mb_bi_writer_set_error(biw, mb_file_error(file),
                                        "Unexpected EOF when reading entry");
                 return MB_BI_FAILED;
@@ -130,7 +140,8 @@ static int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
                 return MB_BI_FAILED;
             }
 
-            remain -= to_read;
+            offset += n;
+            remain -= n;
         }
 
         uint32_t le32_size;
@@ -178,6 +189,95 @@ static int _mtk_compute_sha1(MbBiWriter *biw, SegmentWriterCtx *segctx,
     return MB_BI_OK;
 }
 
+static int _mtk_sha1_update(MbBiWriter *biw, MtkWriterCtx *ctx,
+                            const void *data, size_t size)
+{
+    if (!SHA1_Update(&ctx->sha_ctx, data, size)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to update SHA1 hash");
+        // This must be fatal as the write already happened and cannot be
+        // reattempted
+        return MB_BI_FATAL;
+    }
+
+    return MB_BI_OK;
+}
+
+/*!
+ * \brief Include the size of an entry in the SHA1 hash
+ *
+ * This must match the size handling in _mtk_compute_sha1().
+ */
+static int _mtk_sha1_update_size(MbBiWriter *biw, MtkWriterCtx *ctx,
+                                 SegmentWriterEntry *entry)
+{
+    uint32_t le32_size;
+
+    switch (entry->type) {
+    case MB_BI_ENTRY_MTK_KERNEL_HEADER:
+        ctx->sha_kernel_mtkhdr_size = entry->size;
+        return MB_BI_OK;
+    case MB_BI_ENTRY_MTK_RAMDISK_HEADER:
+        ctx->sha_ramdisk_mtkhdr_size = entry->size;
+        return MB_BI_OK;
+    case MB_BI_ENTRY_KERNEL:
+        le32_size = mb_htole32(entry->size + ctx->sha_kernel_mtkhdr_size);
+        break;
+    case MB_BI_ENTRY_RAMDISK:
+        le32_size = mb_htole32(entry->size + ctx->sha_ramdisk_mtkhdr_size);
+        break;
+    case MB_BI_ENTRY_SECONDBOOT:
+        le32_size = mb_htole32(entry->size);
+        break;
+    case MB_BI_ENTRY_DEVICE_TREE:
+        if (entry->size == 0) {
+            return MB_BI_OK;
+        }
+        le32_size = mb_htole32(entry->size);
+        break;
+    default:
+        return MB_BI_OK;
+    }
+
+    return _mtk_sha1_update(biw, ctx, &le32_size, sizeof(le32_size));
+}
+
+/*!
+ * \brief Include entries that the client skipped in the SHA1 hash
+ *
+ * \param biw MbBiWriter
+ * \param ctx MTK writer context
+ * \param end Index of the first entry that should not be included
+ */
+static int _mtk_sha1_skip_entries(MbBiWriter *biw, MtkWriterCtx *ctx,
+                                  size_t end)
+{
+    int ret;
+
+    for (; ctx->sha_valid && ctx->sha_next_entry < end;
+            ++ctx->sha_next_entry) {
+        SegmentWriterEntry *entry =
+                _segment_writer_entries_get(&ctx->segctx, ctx->sha_next_entry);
+
+        // The size field of a skipped MTK header would be written over the
+        // following image and a pending MTK header needs the size of the
+        // skipped image. Leave those odd cases to _mtk_compute_sha1().
+        if (ctx->sha_have_mtkhdr
+                || entry->type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                || entry->type == MB_BI_ENTRY_MTK_RAMDISK_HEADER) {
+            ctx->sha_valid = false;
+            break;
+        }
+
+        ret = _mtk_sha1_update_size(biw, ctx, entry);
+        if (ret != MB_BI_OK) {
+            return ret;
+        }
+    }
+
+    return MB_BI_OK;
+}
+
 int mtk_writer_get_header(MbBiWriter *biw, void *userdata,
                           MbBiHeader **header)
 {
@@ -329,8 +429,44 @@ int mtk_writer_write_entry(MbBiWriter *biw, void *userdata,
                            MbBiEntry *entry)
 {
     MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(userdata);
+    SegmentWriterEntry *swentry;
+    int ret;
 
-    return _segment_writer_write_entry(&ctx->segctx, biw->file, entry, biw);
+    ret = _segment_writer_write_entry(&ctx->segctx, biw->file, entry, biw);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    swentry = _segment_writer_entry(&ctx->segctx);
+
+    ret = _mtk_sha1_skip_entries(biw, ctx, swentry - ctx->segctx.entries);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    ctx->sha_entry_size = 0;
+
+    // The MTK header is hashed with its final size field, so it can only be
+    // hashed ahead of the image data if the image size is known up front
+    if (ctx->sha_valid && ctx->sha_have_mtkhdr) {
+        if (swentry->size_set) {
+            uint32_t le32_size = mb_htole32(swentry->size);
+            memcpy(ctx->sha_mtkhdr + offsetof(MtkHeader, size),
+                   &le32_size, sizeof(le32_size));
+
+            ret = _mtk_sha1_update(biw, ctx, ctx->sha_mtkhdr,
+                                   sizeof(ctx->sha_mtkhdr));
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+
+            ctx->sha_have_mtkhdr = false;
+        } else {
+            ctx->sha_valid = false;
+        }
+    }
+
+    return MB_BI_OK;
 }
 
 int mtk_writer_write_data(MbBiWriter *biw, void *userdata,
@@ -338,9 +474,36 @@ int mtk_writer_write_data(MbBiWriter *biw, void *userdata,
                           size_t *bytes_written)
 {
     MtkWriterCtx *const ctx = static_cast<MtkWriterCtx *>(userdata);
+    SegmentWriterEntry *swentry;
+    int ret;
+
+    ret = _segment_writer_write_data(&ctx->segctx, biw->file, buf, buf_size,
+                                     bytes_written, biw);
+    if (ret != MB_BI_OK) {
+        return ret;
+    }
+
+    if (ctx->sha_valid) {
+        swentry = _segment_writer_entry(&ctx->segctx);
+
+        if (swentry->type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                || swentry->type == MB_BI_ENTRY_MTK_RAMDISK_HEADER) {
+            // Hashed once the image size is known. Oversized headers are
+            // rejected in mtk_writer_finish_entry().
+            if (buf_size <= sizeof(ctx->sha_mtkhdr) - ctx->sha_entry_size) {
+                memcpy(ctx->sha_mtkhdr + ctx->sha_entry_size, buf, buf_size);
+            }
+        } else {
+            ret = _mtk_sha1_update(biw, ctx, buf, buf_size);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        }
+
+        ctx->sha_entry_size += buf_size;
+    }
 
-    return _segment_writer_write_data(&ctx->segctx, biw->file, buf, buf_size,
-                                      bytes_written, biw);
+    return MB_BI_OK;
 }
 
 int mtk_writer_finish_entry(MbBiWriter *biw, void *userdata)
@@ -385,6 +548,25 @@ int mtk_writer_finish_entry(MbBiWriter *biw, void *userdata)
         break;
     }
 
+    if (ctx->sha_valid) {
+        if (ctx->sha_entry_size != swentry->size) {
+            // The entry size set by the client does not match the data
+            ctx->sha_valid = false;
+        } else {
+            if (swentry->type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                    || swentry->type == MB_BI_ENTRY_MTK_RAMDISK_HEADER) {
+                ctx->sha_have_mtkhdr = true;
+            }
+
+            ret = _mtk_sha1_update_size(biw, ctx, swentry);
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+
+            ctx->sha_next_entry = swentry - ctx->segctx.entries + 1;
+        }
+    }
+
     return MB_BI_OK;
 }
 
@@ -444,16 +626,31 @@ int mtk_writer_close(MbBiWriter *biw, void *userdata)
             }
         }
 
-        // We need to take the performance hit and compute the SHA1 here.
-        // We can't fill in the sizes in the MTK headers when we're writing
-        // them. Thus, if we calculated the SHA1sum during write, it would be
-        // incorrect.
-        ret = _mtk_compute_sha1(biw, &ctx->segctx, biw->file,
-                                reinterpret_cast<unsigned char *>(ctx->hdr.id));
+        ret = _mtk_sha1_skip_entries(
+                biw, ctx, _segment_writer_entries_size(&ctx->segctx));
         if (ret != MB_BI_OK) {
             return ret;
         }
 
+        if (ctx->sha_valid && !ctx->sha_have_mtkhdr) {
+            if (!SHA1_Final(reinterpret_cast<unsigned char *>(ctx->hdr.id),
+                            &ctx->sha_ctx)) {
+                mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                                       "Failed to finalize SHA1 hash");
+                return MB_BI_FATAL;
+            }
+        } else {
+            // The MTK header sizes could not be filled in while the entries
+            // were written, so we need to take the performance hit and reread
+            // them
+            ret = _mtk_compute_sha1(
+                    biw, &ctx->segctx, biw->file,
+                    reinterpret_cast<unsigned char *>(ctx->hdr.id));
+            if (ret != MB_BI_OK) {
+                return ret;
+            }
+        }
+
         // Convert fields back to little-endian
         AndroidHeader hdr = ctx->hdr;
         android_fix_header_byte_order(&hdr);
@@ -524,6 +721,17 @@ int mb_bi_writer_set_format_mtk(MbBiWriter *biw)
         return MB_BI_FAILED;
     }
 
+    if (!SHA1_Init(&ctx->sha_ctx)) {
+        mb_bi_writer_set_error(biw, MB_BI_ERROR_INTERNAL_ERROR,
+                               "Failed to initialize SHA_CTX");
+        mb_bi_header_free(ctx->client_header);
+        mb_bi_entry_free(ctx->client_entry);
+        free(ctx);
+        return MB_BI_FAILED;
+    }
+
+    ctx->sha_valid = true;
+
     _segment_writer_init(&ctx->segctx);
 
     return _mb_bi_writer_register_format(biw,
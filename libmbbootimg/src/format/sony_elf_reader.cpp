@@ -69,15 +69,7 @@ int find_sony_elf_header(MbBiReader *bir, MbFile *file,
     size_t n;
     int ret;
 
-    ret = mb_file_seek(file, 0, SEEK_SET, nullptr);
-    if (ret != MB_FILE_OK) {
-        mb_bi_reader_set_error(bir, mb_file_error(file),
-                               "Failed to seek to beginning: %s",
-                               mb_file_error_string(file));
-        return ret == MB_FILE_FATAL ? MB_BI_FATAL : MB_BI_FAILED;
-    }
-
-    ret = mb_file_read_fully(file, &header, sizeof(header), &n);
+    ret = _mb_bi_reader_probe_read(bir, file, 0, &header, sizeof(header), &n);
     if (ret != MB_FILE_OK) {
         mb_bi_reader_set_error(bir, mb_file_error(file),
                                "Failed to read header: %s",
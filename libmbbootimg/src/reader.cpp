@@ -19,6 +19,9 @@
 
 #include "mbbootimg/reader.h"
 
+#include <algorithm>
+#include <chrono>
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -54,8 +57,9 @@
  *
  * Place a bid based on the confidence in which the format reader can parse the
  * boot image. The bid is usually the number of bits the reader is confident
- * that conform to the file format (eg. magic string). The file position will be
- * set to the beginning of the file before this function is called.
+ * that conform to the file format (eg. magic string). The file position is
+ * undefined when this function is called. Bidders should read the file with
+ * _mb_bi_reader_probe_read() so that the data is shared with the other bidders.
  *
  * \param bir MbBiReader
  * \param userdata User callback data
@@ -247,6 +251,8 @@ int _mb_bi_reader_register_format(MbBiReader *bir,
     format.read_data_cb = read_data_cb;
     format.free_cb = free_cb;
     format.userdata = userdata;
+    format.bid = MB_BI_WARN;
+    format.bid_time_ns = 0;
 
     if (!format.name) {
         mb_bi_reader_set_error(bir, -errno, "%s", strerror(errno));
@@ -322,6 +328,192 @@ int _mb_bi_reader_free_format(MbBiReader *bir, FormatReader *format)
     return ret;
 }
 
+static int read_fully_at(MbFile *file, void *buf, size_t size,
+                         uint64_t offset, size_t *bytes_read)
+{
+    size_t n;
+    int ret;
+
+    *bytes_read = 0;
+
+    while (*bytes_read < size) {
+        ret = mb_file_read_at(file, static_cast<char *>(buf) + *bytes_read,
+                              size - *bytes_read, offset + *bytes_read, &n);
+        if (ret == MB_FILE_RETRY) {
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        } else if (n == 0) {
+            break;
+        }
+
+        *bytes_read += n;
+    }
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Read from the opened file through the probe cache
+ *
+ * Format readers use this instead of mb_file_seek() and mb_file_read_fully() so
+ * that the bytes needed for format detection are only read from the file once,
+ * regardless of how many bidders look at them. The first read caches
+ * #PROBE_MIN_READ_SIZE bytes from the beginning of the file. Reads just past
+ * the cached prefix extend it lazily by doubling its size, up to
+ * #PROBE_MAX_PREFIX_SIZE bytes. Reads further away go through a single window
+ * of at least #PROBE_WINDOW_SIZE bytes, which is replaced on a miss.
+ *
+ * If the file's contents are already in memory (see mb_file_get_buffer()), the
+ * data is copied from there instead. If \p file is not the file opened by
+ * \p bir, the cache is bypassed.
+ *
+ * \note Like mb_file_read_fully(), this function only reads fewer than \p size
+ *       bytes if EOF is reached. The file position is not changed.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] file MbFile handle
+ * \param[in] offset Offset to read from
+ * \param[out] buf Buffer to read into
+ * \param[in] size Number of bytes to read
+ * \param[out] bytes_read Output number of bytes that are read
+ *
+ * \return
+ *   * #MB_FILE_OK if no error occurs
+ *   * \<= #MB_FILE_WARN if an error occurs. The error is set on \p file.
+ */
+int _mb_bi_reader_probe_read(MbBiReader *bir, MbFile *file, uint64_t offset,
+                             void *buf, size_t size, size_t *bytes_read)
+{
+    const void *file_data;
+    size_t file_size;
+    size_t n;
+    int ret;
+
+    *bytes_read = 0;
+
+    if (file != bir->file) {
+        return read_fully_at(file, buf, size, offset, bytes_read);
+    }
+
+    if (!bir->probe_have_file_data && !bir->probe_buf && !bir->probe_window) {
+        ret = mb_file_get_buffer(file, &file_data, &file_size);
+        if (ret == MB_FILE_OK) {
+            bir->probe_have_file_data = true;
+            bir->probe_file_data =
+                    static_cast<const unsigned char *>(file_data);
+            bir->probe_file_size = file_size;
+        } else if (ret != MB_FILE_UNSUPPORTED) {
+            return ret;
+        }
+    }
+
+    if (bir->probe_have_file_data) {
+        if (offset < bir->probe_file_size) {
+            n = std::min<uint64_t>(size, bir->probe_file_size - offset);
+            memcpy(buf, bir->probe_file_data + offset, n);
+            *bytes_read = n;
+        }
+        return MB_FILE_OK;
+    }
+
+    // Grow the prefix by at most doubling it so that a single read far into
+    // the file does not pull in everything before it
+    size_t prefix_limit = std::max<size_t>(2 * bir->probe_size,
+                                           PROBE_MIN_READ_SIZE);
+    prefix_limit = std::min<size_t>(prefix_limit, PROBE_MAX_PREFIX_SIZE);
+
+    if (offset <= prefix_limit && size <= prefix_limit - offset) {
+        size_t end = offset + size;
+
+        if (end > bir->probe_size && !bir->probe_eof) {
+
+            if (prefix_limit > bir->probe_capacity) {
+                void *new_buf = realloc(bir->probe_buf, prefix_limit);
+                if (!new_buf) {
+                    return read_fully_at(file, buf, size, offset, bytes_read);
+                }
+                bir->probe_buf = static_cast<unsigned char *>(new_buf);
+                bir->probe_capacity = prefix_limit;
+            }
+
+            ret = read_fully_at(file, bir->probe_buf + bir->probe_size,
+                                prefix_limit - bir->probe_size, bir->probe_size, &n);
+            if (ret < 0) {
+                return ret;
+            }
+
+            bir->probe_eof = n < prefix_limit - bir->probe_size;
+            bir->probe_size += n;
+        }
+
+        if (offset < bir->probe_size) {
+            n = std::min(size, bir->probe_size - static_cast<size_t>(offset));
+            memcpy(buf, bir->probe_buf + offset, n);
+            *bytes_read = n;
+        }
+        return MB_FILE_OK;
+    }
+
+    if (!bir->probe_window || offset < bir->probe_window_offset
+            || offset - bir->probe_window_offset > bir->probe_window_size
+            || size > bir->probe_window_size
+                    - (offset - bir->probe_window_offset)) {
+        size_t target = std::max<size_t>(size, PROBE_WINDOW_SIZE);
+
+        if (target > bir->probe_window_capacity) {
+            void *new_buf = realloc(bir->probe_window, target);
+            if (!new_buf) {
+                return read_fully_at(file, buf, size, offset, bytes_read);
+            }
+            bir->probe_window = static_cast<unsigned char *>(new_buf);
+            bir->probe_window_capacity = target;
+        }
+
+        // Invalidate the window in case the read fails
+        bir->probe_window_size = 0;
+
+        ret = read_fully_at(file, bir->probe_window, target, offset, &n);
+        if (ret < 0) {
+            return ret;
+        }
+
+        bir->probe_window_offset = offset;
+        bir->probe_window_size = n;
+    }
+
+    n = std::min<uint64_t>(size, bir->probe_window_offset
+            + bir->probe_window_size - offset);
+    memcpy(buf, bir->probe_window + (offset - bir->probe_window_offset), n);
+    *bytes_read = n;
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Discard the probe cache
+ *
+ * \param bir MbBiReader
+ */
+void _mb_bi_reader_probe_clear(MbBiReader *bir)
+{
+    bir->probe_have_file_data = false;
+    bir->probe_file_data = nullptr;
+    bir->probe_file_size = 0;
+
+    free(bir->probe_buf);
+    bir->probe_buf = nullptr;
+    bir->probe_size = 0;
+    bir->probe_capacity = 0;
+    bir->probe_eof = false;
+
+    free(bir->probe_window);
+    bir->probe_window = nullptr;
+    bir->probe_window_offset = 0;
+    bir->probe_window_size = 0;
+    bir->probe_window_capacity = 0;
+}
+
 /*!
  * \brief Allocate new MbBiReader.
  *
@@ -500,19 +692,24 @@ int mb_bi_reader_open(MbBiReader *bir, MbFile *file, bool owned)
 
         for (size_t i = 0; i < bir->formats_len; ++i) {
             cur = &bir->formats[i];
+            cur->bid = MB_BI_WARN;
+            cur->bid_time_ns = 0;
+        }
 
-            if (cur->bidder_cb) {
-                // Seek to beginning
-                ret = mb_file_seek(bir->file, 0, SEEK_SET, nullptr);
-                if (ret < 0) {
-                    mb_bi_reader_set_error(bir, mb_file_error(bir->file),
-                                           "Failed to seek file: %s",
-                                           mb_file_error_string(bir->file));
-                    goto done;
-                }
+        for (size_t i = 0; i < bir->formats_len; ++i) {
+            cur = &bir->formats[i];
 
+            if (cur->bidder_cb) {
                 // Call bidder
+                auto start = std::chrono::steady_clock::now();
                 ret = cur->bidder_cb(bir, cur->userdata, best_bid);
+                auto end = std::chrono::steady_clock::now();
+
+                cur->bid = ret;
+                cur->bid_time_ns = static_cast<uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                end - start).count());
+
                 if (ret > best_bid) {
                     best_bid = ret;
                     format = cur;
@@ -524,6 +721,9 @@ int mb_bi_reader_open(MbBiReader *bir, MbFile *file, bool owned)
             }
         }
 
+        // The probe cache is only used by the bidders
+        _mb_bi_reader_probe_clear(bir);
+
         if (format) {
             bir->format = format;
         } else {
@@ -540,6 +740,8 @@ int mb_bi_reader_open(MbBiReader *bir, MbFile *file, bool owned)
 
 done:
     if (ret != MB_BI_OK) {
+        _mb_bi_reader_probe_clear(bir);
+
         if (owned) {
             mb_file_free(file);
         }
@@ -587,6 +789,8 @@ int mb_bi_reader_close(MbBiReader *bir)
         bir->file = nullptr;
         bir->file_owned = false;
 
+        _mb_bi_reader_probe_clear(bir);
+
         // Don't change state to ReaderState::FATAL if MB_BI_FATAL is returned.
         // Otherwise, we risk double-closing the boot image. CLOSED and FATAL
         // are the same anyway, aside from the fact that boot images can be
@@ -831,6 +1035,51 @@ const char * mb_bi_reader_format_name(MbBiReader *bir)
     return bir->format->name;
 }
 
+/*!
+ * \brief Get bid statistics for an enabled format.
+ *
+ * Formats are indexed in the order in which they were enabled. The statistics
+ * describe the bidding performed by the last call to mb_bi_reader_open(). If
+ * the format did not place a bid (eg. because a format was forced or the bid
+ * could not be won), then \p bid is set to #MB_BI_WARN.
+ *
+ * \param[in] bir MbBiReader
+ * \param[in] index Index of enabled format
+ * \param[out] code Pointer to store format code (\ref MB_BI_FORMAT_CODES)
+ *                  (optional)
+ * \param[out] bid Pointer to store bidder return value (optional)
+ * \param[out] time_ns Pointer to store time spent in the bidder in nanoseconds
+ *                     (optional)
+ *
+ * \return
+ *   * #MB_BI_OK if the statistics are successfully retrieved
+ *   * #MB_BI_WARN if \p index is out of range
+ */
+int mb_bi_reader_bid_stats(MbBiReader *bir, size_t index, int *code, int *bid,
+                           uint64_t *time_ns)
+{
+    if (index >= bir->formats_len) {
+        mb_bi_reader_set_error(bir, MB_BI_ERROR_INVALID_ARGUMENT,
+                               "Format index out of range: %" MB_PRIzu,
+                               index);
+        return MB_BI_WARN;
+    }
+
+    FormatReader *format = &bir->formats[index];
+
+    if (code) {
+        *code = format->type;
+    }
+    if (bid) {
+        *bid = format->bid;
+    }
+    if (time_ns) {
+        *time_ns = format->bid_time_ns;
+    }
+
+    return MB_BI_OK;
+}
+
 /*!
  * \brief Force support for a boot image format by its code.
  *
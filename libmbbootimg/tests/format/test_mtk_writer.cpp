@@ -18,3 +18,175 @@
  */
 
 #include <gtest/gtest.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/entry.h"
+#include "mbbootimg/format/mtk_writer_p.h"
+#include "mbbootimg/header.h"
+#include "mbbootimg/writer.h"
+#include "mbbootimg/writer_p.h"
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+struct MtkWriterSHA1Test : public ::testing::Test
+{
+protected:
+    ScopedFile _file;
+    ScopedWriter _biw;
+    void *_buf;
+    size_t _buf_size;
+
+    MtkWriterSHA1Test()
+        : _file(mb_file_new(), mb_file_free)
+        , _biw(mb_bi_writer_new(), mb_bi_writer_free)
+        , _buf(nullptr)
+        , _buf_size(0)
+    {
+    }
+
+    virtual ~MtkWriterSHA1Test()
+    {
+        free(_buf);
+    }
+
+    virtual void SetUp()
+    {
+        ASSERT_TRUE(!!_file);
+        ASSERT_TRUE(!!_biw);
+
+        ASSERT_EQ(mb_file_open_memory_dynamic(_file.get(), &_buf, &_buf_size),
+                  MB_FILE_OK);
+
+        ASSERT_EQ(mb_bi_writer_set_format_mtk(_biw.get()), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_open(_biw.get(), _file.get(), false), MB_BI_OK);
+    }
+
+    MtkWriterCtx * ctx()
+    {
+        return static_cast<MtkWriterCtx *>(_biw->format.userdata);
+    }
+
+    // Write an image where the data for each entry type in types is written.
+    // If set_sizes is true, then the entry sizes are set before writing.
+    void WriteImage(int types, bool set_sizes)
+    {
+        MbBiHeader *header;
+        MbBiEntry *entry;
+        int ret;
+        size_t n;
+
+        ASSERT_EQ(mb_bi_writer_get_header(_biw.get(), &header), MB_BI_OK);
+        ASSERT_EQ(mb_bi_header_set_page_size(header, 2048), MB_BI_OK);
+        ASSERT_EQ(mb_bi_writer_write_header(_biw.get(), header), MB_BI_OK);
+
+        while ((ret = mb_bi_writer_get_entry(_biw.get(), &entry)) == MB_BI_OK) {
+            int type = mb_bi_entry_type(entry);
+            std::vector<unsigned char> data;
+
+            if (type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                    || type == MB_BI_ENTRY_MTK_RAMDISK_HEADER) {
+                MtkHeader mtkhdr;
+                memset(&mtkhdr, 0xff, sizeof(mtkhdr));
+                memcpy(mtkhdr.magic, MTK_MAGIC, MTK_MAGIC_SIZE);
+                mtkhdr.size = 0;
+                memset(mtkhdr.type, 0, sizeof(mtkhdr.type));
+                strcpy(mtkhdr.type, type == MB_BI_ENTRY_MTK_KERNEL_HEADER
+                       ? "KERNEL" : "ROOTFS");
+
+                auto ptr = reinterpret_cast<unsigned char *>(&mtkhdr);
+                data.assign(ptr, ptr + sizeof(mtkhdr));
+            } else {
+                // Give every entry a different size and contents
+                data.resize(1000 + 100 * type);
+                for (size_t i = 0; i < data.size(); ++i) {
+                    data[i] = static_cast<unsigned char>(i * type);
+                }
+            }
+
+            if (!(type & types)) {
+                continue;
+            }
+
+            if (set_sizes) {
+                ASSERT_EQ(mb_bi_entry_set_size(entry, data.size()), MB_BI_OK);
+            }
+
+            ASSERT_EQ(mb_bi_writer_write_entry(_biw.get(), entry), MB_BI_OK);
+
+            // Write in small chunks to exercise buffering of the MTK header
+            for (size_t i = 0; i < data.size(); i += 100) {
+                size_t to_write = std::min<size_t>(100, data.size() - i);
+                ASSERT_EQ(mb_bi_writer_write_data(_biw.get(), data.data() + i,
+                                                  to_write, &n), MB_BI_OK);
+                ASSERT_EQ(n, to_write);
+            }
+        }
+        ASSERT_EQ(ret, MB_BI_EOF);
+
+        ASSERT_EQ(mb_bi_writer_close(_biw.get()), MB_BI_OK);
+    }
+
+    // Check that the ID matches the expected value and the SHA1 computed by
+    // rereading the image
+    void CheckChecksum(const unsigned char expected[SHA_DIGEST_LENGTH])
+    {
+        unsigned char digest[SHA_DIGEST_LENGTH];
+
+        ASSERT_EQ(_mtk_compute_sha1(_biw.get(), &ctx()->segctx, _file.get(),
+                                    digest), MB_BI_OK);
+        ASSERT_EQ(memcmp(digest, expected, sizeof(digest)), 0);
+        ASSERT_EQ(memcmp(static_cast<unsigned char *>(_buf) + 576,
+                         expected, sizeof(digest)), 0);
+    }
+};
+
+static const unsigned char all_types_sha1[] = {
+    0xcb, 0x99, 0x95, 0xab, 0x8b, 0xf3, 0xf9, 0xd6, 0xbe, 0xf4,
+    0x53, 0x9c, 0xd0, 0x73, 0x5a, 0x01, 0xe6, 0x13, 0xa2, 0x10,
+};
+
+static const int all_types =
+        MB_BI_ENTRY_MTK_KERNEL_HEADER | MB_BI_ENTRY_KERNEL
+        | MB_BI_ENTRY_MTK_RAMDISK_HEADER | MB_BI_ENTRY_RAMDISK
+        | MB_BI_ENTRY_SECONDBOOT | MB_BI_ENTRY_DEVICE_TREE;
+
+TEST_F(MtkWriterSHA1Test, StreamsHashIfSizesAreSet)
+{
+    WriteImage(all_types, true);
+
+    // Computed while writing
+    ASSERT_TRUE(ctx()->sha_valid);
+    CheckChecksum(all_types_sha1);
+}
+
+TEST_F(MtkWriterSHA1Test, RereadsIfSizesAreNotSet)
+{
+    WriteImage(all_types, false);
+
+    // MTK headers had to be hashed before their image sizes were known
+    ASSERT_FALSE(ctx()->sha_valid);
+    CheckChecksum(all_types_sha1);
+}
+
+TEST_F(MtkWriterSHA1Test, HandlesSkippedEntries)
+{
+    static const unsigned char expected[] = {
+        0xe4, 0x55, 0xa2, 0xfd, 0x52, 0x13, 0x89, 0x37, 0xaf, 0xaa,
+        0x4e, 0x4b, 0xd8, 0x24, 0xd5, 0xcb, 0x2c, 0x3f, 0x29, 0x54,
+    };
+
+    WriteImage(MB_BI_ENTRY_MTK_KERNEL_HEADER | MB_BI_ENTRY_KERNEL
+            | MB_BI_ENTRY_MTK_RAMDISK_HEADER | MB_BI_ENTRY_RAMDISK, true);
+
+    ASSERT_TRUE(ctx()->sha_valid);
+    CheckChecksum(expected);
+}
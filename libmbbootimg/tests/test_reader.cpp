@@ -20,10 +20,18 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <vector>
 
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
+
+#include "mbbootimg/format/android_p.h"
 #include "mbbootimg/reader.h"
 #include "mbbootimg/reader_p.h"
 
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
 typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
 
 
@@ -51,3 +59,203 @@ TEST(BootImgReaderTest, CheckInitialValues)
     ASSERT_NE(bir->header, nullptr);
     ASSERT_NE(bir->entry, nullptr);
 }
+
+struct ReaderProbeTest : testing::Test
+{
+    ScopedReader _bir;
+    ScopedFile _file;
+    std::vector<unsigned char> _data;
+    size_t _pos = 0;
+    size_t _n_reads = 0;
+
+    ReaderProbeTest()
+        : _bir(mb_bi_reader_new(), &mb_bi_reader_free)
+        , _file(mb_file_new(), &mb_file_free)
+    {
+    }
+
+    static int _read_cb(MbFile *file, void *userdata,
+                        void *buf, size_t size, size_t *bytes_read)
+    {
+        (void) file;
+        ReaderProbeTest *test = static_cast<ReaderProbeTest *>(userdata);
+
+        size_t n = 0;
+        if (test->_pos < test->_data.size()) {
+            n = std::min(size, test->_data.size() - test->_pos);
+            memcpy(buf, test->_data.data() + test->_pos, n);
+            test->_pos += n;
+        }
+        ++test->_n_reads;
+
+        *bytes_read = n;
+        return MB_FILE_OK;
+    }
+
+    static int _seek_cb(MbFile *file, void *userdata,
+                        int64_t offset, int whence, uint64_t *new_offset)
+    {
+        (void) file;
+        ReaderProbeTest *test = static_cast<ReaderProbeTest *>(userdata);
+
+        switch (whence) {
+        case SEEK_SET:
+            test->_pos = offset;
+            break;
+        case SEEK_CUR:
+            test->_pos += offset;
+            break;
+        case SEEK_END:
+            test->_pos = test->_data.size() + offset;
+            break;
+        default:
+            return MB_FILE_FAILED;
+        }
+
+        *new_offset = test->_pos;
+        return MB_FILE_OK;
+    }
+
+    // Open file without a buffer callback so that reads go through the cache
+    void open_stream()
+    {
+        ASSERT_EQ(mb_file_set_read_callback(_file.get(), &_read_cb),
+                  MB_FILE_OK);
+        ASSERT_EQ(mb_file_set_seek_callback(_file.get(), &_seek_cb),
+                  MB_FILE_OK);
+        ASSERT_EQ(mb_file_set_callback_data(_file.get(), this), MB_FILE_OK);
+        ASSERT_EQ(mb_file_open(_file.get()), MB_FILE_OK);
+    }
+};
+
+TEST_F(ReaderProbeTest, CachePrefixAndWindow)
+{
+    _data.resize(PROBE_MAX_PREFIX_SIZE + 3 * PROBE_WINDOW_SIZE);
+    for (size_t i = 0; i < _data.size(); ++i) {
+        _data[i] = static_cast<unsigned char>(i * 7);
+    }
+    open_stream();
+
+    // Not opened through the reader so that bidding does not fill the cache
+    _bir->file = _file.get();
+
+    unsigned char buf[64];
+    size_t n;
+
+    auto check_read = [&](uint64_t offset, size_t size, size_t expected) {
+        ASSERT_EQ(_mb_bi_reader_probe_read(_bir.get(), _file.get(), offset,
+                                           buf, size, &n), MB_FILE_OK);
+        ASSERT_EQ(n, expected);
+        ASSERT_EQ(memcmp(buf, _data.data() + offset, n), 0);
+    };
+
+    // First read fills the minimum prefix
+    check_read(0, 16, 16);
+    size_t reads = _n_reads;
+    ASSERT_GT(reads, 0u);
+    ASSERT_EQ(_bir->probe_size, static_cast<size_t>(PROBE_MIN_READ_SIZE));
+
+    // Reads within the prefix are served from the cache
+    check_read(0x400, 64, 64);
+    check_read(PROBE_MIN_READ_SIZE - 32, 32, 32);
+    ASSERT_EQ(_n_reads, reads);
+
+    // Reading past the prefix extends it
+    check_read(PROBE_MIN_READ_SIZE + 10, 64, 64);
+    ASSERT_GT(_n_reads, reads);
+    ASSERT_GE(_bir->probe_size, static_cast<size_t>(2 * PROBE_MIN_READ_SIZE));
+    reads = _n_reads;
+
+    // Reads past the maximum prefix size use the window
+    uint64_t far = PROBE_MAX_PREFIX_SIZE + PROBE_WINDOW_SIZE + 100;
+    check_read(far, 16, 16);
+    ASSERT_GT(_n_reads, reads);
+    ASSERT_LE(_bir->probe_size, static_cast<size_t>(PROBE_MAX_PREFIX_SIZE));
+    reads = _n_reads;
+
+    check_read(far, 16, 16);
+    check_read(far + 32, 32, 32);
+    ASSERT_EQ(_n_reads, reads);
+
+    // Reads are truncated at EOF
+    check_read(_data.size() - 10, 32, 10);
+    check_read(_data.size() + 10, 32, 0);
+
+    _mb_bi_reader_probe_clear(_bir.get());
+    ASSERT_EQ(_bir->probe_buf, nullptr);
+    ASSERT_EQ(_bir->probe_size, 0u);
+    ASSERT_EQ(_bir->probe_window, nullptr);
+
+    _bir->file = nullptr;
+}
+
+TEST_F(ReaderProbeTest, BiddersShareCache)
+{
+    AndroidHeader hdr = {};
+    memcpy(hdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    hdr.page_size = 2048;
+
+    _data.resize(2 * hdr.page_size);
+    memcpy(_data.data(), &hdr, sizeof(hdr));
+    open_stream();
+
+    ASSERT_EQ(mb_bi_reader_enable_format_all(_bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_open(_bir.get(), _file.get(), false), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_format_code(_bir.get()), MB_BI_FORMAT_ANDROID);
+
+    // The whole image fits in the prefix, so it is read exactly once. The
+    // second read is the one that hits EOF.
+    ASSERT_EQ(_n_reads, 2u);
+
+    // The cache is freed once bidding finishes
+    ASSERT_EQ(_bir->probe_buf, nullptr);
+    ASSERT_EQ(_bir->probe_size, 0u);
+    ASSERT_EQ(_bir->probe_window, nullptr);
+
+    ASSERT_EQ(mb_bi_reader_close(_bir.get()), MB_BI_OK);
+}
+
+TEST(BootImgReaderTest, BidStats)
+{
+    ScopedFile file(mb_file_new(), &mb_file_free);
+    ASSERT_TRUE(!!file);
+    ScopedReader bir(mb_bi_reader_new(), &mb_bi_reader_free);
+    ASSERT_TRUE(!!bir);
+
+    AndroidHeader hdr = {};
+    memcpy(hdr.magic, ANDROID_BOOT_MAGIC, ANDROID_BOOT_MAGIC_SIZE);
+    hdr.page_size = 2048;
+
+    ASSERT_EQ(mb_file_open_memory_static(file.get(), &hdr, sizeof(hdr)),
+              MB_FILE_OK);
+
+    ASSERT_EQ(mb_bi_reader_enable_format_android(bir.get()), MB_BI_OK);
+    ASSERT_EQ(mb_bi_reader_enable_format_sony_elf(bir.get()), MB_BI_OK);
+
+    int code;
+    int bid;
+    uint64_t time_ns;
+
+    // Nothing bid yet
+    ASSERT_EQ(mb_bi_reader_bid_stats(bir.get(), 0, &code, &bid, &time_ns),
+              MB_BI_OK);
+    ASSERT_EQ(code, MB_BI_FORMAT_ANDROID);
+    ASSERT_EQ(bid, MB_BI_WARN);
+    ASSERT_EQ(time_ns, 0u);
+
+    ASSERT_EQ(mb_bi_reader_open(bir.get(), file.get(), false), MB_BI_OK);
+
+    ASSERT_EQ(mb_bi_reader_bid_stats(bir.get(), 0, &code, &bid, nullptr),
+              MB_BI_OK);
+    ASSERT_EQ(code, MB_BI_FORMAT_ANDROID);
+    ASSERT_EQ(bid, ANDROID_BOOT_MAGIC_SIZE * 8);
+
+    // The Android bid cannot be beaten by the Sony ELF bidder
+    ASSERT_EQ(mb_bi_reader_bid_stats(bir.get(), 1, &code, &bid, nullptr),
+              MB_BI_OK);
+    ASSERT_EQ(code, MB_BI_FORMAT_SONY_ELF);
+    ASSERT_EQ(bid, MB_BI_WARN);
+
+    ASSERT_EQ(mb_bi_reader_bid_stats(bir.get(), 2, nullptr, nullptr, nullptr),
+              MB_BI_WARN);
+}
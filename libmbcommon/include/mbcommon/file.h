@@ -67,6 +67,17 @@ typedef int (*MbFileSeekCb)(struct MbFile *file, void *userdata,
                             uint64_t *new_offset);
 typedef int (*MbFileTruncateCb)(struct MbFile *file, void *userdata,
                                 uint64_t size);
+typedef int (*MbFileReadAtCb)(struct MbFile *file, void *userdata,
+                              void *buf, size_t size, uint64_t offset,
+                              size_t *bytes_read);
+typedef int (*MbFileWriteAtCb)(struct MbFile *file, void *userdata,
+                               const void *buf, size_t size, uint64_t offset,
+                               size_t *bytes_written);
+typedef int (*MbFileMoveCb)(struct MbFile *file, void *userdata,
+                            uint64_t src, uint64_t dest, uint64_t size,
+                            uint64_t *size_moved);
+typedef int (*MbFileBufferCb)(struct MbFile *file, void *userdata,
+                              const void **buf, size_t *size);
 
 // Handle creation/destruction
 MB_EXPORT struct MbFile * mb_file_new();
@@ -85,6 +96,14 @@ MB_EXPORT int mb_file_set_seek_callback(struct MbFile *file,
                                         MbFileSeekCb seek_cb);
 MB_EXPORT int mb_file_set_truncate_callback(struct MbFile *file,
                                             MbFileTruncateCb truncate_cb);
+MB_EXPORT int mb_file_set_read_at_callback(struct MbFile *file,
+                                           MbFileReadAtCb read_at_cb);
+MB_EXPORT int mb_file_set_write_at_callback(struct MbFile *file,
+                                            MbFileWriteAtCb write_at_cb);
+MB_EXPORT int mb_file_set_move_callback(struct MbFile *file,
+                                        MbFileMoveCb move_cb);
+MB_EXPORT int mb_file_set_buffer_callback(struct MbFile *file,
+                                          MbFileBufferCb buffer_cb);
 MB_EXPORT int mb_file_set_callback_data(struct MbFile *file, void *userdata);
 
 // File open/close
@@ -99,6 +118,13 @@ MB_EXPORT int mb_file_write(struct MbFile *file, const void *buf, size_t size,
 MB_EXPORT int mb_file_seek(struct MbFile *file, int64_t offset, int whence,
                            uint64_t *new_offset);
 MB_EXPORT int mb_file_truncate(struct MbFile *file, uint64_t size);
+MB_EXPORT int mb_file_read_at(struct MbFile *file, void *buf, size_t size,
+                              uint64_t offset, size_t *bytes_read);
+MB_EXPORT int mb_file_write_at(struct MbFile *file, const void *buf,
+                               size_t size, uint64_t offset,
+                               size_t *bytes_written);
+MB_EXPORT int mb_file_get_buffer(struct MbFile *file, const void **buf,
+                                 size_t *size);
 
 // Error handling functions
 MB_EXPORT int mb_file_error(struct MbFile *file);
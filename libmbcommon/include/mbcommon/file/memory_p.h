@@ -30,6 +30,8 @@ struct MemoryFileCtx
 {
     void *data;
     size_t size;
+    // Allocated size of dynamic buffers
+    size_t capacity;
 
     void **data_ptr;
     size_t *size_ptr;
@@ -111,6 +111,21 @@ struct SysVtable
     PosixReadFn fn_read;
     PosixWriteFn fn_write;
 
+#ifndef _WIN32
+    // Optional: positional I/O and in-kernel copies (used by mb_file_move())
+    typedef ssize_t (*PosixPread64Fn)(void *userdata, int fd, void *buf,
+                                      size_t count, off64_t offset);
+    typedef ssize_t (*PosixPwrite64Fn)(void *userdata, int fd, const void *buf,
+                                       size_t count, off64_t offset);
+    typedef ssize_t (*LinuxCopyFileRangeFn)(void *userdata, int fd_in,
+                                            off64_t *off_in, int fd_out,
+                                            off64_t *off_out, size_t len,
+                                            unsigned int flags);
+    PosixPread64Fn fn_pread64;
+    PosixPwrite64Fn fn_pwrite64;
+    LinuxCopyFileRangeFn fn_copy_file_range;
+#endif
+
 #ifdef _WIN32
     // windows.h
     typedef BOOL (*Win32CloseHandleFn)(void *userdata, HANDLE hObject);
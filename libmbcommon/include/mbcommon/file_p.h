@@ -46,6 +46,10 @@ struct MbFile
     MbFileWriteCb write_cb;
     MbFileSeekCb seek_cb;
     MbFileTruncateCb truncate_cb;
+    MbFileReadAtCb read_at_cb;
+    MbFileWriteAtCb write_at_cb;
+    MbFileMoveCb move_cb;
+    MbFileBufferCb buffer_cb;
     void *cb_userdata;
 
     // Error
@@ -25,6 +25,15 @@ MB_BEGIN_C_DECLS
 
 typedef int (*MbFileSearchResultCallback)(struct MbFile *file, void *userdata,
                                           uint64_t offset);
+typedef int (*MbFileSearchMultiResultCallback)(struct MbFile *file,
+                                               void *userdata, size_t index,
+                                               uint64_t offset);
+
+struct MbFileSearchPattern
+{
+    const void *data;
+    size_t size;
+};
 
 MB_EXPORT int mb_file_read_fully(struct MbFile *file,
                                  void *buf, size_t size,
@@ -41,6 +50,12 @@ MB_EXPORT int mb_file_search(struct MbFile *file, int64_t start, int64_t end,
                              size_t pattern_size, int64_t max_matches,
                              MbFileSearchResultCallback result_cb,
                              void *userdata);
+MB_EXPORT int mb_file_search_multi(struct MbFile *file, int64_t start,
+                                   int64_t end, size_t bsize,
+                                   const struct MbFileSearchPattern *patterns,
+                                   size_t patterns_count, int64_t max_matches,
+                                   MbFileSearchMultiResultCallback result_cb,
+                                   void *userdata);
 
 MB_EXPORT int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
                            uint64_t size, uint64_t *size_moved);
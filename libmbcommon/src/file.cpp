@@ -20,6 +20,7 @@
 #include "mbcommon/file.h"
 
 #include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 
@@ -261,6 +262,148 @@
  *   * Return \<= #MB_FILE_WARN if an error occurs
  */
 
+/*!
+ * \typedef MbFileReadAtCb
+ *
+ * \brief File positional read callback
+ *
+ * \note This callback must *not* change the file position.
+ *
+ * \param[in] file MbFile handle
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[in] offset File offset to read from
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file. This parameter is guaranteed to be non-NULL.
+ *
+ * \return
+ *   * Return #MB_FILE_OK if some bytes were read or EOF is reached
+ *   * Return #MB_FILE_RETRY if the same operation should be reattempted
+ *   * Return #MB_FILE_UNSUPPORTED if mb_file_read_at() should emulate the
+ *     operation with the seek and read callbacks (Not registering a positional
+ *     read callback has the same effect.)
+ *   * Return \<= #MB_FILE_WARN if an error occurs
+ */
+
+/*!
+ * \typedef MbFileWriteAtCb
+ *
+ * \brief File positional write callback
+ *
+ * \note This callback must *not* change the file position.
+ *
+ * \param[in] file MbFile handle
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[in] offset File offset to write to
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter is guaranteed to be non-NULL.
+ *
+ * \return
+ *   * Return #MB_FILE_OK if some bytes were written
+ *   * Return #MB_FILE_RETRY if the same operation should be reattempted
+ *   * Return #MB_FILE_UNSUPPORTED if mb_file_write_at() should emulate the
+ *     operation with the seek and write callbacks (Not registering a
+ *     positional write callback has the same effect.)
+ *   * Return \<= #MB_FILE_WARN if an error occurs
+ */
+
+/*!
+ * \typedef MbFileMoveCb
+ *
+ * \brief File move callback
+ *
+ * This optional callback allows mb_file_move() to use a more efficient method
+ * of copying data within the file than reading and writing through the file
+ * position. The source and destination regions can overlap. Data beyond the end
+ * of the file must not be copied.
+ *
+ * \note The file position after this callback returns is undefined.
+ *
+ * \param[in] file MbFile handle
+ * \param[in] src Source offset
+ * \param[in] dest Destination offset
+ * \param[in] size Size of data to move
+ * \param[out] size_moved Output size of data that was moved. This parameter is
+ *                        guaranteed to be non-NULL.
+ *
+ * \return
+ *   * Return #MB_FILE_OK if the data was successfully moved
+ *   * Return #MB_FILE_UNSUPPORTED if the generic implementation should be used
+ *     instead (Not registering a move callback has the same effect.)
+ *   * Return \<= #MB_FILE_WARN if an error occurs
+ */
+
+/*!
+ * \typedef MbFileBufferCb
+ *
+ * \brief File buffer callback
+ *
+ * This optional callback exposes the entire contents of a file that is already
+ * in memory (eg. a memory buffer or a memory mapping) so that callers can
+ * access the data directly instead of copying it with mb_file_read().
+ *
+ * \note This callback must *not* change the file position.
+ *
+ * \param[in] file MbFile handle
+ * \param[out] buf Output pointer to the file contents. This parameter is
+ *                 guaranteed to be non-NULL.
+ * \param[out] size Output size of the file contents. This parameter is
+ *                  guaranteed to be non-NULL.
+ *
+ * \return
+ *   * Return #MB_FILE_OK if the buffer is available
+ *   * Return #MB_FILE_UNSUPPORTED if the file contents are not in memory (Not
+ *     registering a buffer callback has the same effect.)
+ *   * Return \<= #MB_FILE_WARN if an error occurs
+ */
+
+/*!
+ * \brief Emulate positional I/O by seeking around a read or write
+ *
+ * The original file position is restored afterwards. If it cannot be restored,
+ * #MB_FILE_FATAL is returned since the position would no longer be known.
+ */
+template<typename Fn>
+static int emulate_at(struct MbFile *file, uint64_t offset, Fn &&fn)
+{
+    uint64_t orig_offset;
+    uint64_t new_offset;
+    int ret;
+
+    if (!file->seek_cb) {
+        mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
+                          "Positional I/O requires a seek callback");
+        return MB_FILE_UNSUPPORTED;
+    } else if (offset > INT64_MAX) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Offset too large: %" PRIu64, offset);
+        return MB_FILE_FAILED;
+    }
+
+    ret = file->seek_cb(file, file->cb_userdata, 0, SEEK_CUR, &orig_offset);
+    if (ret != MB_FILE_OK) {
+        return ret;
+    }
+
+    ret = file->seek_cb(file, file->cb_userdata, static_cast<int64_t>(offset),
+                        SEEK_SET, &new_offset);
+    if (ret != MB_FILE_OK) {
+        return ret;
+    }
+
+    ret = fn();
+
+    int ret2 = file->seek_cb(file, file->cb_userdata,
+                             static_cast<int64_t>(orig_offset), SEEK_SET,
+                             &new_offset);
+    if (ret2 != MB_FILE_OK) {
+        return MB_FILE_FATAL;
+    }
+
+    return ret;
+}
+
 MB_BEGIN_C_DECLS
 
 /*!
@@ -410,6 +553,76 @@ int mb_file_set_truncate_callback(struct MbFile *file,
     return MB_FILE_OK;
 }
 
+/*!
+ * \brief Set the file positional read callback for an MbFile handle.
+ *
+ * \param file MbFile handle
+ * \param read_at_cb File positional read callback
+ *
+ * \return
+ *   * #MB_FILE_OK if the callback was successfully set
+ *   * #MB_FILE_FATAL if the file has already been opened
+ */
+int mb_file_set_read_at_callback(struct MbFile *file,
+                                 MbFileReadAtCb read_at_cb)
+{
+    ENSURE_STATE(file, MbFileState::NEW);
+    file->read_at_cb = read_at_cb;
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Set the file positional write callback for an MbFile handle.
+ *
+ * \param file MbFile handle
+ * \param write_at_cb File positional write callback
+ *
+ * \return
+ *   * #MB_FILE_OK if the callback was successfully set
+ *   * #MB_FILE_FATAL if the file has already been opened
+ */
+int mb_file_set_write_at_callback(struct MbFile *file,
+                                  MbFileWriteAtCb write_at_cb)
+{
+    ENSURE_STATE(file, MbFileState::NEW);
+    file->write_at_cb = write_at_cb;
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Set the file move callback for an MbFile handle.
+ *
+ * \param file MbFile handle
+ * \param move_cb File move callback
+ *
+ * \return
+ *   * #MB_FILE_OK if the callback was successfully set
+ *   * #MB_FILE_FATAL if the file has already been opened
+ */
+int mb_file_set_move_callback(struct MbFile *file, MbFileMoveCb move_cb)
+{
+    ENSURE_STATE(file, MbFileState::NEW);
+    file->move_cb = move_cb;
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Set the file buffer callback for an MbFile handle.
+ *
+ * \param file MbFile handle
+ * \param buffer_cb File buffer callback
+ *
+ * \return
+ *   * #MB_FILE_OK if the callback was successfully set
+ *   * #MB_FILE_FATAL if the file has already been opened
+ */
+int mb_file_set_buffer_callback(struct MbFile *file, MbFileBufferCb buffer_cb)
+{
+    ENSURE_STATE(file, MbFileState::NEW);
+    file->buffer_cb = buffer_cb;
+    return MB_FILE_OK;
+}
+
 /*!
  * \brief Set the data to provide to callbacks for an MbFile handle.
  *
@@ -679,6 +892,178 @@ int mb_file_truncate(struct MbFile *file, uint64_t size)
     return ret;
 }
 
+/*!
+ * \brief Read from an MbFile handle at the specified offset.
+ *
+ * This is like mb_file_read(), except the data is read from \p offset and the
+ * file position is not changed (like `pread()`). If the handle does not
+ * implement positional reads natively, the operation is emulated by saving the
+ * file position, seeking to \p offset, reading, and restoring the position.
+ *
+ * \note Handles with a native implementation (eg. those opened with
+ *       mb_file_open_fd() and mb_file_open_memory_static()) do not touch the
+ *       file position, so multiple threads can read from the same handle
+ *       concurrently as long as no errors occur. With the emulated
+ *       implementation, the caller must serialize all access to the handle.
+ *
+ * \param[in] file MbFile handle
+ * \param[out] buf Buffer to read into
+ * \param[in] size Buffer size
+ * \param[in] offset File offset to read from
+ * \param[out] bytes_read Output number of bytes that were read. 0 indicates end
+ *                        of file. This parameter cannot be NULL.
+ *
+ * \return
+ *   * #MB_FILE_OK if some bytes were read or EOF is reached
+ *   * #MB_FILE_RETRY if the same operation should be reattempted
+ *   * #MB_FILE_UNSUPPORTED if the handle source does not support reading or
+ *     seeking
+ *   * \<= #MB_FILE_WARN if an error occurs
+ */
+int mb_file_read_at(struct MbFile *file, void *buf, size_t size,
+                    uint64_t offset, size_t *bytes_read)
+{
+    int ret = MB_FILE_UNSUPPORTED;
+
+    ENSURE_STATE(file, MbFileState::OPENED);
+
+    if (!bytes_read) {
+        mb_file_set_error(file, MB_FILE_ERROR_PROGRAMMER_ERROR,
+                          "%s: bytes_read is NULL",
+                          __func__);
+        ret = MB_FILE_FATAL;
+    } else {
+        if (file->read_at_cb) {
+            ret = file->read_at_cb(file, file->cb_userdata, buf, size, offset,
+                                   bytes_read);
+        }
+        if (ret == MB_FILE_UNSUPPORTED) {
+            if (file->read_cb) {
+                ret = emulate_at(file, offset, [&]{
+                    return file->read_cb(file, file->cb_userdata, buf, size,
+                                         bytes_read);
+                });
+            } else {
+                mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
+                                  "%s: No read callback registered",
+                                  __func__);
+            }
+        }
+    }
+    if (ret <= MB_FILE_FATAL) {
+        file->state = MbFileState::FATAL;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Write to an MbFile handle at the specified offset.
+ *
+ * This is like mb_file_write(), except the data is written to \p offset and
+ * the file position is not changed (like `pwrite()`). If the handle does not
+ * implement positional writes natively, the operation is emulated by saving
+ * the file position, seeking to \p offset, writing, and restoring the position.
+ *
+ * \note See mb_file_read_at() regarding concurrent use. Concurrent writes to
+ *       memory handles are not safe since the buffer may be reallocated.
+ *
+ * \param[in] file MbFile handle
+ * \param[in] buf Buffer to write from
+ * \param[in] size Buffer size
+ * \param[in] offset File offset to write to
+ * \param[out] bytes_written Output number of bytes that were written. This
+ *                           parameter cannot be NULL.
+ *
+ * \return
+ *   * #MB_FILE_OK if some bytes were written
+ *   * #MB_FILE_RETRY if the same operation should be reattempted
+ *   * #MB_FILE_UNSUPPORTED if the handle source does not support writing or
+ *     seeking
+ *   * \<= #MB_FILE_WARN if an error occurs
+ */
+int mb_file_write_at(struct MbFile *file, const void *buf, size_t size,
+                     uint64_t offset, size_t *bytes_written)
+{
+    int ret = MB_FILE_UNSUPPORTED;
+
+    ENSURE_STATE(file, MbFileState::OPENED);
+
+    if (!bytes_written) {
+        mb_file_set_error(file, MB_FILE_ERROR_PROGRAMMER_ERROR,
+                          "%s: bytes_written is NULL",
+                          __func__);
+        ret = MB_FILE_FATAL;
+    } else {
+        if (file->write_at_cb) {
+            ret = file->write_at_cb(file, file->cb_userdata, buf, size, offset,
+                                    bytes_written);
+        }
+        if (ret == MB_FILE_UNSUPPORTED) {
+            if (file->write_cb) {
+                ret = emulate_at(file, offset, [&]{
+                    return file->write_cb(file, file->cb_userdata, buf, size,
+                                          bytes_written);
+                });
+            } else {
+                mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
+                                  "%s: No write callback registered",
+                                  __func__);
+            }
+        }
+    }
+    if (ret <= MB_FILE_FATAL) {
+        file->state = MbFileState::FATAL;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Get in-memory contents of an MbFile handle.
+ *
+ * If the handle is backed by memory (eg. opened with
+ * mb_file_open_memory_static() or mb_file_open_mmap_filename()), this provides
+ * direct read-only access to the whole file without copying. Callers should
+ * fall back to mb_file_read() or mb_file_read_at() if #MB_FILE_UNSUPPORTED is
+ * returned. This is not an error, so no error string is set in that case.
+ *
+ * \warning The buffer becomes invalid when the file is written to, truncated,
+ *          or closed. For example, writing to a file opened with
+ *          mb_file_open_memory_dynamic() may reallocate the buffer.
+ *
+ * \param[in] file MbFile handle
+ * \param[out] buf Output pointer to the file contents. This parameter cannot be
+ *                 NULL.
+ * \param[out] size Output size of the file contents. This parameter cannot be
+ *                  NULL.
+ *
+ * \return
+ *   * #MB_FILE_OK if the buffer is available
+ *   * #MB_FILE_UNSUPPORTED if the file contents are not in memory
+ *   * \<= #MB_FILE_WARN if an error occurs
+ */
+int mb_file_get_buffer(struct MbFile *file, const void **buf, size_t *size)
+{
+    int ret = MB_FILE_UNSUPPORTED;
+
+    ENSURE_STATE(file, MbFileState::OPENED);
+
+    if (!buf || !size) {
+        mb_file_set_error(file, MB_FILE_ERROR_PROGRAMMER_ERROR,
+                          "%s: buf or size is NULL",
+                          __func__);
+        ret = MB_FILE_FATAL;
+    } else if (file->buffer_cb) {
+        ret = file->buffer_cb(file, file->cb_userdata, buf, size);
+    }
+    if (ret <= MB_FILE_FATAL) {
+        file->state = MbFileState::FATAL;
+    }
+
+    return ret;
+}
+
 /*!
  * \brief Get error code for a failed operation.
  *
@@ -19,6 +19,8 @@
 
 #include "mbcommon/file/fd.h"
 
+#include <algorithm>
+
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
@@ -36,6 +38,11 @@
 #define DEFAULT_MODE \
     (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
+// Maximum buffer size for moving data with pread64() and pwrite64()
+#define MOVE_BUFFER_SIZE        (8 * 1024 * 1024)
+// Buffer alignment for moving data (matches the page size of most devices)
+#define MOVE_BUFFER_ALIGNMENT   4096
+
 /*!
  * \file mbcommon/file/fd.h
  * \brief Open file with POSIX file descriptors API
@@ -173,6 +180,250 @@ static int fd_truncate_cb(struct MbFile *file, void *userdata,
     return MB_FILE_OK;
 }
 
+#ifndef _WIN32
+static int fd_read_at_cb(struct MbFile *file, void *userdata,
+                         void *buf, size_t size, uint64_t offset,
+                         size_t *bytes_read)
+{
+    FdFileCtx *ctx = static_cast<FdFileCtx *>(userdata);
+
+    if (!ctx->vtable.fn_pread64) {
+        return MB_FILE_UNSUPPORTED;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = ctx->vtable.fn_pread64(ctx->vtable.userdata, ctx->fd, buf,
+                                       size, offset);
+    if (n < 0) {
+        mb_file_set_error(file, -errno,
+                          "Failed to read file: %s", strerror(errno));
+        return errno == EINTR ? MB_FILE_RETRY : MB_FILE_FAILED;
+    }
+
+    *bytes_read = n;
+    return MB_FILE_OK;
+}
+
+static int fd_write_at_cb(struct MbFile *file, void *userdata,
+                          const void *buf, size_t size, uint64_t offset,
+                          size_t *bytes_written)
+{
+    FdFileCtx *ctx = static_cast<FdFileCtx *>(userdata);
+
+    if (!ctx->vtable.fn_pwrite64) {
+        return MB_FILE_UNSUPPORTED;
+    }
+
+    if (size > SSIZE_MAX) {
+        size = SSIZE_MAX;
+    }
+
+    ssize_t n = ctx->vtable.fn_pwrite64(ctx->vtable.userdata, ctx->fd, buf,
+                                        size, offset);
+    if (n < 0) {
+        mb_file_set_error(file, -errno,
+                          "Failed to write file: %s", strerror(errno));
+        return errno == EINTR ? MB_FILE_RETRY : MB_FILE_FAILED;
+    }
+
+    *bytes_written = n;
+    return MB_FILE_OK;
+}
+
+static int fd_pread_fully(struct MbFile *file, FdFileCtx *ctx, void *buf,
+                          size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = ctx->vtable.fn_pread64(ctx->vtable.userdata, ctx->fd, buf,
+                                           std::min<size_t>(size, SSIZE_MAX),
+                                           offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            mb_file_set_error(file, -errno,
+                              "Failed to read file: %s", strerror(errno));
+            return MB_FILE_FAILED;
+        } else if (n == 0) {
+            mb_file_set_error(file, MB_FILE_ERROR_INTERNAL_ERROR,
+                              "Unexpected EOF while moving data");
+            return MB_FILE_FAILED;
+        }
+
+        buf = static_cast<char *>(buf) + n;
+        size -= n;
+        offset += n;
+    }
+
+    return MB_FILE_OK;
+}
+
+static int fd_pwrite_fully(struct MbFile *file, FdFileCtx *ctx,
+                           const void *buf, size_t size, uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = ctx->vtable.fn_pwrite64(ctx->vtable.userdata, ctx->fd, buf,
+                                            std::min<size_t>(size, SSIZE_MAX),
+                                            offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            mb_file_set_error(file, -errno,
+                              "Failed to write file: %s", strerror(errno));
+            return MB_FILE_FAILED;
+        } else if (n == 0) {
+            mb_file_set_error(file, MB_FILE_ERROR_INTERNAL_ERROR,
+                              "Unexpected zero-length write");
+            return MB_FILE_FAILED;
+        }
+
+        buf = static_cast<const char *>(buf) + n;
+        size -= n;
+        offset += n;
+    }
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Copy non-overlapping data with copy_file_range()
+ *
+ * \return
+ *   * #MB_FILE_OK if the data was copied
+ *   * #MB_FILE_UNSUPPORTED if the kernel or filesystem does not support
+ *     copy_file_range(). \p size_moved indicates how much data was already
+ *     copied.
+ *   * #MB_FILE_FAILED if an error occurs
+ */
+static int fd_copy_range(struct MbFile *file, FdFileCtx *ctx,
+                         uint64_t src, uint64_t dest, uint64_t size,
+                         uint64_t *size_moved)
+{
+    while (*size_moved < size) {
+        off64_t off_in = src + *size_moved;
+        off64_t off_out = dest + *size_moved;
+
+        ssize_t n = ctx->vtable.fn_copy_file_range(
+                ctx->vtable.userdata, ctx->fd, &off_in, ctx->fd, &off_out,
+                std::min<uint64_t>(size - *size_moved, SSIZE_MAX), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == ENOSYS || errno == EXDEV
+                || errno == EINVAL || errno == EOPNOTSUPP
+                || errno == EBADF)) {
+            return MB_FILE_UNSUPPORTED;
+        } else if (n < 0) {
+            mb_file_set_error(file, -errno,
+                              "Failed to copy data: %s", strerror(errno));
+            return MB_FILE_FAILED;
+        } else if (n == 0) {
+            return MB_FILE_UNSUPPORTED;
+        }
+
+        *size_moved += n;
+    }
+
+    return MB_FILE_OK;
+}
+
+static int fd_move_cb(struct MbFile *file, void *userdata,
+                      uint64_t src, uint64_t dest, uint64_t size,
+                      uint64_t *size_moved)
+{
+    FdFileCtx *ctx = static_cast<FdFileCtx *>(userdata);
+    struct stat sb;
+    int ret;
+
+    if (!ctx->vtable.fn_pread64 || !ctx->vtable.fn_pwrite64) {
+        return MB_FILE_UNSUPPORTED;
+    }
+
+    if (ctx->vtable.fn_fstat(ctx->vtable.userdata, ctx->fd, &sb) < 0) {
+        mb_file_set_error(file, -errno,
+                          "Failed to stat file: %s", strerror(errno));
+        return MB_FILE_FAILED;
+    }
+
+    // The size of block devices, etc. is not known here, so let the generic
+    // implementation find the end of the data
+    if (!S_ISREG(sb.st_mode)) {
+        return MB_FILE_UNSUPPORTED;
+    }
+
+    // Don't copy anything past EOF
+    uint64_t file_size = sb.st_size;
+    size = src < file_size ? std::min(size, file_size - src) : 0;
+
+    *size_moved = 0;
+
+    if (size == 0) {
+        return MB_FILE_OK;
+    }
+
+    // copy_file_range() does not allow overlapping ranges within a file
+    if (ctx->vtable.fn_copy_file_range
+            && (src + size <= dest || dest + size <= src)) {
+        ret = fd_copy_range(file, ctx, src, dest, size, size_moved);
+        if (ret != MB_FILE_UNSUPPORTED) {
+            return ret;
+        }
+    }
+
+    size_t buf_size = std::min<uint64_t>(size - *size_moved, MOVE_BUFFER_SIZE);
+    void *buf;
+
+    errno = posix_memalign(&buf, MOVE_BUFFER_ALIGNMENT, buf_size);
+    if (errno != 0) {
+        mb_file_set_error(file, -errno,
+                          "Failed to allocate buffer: %s", strerror(errno));
+        return MB_FILE_FAILED;
+    }
+
+    ret = MB_FILE_OK;
+
+    if (dest < src) {
+        // Copy forwards
+        while (ret == MB_FILE_OK && *size_moved < size) {
+            size_t n = std::min<uint64_t>(buf_size, size - *size_moved);
+
+            ret = fd_pread_fully(file, ctx, buf, n, src + *size_moved);
+            if (ret == MB_FILE_OK) {
+                ret = fd_pwrite_fully(file, ctx, buf, n, dest + *size_moved);
+            }
+            if (ret == MB_FILE_OK) {
+                *size_moved += n;
+            }
+        }
+    } else {
+        // Copy backwards. Anything already copied by copy_file_range() is at
+        // the beginning of the range.
+        uint64_t remaining = size - *size_moved;
+
+        while (ret == MB_FILE_OK && remaining > 0) {
+            size_t n = std::min<uint64_t>(buf_size, remaining);
+            uint64_t offset = *size_moved + remaining - n;
+
+            ret = fd_pread_fully(file, ctx, buf, n, src + offset);
+            if (ret == MB_FILE_OK) {
+                ret = fd_pwrite_fully(file, ctx, buf, n, dest + offset);
+            }
+            if (ret == MB_FILE_OK) {
+                remaining -= n;
+            }
+        }
+
+        if (ret == MB_FILE_OK) {
+            *size_moved = size;
+        }
+    }
+
+    free(buf);
+    return ret;
+}
+#endif
+
 static bool check_vtable(SysVtable *vtable, bool needs_open)
 {
     return vtable
@@ -213,6 +464,31 @@ static FdFileCtx * create_ctx(struct MbFile *file, SysVtable *vtable,
 
 static int open_ctx(struct MbFile *file, FdFileCtx *ctx)
 {
+#ifndef _WIN32
+    int ret = MB_FILE_OK;
+    int ret2;
+
+    ret2 = mb_file_set_read_at_callback(file, &fd_read_at_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_write_at_callback(file, &fd_write_at_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_move_callback(file, &fd_move_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    if (ret != MB_FILE_OK) {
+        free_ctx(ctx);
+        return ret;
+    }
+#endif
+
     return mb_file_open_callbacks(file,
                                   &fd_open_cb,
                                   &fd_close_cb,
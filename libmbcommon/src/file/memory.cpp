@@ -52,73 +52,141 @@ static int memory_close_cb(struct MbFile *file, void *userdata)
     return MB_FILE_OK;
 }
 
-static int memory_read_cb(struct MbFile *file, void *userdata,
-                          void *buf, size_t size, size_t *bytes_read)
+static int memory_resize(struct MbFile *file, MemoryFileCtx *ctx, size_t size)
 {
-    (void) file;
-    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+    if (size > ctx->capacity) {
+        // Grow geometrically so that many small writes (eg. from a streaming
+        // writer) don't reallocate and copy the whole buffer every time
+        size_t new_capacity = ctx->capacity > SIZE_MAX / 2
+                ? SIZE_MAX : ctx->capacity * 2;
+        if (new_capacity < size) {
+            new_capacity = size;
+        }
 
-    size_t to_read = 0;
-    if (ctx->pos < ctx->size) {
-        to_read = std::min(ctx->size - ctx->pos, size);
+        void *new_data = realloc(ctx->data, new_capacity);
+        if (!new_data) {
+            mb_file_set_error(file, -errno,
+                              "Failed to resize buffer: %s",
+                              strerror(errno));
+            return MB_FILE_FAILED;
+        }
+
+        ctx->data = new_data;
+        ctx->capacity = new_capacity;
     }
 
-    memcpy(buf, static_cast<char *>(ctx->data) + ctx->pos, to_read);
-    ctx->pos += to_read;
+    // Zero-initialize new space
+    if (size > ctx->size) {
+        memset(static_cast<char *>(ctx->data) + ctx->size, 0,
+               size - ctx->size);
+    }
+
+    ctx->size = size;
+    if (ctx->data_ptr) {
+        *ctx->data_ptr = ctx->data;
+    }
+    if (ctx->size_ptr) {
+        *ctx->size_ptr = ctx->size;
+    }
 
-    *bytes_read = to_read;
     return MB_FILE_OK;
 }
 
-static int memory_write_cb(struct MbFile *file, void *userdata,
-                           const void *buf, size_t size, size_t *bytes_written)
+static size_t memory_read_at(MemoryFileCtx *ctx, void *buf, size_t size,
+                             size_t offset)
 {
-    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+    size_t to_read = 0;
+    if (offset < ctx->size) {
+        to_read = std::min(ctx->size - offset, size);
+    }
+
+    memcpy(buf, static_cast<char *>(ctx->data) + offset, to_read);
+
+    return to_read;
+}
 
-    if (ctx->pos > SIZE_MAX - size) {
+static int memory_write_at(struct MbFile *file, MemoryFileCtx *ctx,
+                           const void *buf, size_t size, size_t offset,
+                           size_t *bytes_written)
+{
+    if (offset > SIZE_MAX - size) {
         mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
                           "Write would overflow size_t");
         return MB_FILE_FAILED;
     }
 
-    size_t desired_size = ctx->pos + size;
+    size_t desired_size = offset + size;
     size_t to_write = size;
 
     if (desired_size > ctx->size) {
         if (ctx->fixed_size) {
-            to_write = ctx->pos <= ctx->size ? ctx->size - ctx->pos : 0;
+            to_write = offset <= ctx->size ? ctx->size - offset : 0;
         } else {
             // Enlarge buffer
-            void *new_data = realloc(ctx->data, desired_size);
-            if (!new_data) {
-                mb_file_set_error(file, -errno,
-                                  "Failed to enlarge buffer: %s",
-                                  strerror(errno));
-                return MB_FILE_FAILED;
-            }
-
-            // Zero-initialize new space
-            memset(static_cast<char *>(new_data) + ctx->size, 0,
-                   desired_size - ctx->size);
-
-            ctx->data = new_data;
-            ctx->size = desired_size;
-            if (ctx->data_ptr) {
-                *ctx->data_ptr = ctx->data;
-            }
-            if (ctx->size_ptr) {
-                *ctx->size_ptr = ctx->size;
+            int ret = memory_resize(file, ctx, desired_size);
+            if (ret != MB_FILE_OK) {
+                return ret;
             }
         }
     }
 
-    memcpy(static_cast<char *>(ctx->data) + ctx->pos, buf, to_write);
-    ctx->pos += to_write;
+    memcpy(static_cast<char *>(ctx->data) + offset, buf, to_write);
 
     *bytes_written = to_write;
     return MB_FILE_OK;
 }
 
+static int memory_read_cb(struct MbFile *file, void *userdata,
+                          void *buf, size_t size, size_t *bytes_read)
+{
+    (void) file;
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+
+    *bytes_read = memory_read_at(ctx, buf, size, ctx->pos);
+    ctx->pos += *bytes_read;
+
+    return MB_FILE_OK;
+}
+
+static int memory_write_cb(struct MbFile *file, void *userdata,
+                           const void *buf, size_t size, size_t *bytes_written)
+{
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+
+    int ret = memory_write_at(file, ctx, buf, size, ctx->pos, bytes_written);
+    if (ret == MB_FILE_OK) {
+        ctx->pos += *bytes_written;
+    }
+
+    return ret;
+}
+
+static int memory_read_at_cb(struct MbFile *file, void *userdata,
+                             void *buf, size_t size, uint64_t offset,
+                             size_t *bytes_read)
+{
+    (void) file;
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+
+    *bytes_read = offset < ctx->size ? memory_read_at(ctx, buf, size, offset) : 0;
+    return MB_FILE_OK;
+}
+
+static int memory_write_at_cb(struct MbFile *file, void *userdata,
+                              const void *buf, size_t size, uint64_t offset,
+                              size_t *bytes_written)
+{
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+
+    if (offset > SIZE_MAX) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Offset too large: %" PRIu64, offset);
+        return MB_FILE_FAILED;
+    }
+
+    return memory_write_at(file, ctx, buf, size, offset, bytes_written);
+}
+
 static int memory_seek_cb(struct MbFile *file, void *userdata,
                           int64_t offset, int whence, uint64_t *new_offset)
 {
@@ -176,31 +244,50 @@ static int memory_truncate_cb(struct MbFile *file, void *userdata,
         mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
                           "Cannot truncate fixed buffer");
         return MB_FILE_UNSUPPORTED;
+    } else if (size > SIZE_MAX) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Size too large: %" PRIu64, size);
+        return MB_FILE_FAILED;
     } else {
-        void *new_data = realloc(ctx->data, size);
-        if (!new_data) {
-            mb_file_set_error(file, -errno,
-                              "Failed to resize buffer: %s",
-                              strerror(errno));
-            return MB_FILE_FAILED;
-        }
+        return memory_resize(file, ctx, size);
+    }
+}
 
-        // Zero-initialize new space
-        if (size > ctx->size) {
-            memset(static_cast<char *>(new_data) + ctx->size, 0,
-                   size - ctx->size);
-        }
+static int memory_move_cb(struct MbFile *file, void *userdata,
+                          uint64_t src, uint64_t dest, uint64_t size,
+                          uint64_t *size_moved)
+{
+    (void) file;
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
 
-        ctx->data = new_data;
-        ctx->size = size;
-        if (ctx->data_ptr) {
-            *ctx->data_ptr = ctx->data;
-        }
-        if (ctx->size_ptr) {
-            *ctx->size_ptr = ctx->size;
+    // Don't copy anything past EOF
+    size = src < ctx->size ? std::min<uint64_t>(size, ctx->size - src) : 0;
+
+    if (dest + size > ctx->size) {
+        if (ctx->fixed_size) {
+            // Writes past the end of a fixed buffer are truncated
+            size = dest < ctx->size ? ctx->size - dest : 0;
+        } else {
+            // Let the generic implementation enlarge the buffer
+            return MB_FILE_UNSUPPORTED;
         }
     }
 
+    memmove(static_cast<char *>(ctx->data) + dest,
+            static_cast<char *>(ctx->data) + src, size);
+
+    *size_moved = size;
+    return MB_FILE_OK;
+}
+
+static int memory_buffer_cb(struct MbFile *file, void *userdata,
+                            const void **buf, size_t *size)
+{
+    (void) file;
+    MemoryFileCtx *const ctx = static_cast<MemoryFileCtx *>(userdata);
+
+    *buf = ctx->data;
+    *size = ctx->size;
     return MB_FILE_OK;
 }
 
@@ -220,6 +307,34 @@ static MemoryFileCtx * create_ctx(struct MbFile *file)
 
 static int open_ctx(struct MbFile *file, MemoryFileCtx *ctx)
 {
+    int ret = MB_FILE_OK;
+    int ret2;
+
+    ret2 = mb_file_set_read_at_callback(file, &memory_read_at_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_write_at_callback(file, &memory_write_at_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_move_callback(file, &memory_move_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_buffer_callback(file, &memory_buffer_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    if (ret != MB_FILE_OK) {
+        free_ctx(ctx);
+        return ret;
+    }
+
     return mb_file_open_callbacks(file,
                                   nullptr,
                                   &memory_close_cb,
@@ -259,6 +374,13 @@ int mb_file_open_memory_static(struct MbFile *file,
 /*!
  * Open MbFile handle from dynamically sized memory buffer.
  *
+ * The buffer is enlarged with `realloc()` as needed and \p buf_ptr and
+ * \p size_ptr are updated whenever it changes. The allocated size grows
+ * geometrically and may be larger than `*size_ptr`, so writing a large file in
+ * small pieces does not copy the buffer on every write. Truncating the file to
+ * a smaller size does not shrink the allocation. The buffer must be freed with
+ * `free()` by the caller.
+ *
  * \param[in] file MbFile handle
  * \param[in,out] buf_ptr Pointer to data buffer
  * \param[in,out] size_ptr Pointer to size of data buffer
@@ -277,6 +399,7 @@ int mb_file_open_memory_dynamic(struct MbFile *file,
 
     ctx->data = *buf_ptr;
     ctx->size = *size_ptr;
+    ctx->capacity = *size_ptr;
     ctx->data_ptr = buf_ptr;
     ctx->size_ptr = size_ptr;
 
@@ -0,0 +1,365 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbcommon/file/mmap.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include "mbcommon/locale.h"
+#include "mbcommon/string.h"
+
+#include "mbcommon/file/callbacks.h"
+#include "mbcommon/file/mmap_p.h"
+
+/*!
+ * \file mbcommon/file/mmap.h
+ * \brief Open read-only file as a memory mapping
+ *
+ * The whole file is mapped into memory when it is opened. Reads are served by
+ * copying directly from the mapping and mb_file_get_buffer() provides access
+ * to the mapping itself, so functions like mb_file_search() do not need to
+ * copy the file contents at all.
+ *
+ * \note This is only supported on Unix-like systems. On other systems, the
+ *       open functions always return #MB_FILE_UNSUPPORTED and callers should
+ *       fall back to mb_file_open_filename().
+ *
+ * \warning If the underlying file is truncated by another process while it is
+ *          mapped, accessing the missing pages will raise `SIGBUS`.
+ */
+
+MB_BEGIN_C_DECLS
+
+#ifndef _WIN32
+
+static void free_ctx(MmapFileCtx *ctx)
+{
+    free(ctx->filename);
+    free(ctx);
+}
+
+static int mmap_open_cb(struct MbFile *file, void *userdata)
+{
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+    struct stat sb;
+    off64_t size;
+    int saved_errno;
+
+    int fd = open(ctx->filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        mb_file_set_error(file, -errno, "Failed to open file: %s",
+                          strerror(errno));
+        return MB_FILE_FAILED;
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        saved_errno = errno;
+        mb_file_set_error(file, -saved_errno, "Failed to stat file: %s",
+                          strerror(saved_errno));
+        goto error;
+    }
+
+    if (S_ISDIR(sb.st_mode)) {
+        saved_errno = EISDIR;
+        mb_file_set_error(file, -saved_errno, "Cannot open directory");
+        goto error;
+    }
+
+    // st_size is 0 for block devices, so get the size by seeking
+    size = lseek64(fd, 0, SEEK_END);
+    if (size < 0) {
+        saved_errno = errno;
+        mb_file_set_error(file, -saved_errno, "Failed to get file size: %s",
+                          strerror(saved_errno));
+        goto error;
+    } else if (static_cast<uint64_t>(size) > SIZE_MAX) {
+        saved_errno = EFBIG;
+        mb_file_set_error(file, -saved_errno,
+                          "File too large to map: %" PRId64,
+                          static_cast<int64_t>(size));
+        goto error;
+    }
+
+    // mmap() fails with EINVAL for empty mappings
+    if (size > 0) {
+        ctx->data = mmap(nullptr, static_cast<size_t>(size), PROT_READ,
+                         MAP_PRIVATE, fd, 0);
+        if (ctx->data == MAP_FAILED) {
+            ctx->data = nullptr;
+            saved_errno = errno;
+            mb_file_set_error(file, -saved_errno, "Failed to map file: %s",
+                              strerror(saved_errno));
+            goto error;
+        }
+
+        // These are only hints, so failures are harmless
+        madvise(ctx->data, static_cast<size_t>(size), MADV_SEQUENTIAL);
+        madvise(ctx->data, static_cast<size_t>(size), MADV_WILLNEED);
+    }
+
+    ctx->size = static_cast<size_t>(size);
+
+    // The mapping remains valid after the descriptor is closed
+    close(fd);
+
+    return MB_FILE_OK;
+
+error:
+    close(fd);
+    return MB_FILE_FAILED;
+}
+
+static int mmap_close_cb(struct MbFile *file, void *userdata)
+{
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+    int ret = MB_FILE_OK;
+
+    if (ctx->data && munmap(ctx->data, ctx->size) < 0) {
+        mb_file_set_error(file, -errno, "Failed to unmap file: %s",
+                          strerror(errno));
+        ret = MB_FILE_FAILED;
+    }
+
+    free_ctx(ctx);
+
+    return ret;
+}
+
+static size_t mmap_read_at(MmapFileCtx *ctx, void *buf, size_t size,
+                           uint64_t offset)
+{
+    size_t to_read = 0;
+    if (offset < ctx->size) {
+        to_read = std::min<size_t>(ctx->size - offset, size);
+        memcpy(buf, static_cast<char *>(ctx->data) + offset, to_read);
+    }
+
+    return to_read;
+}
+
+static int mmap_read_cb(struct MbFile *file, void *userdata,
+                        void *buf, size_t size, size_t *bytes_read)
+{
+    (void) file;
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+
+    *bytes_read = mmap_read_at(ctx, buf, size, ctx->pos);
+    ctx->pos += *bytes_read;
+
+    return MB_FILE_OK;
+}
+
+static int mmap_seek_cb(struct MbFile *file, void *userdata,
+                        int64_t offset, int whence, uint64_t *new_offset)
+{
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+    size_t base;
+
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = ctx->pos;
+        break;
+    case SEEK_END:
+        base = ctx->size;
+        break;
+    default:
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Invalid whence argument: %d", whence);
+        return MB_FILE_FAILED;
+    }
+
+    if ((offset < 0 && static_cast<uint64_t>(-offset) > base)
+            || (offset > 0 && static_cast<uint64_t>(offset)
+                    > SIZE_MAX - base)) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Invalid offset %" PRId64 " for base %" MB_PRIzu,
+                          offset, base);
+        return MB_FILE_FAILED;
+    }
+
+    *new_offset = ctx->pos = base + offset;
+
+    return MB_FILE_OK;
+}
+
+static int mmap_read_at_cb(struct MbFile *file, void *userdata,
+                           void *buf, size_t size, uint64_t offset,
+                           size_t *bytes_read)
+{
+    (void) file;
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+
+    *bytes_read = mmap_read_at(ctx, buf, size, offset);
+    return MB_FILE_OK;
+}
+
+static int mmap_buffer_cb(struct MbFile *file, void *userdata,
+                          const void **buf, size_t *size)
+{
+    (void) file;
+    MmapFileCtx *const ctx = static_cast<MmapFileCtx *>(userdata);
+
+    *buf = ctx->data;
+    *size = ctx->size;
+    return MB_FILE_OK;
+}
+
+static MmapFileCtx * create_ctx(struct MbFile *file)
+{
+    MmapFileCtx *ctx = static_cast<MmapFileCtx *>(
+            calloc(1, sizeof(MmapFileCtx)));
+    if (!ctx) {
+        mb_file_set_error(file, MB_FILE_ERROR_INTERNAL_ERROR,
+                          "Failed to allocate MmapFileCtx: %s",
+                          strerror(errno));
+        return nullptr;
+    }
+
+    return ctx;
+}
+
+static int open_ctx(struct MbFile *file, MmapFileCtx *ctx)
+{
+    int ret = MB_FILE_OK;
+    int ret2;
+
+    ret2 = mb_file_set_read_at_callback(file, &mmap_read_at_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    ret2 = mb_file_set_buffer_callback(file, &mmap_buffer_cb);
+    if (ret2 < ret) {
+        ret = ret2;
+    }
+
+    if (ret != MB_FILE_OK) {
+        free_ctx(ctx);
+        return ret;
+    }
+
+    return mb_file_open_callbacks(file,
+                                  &mmap_open_cb,
+                                  &mmap_close_cb,
+                                  &mmap_read_cb,
+                                  nullptr,
+                                  &mmap_seek_cb,
+                                  nullptr,
+                                  ctx);
+}
+
+#endif
+
+/*!
+ * Open MbFile handle by mapping a file read-only into memory.
+ *
+ * The mapping is advised as `MADV_SEQUENTIAL` and `MADV_WILLNEED` so that the
+ * kernel reads ahead aggressively. The handle does not support writing or
+ * truncation.
+ *
+ * \param file MbFile handle
+ * \param filename MBS filename
+ *
+ * \return
+ *   * #MB_FILE_OK if the file was successfully opened and mapped
+ *   * #MB_FILE_UNSUPPORTED if memory mappings are not supported on this system
+ *   * \<= #MB_FILE_WARN if an error occurs
+ */
+int mb_file_open_mmap_filename(struct MbFile *file, const char *filename)
+{
+#ifdef _WIN32
+    (void) filename;
+    mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
+                      "Memory mapped files are not supported");
+    return MB_FILE_UNSUPPORTED;
+#else
+    MmapFileCtx *ctx = create_ctx(file);
+    if (!ctx) {
+        return MB_FILE_FATAL;
+    }
+
+    ctx->filename = strdup(filename);
+    if (!ctx->filename) {
+        mb_file_set_error(file, MB_FILE_ERROR_INTERNAL_ERROR,
+                          "Failed to allocate string: %s", strerror(errno));
+        free_ctx(ctx);
+        return MB_FILE_FATAL;
+    }
+
+    return open_ctx(file, ctx);
+#endif
+}
+
+/*!
+ * Open MbFile handle by mapping a file read-only into memory.
+ *
+ * \p filename is converted to MBS using mb::wcs_to_mbs() before being used.
+ *
+ * \param file MbFile handle
+ * \param filename WCS filename
+ *
+ * \return
+ *   * #MB_FILE_OK if the file was successfully opened and mapped
+ *   * #MB_FILE_UNSUPPORTED if memory mappings are not supported on this system
+ *   * \<= #MB_FILE_WARN if an error occurs
+ *
+ * \sa mb_file_open_mmap_filename()
+ */
+int mb_file_open_mmap_filename_w(struct MbFile *file, const wchar_t *filename)
+{
+#ifdef _WIN32
+    (void) filename;
+    mb_file_set_error(file, MB_FILE_ERROR_UNSUPPORTED,
+                      "Memory mapped files are not supported");
+    return MB_FILE_UNSUPPORTED;
+#else
+    MmapFileCtx *ctx = create_ctx(file);
+    if (!ctx) {
+        return MB_FILE_FATAL;
+    }
+
+    ctx->filename = mb::wcs_to_mbs(filename);
+    if (!ctx->filename) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Failed to convert WCS filename to MBS");
+        free_ctx(ctx);
+        return MB_FILE_FATAL;
+    }
+
+    return open_ctx(file, ctx);
+#endif
+}
+
+MB_END_C_DECLS
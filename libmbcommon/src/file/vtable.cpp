@@ -19,8 +19,13 @@
 
 #include "mbcommon/file/vtable_p.h"
 
+#include <cerrno>
+
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#endif
 
 MB_BEGIN_C_DECLS
 
@@ -148,6 +153,44 @@ static ssize_t _default_write(void *userdata, int fd, const void *buf,
     return write(fd, buf, count);
 }
 
+#ifndef _WIN32
+static ssize_t _default_pread64(void *userdata, int fd, void *buf,
+                                size_t count, off64_t offset)
+{
+    (void) userdata;
+    return pread64(fd, buf, count, offset);
+}
+
+static ssize_t _default_pwrite64(void *userdata, int fd, const void *buf,
+                                 size_t count, off64_t offset)
+{
+    (void) userdata;
+    return pwrite64(fd, buf, count, offset);
+}
+
+static ssize_t _default_copy_file_range(void *userdata, int fd_in,
+                                        off64_t *off_in, int fd_out,
+                                        off64_t *off_out, size_t len,
+                                        unsigned int flags)
+{
+    (void) userdata;
+#ifdef __NR_copy_file_range
+    // Not all libcs provide a wrapper yet
+    return syscall(__NR_copy_file_range, fd_in, off_in, fd_out, off_out, len,
+                   flags);
+#else
+    (void) fd_in;
+    (void) off_in;
+    (void) fd_out;
+    (void) off_out;
+    (void) len;
+    (void) flags;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
 #ifdef _WIN32
 static BOOL _default_CloseHandle(void *userdata, HANDLE hObject)
 {
@@ -236,6 +279,11 @@ void _vtable_fill_system_funcs(SysVtable *vtable)
     vtable->fn_lseek64 = _default_lseek64;
     vtable->fn_read = _default_read;
     vtable->fn_write = _default_write;
+#ifndef _WIN32
+    vtable->fn_pread64 = _default_pread64;
+    vtable->fn_pwrite64 = _default_pwrite64;
+    vtable->fn_copy_file_range = _default_copy_file_range;
+#endif
 #ifdef _WIN32
     // windows.h
     vtable->fn_CloseHandle = _default_CloseHandle;
@@ -20,15 +20,30 @@
 #include "mbcommon/file_util.h"
 
 #include <algorithm>
+#include <vector>
 
 #include <cerrno>
 #include <cstdio>
 #include <cstring>
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+#include "mbcommon/file_p.h"
 #include "mbcommon/string.h"
 
 #define DEFAULT_BUFFER_SIZE             (8 * 1024 * 1024)
 
+// Largest pattern set that is filtered with vector instructions. Larger sets
+// are matched through a table of patterns indexed by their first byte.
+#define SEARCH_MULTI_MAX_VECTOR_PATTERNS 8
+
+#define MOVE_MIN_BUFFER_SIZE            (1 * 1024 * 1024)
+#define MOVE_MAX_BUFFER_SIZE            (8 * 1024 * 1024)
+
 /*!
  * \file mbcommon/file_util.h
  * \brief Useful utility functions for MbFile API
@@ -52,6 +67,40 @@
  *   * Return \<= #MB_FILE_FAILED if the search should fail
  */
 
+/*!
+ * \typedef MbFileSearchMultiResultCallback
+ *
+ * \note The same restrictions as #MbFileSearchResultCallback apply.
+ *
+ * \param file MbFile handle
+ * \param userdata User callback data
+ * \param index Index of the pattern that matched
+ * \param offset Offset of match
+ *
+ * \return
+ *   * Return #MB_FILE_OK if the search can continue
+ *   * Return #MB_FILE_WARN if the search should stop, but return MB_FILE_OK
+ *   * Return \<= #MB_FILE_FAILED if the search should fail
+ */
+
+/*!
+ * \struct MbFileSearchPattern
+ *
+ * \brief Pattern for mb_file_search_multi()
+ */
+
+/*!
+ * \var MbFileSearchPattern::data
+ *
+ * \brief Pattern data
+ */
+
+/*!
+ * \var MbFileSearchPattern::size
+ *
+ * \brief Size of pattern data (must be non-zero)
+ */
+
 MB_BEGIN_C_DECLS
 
 /*!
@@ -200,6 +249,52 @@ int mb_file_read_discard(struct MbFile *file, uint64_t size,
     return MB_FILE_OK;
 }
 
+static int search_buffer(struct MbFile *file, const char *data, size_t size,
+                         int64_t start, int64_t end, const void *pattern,
+                         size_t pattern_size, int64_t max_matches,
+                         MbFileSearchResultCallback result_cb,
+                         void *userdata)
+{
+    const char *ptr = data;
+    const char *ptr_end = data + size;
+    const char *match;
+    int ret;
+
+    if (start >= 0 && static_cast<uint64_t>(start) < size) {
+        ptr += start;
+    } else if (start >= 0) {
+        ptr = ptr_end;
+    }
+    if (end >= 0 && static_cast<uint64_t>(end) < size) {
+        ptr_end = data + end;
+    }
+
+    while (static_cast<size_t>(ptr_end - ptr) >= pattern_size
+            && (match = static_cast<const char *>(mb_memmem(
+                    ptr, ptr_end - ptr, pattern, pattern_size)))) {
+        // Invoke callback
+        ret = result_cb(file, userdata, match - data);
+        if (ret == MB_FILE_WARN) {
+            // Stop searching early
+            break;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        if (max_matches > 0) {
+            --max_matches;
+            if (max_matches == 0) {
+                break;
+            }
+        }
+
+        // We don't do overlapping searches
+        ptr = match + pattern_size;
+    }
+
+    return MB_FILE_OK;
+}
+
 /*!
  * \brief Search file for binary sequence
  *
@@ -210,6 +305,9 @@ int mb_file_read_discard(struct MbFile *file, uint64_t size,
  * 2 * \p pattern_size would exceed the maximum value of a `size_t`, `SIZE_MAX`
  * will be used.
  *
+ * If the contents of \p file are already in memory (see mb_file_get_buffer()),
+ * the memory is searched directly and \p bsize is ignored.
+ *
  * If \p file does not support seeking, then the file position must be set to
  * the beginning of the file before calling this function. Instead of seeking,
  * the function will read and discard any data before \p start.
@@ -252,6 +350,8 @@ int mb_file_search(struct MbFile *file, int64_t start, int64_t end,
     size_t match_remain;
     uint64_t offset;
     size_t n;
+    const void *data;
+    size_t data_size;
 
     // Check boundaries
     if (start >= 0 && end >= 0 && end < start) {
@@ -287,6 +387,18 @@ int mb_file_search(struct MbFile *file, int64_t start, int64_t end,
         goto done;
     }
 
+    // Search directly in memory if the file is already in memory
+    ret = mb_file_get_buffer(file, &data, &data_size);
+    if (ret == MB_FILE_OK) {
+        ret = search_buffer(file, static_cast<const char *>(data), data_size,
+                            start, end, pattern, pattern_size, max_matches,
+                            result_cb, userdata);
+        goto done;
+    } else if (ret != MB_FILE_UNSUPPORTED) {
+        goto done;
+    }
+    ret = MB_FILE_OK;
+
     buf = static_cast<char *>(malloc(buf_size));
     if (!buf) {
         mb_file_set_error(file, -errno, "Failed to allocate buffer: %s",
@@ -402,6 +514,437 @@ done:
     return ret;
 }
 
+/*!
+ * \brief Allocate buffer for mb_file_move()
+ *
+ * The buffer is at most #MOVE_MAX_BUFFER_SIZE bytes, but no larger than
+ * \p size. If the allocation fails, smaller buffers are tried down to
+ * #MOVE_MIN_BUFFER_SIZE bytes.
+ */
+struct MultiSearchCtx
+{
+    struct MbFile *file;
+    const MbFileSearchPattern *patterns;
+    size_t patterns_count;
+    size_t max_size;
+    int64_t max_matches;
+    MbFileSearchMultiResultCallback result_cb;
+    void *userdata;
+
+    // Offset before which each pattern cannot match again, since we don't do
+    // overlapping searches
+    std::vector<uint64_t> next_offset;
+    // Pattern indices for each possible first byte
+    std::vector<std::vector<size_t>> buckets;
+
+    bool stop;
+};
+
+static int search_multi_check(MultiSearchCtx *ctx, const unsigned char *data,
+                              size_t data_size, uint64_t base, size_t pos,
+                              size_t index)
+{
+    const MbFileSearchPattern *pattern = &ctx->patterns[index];
+
+    if (pattern->size > data_size - pos
+            || base + pos < ctx->next_offset[index]
+            || memcmp(data + pos, pattern->data, pattern->size) != 0) {
+        return MB_FILE_OK;
+    }
+
+    ctx->next_offset[index] = base + pos + pattern->size;
+
+    // Invoke callback
+    int ret = ctx->result_cb(ctx->file, ctx->userdata, index, base + pos);
+    if (ret == MB_FILE_WARN) {
+        // Stop searching early
+        ctx->stop = true;
+        return MB_FILE_OK;
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    if (ctx->max_matches > 0) {
+        --ctx->max_matches;
+        if (ctx->max_matches == 0) {
+            ctx->stop = true;
+        }
+    }
+
+    return MB_FILE_OK;
+}
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+
+#define SEARCH_VECTOR_SIZE 16
+
+#if defined(__SSE2__)
+// One mask bit per byte
+#define SEARCH_MASK_BITS 1
+
+static inline uint64_t search_vector_mask(const unsigned char *first_ptr,
+                                          const unsigned char *last_ptr,
+                                          unsigned char first,
+                                          unsigned char last)
+{
+    __m128i eq_first = _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(first_ptr)),
+            _mm_set1_epi8(static_cast<char>(first)));
+    __m128i eq_last = _mm_cmpeq_epi8(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(last_ptr)),
+            _mm_set1_epi8(static_cast<char>(last)));
+    return static_cast<uint64_t>(
+            _mm_movemask_epi8(_mm_and_si128(eq_first, eq_last)));
+}
+#else
+// NEON has no movemask, so narrow each 0x00/0xff byte to a nibble instead
+#define SEARCH_MASK_BITS 4
+
+static inline uint64_t search_vector_mask(const unsigned char *first_ptr,
+                                          const unsigned char *last_ptr,
+                                          unsigned char first,
+                                          unsigned char last)
+{
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(first_ptr), vdupq_n_u8(first)),
+                             vceqq_u8(vld1q_u8(last_ptr), vdupq_n_u8(last)));
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) & 0x1111111111111111;
+}
+#endif
+
+/*!
+ * \brief Find candidates with vector instructions
+ *
+ * For each pattern, compare its first and last bytes with SEARCH_VECTOR_SIZE
+ * consecutive positions at once (see http://0x80.pl/articles/simd-strfind.html)
+ * and only run memcmp() on positions where both bytes match.
+ *
+ * \return Number of positions scanned (a multiple of SEARCH_VECTOR_SIZE) or
+ *         a negative #MB_FILE_* code on failure
+ */
+static int64_t search_multi_vector(MultiSearchCtx *ctx,
+                                   const unsigned char *data,
+                                   size_t scan_size, size_t data_size,
+                                   uint64_t base)
+{
+    uint64_t masks[SEARCH_MULTI_MAX_VECTOR_PATTERNS];
+    size_t pos = 0;
+    int ret;
+
+    // Every load for the last byte must stay within the data
+    while (!ctx->stop && scan_size - pos >= SEARCH_VECTOR_SIZE
+            && data_size - pos >= SEARCH_VECTOR_SIZE + ctx->max_size - 1) {
+        uint64_t candidates = 0;
+
+        for (size_t i = 0; i < ctx->patterns_count; ++i) {
+            const MbFileSearchPattern *pattern = &ctx->patterns[i];
+            const unsigned char *pattern_data =
+                    static_cast<const unsigned char *>(pattern->data);
+
+            masks[i] = search_vector_mask(
+                    data + pos, data + pos + pattern->size - 1,
+                    pattern_data[0], pattern_data[pattern->size - 1]);
+            candidates |= masks[i];
+        }
+
+        // Report candidates in offset order, then in pattern order
+        while (candidates && !ctx->stop) {
+            size_t bit = static_cast<size_t>(__builtin_ctzll(candidates));
+            bit -= bit % SEARCH_MASK_BITS;
+            candidates &= ~(((UINT64_C(1) << SEARCH_MASK_BITS) - 1) << bit);
+
+            for (size_t i = 0; i < ctx->patterns_count && !ctx->stop; ++i) {
+                if (masks[i] & (UINT64_C(1) << bit)) {
+                    ret = search_multi_check(ctx, data, data_size, base,
+                                             pos + bit / SEARCH_MASK_BITS, i);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                }
+            }
+        }
+
+        pos += SEARCH_VECTOR_SIZE;
+    }
+
+    return static_cast<int64_t>(pos);
+}
+
+#endif
+
+/*!
+ * \brief Check all positions in [0, \p scan_size) for matches
+ *
+ * \p data is valid for \p data_size bytes, which may be more than
+ * \p scan_size so that longer patterns starting near the end of the scanned
+ * region can be verified. \p base is the file offset of \p data.
+ */
+static int search_multi_scan(MultiSearchCtx *ctx, const unsigned char *data,
+                             size_t scan_size, size_t data_size,
+                             uint64_t base)
+{
+    size_t pos = 0;
+    int ret;
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    if (ctx->patterns_count <= SEARCH_MULTI_MAX_VECTOR_PATTERNS) {
+        int64_t scanned = search_multi_vector(ctx, data, scan_size, data_size,
+                                              base);
+        if (scanned < 0) {
+            return static_cast<int>(scanned);
+        }
+        pos = static_cast<size_t>(scanned);
+    }
+#endif
+
+    // Handle the remaining positions one at a time
+    for (; pos < scan_size && !ctx->stop; ++pos) {
+        for (size_t index : ctx->buckets[data[pos]]) {
+            ret = search_multi_check(ctx, data, data_size, base, pos, index);
+            if (ret < 0) {
+                return ret;
+            } else if (ctx->stop) {
+                break;
+            }
+        }
+    }
+
+    return MB_FILE_OK;
+}
+
+/*!
+ * \brief Search file for multiple binary sequences at once
+ *
+ * This works like mb_file_search(), except that the file is only read once
+ * for all of the patterns in \p patterns. Matches are reported in order of
+ * their offset. If multiple patterns match at the same offset, they are
+ * reported in the order that they appear in \p patterns.
+ *
+ * Up to 8 patterns are located by checking the first and last bytes of each
+ * pattern for many positions at once with SSE2 or NEON instructions. Larger
+ * sets of patterns are located with a lookup table indexed by the first byte.
+ *
+ * The buffer size is chosen like in mb_file_search(), except that the size of
+ * the largest pattern is used.
+ *
+ * \note Like mb_file_search(), we do not do overlapping searches for a given
+ *       pattern. However, matches of different patterns may overlap. For
+ *       example, if a file's contents is "abcabc" and the patterns are "abca"
+ *       and "ca", both "abca" at 0 and "ca" at 2 will be reported.
+ *
+ * \note The file position after this function returns is undefined. Be sure to
+ *       seek to a known location before attempting further read or write
+ *       operations.
+ *
+ * \param file MbFile handle
+ * \param start Start offset or negative number for beginning of file
+ * \param end End offset or negative number for end of file
+ * \param bsize Buffer size or 0 to automatically choose a size
+ * \param patterns Patterns to search
+ * \param patterns_count Number of patterns
+ * \param max_matches Maximum number of matches (across all patterns) or -1 to
+ *                    find all matches
+ * \param result_cb Callback to invoke upon finding a match
+ * \param userdata User callback data
+ *
+ * \return
+ *   * #MB_FILE_OK if the search completes successfully
+ *   * \<= #MB_FILE_WARN if an error occurs
+ */
+int mb_file_search_multi(struct MbFile *file, int64_t start, int64_t end,
+                         size_t bsize,
+                         const struct MbFileSearchPattern *patterns,
+                         size_t patterns_count, int64_t max_matches,
+                         MbFileSearchMultiResultCallback result_cb,
+                         void *userdata)
+{
+    int ret = MB_FILE_OK;
+    unsigned char *buf = nullptr;
+    size_t buf_size;
+    unsigned char *ptr;
+    size_t ptr_remain;
+    uint64_t offset;
+    size_t n;
+    const void *data;
+    size_t data_size;
+    MultiSearchCtx ctx;
+
+    // Check boundaries
+    if (start >= 0 && end >= 0 && end < start) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "End offset < start offset");
+        ret = MB_FILE_FAILED;
+        goto done;
+    }
+
+    // Trivial case
+    if (max_matches == 0 || patterns_count == 0) {
+        goto done;
+    }
+
+    ctx.file = file;
+    ctx.patterns = patterns;
+    ctx.patterns_count = patterns_count;
+    ctx.max_size = 0;
+    ctx.max_matches = max_matches;
+    ctx.result_cb = result_cb;
+    ctx.userdata = userdata;
+    ctx.next_offset.resize(patterns_count);
+    ctx.buckets.resize(256);
+    ctx.stop = false;
+
+    for (size_t i = 0; i < patterns_count; ++i) {
+        if (patterns[i].size == 0) {
+            mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                              "Pattern %" MB_PRIzu " is empty", i);
+            ret = MB_FILE_FAILED;
+            goto done;
+        }
+
+        ctx.max_size = std::max(ctx.max_size, patterns[i].size);
+        ctx.buckets[*static_cast<const unsigned char *>(patterns[i].data)]
+                .push_back(i);
+    }
+
+    // Compute buffer size
+    if (bsize != 0) {
+        buf_size = bsize;
+    } else {
+        buf_size = DEFAULT_BUFFER_SIZE;
+
+        if (ctx.max_size > SIZE_MAX / 2) {
+            buf_size = SIZE_MAX;
+        } else {
+            buf_size = std::max(buf_size, ctx.max_size * 2);
+        }
+    }
+
+    // Ensure buffer is large enough
+    if (buf_size < ctx.max_size) {
+        mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                          "Buffer size cannot be less than pattern size");
+        ret = MB_FILE_FAILED;
+        goto done;
+    }
+
+    offset = start >= 0 ? static_cast<uint64_t>(start) : 0;
+
+    // Search directly in memory if the file is already in memory
+    ret = mb_file_get_buffer(file, &data, &data_size);
+    if (ret == MB_FILE_OK) {
+        if (end >= 0 && static_cast<uint64_t>(end) < data_size) {
+            data_size = static_cast<size_t>(end);
+        }
+        if (offset < data_size) {
+            ret = search_multi_scan(
+                    &ctx, static_cast<const unsigned char *>(data) + offset,
+                    data_size - offset, data_size - offset, offset);
+        }
+        goto done;
+    } else if (ret != MB_FILE_UNSUPPORTED) {
+        goto done;
+    }
+
+    buf = static_cast<unsigned char *>(malloc(buf_size));
+    if (!buf) {
+        mb_file_set_error(file, -errno, "Failed to allocate buffer: %s",
+                          strerror(errno));
+        ret = MB_FILE_FAILED;
+        goto done;
+    }
+
+    // Seek to starting point
+    ret = mb_file_seek(file, offset, SEEK_SET, nullptr);
+    if (ret == MB_FILE_UNSUPPORTED) {
+        uint64_t discarded;
+        ret = mb_file_read_discard(file, offset, &discarded);
+        if (ret < 0) {
+            goto done;
+        } else if (discarded != offset) {
+            mb_file_set_error(file, MB_FILE_ERROR_INVALID_ARGUMENT,
+                              "Reached EOF before starting offset");
+            ret = MB_FILE_FATAL;
+            goto done;
+        }
+    } else if (ret < 0) {
+        goto done;
+    }
+
+    // Initially read to beginning of buffer
+    ptr = buf;
+    ptr_remain = buf_size;
+
+    while (true) {
+        if (end >= 0 && offset >= static_cast<uint64_t>(end)) {
+            // Artificial EOF
+            break;
+        }
+
+        ret = mb_file_read_fully(file, ptr, ptr_remain, &n);
+        if (ret < 0) {
+            goto done;
+        }
+
+        // Number of available bytes in buf
+        bool eof = n < ptr_remain;
+        n += ptr - buf;
+
+        // Ensure that offset + n cannot overflow
+        if (n > UINT64_MAX - offset) {
+            mb_file_set_error(file, MB_FILE_ERROR_INTERNAL_ERROR,
+                              "Read overflows offset value");
+            ret = MB_FILE_FAILED;
+            goto done;
+        }
+
+        // Hide data past the ending boundary
+        if (end >= 0 && offset + n >= static_cast<uint64_t>(end)) {
+            n = static_cast<size_t>(end - offset);
+            eof = true;
+        }
+
+        // Unless this is the end, keep the last max_size - 1 bytes for the
+        // next iteration since longer patterns starting there can't be
+        // verified yet
+        size_t keep = eof ? 0 : ctx.max_size - 1;
+        size_t scan_size = n - keep;
+
+        ret = search_multi_scan(&ctx, buf, scan_size, n, offset);
+        if (ret < 0 || ctx.stop || eof) {
+            goto done;
+        }
+
+        memmove(buf, buf + scan_size, keep);
+        ptr = buf + keep;
+        ptr_remain = buf_size - keep;
+        offset += scan_size;
+    }
+
+done:
+    free(buf);
+    return ret;
+}
+
+static void * alloc_move_buffer(struct MbFile *file, uint64_t size,
+                                size_t *buf_size)
+{
+    size_t n = std::min<uint64_t>(size, MOVE_MAX_BUFFER_SIZE);
+
+    while (true) {
+        void *buf = malloc(n);
+        if (buf) {
+            *buf_size = n;
+            return buf;
+        } else if (n <= MOVE_MIN_BUFFER_SIZE) {
+            mb_file_set_error(file, -errno, "Failed to allocate buffer: %s",
+                              strerror(errno));
+            return nullptr;
+        }
+
+        n = std::max<size_t>(n / 2, MOVE_MIN_BUFFER_SIZE);
+    }
+}
+
 /*!
  * \brief Move data in file
  *
@@ -410,14 +953,21 @@ done:
  * case where \p src == \p dest or \p size == 0, no operation will be performed,
  * but the function will return #MB_BI_OK and set \p size_moved accordingly.
  *
- * \note This function is very seek-heavy and may be slow if the handle cannot
- *       seek efficiently. It will perform two seeks per loop interation. Each
- *       iteration moves up to 10240 bytes.
+ * If the handle provides a move callback (see #MbFileMoveCb), it is used to
+ * move the data natively. For example, file descriptor handles use
+ * `copy_file_range()` or `pread64()`/`pwrite64()` and memory handles use a
+ * single `memmove()`.
+ *
+ * \note Otherwise, this function is seek-heavy and may be slow if the handle
+ *       cannot seek efficiently. It will perform two seeks per loop iteration.
+ *       Each iteration moves up to 8 MiB.
  *
  * \note If \p *size_moved is less than \p size, then the *first* \p *size_moved
  *       bytes have been copied from offset \p src to offset \p dest. This is
  *       true even if \p src \< \p dest, resulting in a backwards copy.
  *
+ * \note The file position after this function returns is undefined.
+ *
  * \param[in] file MbFile handle
  * \param[in] src Source offset
  * \param[in] dest Destination offset
@@ -431,7 +981,8 @@ done:
 int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
                  uint64_t size, uint64_t *size_moved)
 {
-    char buf[10240];
+    char *buf;
+    size_t buf_size;
     size_t n_read;
     size_t n_written;
     int ret;
@@ -448,24 +999,41 @@ int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
         return MB_FILE_FAILED;
     }
 
+    if (file->state == MbFileState::OPENED && file->move_cb) {
+        ret = file->move_cb(file, file->cb_userdata, src, dest, size,
+                            size_moved);
+        if (ret != MB_FILE_UNSUPPORTED) {
+            if (ret <= MB_FILE_FATAL) {
+                file->state = MbFileState::FATAL;
+            }
+            return ret;
+        }
+    }
+
+    buf = static_cast<char *>(alloc_move_buffer(file, size, &buf_size));
+    if (!buf) {
+        return MB_FILE_FAILED;
+    }
+
     *size_moved = 0;
+    ret = MB_FILE_OK;
 
     if (dest < src) {
         // Copy forwards
         while (*size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - *size_moved);
+                    buf_size, size - *size_moved);
 
             // Seek to source offset
             ret = mb_file_seek(file, src + *size_moved, SEEK_SET, nullptr);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             // Read data from source
             ret = mb_file_read_fully(file, buf, to_read, &n_read);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             } else if (n_read == 0) {
                 break;
             }
@@ -473,13 +1041,13 @@ int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
             // Seek to destination offset
             ret = mb_file_seek(file, dest + *size_moved, SEEK_SET, nullptr);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             // Write data to destination
             ret = mb_file_write_fully(file, buf, n_read, &n_written);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             *size_moved += n_written;
@@ -492,19 +1060,19 @@ int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
         // Copy backwards
         while (*size_moved < size) {
             size_t to_read = std::min<uint64_t>(
-                    sizeof(buf), size - *size_moved);
+                    buf_size, size - *size_moved);
 
             // Seek to source offset
             ret = mb_file_seek(file, src + size - *size_moved - to_read,
                                SEEK_SET, nullptr);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             // Read data form source
             ret = mb_file_read_fully(file, buf, to_read, &n_read);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             } else if (n_read == 0) {
                 break;
             }
@@ -513,13 +1081,13 @@ int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
             ret = mb_file_seek(file, dest + size - *size_moved - n_read,
                                SEEK_SET, nullptr);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             // Write data to destination
             ret = mb_file_write_fully(file, buf, n_read, &n_written);
             if (ret != MB_FILE_OK) {
-                return ret;
+                goto done;
             }
 
             *size_moved += n_written;
@@ -531,7 +1099,9 @@ int mb_file_move(struct MbFile *file, uint64_t src, uint64_t dest,
         }
     }
 
-    return MB_FILE_OK;
+done:
+    free(buf);
+    return ret;
 }
 
 MB_END_C_DECLS
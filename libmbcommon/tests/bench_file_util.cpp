@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures mb_file_search() throughput when reading through a regular file
+// handle and when searching a memory mapping directly.
+//
+// Usage: bench_file_util <temporary file> [size in MiB] [passes]
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/file/filename.h"
+#include "mbcommon/file/mmap.h"
+
+#define BLOCK_SIZE      (1024 * 1024)
+#define MATCH_INTERVAL  64
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+
+static const char PATTERN[] = "ANDROID!";
+
+// Write file consisting of a repeated random block with the pattern inserted
+// every MATCH_INTERVAL MiB
+static bool writeFile(const char *path, unsigned long sizeMiB,
+                      uint64_t *matches)
+{
+    std::mt19937 rng(0);
+    std::vector<unsigned char> block(BLOCK_SIZE);
+    for (auto &c : block) {
+        // Avoid 'A' so that the pattern cannot appear by accident
+        do {
+            c = static_cast<unsigned char>(rng());
+        } while (c == 'A');
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        return false;
+    }
+
+    *matches = 0;
+
+    for (unsigned long i = 0; i < sizeMiB; ++i) {
+        std::vector<unsigned char> data(block);
+        if (i % MATCH_INTERVAL == MATCH_INTERVAL - 1) {
+            memcpy(data.data() + BLOCK_SIZE / 2, PATTERN, sizeof(PATTERN) - 1);
+            ++*matches;
+        }
+        if (fwrite(data.data(), 1, data.size(), fp) != data.size()) {
+            fclose(fp);
+            return false;
+        }
+    }
+
+    return fclose(fp) == 0;
+}
+
+static bool searchFile(const char *path, bool useMmap, double *seconds,
+                       uint64_t *matches)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    if (!file) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    int ret = useMmap
+            ? mb_file_open_mmap_filename(file.get(), path)
+            : mb_file_open_filename(file.get(), path, MB_FILE_OPEN_READ_ONLY);
+    if (ret != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to open: %s\n",
+                path, mb_file_error_string(file.get()));
+        return false;
+    }
+
+    *matches = 0;
+
+    auto result_cb = [](MbFile *file, void *userdata,
+                        uint64_t offset) -> int {
+        (void) file;
+        (void) offset;
+        ++*static_cast<uint64_t *>(userdata);
+        return MB_FILE_OK;
+    };
+
+    ret = mb_file_search(file.get(), -1, -1, 0, PATTERN, sizeof(PATTERN) - 1,
+                         -1, result_cb, matches);
+    if (ret != MB_FILE_OK) {
+        fprintf(stderr, "%s: Failed to search: %s\n",
+                path, mb_file_error_string(file.get()));
+        return false;
+    }
+
+    mb_file_close(file.get());
+
+    auto end = std::chrono::steady_clock::now();
+    *seconds = std::chrono::duration<double>(end - start).count();
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long sizeMiB = 2048;
+    int passes = 3;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <temporary file> [size in MiB] [passes]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (argc > 2) {
+        sizeMiB = strtoul(argv[2], nullptr, 10);
+    }
+    if (argc > 3) {
+        passes = atoi(argv[3]);
+    }
+
+    const char *path = argv[1];
+    uint64_t expected;
+
+    if (!writeFile(path, sizeMiB, &expected)) {
+        fprintf(stderr, "%s: Failed to write file\n", path);
+        remove(path);
+        return EXIT_FAILURE;
+    }
+
+    printf("File size: %lu MiB (%" PRIu64 " matches)\n", sizeMiB, expected);
+
+    bool ok = true;
+
+    for (bool useMmap : { false, true }) {
+        double best = 0;
+
+        for (int i = 0; i < passes && ok; ++i) {
+            double seconds;
+            uint64_t matches;
+
+            if (!searchFile(path, useMmap, &seconds, &matches)) {
+                ok = false;
+            } else if (matches != expected) {
+                fprintf(stderr, "Expected %" PRIu64 " matches, but found %"
+                        PRIu64 "\n", expected, matches);
+                ok = false;
+            } else {
+                best = std::max(best, sizeMiB / seconds);
+            }
+        }
+
+        if (ok) {
+            printf("%-10s %.0f MiB/s\n",
+                   useMmap ? "mmap:" : "filename:", best);
+        }
+    }
+
+    remove(path);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
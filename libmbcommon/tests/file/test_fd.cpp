@@ -20,11 +20,13 @@
 #include <gtest/gtest.h>
 
 #include <climits>
+#include <string>
 
 #include <fcntl.h>
 
 #include "mbcommon/file.h"
 #include "mbcommon/file/fd.h"
+#include "mbcommon/file_util.h"
 #include "mbcommon/file/fd_p.h"
 #include "mbcommon/file/vtable_p.h"
 
@@ -44,6 +46,14 @@ struct FileFdTest : testing::Test
     int _n_lseek64 = 0;
     int _n_read = 0;
     int _n_write = 0;
+#ifndef _WIN32
+    int _n_pread64 = 0;
+    int _n_pwrite64 = 0;
+    int _n_copy_file_range = 0;
+
+    // File contents for positional I/O tests
+    std::string _data;
+#endif
 
     FileFdTest() : _file(mb_file_new())
     {
@@ -59,6 +69,12 @@ struct FileFdTest : testing::Test
         _vtable.fn_lseek64 = _lseek64;
         _vtable.fn_read = _read;
         _vtable.fn_write = _write;
+#ifndef _WIN32
+        // These are optional
+        _vtable.fn_pread64 = nullptr;
+        _vtable.fn_pwrite64 = nullptr;
+        _vtable.fn_copy_file_range = nullptr;
+#endif
 
         _vtable.userdata = this;
     }
@@ -182,6 +198,93 @@ struct FileFdTest : testing::Test
         errno = EIO;
         return -1;
     }
+
+#ifndef _WIN32
+    static int _fstat_data(void *userdata, int fildes, struct stat *buf)
+    {
+        (void) fildes;
+
+        FileFdTest *test = static_cast<FileFdTest *>(userdata);
+        ++test->_n_fstat;
+
+        buf->st_mode = S_IFREG | S_IRWXU | S_IRWXG | S_IRWXO;
+        buf->st_size = test->_data.size();
+        return 0;
+    }
+
+    static ssize_t _pread64_data(void *userdata, int fd, void *buf,
+                                 size_t count, off64_t offset)
+    {
+        (void) fd;
+
+        FileFdTest *test = static_cast<FileFdTest *>(userdata);
+        ++test->_n_pread64;
+
+        if (static_cast<size_t>(offset) >= test->_data.size()) {
+            return 0;
+        }
+        count = std::min<size_t>(count, test->_data.size() - offset);
+        memcpy(buf, test->_data.data() + offset, count);
+        return count;
+    }
+
+    static ssize_t _pwrite64_data(void *userdata, int fd, const void *buf,
+                                  size_t count, off64_t offset)
+    {
+        (void) fd;
+
+        FileFdTest *test = static_cast<FileFdTest *>(userdata);
+        ++test->_n_pwrite64;
+
+        if (offset + count > test->_data.size()) {
+            test->_data.resize(offset + count);
+        }
+        memcpy(&test->_data[offset], buf, count);
+        return count;
+    }
+
+    static ssize_t _copy_file_range_data(void *userdata, int fd_in,
+                                         off64_t *off_in, int fd_out,
+                                         off64_t *off_out, size_t len,
+                                         unsigned int flags)
+    {
+        (void) fd_in;
+        (void) fd_out;
+        (void) flags;
+
+        FileFdTest *test = static_cast<FileFdTest *>(userdata);
+        ++test->_n_copy_file_range;
+
+        // Copy at most 2 bytes at a time to test partial copies
+        std::string buf = test->_data.substr(*off_in, std::min<size_t>(len, 2));
+        if (*off_out + buf.size() > test->_data.size()) {
+            test->_data.resize(*off_out + buf.size());
+        }
+        test->_data.replace(*off_out, buf.size(), buf);
+        *off_in += buf.size();
+        *off_out += buf.size();
+        return buf.size();
+    }
+
+    static ssize_t _copy_file_range_enosys(void *userdata, int fd_in,
+                                           off64_t *off_in, int fd_out,
+                                           off64_t *off_out, size_t len,
+                                           unsigned int flags)
+    {
+        (void) fd_in;
+        (void) off_in;
+        (void) fd_out;
+        (void) off_out;
+        (void) len;
+        (void) flags;
+
+        FileFdTest *test = static_cast<FileFdTest *>(userdata);
+        ++test->_n_copy_file_range;
+
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
 };
 
 TEST_F(FileFdTest, OpenNoVtable)
@@ -736,3 +839,123 @@ TEST_F(FileFdTest, TruncateFailed)
     ASSERT_EQ(mb_file_error(_file), -EIO);
     ASSERT_EQ(_n_ftruncate64, 1);
 }
+
+#ifndef _WIN32
+TEST_F(FileFdTest, MoveNonOverlappingUsesCopyFileRange)
+{
+    _vtable.fn_fstat = _fstat_data;
+    _vtable.fn_pread64 = _pread64_data;
+    _vtable.fn_pwrite64 = _pwrite64_data;
+    _vtable.fn_copy_file_range = _copy_file_range_data;
+    _data = "abcdefgh";
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    uint64_t n;
+    ASSERT_EQ(mb_file_move(_file, 5, 0, 3, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(_data, "fghdefgh");
+    ASSERT_EQ(_n_copy_file_range, 2);
+    ASSERT_EQ(_n_pread64, 0);
+    ASSERT_EQ(_n_pwrite64, 0);
+    ASSERT_EQ(_n_lseek64, 0);
+}
+
+TEST_F(FileFdTest, MoveOverlappingUsesPositionalIo)
+{
+    _vtable.fn_fstat = _fstat_data;
+    _vtable.fn_pread64 = _pread64_data;
+    _vtable.fn_pwrite64 = _pwrite64_data;
+    _vtable.fn_copy_file_range = _copy_file_range_data;
+    _data = "abcdef";
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    uint64_t n;
+    ASSERT_EQ(mb_file_move(_file, 0, 2, 3, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(_data, "ababcf");
+    ASSERT_EQ(_n_copy_file_range, 0);
+    ASSERT_EQ(_n_pread64, 1);
+    ASSERT_EQ(_n_pwrite64, 1);
+    ASSERT_EQ(_n_lseek64, 0);
+}
+
+TEST_F(FileFdTest, MoveCopyFileRangeUnsupported)
+{
+    _vtable.fn_fstat = _fstat_data;
+    _vtable.fn_pread64 = _pread64_data;
+    _vtable.fn_pwrite64 = _pwrite64_data;
+    _vtable.fn_copy_file_range = _copy_file_range_enosys;
+    _data = "abcdefgh";
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    uint64_t n;
+    ASSERT_EQ(mb_file_move(_file, 0, 5, 3, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(_data, "abcdeabc");
+    ASSERT_EQ(_n_copy_file_range, 1);
+    ASSERT_EQ(_n_pread64, 1);
+    ASSERT_EQ(_n_pwrite64, 1);
+}
+
+TEST_F(FileFdTest, MoveStopsAtEof)
+{
+    _vtable.fn_fstat = _fstat_data;
+    _vtable.fn_pread64 = _pread64_data;
+    _vtable.fn_pwrite64 = _pwrite64_data;
+    _data = "abcdef";
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    uint64_t n;
+    ASSERT_EQ(mb_file_move(_file, 2, 0, 5, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(_data, "cdefef");
+
+    // Destination may extend the file
+    ASSERT_EQ(mb_file_move(_file, 0, 4, 6, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 6);
+    ASSERT_EQ(_data, "cdefcdefef");
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(FileFdTest, ReadAtWriteAtUsePositionalIo)
+{
+    _vtable.fn_fstat = _fstat_data;
+    _vtable.fn_pread64 = _pread64_data;
+    _vtable.fn_pwrite64 = _pwrite64_data;
+    _data = "abcdef";
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    char buf[2];
+    size_t n;
+    ASSERT_EQ(mb_file_read_at(_file, buf, sizeof(buf), 3, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 2);
+    ASSERT_EQ(memcmp(buf, "de", 2), 0);
+    ASSERT_EQ(mb_file_write_at(_file, "xy", 2, 1, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 2);
+    ASSERT_EQ(_data, "axydef");
+    ASSERT_EQ(_n_pread64, 1);
+    ASSERT_EQ(_n_pwrite64, 1);
+    ASSERT_EQ(_n_lseek64, 0);
+}
+
+TEST_F(FileFdTest, ReadAtWithoutPreadIsEmulated)
+{
+    _vtable.fn_fstat = _fstat_file;
+
+    ASSERT_EQ(_mb_file_open_fd(&_vtable, _file, 0, true), MB_FILE_OK);
+
+    // Falls back to lseek64(), which fails in this fixture
+    char c;
+    size_t n;
+    ASSERT_EQ(mb_file_read_at(_file, &c, 1, 0, &n), MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(_file), -EIO);
+    ASSERT_EQ(_n_lseek64, 1);
+    ASSERT_EQ(_n_read, 0);
+}
+#endif
@@ -66,6 +66,36 @@ TEST(FileStaticMemoryTest, ReadInBounds)
     ASSERT_EQ(out[0], 'x');
 }
 
+TEST(FileStaticMemoryTest, ReadAtWriteAt)
+{
+    char in[] = "abcdef";
+    char out[4];
+    size_t n;
+    uint64_t pos;
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+    ASSERT_EQ(mb_file_open_memory_static(file.get(), in, 6), MB_FILE_OK);
+
+    ASSERT_EQ(mb_file_read_at(file.get(), out, sizeof(out), 4, &n),
+              MB_FILE_OK);
+    ASSERT_EQ(n, 2);
+    ASSERT_EQ(memcmp(out, "ef", 2), 0);
+
+    ASSERT_EQ(mb_file_read_at(file.get(), out, sizeof(out), 10, &n),
+              MB_FILE_OK);
+    ASSERT_EQ(n, 0);
+
+    // Writes past the end are truncated
+    ASSERT_EQ(mb_file_write_at(file.get(), "xyz", 3, 4, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 2);
+    ASSERT_STREQ(in, "abcdxy");
+
+    // File position is untouched
+    ASSERT_EQ(mb_file_seek(file.get(), 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 0);
+}
+
 TEST(FileStaticMemoryTest, ReadOutOfBounds)
 {
     char in[] = "x";
@@ -416,6 +446,32 @@ TEST(FileDynamicMemoryTest, WriteOutOfBounds)
     free(in);
 }
 
+TEST(FileDynamicMemoryTest, WriteAtOutOfBounds)
+{
+    void *in = strdup("x");
+    size_t in_size = 1;
+    size_t n;
+    uint64_t pos;
+
+    ASSERT_NE(in, nullptr);
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+    ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), &in, &in_size),
+              MB_FILE_OK);
+
+    ASSERT_EQ(mb_file_write_at(file.get(), "y", 1, 10, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 1);
+    ASSERT_EQ(in_size, 11);
+    ASSERT_NE(in, nullptr);
+    ASSERT_EQ(static_cast<char *>(in)[10], 'y');
+
+    ASSERT_EQ(mb_file_seek(file.get(), 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 0);
+
+    free(in);
+}
+
 TEST(FileDynamicMemoryTest, WriteEmpty)
 {
     void *in = nullptr;
@@ -571,3 +627,50 @@ TEST(FileDynamicMemoryTest, TruncateFile)
 
     free(in);
 }
+
+TEST(FileDynamicMemoryTest, WriteManySmallChunks)
+{
+    void *in = nullptr;
+    size_t in_size = 0;
+    size_t n;
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+    ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), &in, &in_size),
+              MB_FILE_OK);
+
+    for (int i = 0; i < 10000; ++i) {
+        char c = static_cast<char>('a' + i % 26);
+        ASSERT_EQ(mb_file_write(file.get(), &c, 1, &n), MB_FILE_OK);
+        ASSERT_EQ(n, 1);
+        ASSERT_EQ(in_size, static_cast<size_t>(i + 1));
+    }
+
+    ASSERT_NE(in, nullptr);
+    for (int i = 0; i < 10000; ++i) {
+        ASSERT_EQ(static_cast<char *>(in)[i], 'a' + i % 26);
+    }
+
+    free(in);
+}
+
+TEST(FileDynamicMemoryTest, TruncateAndEnlargeFile)
+{
+    void *in = strdup("abcdefghij");
+    size_t in_size = 10;
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+    ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), &in, &in_size),
+              MB_FILE_OK);
+
+    ASSERT_EQ(mb_file_truncate(file.get(), 2), MB_FILE_OK);
+    ASSERT_EQ(in_size, 2);
+
+    // Space that was previously used must be zeroed again
+    ASSERT_EQ(mb_file_truncate(file.get(), 10), MB_FILE_OK);
+    ASSERT_EQ(in_size, 10);
+    ASSERT_EQ(memcmp(in, "ab\0\0\0\0\0\0\0\0", 10), 0);
+
+    free(in);
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include "mbcommon/file.h"
+#include "mbcommon/file_util.h"
+#include "mbcommon/file/mmap.h"
+
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedFile;
+
+struct FileMmapTest : testing::Test
+{
+    char _path[64];
+
+    FileMmapTest()
+    {
+        strcpy(_path, "/tmp/mbcommon-mmap-test.XXXXXX");
+    }
+
+    virtual void SetUp() override
+    {
+        int fd = mkstemp(_path);
+        ASSERT_GE(fd, 0);
+        ASSERT_EQ(close(fd), 0);
+    }
+
+    virtual void TearDown() override
+    {
+        unlink(_path);
+    }
+
+    void write_file(const char *data, size_t size)
+    {
+        FILE *fp = fopen(_path, "wb");
+        ASSERT_NE(fp, nullptr);
+        ASSERT_EQ(fwrite(data, 1, size, fp), size);
+        ASSERT_EQ(fclose(fp), 0);
+    }
+};
+
+TEST_F(FileMmapTest, OpenMissingFileFails)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), "/nonexistent/file"),
+              MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(file.get()), -ENOENT);
+}
+
+TEST_F(FileMmapTest, OpenDirectoryFails)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), "/tmp"), MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(file.get()), -EISDIR);
+}
+
+TEST_F(FileMmapTest, OpenEmptyFile)
+{
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), _path), MB_FILE_OK);
+
+    const void *buf;
+    size_t size;
+    ASSERT_EQ(mb_file_get_buffer(file.get(), &buf, &size), MB_FILE_OK);
+    ASSERT_EQ(size, 0);
+
+    char c;
+    size_t n;
+    ASSERT_EQ(mb_file_read(file.get(), &c, 1, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 0);
+
+    ASSERT_EQ(mb_file_close(file.get()), MB_FILE_OK);
+}
+
+TEST_F(FileMmapTest, ReadAndSeek)
+{
+    write_file("abcdef", 6);
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), _path), MB_FILE_OK);
+
+    char buf[4];
+    size_t n;
+    uint64_t pos;
+
+    ASSERT_EQ(mb_file_read(file.get(), buf, 4, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(memcmp(buf, "abcd", 4), 0);
+    ASSERT_EQ(mb_file_read(file.get(), buf, 4, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 2);
+    ASSERT_EQ(memcmp(buf, "ef", 2), 0);
+
+    ASSERT_EQ(mb_file_seek(file.get(), -3, SEEK_END, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 3);
+    ASSERT_EQ(mb_file_seek(file.get(), -1, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 2);
+    ASSERT_EQ(mb_file_seek(file.get(), -3, SEEK_CUR, nullptr),
+              MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(file.get()), MB_FILE_ERROR_INVALID_ARGUMENT);
+
+    ASSERT_EQ(mb_file_read_at(file.get(), buf, 4, 1, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 4);
+    ASSERT_EQ(memcmp(buf, "bcde", 4), 0);
+    ASSERT_EQ(mb_file_seek(file.get(), 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 2);
+
+    ASSERT_EQ(mb_file_close(file.get()), MB_FILE_OK);
+}
+
+TEST_F(FileMmapTest, WriteUnsupported)
+{
+    write_file("abc", 3);
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), _path), MB_FILE_OK);
+
+    size_t n;
+    ASSERT_EQ(mb_file_write(file.get(), "x", 1, &n), MB_FILE_UNSUPPORTED);
+    ASSERT_EQ(mb_file_truncate(file.get(), 0), MB_FILE_UNSUPPORTED);
+}
+
+TEST_F(FileMmapTest, BufferAndSearch)
+{
+    write_file("xxabxxabxx", 10);
+
+    ScopedFile file(mb_file_new(), mb_file_free);
+    ASSERT_TRUE(!!file);
+
+    ASSERT_EQ(mb_file_open_mmap_filename(file.get(), _path), MB_FILE_OK);
+
+    const void *buf;
+    size_t size;
+    ASSERT_EQ(mb_file_get_buffer(file.get(), &buf, &size), MB_FILE_OK);
+    ASSERT_EQ(size, 10);
+    ASSERT_EQ(memcmp(buf, "xxabxxabxx", 10), 0);
+
+    std::vector<uint64_t> offsets;
+    auto result_cb = [](MbFile *file, void *userdata,
+                        uint64_t offset) -> int {
+        (void) file;
+        static_cast<std::vector<uint64_t> *>(userdata)->push_back(offset);
+        return MB_FILE_OK;
+    };
+
+    ASSERT_EQ(mb_file_search(file.get(), -1, -1, 0, "ab", 2, -1,
+                             result_cb, &offsets), MB_FILE_OK);
+    ASSERT_EQ(offsets, std::vector<uint64_t>({ 2, 6 }));
+}
@@ -202,6 +202,9 @@ TEST_F(FileTest, CheckInitialValues)
     ASSERT_EQ(_file->write_cb, nullptr);
     ASSERT_EQ(_file->seek_cb, nullptr);
     ASSERT_EQ(_file->truncate_cb, nullptr);
+    ASSERT_EQ(_file->read_at_cb, nullptr);
+    ASSERT_EQ(_file->write_at_cb, nullptr);
+    ASSERT_EQ(_file->move_cb, nullptr);
     ASSERT_EQ(_file->cb_userdata, nullptr);
     ASSERT_EQ(_file->error_code, MB_FILE_ERROR_NONE);
     ASSERT_EQ(_file->error_string, nullptr);
@@ -1159,6 +1162,106 @@ TEST_F(FileTest, TruncateReturnFatalFailure)
     ASSERT_EQ(_n_truncate, 1);
 }
 
+TEST_F(FileTest, ReadAtEmulated)
+{
+    // Set callbacks
+    set_all_callbacks();
+
+    // Open file
+    ASSERT_EQ(mb_file_open(_file), MB_FILE_OK);
+    ASSERT_EQ(mb_file_seek(_file, 5, SEEK_SET, nullptr), MB_FILE_OK);
+
+    // Read at offset and check that the position is restored
+    char buf[3];
+    size_t n;
+    uint64_t pos;
+    ASSERT_EQ(mb_file_read_at(_file, buf, sizeof(buf), 26, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(memcmp(buf, "abc", 3), 0);
+    ASSERT_EQ(_n_read, 1);
+    ASSERT_EQ(mb_file_seek(_file, 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 5);
+}
+
+TEST_F(FileTest, WriteAtEmulated)
+{
+    // Set callbacks
+    set_all_callbacks();
+
+    // Open file
+    ASSERT_EQ(mb_file_open(_file), MB_FILE_OK);
+
+    // Write at offset and check that the position is restored
+    size_t n;
+    uint64_t pos;
+    ASSERT_EQ(mb_file_write_at(_file, "xyz", 3, 1, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 3);
+    ASSERT_EQ(memcmp(_buf.data(), "axyze", 5), 0);
+    ASSERT_EQ(_n_write, 1);
+    ASSERT_EQ(mb_file_seek(_file, 0, SEEK_CUR, &pos), MB_FILE_OK);
+    ASSERT_EQ(pos, 0);
+}
+
+TEST_F(FileTest, ReadAtNativeCallback)
+{
+    // Set callbacks
+    set_all_callbacks();
+    ASSERT_EQ(mb_file_set_read_at_callback(_file, [](MbFile *file,
+            void *userdata, void *buf, size_t size, uint64_t offset,
+            size_t *bytes_read) -> int {
+        (void) file;
+        (void) userdata;
+        memset(buf, 'z', size);
+        *bytes_read = offset == 0 ? size : 0;
+        return MB_FILE_OK;
+    }), MB_FILE_OK);
+
+    // Open file
+    ASSERT_EQ(mb_file_open(_file), MB_FILE_OK);
+
+    // The native callback is used instead of seeking
+    char c;
+    size_t n;
+    ASSERT_EQ(mb_file_read_at(_file, &c, 1, 0, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 1);
+    ASSERT_EQ(c, 'z');
+    ASSERT_EQ(_n_read, 0);
+    ASSERT_EQ(_n_seek, 0);
+}
+
+TEST_F(FileTest, ReadAtNoSeekCallback)
+{
+    // Set callbacks
+    set_all_callbacks();
+    ASSERT_EQ(mb_file_set_seek_callback(_file, nullptr), MB_FILE_OK);
+
+    // Open file
+    ASSERT_EQ(mb_file_open(_file), MB_FILE_OK);
+
+    char c;
+    size_t n;
+    ASSERT_EQ(mb_file_read_at(_file, &c, 1, 0, &n), MB_FILE_UNSUPPORTED);
+    ASSERT_EQ(mb_file_error(_file), MB_FILE_ERROR_UNSUPPORTED);
+    ASSERT_EQ(_n_read, 0);
+}
+
+TEST_F(FileTest, GetBufferNoCallback)
+{
+    // Set callbacks
+    set_all_callbacks();
+
+    // Open file
+    ASSERT_EQ(mb_file_open(_file), MB_FILE_OK);
+
+    // Not having a buffer is not an error
+    const void *buf;
+    size_t size;
+    ASSERT_EQ(mb_file_get_buffer(_file, &buf, &size), MB_FILE_UNSUPPORTED);
+    ASSERT_EQ(_file->state, MbFileState::OPENED);
+    ASSERT_EQ(_file->error_code, MB_FILE_ERROR_NONE);
+    ASSERT_EQ(_file->error_string, nullptr);
+}
+
 TEST_F(FileTest, SetError)
 {
     ASSERT_EQ(_file->error_code, MB_FILE_ERROR_NONE);
@@ -20,6 +20,10 @@
 #include <gtest/gtest.h>
 
 #include <memory>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
 
 #include <cinttypes>
 
@@ -583,6 +587,240 @@ TEST_F(FileSearchTest, FindNormal)
                              &_result_cb, this), MB_FILE_OK);
 }
 
+TEST_F(FileSearchTest, FindInMemoryWithBoundaries)
+{
+    ASSERT_EQ(mb_file_open_memory_static(_file, "abcabcabc", 9), MB_FILE_OK);
+
+    // Match at 6 ends past the ending boundary
+    ASSERT_EQ(mb_file_search(_file, 1, 8, 0, "abc", 3, -1,
+                             &_result_cb, this), MB_FILE_OK);
+    ASSERT_EQ(_n_result, 1);
+
+    // Starting offset past EOF
+    _n_result = 0;
+    ASSERT_EQ(mb_file_search(_file, 20, -1, 0, "abc", 3, -1,
+                             &_result_cb, this), MB_FILE_OK);
+    ASSERT_EQ(_n_result, 0);
+
+    // Maximum number of matches
+    ASSERT_EQ(mb_file_search(_file, -1, -1, 0, "abc", 3, 2,
+                             &_result_cb, this), MB_FILE_OK);
+    ASSERT_EQ(_n_result, 2);
+}
+
+struct FileSearchMultiTest : testing::Test
+{
+    typedef std::pair<size_t, uint64_t> Match;
+
+    MbFile *_file;
+    std::string _data;
+    size_t _pos = 0;
+    std::vector<Match> _matches;
+
+    FileSearchMultiTest() : _file(mb_file_new())
+    {
+    }
+
+    virtual ~FileSearchMultiTest()
+    {
+        mb_file_free(_file);
+    }
+
+    static int _result_cb(MbFile *file, void *userdata, size_t index,
+                          uint64_t offset)
+    {
+        (void) file;
+
+        FileSearchMultiTest *test = static_cast<FileSearchMultiTest *>(userdata);
+        test->_matches.emplace_back(index, offset);
+
+        return MB_FILE_OK;
+    }
+
+    static int _read_cb(MbFile *file, void *userdata, void *buf, size_t size,
+                        size_t *bytes_read)
+    {
+        (void) file;
+
+        FileSearchMultiTest *test = static_cast<FileSearchMultiTest *>(userdata);
+        size_t n = std::min(size, test->_data.size() - test->_pos);
+        memcpy(buf, test->_data.data() + test->_pos, n);
+        test->_pos += n;
+        *bytes_read = n;
+
+        return MB_FILE_OK;
+    }
+
+    static int _seek_cb(MbFile *file, void *userdata, int64_t offset,
+                        int whence, uint64_t *new_offset)
+    {
+        (void) file;
+        (void) whence;
+
+        FileSearchMultiTest *test = static_cast<FileSearchMultiTest *>(userdata);
+        test->_pos = std::min<size_t>(offset, test->_data.size());
+        *new_offset = test->_pos;
+
+        return MB_FILE_OK;
+    }
+
+    // Open file without a buffer callback so that it must be read in chunks
+    void open_stream(MbFile *file)
+    {
+        _pos = 0;
+        ASSERT_EQ(mb_file_set_read_callback(file, &_read_cb), MB_FILE_OK);
+        ASSERT_EQ(mb_file_set_seek_callback(file, &_seek_cb), MB_FILE_OK);
+        ASSERT_EQ(mb_file_set_callback_data(file, this), MB_FILE_OK);
+        ASSERT_EQ(mb_file_open(file), MB_FILE_OK);
+    }
+
+    // Reference implementation
+    static std::vector<Match> naive_search(
+            const std::string &data, int64_t start, int64_t end,
+            const std::vector<std::string> &patterns)
+    {
+        std::vector<Match> matches;
+        std::vector<uint64_t> next(patterns.size());
+        size_t limit = end >= 0 ? std::min<size_t>(end, data.size())
+                : data.size();
+
+        for (size_t pos = start >= 0 ? start : 0; pos < limit; ++pos) {
+            for (size_t i = 0; i < patterns.size(); ++i) {
+                if (pos >= next[i] && patterns[i].size() <= limit - pos
+                        && data.compare(pos, patterns[i].size(),
+                                        patterns[i]) == 0) {
+                    matches.emplace_back(i, pos);
+                    next[i] = pos + patterns[i].size();
+                }
+            }
+        }
+
+        return matches;
+    }
+
+    static std::vector<MbFileSearchPattern> to_patterns(
+            const std::vector<std::string> &patterns)
+    {
+        std::vector<MbFileSearchPattern> result;
+        for (auto const &p : patterns) {
+            result.push_back({ p.data(), p.size() });
+        }
+        return result;
+    }
+};
+
+TEST_F(FileSearchMultiTest, FindOverlappingPatterns)
+{
+    ASSERT_EQ(mb_file_open_memory_static(_file, "abcabc", 6), MB_FILE_OK);
+
+    std::vector<MbFileSearchPattern> patterns{
+        { "abca", 4 },
+        { "ca", 2 },
+        { "c", 1 },
+    };
+
+    ASSERT_EQ(mb_file_search_multi(_file, -1, -1, 0, patterns.data(),
+                                   patterns.size(), -1, &_result_cb, this),
+              MB_FILE_OK);
+    ASSERT_EQ(_matches, std::vector<Match>({ { 0, 0 }, { 1, 2 }, { 2, 2 },
+                                             { 2, 5 } }));
+}
+
+TEST_F(FileSearchMultiTest, CheckInvalidArguments)
+{
+    ASSERT_EQ(mb_file_open_memory_static(_file, "", 0), MB_FILE_OK);
+
+    std::vector<MbFileSearchPattern> patterns{
+        { "abc", 3 },
+        { "", 0 },
+    };
+
+    // Empty pattern
+    ASSERT_EQ(mb_file_search_multi(_file, -1, -1, 0, patterns.data(),
+                                   patterns.size(), -1, &_result_cb, this),
+              MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(_file), MB_FILE_ERROR_INVALID_ARGUMENT);
+
+    // Buffer smaller than longest pattern
+    ASSERT_EQ(mb_file_search_multi(_file, -1, -1, 2, patterns.data(), 1, -1,
+                                   &_result_cb, this), MB_FILE_FAILED);
+    ASSERT_EQ(mb_file_error(_file), MB_FILE_ERROR_INVALID_ARGUMENT);
+
+    // No patterns
+    ASSERT_EQ(mb_file_search_multi(_file, -1, -1, 0, nullptr, 0, -1,
+                                   &_result_cb, this), MB_FILE_OK);
+}
+
+TEST_F(FileSearchMultiTest, StopAfterMaxMatches)
+{
+    _data = "aXbXaXbX";
+    open_stream(_file);
+
+    std::vector<MbFileSearchPattern> patterns{
+        { "b", 1 },
+        { "a", 1 },
+    };
+
+    ASSERT_EQ(mb_file_search_multi(_file, -1, -1, 0, patterns.data(),
+                                   patterns.size(), 3, &_result_cb, this),
+              MB_FILE_OK);
+    ASSERT_EQ(_matches, std::vector<Match>({ { 1, 0 }, { 0, 2 }, { 1, 4 } }));
+}
+
+TEST_F(FileSearchMultiTest, MatchesRandomDataLikeReference)
+{
+    std::mt19937 rng(1234);
+
+    // Small alphabet so that patterns match often
+    _data.resize(100000);
+    for (auto &c : _data) {
+        c = "abcd"[rng() % 4];
+    }
+
+    for (size_t count : { 1, 3, 8, 9, 20 }) {
+        std::vector<std::string> patterns;
+        for (size_t i = 0; i < count; ++i) {
+            size_t size = 1 + rng() % 12;
+            size_t pos = rng() % (_data.size() - size);
+            patterns.push_back(_data.substr(pos, size));
+        }
+        auto mb_patterns = to_patterns(patterns);
+
+        for (auto const &bounds : { std::make_pair(-1, -1),
+                                    std::make_pair(17, 99983) }) {
+            auto expected = naive_search(_data, bounds.first, bounds.second,
+                                         patterns);
+
+            // In-memory search
+            ScopedFile file(mb_file_new(), mb_file_free);
+            ASSERT_EQ(mb_file_open_memory_static(file.get(), _data.data(),
+                                                 _data.size()), MB_FILE_OK);
+            _matches.clear();
+            ASSERT_EQ(mb_file_search_multi(file.get(), bounds.first,
+                                           bounds.second, 0,
+                                           mb_patterns.data(),
+                                           mb_patterns.size(), -1,
+                                           &_result_cb, this), MB_FILE_OK);
+            ASSERT_EQ(_matches, expected) << "patterns: " << count;
+
+            // Streaming search with small buffers
+            for (size_t bsize : { 12, 13, 64, 4096 }) {
+                ScopedFile stream(mb_file_new(), mb_file_free);
+                open_stream(stream.get());
+                _matches.clear();
+                ASSERT_EQ(mb_file_search_multi(stream.get(), bounds.first,
+                                               bounds.second, bsize,
+                                               mb_patterns.data(),
+                                               mb_patterns.size(), -1,
+                                               &_result_cb, this),
+                          MB_FILE_OK);
+                ASSERT_EQ(_matches, expected)
+                        << "patterns: " << count << ", bsize: " << bsize;
+            }
+        }
+    }
+}
+
 TEST(FileMoveTest, DegenerateCasesShouldSucceed)
 {
     char buf[] = "abcdef";
@@ -716,4 +954,26 @@ TEST(FileMoveTest, LargeBackwardsCopyShouldSucceed)
     free(buf);
 }
 
+TEST(FileMoveTest, DynamicBufferShouldGrow)
+{
+    void *buf = strdup("abcdef");
+    size_t buf_size = 6;
+    uint64_t n;
+
+    ASSERT_TRUE(!!buf);
+
+    ScopedFile file(mb_file_new(), &mb_file_free);
+    ASSERT_TRUE(!!file);
+    ASSERT_EQ(mb_file_open_memory_dynamic(file.get(), &buf, &buf_size),
+              MB_FILE_OK);
+
+    ASSERT_EQ(mb_file_move(file.get(), 0, 4, 6, &n), MB_FILE_OK);
+    ASSERT_EQ(n, 6);
+    ASSERT_EQ(buf_size, 10);
+    ASSERT_EQ(memcmp(buf, "abcdabcdef", 10), 0);
+
+    ASSERT_EQ(mb_file_close(file.get()), MB_FILE_OK);
+    free(buf);
+}
+
 // TODO: Add more tests after integrating gmock
@@ -39,6 +39,16 @@ MB_EXPORT char * mbp_config_temp_directory(const CPatcherConfig *pc);
 MB_EXPORT void mbp_config_set_data_directory(CPatcherConfig *pc, char *path);
 MB_EXPORT void mbp_config_set_temp_directory(CPatcherConfig *pc, char *path);
 
+MB_EXPORT unsigned int mbp_config_threads(const CPatcherConfig *pc);
+MB_EXPORT void mbp_config_set_threads(CPatcherConfig *pc, unsigned int threads);
+
+MB_EXPORT /* enum CompressionLevel */ int mbp_config_compression_level(const CPatcherConfig *pc);
+MB_EXPORT void mbp_config_set_compression_level(CPatcherConfig *pc,
+                                                /* enum CompressionLevel */ int level);
+MB_EXPORT void mbp_config_set_compression_level_for_suffix(CPatcherConfig *pc,
+                                                           const char *suffix,
+                                                           /* enum CompressionLevel */ int level);
+
 MB_EXPORT char ** mbp_config_patchers(const CPatcherConfig *pc);
 MB_EXPORT char ** mbp_config_autopatchers(const CPatcherConfig *pc);
 MB_EXPORT char ** mbp_config_ramdiskpatchers(const CPatcherConfig *pc);
@@ -43,6 +43,7 @@ MB_EXPORT bool mbp_patcher_patch_file(CPatcher *patcher,
                                       DetailsUpdatedCallback detailsCb,
                                       void *userData);
 MB_EXPORT void mbp_patcher_cancel_patching(CPatcher *patcher);
+MB_EXPORT bool mbp_patcher_odin_set_threads(CPatcher *patcher, unsigned int threads);
 
 
 MB_EXPORT /* enum ErrorCode */ int mbp_autopatcher_error(const CAutoPatcher *patcher);
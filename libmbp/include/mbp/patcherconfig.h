@@ -20,6 +20,7 @@
 #pragma once
 
 #include <memory>
+#include <string>
 
 #include "mbcommon/common.h"
 
@@ -35,6 +36,18 @@ class Patcher;
 class AutoPatcher;
 class RamdiskPatcher;
 
+enum class CompressionLevel
+{
+    // Store without compression
+    Store,
+    // Fastest deflate compression
+    Fast,
+    // Default deflate compression
+    Default,
+    // Best deflate compression
+    Max,
+};
+
 class MB_EXPORT PatcherConfig
 {
 public:
@@ -49,6 +62,15 @@ public:
     void setDataDirectory(std::string path);
     void setTempDirectory(std::string path);
 
+    unsigned int threads() const;
+    void setThreads(unsigned int threads);
+
+    CompressionLevel compressionLevel() const;
+    void setCompressionLevel(CompressionLevel level);
+    void setCompressionLevel(const std::string &suffix,
+                             CompressionLevel level);
+    CompressionLevel compressionLevelForFile(const std::string &name) const;
+
     std::vector<std::string> patchers() const;
     std::vector<std::string> autoPatchers() const;
     std::vector<std::string> ramdiskPatchers() const;
@@ -28,7 +28,7 @@
 namespace mbp
 {
 
-class MultiBootPatcher : public Patcher
+class MB_EXPORT MultiBootPatcher : public Patcher
 {
 public:
     explicit MultiBootPatcher(PatcherConfig * const pc);
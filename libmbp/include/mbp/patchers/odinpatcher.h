@@ -28,7 +28,7 @@
 namespace mbp
 {
 
-class OdinPatcher : public Patcher
+class MB_EXPORT OdinPatcher : public Patcher
 {
 public:
     explicit OdinPatcher(PatcherConfig * const pc);
@@ -51,6 +51,9 @@ public:
 
     virtual void cancelPatching() override;
 
+    // Compression
+    void setThreads(unsigned int threads);
+
 private:
     class Impl;
     std::unique_ptr<Impl> m_impl;
@@ -26,6 +26,7 @@
 #include "minizip/zip.h"
 
 #include "mbp/errors.h"
+#include "mbp/patcherconfig.h"
 
 
 namespace mbp
@@ -39,6 +40,13 @@ public:
         uint64_t totalSize;
     };
 
+    struct DeflatedData {
+        std::vector<unsigned char> data;
+        uint64_t uncompressedSize;
+        uint32_t crc;
+        CompressionLevel level;
+    };
+
     static std::string unzErrorString(int ret);
 
     static std::string zipErrorString(int ret);
@@ -80,11 +88,35 @@ public:
 
     static ErrorCode addFile(zipFile zf,
                              const std::string &name,
-                             const std::vector<unsigned char> &contents);
+                             const std::vector<unsigned char> &contents,
+                             CompressionLevel level = CompressionLevel::Default);
 
     static ErrorCode addFile(zipFile zf,
                              const std::string &name,
-                             const std::string &path);
+                             const std::string &path,
+                             CompressionLevel level = CompressionLevel::Default);
+
+    static ErrorCode deflateData(const std::vector<unsigned char> &contents,
+                                 CompressionLevel level,
+                                 DeflatedData *output);
+
+    static ErrorCode addDeflatedFile(zipFile zf,
+                                     const std::string &name,
+                                     const DeflatedData &deflated);
+
+    struct ParallelDeflateCtx;
+
+    static ErrorCode openParallelDeflate(zipFile zf,
+                                         const std::string &name,
+                                         bool zip64,
+                                         CompressionLevel level,
+                                         unsigned int threads,
+                                         ParallelDeflateCtx **ctxOut);
+
+    static ErrorCode writeParallelDeflate(ParallelDeflateCtx *ctx,
+                                          const void *buf, size_t size);
+
+    static ErrorCode closeParallelDeflate(ParallelDeflateCtx *ctx);
 };
 
 }
@@ -20,9 +20,12 @@
 #include "mbp/bootimage.h"
 
 #include <algorithm>
+#include <memory>
 
 #include <cstring>
 
+#include "mbcommon/file.h"
+#include "mbcommon/file/mmap.h"
 #include "mblog/logging.h"
 
 #include "mbp/bootimage/androidformat.h"
@@ -218,8 +221,9 @@ bool BootImage::load(const std::vector<unsigned char> &data)
 /*!
  * \brief Load a boot image file
  *
- * This function reads a boot image file and then calls
- * BootImage::load(const std::vector<unsigned char> &)
+ * This function maps the boot image file into memory and then calls
+ * BootImage::load(const unsigned char *, std::size_t). If the file cannot be
+ * mapped, it is read into memory instead.
  *
  * \warning If the boot image cannot be loaded, do not use the same BootImage
  *          object to load another boot image as it may contain partially
@@ -231,6 +235,17 @@ bool BootImage::load(const std::vector<unsigned char> &data)
  */
 bool BootImage::loadFile(const std::string &filename)
 {
+    std::unique_ptr<MbFile, decltype(mb_file_free) *> file{
+            mb_file_new(), &mb_file_free};
+    const void *buf;
+    size_t size;
+
+    if (file && mb_file_open_mmap_filename(file.get(), filename.c_str())
+                    == MB_FILE_OK
+            && mb_file_get_buffer(file.get(), &buf, &size) == MB_FILE_OK) {
+        return load(static_cast<const unsigned char *>(buf), size);
+    }
+
     std::vector<unsigned char> data;
     auto ret = FileUtils::readToMemory(filename, &data);
     if (ret != ErrorCode::NoError) {
@@ -21,7 +21,8 @@
 
 #include <cstring>
 
-#include <algorithm>
+#include <list>
+#include <map>
 #include <utility>
 #include <vector>
 
@@ -36,7 +37,8 @@
 namespace mbp
 {
 
-typedef std::pair<archive_entry *, std::vector<unsigned char>> FilePair;
+typedef std::unique_ptr<archive_entry, decltype(archive_entry_free) *>
+        ScopedArchiveEntry;
 
 enum Compression {
     NONE,
@@ -47,24 +49,152 @@ enum Compression {
 };
 
 /*! \cond INTERNAL */
+struct CpioEntry
+{
+    ScopedArchiveEntry entry;
+    // Whether the contents are in \a data instead of a loaded archive
+    bool materialized;
+    // Location of the contents in one of CpioFile::Impl::buffers
+    const unsigned char *ref;
+    std::size_t size;
+    std::vector<unsigned char> data;
+
+    CpioEntry(archive_entry *e)
+        : entry(e, &archive_entry_free), materialized(true), ref(nullptr),
+        size(0)
+    {
+    }
+};
+
+typedef std::list<CpioEntry> CpioEntryList;
+
 class CpioFile::Impl
 {
 public:
-    ~Impl();
-
-    std::vector<FilePair> files;
+    // Files in the order they are written. Loaded files keep the order of the
+    // archive until a file is added, which sorts the list by path. Once sorted,
+    // added and renamed files are inserted at their sorted position.
+    CpioEntryList files;
+    bool sorted = true;
+
+    // First entry for each path. Ordered so that the insertion point of a new
+    // path can be found without walking the list.
+    std::map<std::string, CpioEntryList::iterator> index;
+    // Whether a loaded archive contained multiple entries with the same path
+    bool duplicates = false;
+
+    // Uncompressed cpio archives that unmodified entries point into. Moving
+    // the vectors does not move their data.
+    std::vector<std::vector<unsigned char>> buffers;
 
     Compression compression;
 
     ErrorCode error;
+
+    CpioEntry * find(const std::string &name);
+    const unsigned char * data(const CpioEntry &ce) const;
+    void setData(CpioEntry *ce, std::vector<unsigned char> data);
+    void append(CpioEntry ce);
+    bool add(archive_entry *entry, std::vector<unsigned char> data);
+    CpioEntryList::iterator sortedPosition(const std::string &name);
+    void unindex(const std::string &name);
 };
 /*! \endcond */
 
 
-CpioFile::Impl::~Impl()
+static bool sortByName(const CpioEntry &ce1, const CpioEntry &ce2)
+{
+    const char *cname1 = archive_entry_pathname(ce1.entry.get());
+    const char *cname2 = archive_entry_pathname(ce2.entry.get());
+
+    return std::strcmp(cname1, cname2) < 0;
+}
+
+CpioEntry * CpioFile::Impl::find(const std::string &name)
+{
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : &*it->second;
+}
+
+const unsigned char * CpioFile::Impl::data(const CpioEntry &ce) const
+{
+    return ce.materialized ? ce.data.data() : ce.ref;
+}
+
+void CpioFile::Impl::setData(CpioEntry *ce, std::vector<unsigned char> data)
+{
+    archive_entry_set_size(ce->entry.get(), data.size());
+    ce->materialized = true;
+    ce->ref = nullptr;
+    ce->size = data.size();
+    ce->data = std::move(data);
+}
+
+void CpioFile::Impl::append(CpioEntry ce)
+{
+    std::string name(archive_entry_pathname(ce.entry.get()));
+    auto it = files.insert(files.end(), std::move(ce));
+
+    if (!index.emplace(std::move(name), it).second) {
+        duplicates = true;
+    }
+    sorted = false;
+}
+
+bool CpioFile::Impl::add(archive_entry *entry, std::vector<unsigned char> data)
+{
+    CpioEntry ce(entry);
+    setData(&ce, std::move(data));
+
+    std::string name(archive_entry_pathname(entry));
+    if (index.find(name) != index.end()) {
+        error = ErrorCode::CpioFileAlreadyExistsError;
+        return false;
+    }
+
+    if (!sorted) {
+        files.sort(&sortByName);
+        sorted = true;
+    }
+
+    auto pos = sortedPosition(name);
+    index.emplace(std::move(name), files.insert(pos, std::move(ce)));
+
+    return true;
+}
+
+/*!
+ * \brief Find where an entry named \p name belongs in the sorted list
+ *
+ * \pre The list is sorted and \p name is not in the index
+ *
+ * \return Iterator to the first entry of the next path in the index
+ */
+CpioEntryList::iterator CpioFile::Impl::sortedPosition(const std::string &name)
+{
+    // std::string and strcmp() both compare as unsigned char, so the index is
+    // in the same order as the sorted list
+    auto it = index.upper_bound(name);
+    return it == index.end() ? files.end() : it->second;
+}
+
+/*!
+ * \brief Remove \p name from the index after its entry was removed or renamed
+ *
+ * If the loaded archive contained another entry with the same path, the index
+ * will point to that one instead.
+ */
+void CpioFile::Impl::unindex(const std::string &name)
 {
-    for (auto &p : files) {
-        archive_entry_free(p.first);
+    index.erase(name);
+
+    if (duplicates) {
+        for (auto it = files.begin(); it != files.end(); ++it) {
+            if (name == archive_entry_pathname(it->entry.get())) {
+                index.emplace(name, it);
+                break;
+            }
+        }
     }
 }
 
@@ -105,11 +235,79 @@ ErrorCode CpioFile::error() const
     return m_impl->error;
 }
 
+/*!
+ * \brief Decompress an archive without parsing it
+ */
+static bool decompressArchive(const unsigned char *data, std::size_t size,
+                              std::vector<unsigned char> *dataOut,
+                              ErrorCode *errorOut)
+{
+    archive *a;
+    archive_entry *entry;
+
+    a = archive_read_new();
+
+    // Allow gzip-compressed cpio files to work as well
+    // (libarchive is awesome)
+    archive_read_support_filter_gzip(a);
+    archive_read_support_filter_lzop(a);
+    archive_read_support_filter_lz4(a);
+    archive_read_support_filter_lzma(a);
+    archive_read_support_filter_xz(a);
+    archive_read_support_format_raw(a);
+
+    int ret = archive_read_open_memory(a,
+            const_cast<unsigned char *>(data), size);
+    if (ret != ARCHIVE_OK) {
+        LOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        *errorOut = ErrorCode::ArchiveReadOpenError;
+        return false;
+    }
+
+    ret = archive_read_next_header(a, &entry);
+    if (ret != ARCHIVE_OK) {
+        LOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        *errorOut = ErrorCode::ArchiveReadHeaderError;
+        return false;
+    }
+
+    dataOut->clear();
+
+    __LA_INT64_T offset;
+    const void *buff;
+    size_t bytes_read;
+
+    while ((ret = archive_read_data_block(a, &buff,
+            &bytes_read, &offset)) == ARCHIVE_OK) {
+        dataOut->insert(dataOut->end(),
+                        reinterpret_cast<const char *>(buff),
+                        reinterpret_cast<const char *>(buff) + bytes_read);
+    }
+
+    if (ret < ARCHIVE_WARN) {
+        LOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        *errorOut = ErrorCode::ArchiveReadDataError;
+        return false;
+    }
+
+    archive_read_free(a);
+    return true;
+}
+
 /*!
  * \brief Load a cpio archive from binary data
  *
  * This function loads a cpio archive from a vector containing the binary data.
- * Each file's metadata and contents will be copied and stored.
+ * The archive is decompressed into memory once and the contents of each file
+ * reference the decompressed data until the file is modified. If an archive
+ * was already loaded, the files of this archive are added after the existing
+ * files.
  *
  * \warning If the cpio archive cannot be loaded, this CpioFile object may be
  *          left in an inconsistent state. Create a new CpioFile to load another
@@ -133,22 +331,26 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
         m_impl->compression = NONE;
     }
 
+    std::vector<unsigned char> buffer;
+    if (!decompressArchive(data, size, &buffer, &m_impl->error)) {
+        return false;
+    }
+
+    // Keep the buffers of previously loaded archives since their files may
+    // still point to them
+    m_impl->buffers.push_back(std::move(buffer));
+
     archive *a;
     archive_entry *entry;
 
     a = archive_read_new();
-
-    // Allow gzip-compressed cpio files to work as well
-    // (libarchive is awesome)
-    archive_read_support_filter_gzip(a);
-    archive_read_support_filter_lzop(a);
-    archive_read_support_filter_lz4(a);
-    archive_read_support_filter_lzma(a);
-    archive_read_support_filter_xz(a);
     archive_read_support_format_cpio(a);
 
+    const unsigned char *begin = m_impl->buffers.back().data();
+    const unsigned char *end = begin + m_impl->buffers.back().size();
+
     int ret = archive_read_open_memory(a,
-            const_cast<unsigned char *>(data), size);
+            const_cast<unsigned char *>(begin), end - begin);
     if (ret != ARCHIVE_OK) {
         LOGW("libarchive: %s", archive_error_string(a));
         archive_read_free(a);
@@ -158,20 +360,34 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
     }
 
     while ((ret = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
-        // Read the data for the entry
-        std::vector<unsigned char> entryData;
-        entryData.reserve(archive_entry_size(entry));
+        CpioEntry ce(archive_entry_clone(entry));
+        ce.materialized = false;
 
         int r;
         __LA_INT64_T offset;
         const void *buff;
         size_t bytes_read;
 
+        // libarchive returns pointers into the memory buffer for uncompressed
+        // archives, so the data can usually be referenced in place. If it
+        // can't, fall back to copying the data.
         while ((r = archive_read_data_block(a, &buff,
                 &bytes_read, &offset)) == ARCHIVE_OK) {
-            entryData.insert(entryData.end(),
-                             reinterpret_cast<const char *>(buff),
-                             reinterpret_cast<const char *>(buff) + bytes_read);
+            auto ptr = reinterpret_cast<const unsigned char *>(buff);
+
+            if (!ce.materialized && (ptr < begin || ptr + bytes_read > end
+                    || offset != static_cast<__LA_INT64_T>(ce.size)
+                    || (ce.size > 0 && ptr != ce.ref + ce.size))) {
+                ce.data.assign(ce.ref, ce.ref + ce.size);
+                ce.materialized = true;
+            }
+
+            if (ce.materialized) {
+                ce.data.insert(ce.data.end(), ptr, ptr + bytes_read);
+            } else if (ce.size == 0) {
+                ce.ref = ptr;
+            }
+            ce.size += bytes_read;
         }
 
         if (r < ARCHIVE_WARN) {
@@ -182,9 +398,7 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
             return false;
         }
 
-        // Save the header and data
-        archive_entry *cloned = archive_entry_clone(entry);
-        m_impl->files.push_back(std::make_pair(cloned, std::move(entryData)));
+        m_impl->append(std::move(ce));
     }
 
     if (ret < ARCHIVE_WARN) {
@@ -235,14 +449,6 @@ static int archiveCloseCallback(archive *a, void *clientData)
     return ARCHIVE_OK;
 }
 
-static bool sortByName(const FilePair &p1, const FilePair &p2)
-{
-    const char *cname1 = archive_entry_pathname(p1.first);
-    const char *cname2 = archive_entry_pathname(p2.first);
-
-    return std::strcmp(cname1, cname2) < 0;
-}
-
 /*!
  * \brief Constructs the cpio archive
  *
@@ -288,11 +494,11 @@ bool CpioFile::createData(std::vector<unsigned char> *dataOut)
         return false;
     }
 
-    for (auto const &p : m_impl->files) {
-        if (archive_write_header(a, p.first) != ARCHIVE_OK) {
+    for (auto const &ce : m_impl->files) {
+        if (archive_write_header(a, ce.entry.get()) != ARCHIVE_OK) {
             LOGW("libarchive: %s : %s",
                  archive_error_string(a),
-                 archive_entry_pathname(p.first));
+                 archive_entry_pathname(ce.entry.get()));
             m_impl->error = ErrorCode::ArchiveWriteHeaderError;
 
             archive_write_fail(a);
@@ -300,8 +506,8 @@ bool CpioFile::createData(std::vector<unsigned char> *dataOut)
             return false;
         }
 
-        if (archive_write_data(a, p.second.data(), p.second.size())
-                != int(p.second.size())) {
+        if (archive_write_data(a, m_impl->data(ce), ce.size)
+                != int(ce.size)) {
             archive_write_fail(a);
             archive_write_free(a);
 
@@ -339,13 +545,7 @@ bool CpioFile::createData(std::vector<unsigned char> *dataOut)
  */
 bool CpioFile::exists(const std::string &name) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            return true;
-        }
-    }
-
-    return false;
+    return m_impl->index.find(name) != m_impl->index.end();
 }
 
 /*!
@@ -361,16 +561,14 @@ bool CpioFile::exists(const std::string &name) const
  */
 bool CpioFile::remove(const std::string &name)
 {
-    for (auto it = m_impl->files.begin(); it != m_impl->files.end(); ++it) {
-        archive_entry *entry = (*it).first;
-        if (name == archive_entry_pathname(entry)) {
-            archive_entry_free(entry);
-            m_impl->files.erase(it);
-            return true;
-        }
+    auto it = m_impl->index.find(name);
+    if (it == m_impl->index.end()) {
+        return false;
     }
 
-    return false;
+    m_impl->files.erase(it->second);
+    m_impl->unindex(name);
+    return true;
 }
 
 /*!
@@ -381,9 +579,10 @@ bool CpioFile::remove(const std::string &name)
 std::vector<std::string> CpioFile::filenames() const
 {
     std::vector<std::string> list;
+    list.reserve(m_impl->files.size());
 
-    for (auto const &p : m_impl->files) {
-        list.push_back(archive_entry_pathname(p.first));
+    for (auto const &ce : m_impl->files) {
+        list.push_back(archive_entry_pathname(ce.entry.get()));
     }
 
     return list;
@@ -391,10 +590,8 @@ std::vector<std::string> CpioFile::filenames() const
 
 bool CpioFile::isSymlink(const std::string &name) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            return archive_entry_filetype(p.first) == AE_IFLNK;
-        }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        return archive_entry_filetype(ce->entry.get()) == AE_IFLNK;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -403,18 +600,16 @@ bool CpioFile::isSymlink(const std::string &name) const
 
 bool CpioFile::symlinkPath(const std::string &name, std::string *out) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            if (archive_entry_filetype(p.first) == AE_IFLNK) {
-                const char *path = archive_entry_symlink(p.first);
-                if (path) {
-                    *out = path;
-                    return true;
-                }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        if (archive_entry_filetype(ce->entry.get()) == AE_IFLNK) {
+            const char *path = archive_entry_symlink(ce->entry.get());
+            if (path) {
+                *out = path;
+                return true;
             }
-            m_impl->error = ErrorCode::ArchiveReadHeaderError;
-            return false;
         }
+        m_impl->error = ErrorCode::ArchiveReadHeaderError;
+        return false;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -429,11 +624,10 @@ bool CpioFile::symlinkPath(const std::string &name, std::string *out) const
 bool CpioFile::contents(const std::string &name,
                         std::vector<unsigned char> *dataOut) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            *dataOut = p.second;
-            return true;
-        }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        const unsigned char *data = m_impl->data(*ce);
+        dataOut->assign(data, data + ce->size);
+        return true;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -451,12 +645,9 @@ bool CpioFile::contents(const std::string &name,
 bool CpioFile::setContents(const std::string &name,
                            std::vector<unsigned char> data)
 {
-    for (auto &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            archive_entry_set_size(p.first, data.size());
-            p.second = std::move(data);
-            return true;
-        }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        m_impl->setData(ce, std::move(data));
+        return true;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -466,12 +657,10 @@ bool CpioFile::setContents(const std::string &name,
 bool CpioFile::contentsC(const std::string &name,
                          const unsigned char **data, std::size_t *size) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            *data = p.second.data();
-            *size = p.second.size();
-            return true;
-        }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        *data = m_impl->data(*ce);
+        *size = ce->size;
+        return true;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -481,15 +670,9 @@ bool CpioFile::contentsC(const std::string &name,
 bool CpioFile::setContentsC(const std::string &name,
                             const unsigned char *data, std::size_t size)
 {
-    for (auto &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            archive_entry_set_size(p.first, size);
-            p.second.clear();
-            p.second.shrink_to_fit();
-            p.second.resize(size);
-            std::memcpy(p.second.data(), data, size);
-            return true;
-        }
+    if (CpioEntry *ce = m_impl->find(name)) {
+        m_impl->setData(ce, std::vector<unsigned char>(data, data + size));
+        return true;
     }
 
     m_impl->error = ErrorCode::CpioFileNotExistError;
@@ -531,11 +714,7 @@ bool CpioFile::addSymlink(const std::string &source, const std::string &target)
     archive_entry_set_filetype(entry, AE_IFLNK);
     archive_entry_set_perm(entry, 0777);
 
-    m_impl->files.push_back(std::make_pair(entry, std::vector<unsigned char>()));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
-
-    return true;
+    return m_impl->add(entry, std::vector<unsigned char>());
 }
 
 /*!
@@ -603,11 +782,7 @@ bool CpioFile::addFile(std::vector<unsigned char> contents,
     archive_entry_set_filetype(entry, AE_IFREG);
     archive_entry_set_perm(entry, perms);
 
-    m_impl->files.push_back(std::make_pair(entry, std::move(contents)));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
-
-    return true;
+    return m_impl->add(entry, std::move(contents));
 }
 
 bool CpioFile::addFileC(const unsigned char *data, std::size_t size,
@@ -635,12 +810,7 @@ bool CpioFile::addFileC(const unsigned char *data, std::size_t size,
     archive_entry_set_filetype(entry, AE_IFREG);
     archive_entry_set_perm(entry, perms);
 
-    m_impl->files.push_back(std::make_pair(
-            entry, std::vector<unsigned char>(data, data + size)));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
-
-    return true;
+    return m_impl->add(entry, std::vector<unsigned char>(data, data + size));
 }
 
 bool CpioFile::rename(const std::string &source, const std::string &target)
@@ -650,15 +820,26 @@ bool CpioFile::rename(const std::string &source, const std::string &target)
         return false;
     }
 
-    for (auto &p : m_impl->files) {
-        if (source == archive_entry_pathname(p.first)) {
-            archive_entry_set_pathname(p.first, target.c_str());
-            return true;
-        }
+    auto it = m_impl->index.find(source);
+    if (it == m_impl->index.end()) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    CpioEntryList::iterator entryIt = it->second;
+    archive_entry_set_pathname(entryIt->entry.get(), target.c_str());
+    m_impl->unindex(source);
+
+    // A loaded archive that hasn't been sorted yet keeps its order. Otherwise,
+    // move the entry to where its new path belongs.
+    if (m_impl->sorted) {
+        m_impl->files.splice(m_impl->sortedPosition(target), m_impl->files,
+                             entryIt);
+    }
+
+    m_impl->index.emplace(target, entryIt);
+
+    return true;
 }
 
 }
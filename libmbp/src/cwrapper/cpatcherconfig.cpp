@@ -154,6 +154,81 @@ void mbp_config_set_temp_directory(CPatcherConfig *pc, char *path)
     config->setTempDirectory(path);
 }
 
+/*!
+ * \brief Get maximum number of threads used for patching
+ *
+ * \param pc CPatcherConfig object
+ * \return Number of threads
+ *
+ * \sa PatcherConfig::threads()
+ */
+unsigned int mbp_config_threads(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return config->threads();
+}
+
+/*!
+ * \brief Set maximum number of threads used for patching
+ *
+ * \param pc CPatcherConfig object
+ * \param threads Number of threads (0 to use the number of CPUs)
+ *
+ * \sa PatcherConfig::setThreads()
+ */
+void mbp_config_set_threads(CPatcherConfig *pc, unsigned int threads)
+{
+    CAST(pc);
+    config->setThreads(threads);
+}
+
+/*!
+ * \brief Get default compression level for new and modified files
+ *
+ * \param pc CPatcherConfig object
+ * \return Compression level (value of the CompressionLevel enum)
+ *
+ * \sa PatcherConfig::compressionLevel()
+ */
+/* enum CompressionLevel */ int mbp_config_compression_level(const CPatcherConfig *pc)
+{
+    CCAST(pc);
+    return static_cast<int>(config->compressionLevel());
+}
+
+/*!
+ * \brief Set default compression level for new and modified files
+ *
+ * \param pc CPatcherConfig object
+ * \param level Compression level (value of the CompressionLevel enum)
+ *
+ * \sa PatcherConfig::setCompressionLevel(CompressionLevel)
+ */
+void mbp_config_set_compression_level(CPatcherConfig *pc,
+                                      /* enum CompressionLevel */ int level)
+{
+    CAST(pc);
+    config->setCompressionLevel(static_cast<mbp::CompressionLevel>(level));
+}
+
+/*!
+ * \brief Set compression level for files ending in a suffix
+ *
+ * \param pc CPatcherConfig object
+ * \param suffix Filename suffix (case-sensitive)
+ * \param level Compression level (value of the CompressionLevel enum)
+ *
+ * \sa PatcherConfig::setCompressionLevel(const std::string &, CompressionLevel)
+ */
+void mbp_config_set_compression_level_for_suffix(CPatcherConfig *pc,
+                                                 const char *suffix,
+                                                 /* enum CompressionLevel */ int level)
+{
+    CAST(pc);
+    config->setCompressionLevel(suffix,
+                                static_cast<mbp::CompressionLevel>(level));
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
@@ -24,6 +24,7 @@
 #include "mbp/cwrapper/private/util.h"
 
 #include "mbp/patcherinterface.h"
+#include "mbp/patchers/odinpatcher.h"
 
 
 #define CASTP(x) \
@@ -186,6 +187,26 @@ void mbp_patcher_cancel_patching(CPatcher *patcher)
     p->cancelPatching();
 }
 
+/*!
+ * \brief Set number of threads for compressing the system images
+ *
+ * \param patcher CPatcher object for an OdinPatcher
+ * \param threads Number of threads (0 to use the CPatcherConfig's value)
+ *
+ * \return False if \p patcher is not an OdinPatcher. Otherwise, true.
+ *
+ * \sa OdinPatcher::setThreads()
+ */
+bool mbp_patcher_odin_set_threads(CPatcher *patcher, unsigned int threads)
+{
+    CASTP(patcher);
+    if (p->id() != mbp::OdinPatcher::Id) {
+        return false;
+    }
+    static_cast<mbp::OdinPatcher *>(p)->setThreads(threads);
+    return true;
+}
+
 /*!
  * \brief Get the error information
  *
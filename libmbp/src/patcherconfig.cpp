@@ -20,6 +20,9 @@
 #include "mbp/patcherconfig.h"
 
 #include <algorithm>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 #include <cassert>
 
@@ -46,10 +49,19 @@ public:
     std::string dataDir;
     std::string tempDir;
 
+    // Maximum number of threads for patching (0 for automatic)
+    unsigned int threads = 0;
+
+    // Compression of new and modified files
+    CompressionLevel compressionLevel = CompressionLevel::Default;
+    // Overrides for filename suffixes
+    std::vector<std::pair<std::string, CompressionLevel>> compressionOverrides;
+
     // Errors
     ErrorCode error;
 
-    // Created patchers
+    // Created patchers (patchers may be created from multiple threads)
+    std::mutex allocMutex;
     std::vector<Patcher *> allocPatchers;
     std::vector<AutoPatcher *> allocAutoPatchers;
     std::vector<RamdiskPatcher *> allocRamdiskPatchers;
@@ -147,6 +159,105 @@ void PatcherConfig::setTempDirectory(std::string path)
     m_impl->tempDir = std::move(path);
 }
 
+/*!
+ * \brief Get maximum number of threads used for patching
+ *
+ * The default is the number of CPUs.
+ *
+ * \return Number of threads (always at least 1)
+ */
+unsigned int PatcherConfig::threads() const
+{
+    if (m_impl->threads == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    } else {
+        return m_impl->threads;
+    }
+}
+
+/*!
+ * \brief Set maximum number of threads used for patching
+ *
+ * \param threads Number of threads (0 to use the number of CPUs)
+ */
+void PatcherConfig::setThreads(unsigned int threads)
+{
+    m_impl->threads = threads;
+}
+
+/*!
+ * \brief Get default compression level for new and modified files
+ *
+ * Files that are copied from the input file unmodified keep their original
+ * compression.
+ *
+ * \return Compression level (CompressionLevel::Default by default)
+ */
+CompressionLevel PatcherConfig::compressionLevel() const
+{
+    return m_impl->compressionLevel;
+}
+
+/*!
+ * \brief Set default compression level for new and modified files
+ *
+ * \param level Compression level
+ */
+void PatcherConfig::setCompressionLevel(CompressionLevel level)
+{
+    m_impl->compressionLevel = level;
+}
+
+/*!
+ * \brief Set compression level for files ending in a suffix
+ *
+ * For example, passing ".sparse" and CompressionLevel::Store will store large
+ * sparse images without compression, making them faster to patch and allowing
+ * the installer to read them directly from the zip. If multiple suffixes
+ * match a file, the longest one is used.
+ *
+ * \param suffix Filename suffix (case-sensitive)
+ * \param level Compression level
+ */
+void PatcherConfig::setCompressionLevel(const std::string &suffix,
+                                        CompressionLevel level)
+{
+    for (auto &item : m_impl->compressionOverrides) {
+        if (item.first == suffix) {
+            item.second = level;
+            return;
+        }
+    }
+
+    m_impl->compressionOverrides.emplace_back(suffix, level);
+}
+
+/*!
+ * \brief Get compression level for a file
+ *
+ * \param name Filename (or path in the zip)
+ *
+ * \return Compression level for the longest matching suffix or the default
+ *         compression level if no suffix matches
+ */
+CompressionLevel PatcherConfig::compressionLevelForFile(const std::string &name) const
+{
+    CompressionLevel level = m_impl->compressionLevel;
+    size_t longest = 0;
+
+    for (auto const &item : m_impl->compressionOverrides) {
+        const std::string &suffix = item.first;
+        if (suffix.size() <= name.size() && suffix.size() >= longest
+                && name.compare(name.size() - suffix.size(), suffix.size(),
+                                suffix) == 0) {
+            level = item.second;
+            longest = suffix.size();
+        }
+    }
+
+    return level;
+}
+
 /*!
  * \brief Get list of Patcher IDs
  *
@@ -206,6 +317,7 @@ Patcher * PatcherConfig::createPatcher(const std::string &id)
     }
 
     if (p != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocPatchers.push_back(p);
     }
 
@@ -232,6 +344,7 @@ AutoPatcher * PatcherConfig::createAutoPatcher(const std::string &id,
     }
 
     if (ap != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocAutoPatchers.push_back(ap);
     }
 
@@ -258,6 +371,7 @@ RamdiskPatcher * PatcherConfig::createRamdiskPatcher(const std::string &id,
     }
 
     if (rp != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocRamdiskPatchers.push_back(rp);
     }
 
@@ -271,6 +385,8 @@ RamdiskPatcher * PatcherConfig::createRamdiskPatcher(const std::string &id,
  */
 void PatcherConfig::destroyPatcher(Patcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocPatchers.begin(),
                         m_impl->allocPatchers.end(),
                         patcher);
@@ -288,6 +404,8 @@ void PatcherConfig::destroyPatcher(Patcher *patcher)
  */
 void PatcherConfig::destroyAutoPatcher(AutoPatcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocAutoPatchers.begin(),
                         m_impl->allocAutoPatchers.end(),
                         patcher);
@@ -305,6 +423,8 @@ void PatcherConfig::destroyAutoPatcher(AutoPatcher *patcher)
  */
 void PatcherConfig::destroyRamdiskPatcher(RamdiskPatcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocRamdiskPatchers.begin(),
                         m_impl->allocRamdiskPatchers.end(),
                         patcher);
@@ -20,11 +20,23 @@
 #include "mbp/patchers/multibootpatcher.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 
+#include "mbbootimg/entry.h"
+#include "mbbootimg/reader.h"
+#include "mbbootimg/writer.h"
+#include "mbcommon/file.h"
+#include "mbcommon/file/memory.h"
 #include "mbcommon/string.h"
 #include "mbcommon/version.h"
 #include "mbdevice/json.h"
@@ -32,6 +44,7 @@
 #include "mbpio/delete.h"
 
 #include "mbp/bootimage.h"
+#include "mbp/bootimage/bumppatcher.h"
 #include "mbp/cpiofile.h"
 #include "mbp/patcherconfig.h"
 #include "mbp/private/fileutils.h"
@@ -42,10 +55,45 @@
 #include "minizip/unzip.h"
 #include "minizip/zip.h"
 
+// Maximum amount of uncompressed file data read ahead of the zip writer during
+// the first pass
+#define PASS1_MAX_QUEUED_SIZE           (128 * 1024 * 1024)
+// Boot images should never be over about 30 MiB. This check is here so the
+// patcher won't try to read a multi-gigabyte system image into RAM
+#define PASS1_MAX_PATCH_SIZE            (50 * 1024 * 1024)
+
 
 namespace mbp
 {
 
+/*! \cond INTERNAL */
+struct Pass1Job
+{
+    std::string name;
+    // Size of the file in the input zip
+    uint64_t inputSize;
+    std::vector<unsigned char> data;
+    MinizipUtils::DeflatedData deflated;
+    ErrorCode error = ErrorCode::NoError;
+    bool done = false;
+};
+
+struct Pass1State
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Jobs waiting for a worker thread
+    std::deque<Pass1Job *> pending;
+    // All queued jobs in central directory order, waiting for the writer
+    std::deque<std::unique_ptr<Pass1Job>> ordered;
+    // Size of input data for all queued jobs
+    uint64_t queuedSize = 0;
+    bool readerDone = false;
+    ErrorCode readerError = ErrorCode::NoError;
+    bool stop = false;
+};
+/*! \endcond */
+
 /*! \cond INTERNAL */
 class MultiBootPatcher::Impl
 {
@@ -60,6 +108,11 @@ public:
 
     volatile bool cancelled;
 
+    // State of the running first pass, so cancelPatching() can wake up its
+    // threads
+    std::mutex pass1StateMutex;
+    Pass1State *pass1State = nullptr;
+
     ErrorCode error;
 
     // Callbacks
@@ -77,6 +130,15 @@ public:
 
     bool pass1(const std::string &temporaryDir,
                const std::unordered_set<std::string> &exclude);
+    bool pass1Write(Pass1State *state,
+                    const std::unordered_set<std::string> &exclude);
+    ErrorCode pass1Read(Pass1State *state, MinizipUtils::UnzCtx *ctx,
+                        const std::string &temporaryDir,
+                        const std::unordered_set<std::string> &exclude);
+    void pass1Reader(Pass1State *state, MinizipUtils::UnzCtx *ctx,
+                     const std::string &temporaryDir,
+                     const std::unordered_set<std::string> &exclude);
+    void pass1Worker(Pass1State *state);
     bool pass2(const std::string &temporaryDir,
                const std::unordered_set<std::string> &files);
     bool openInputArchive();
@@ -124,6 +186,16 @@ void MultiBootPatcher::setFileInfo(const FileInfo * const info)
 void MultiBootPatcher::cancelPatching()
 {
     m_impl->cancelled = true;
+
+    std::lock_guard<std::mutex> lock(m_impl->pass1StateMutex);
+    if (m_impl->pass1State) {
+        // Lock the state so the notification can't be sent between a thread
+        // checking the cancelled flag and starting to wait
+        {
+            std::lock_guard<std::mutex> stateLock(m_impl->pass1State->mutex);
+        }
+        m_impl->pass1State->cv.notify_all();
+    }
 }
 
 bool MultiBootPatcher::patchFile(ProgressUpdatedCallback progressCb,
@@ -278,7 +350,9 @@ bool MultiBootPatcher::Impl::patchZip()
         updateFiles(++files, maxFiles);
         updateDetails(spec.target);
 
-        result = MinizipUtils::addFile(zf, spec.target, spec.source);
+        result = MinizipUtils::addFile(
+                zf, spec.target, spec.source,
+                pc->compressionLevelForFile(spec.target));
         if (result != ErrorCode::NoError) {
             error = result;
             return false;
@@ -293,7 +367,8 @@ bool MultiBootPatcher::Impl::patchZip()
     const std::string infoProp = createInfoProp(pc, info->romId());
     result = MinizipUtils::addFile(
             zf, "multiboot/info.prop",
-            std::vector<unsigned char>(infoProp.begin(), infoProp.end()));
+            std::vector<unsigned char>(infoProp.begin(), infoProp.end()),
+            pc->compressionLevelForFile("multiboot/info.prop"));
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
@@ -312,7 +387,8 @@ bool MultiBootPatcher::Impl::patchZip()
 
     result = MinizipUtils::addFile(
             zf, "multiboot/device.json",
-            std::vector<unsigned char>(json, json + strlen(json)));
+            std::vector<unsigned char>(json, json + strlen(json)),
+            pc->compressionLevelForFile("multiboot/device.json"));
     free(json);
 
     if (result != ErrorCode::NoError) {
@@ -325,6 +401,16 @@ bool MultiBootPatcher::Impl::patchZip()
     return true;
 }
 
+static bool isPatchCandidate(const std::string &name,
+                             const unz_file_info64 &fi)
+{
+    // Try to patch files that end in a common boot image extension
+    return (mb_ends_with(name.c_str(), ".img")
+            || mb_ends_with(name.c_str(), ".lok")
+            || mb_ends_with(name.c_str(), ".gz"))
+            && fi.uncompressed_size <= PASS1_MAX_PATCH_SIZE;
+}
+
 /*!
  * \brief First pass of patching operation
  *
@@ -333,9 +419,70 @@ bool MultiBootPatcher::Impl::patchZip()
  * - Patch boot images and copy them to the output zip.
  * - Files needed by an AutoPatcher are extracted to the temporary directory.
  * - Otherwise, the file is copied directly to the output zip.
+ *
+ * The work is split across multiple threads. A reader thread (with its own
+ * handle to the input zip) extracts the AutoPatcher files and loads the boot
+ * image candidates into memory. A pool of worker threads patches and
+ * compresses the boot images. Meanwhile, the calling thread walks through the
+ * input zip in the same order, raw-copying the other files and adding the
+ * patched files as they become ready. The output is identical to what a
+ * single-threaded pass would produce.
  */
 bool MultiBootPatcher::Impl::pass1(const std::string &temporaryDir,
                                    const std::unordered_set<std::string> &exclude)
+{
+    MinizipUtils::UnzCtx *readerCtx =
+            MinizipUtils::openInputFile(info->inputPath());
+    if (!readerCtx) {
+        LOGE("minizip: Failed to open for reading: %s",
+             info->inputPath().c_str());
+        error = ErrorCode::ArchiveReadOpenError;
+        return false;
+    }
+
+    Pass1State state;
+    std::vector<std::thread> threads;
+
+    {
+        std::lock_guard<std::mutex> lock(pass1StateMutex);
+        pass1State = &state;
+    }
+
+    threads.emplace_back(&Impl::pass1Reader, this, &state, readerCtx,
+                         std::cref(temporaryDir), std::cref(exclude));
+    for (unsigned int i = 0; i < pc->threads(); ++i) {
+        threads.emplace_back(&Impl::pass1Worker, this, &state);
+    }
+
+    bool ret = pass1Write(&state, exclude);
+
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.stop = true;
+    }
+    state.cv.notify_all();
+
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pass1StateMutex);
+        pass1State = nullptr;
+    }
+
+    MinizipUtils::closeInputFile(readerCtx);
+
+    if (ret && state.readerError != ErrorCode::NoError) {
+        error = state.readerError;
+        ret = false;
+    }
+
+    return ret;
+}
+
+bool MultiBootPatcher::Impl::pass1Write(Pass1State *state,
+                                        const std::unordered_set<std::string> &exclude)
 {
     unzFile uf = MinizipUtils::ctxGetUnzFile(zInput);
     zipFile zf = MinizipUtils::ctxGetZipFile(zOutput);
@@ -360,60 +507,57 @@ bool MultiBootPatcher::Impl::pass1(const std::string &temporaryDir,
         updateFiles(++files, maxFiles);
         updateDetails(curFile);
 
-        // Skip files that should be patched and added in pass 2
+        // Skip files that should be patched and added in pass 2. The reader
+        // thread extracts them to the temporary directory.
         if (exclude.find(curFile) != exclude.end()) {
-            if (!MinizipUtils::extractFile(uf, temporaryDir)) {
-                error = ErrorCode::ArchiveReadDataError;
-                return false;
-            }
             continue;
         }
 
-        // Try to patch files that end in a common boot image extension
+        if (isPatchCandidate(curFile, fi)) {
+            std::unique_ptr<Pass1Job> job;
 
-        bool isExtImg = mb_ends_with(curFile.c_str(), ".img");
-        bool isExtLok = mb_ends_with(curFile.c_str(), ".lok");
-        bool isExtGz = mb_ends_with(curFile.c_str(), ".gz");
-        // Boot images should never be over about 30 MiB. This check is here so
-        // the patcher won't try to read a multi-gigabyte system image into RAM
-        bool isSizeOK = fi.uncompressed_size <= 50 * 1024 * 1024;
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->cv.wait(lock, [&]{
+                    return cancelled
+                            || (!state->ordered.empty()
+                                    && state->ordered.front()->done)
+                            || (state->ordered.empty() && state->readerDone);
+                });
 
-        if ((isExtImg || isExtLok || isExtGz) && isSizeOK) {
-            // Load the file into memory
-            std::vector<unsigned char> data;
+                if (cancelled) return false;
 
-            if (!MinizipUtils::readToMemory(uf, &data,
-                                            &laProgressCb, this)) {
-                error = ErrorCode::ArchiveReadDataError;
-                return false;
+                if (state->ordered.empty()) {
+                    // The reader thread failed
+                    error = state->readerError;
+                    return false;
+                }
+
+                job = std::move(state->ordered.front());
+                state->ordered.pop_front();
+                state->queuedSize -= job->inputSize;
             }
+            state->cv.notify_all();
 
-            if (isExtGz) {
-                // Some zips build the boot image at install time and the zip
-                // just includes the split out parts of the boot image
-                if (!patchRamdisk(pc, info, &data, &error)) {
-                    // Just ignore for now
-                }
-            } else {
-                // If the file contains the boot image magic string, then
-                // assume it really is a boot image and patch it
-                if (BootImage::isValid(data.data(), data.size())) {
-                    if (!patchBootImage(pc, info, &data, &error)) {
-                        return false;
-                    }
-                }
+            assert(job->name == curFile);
+
+            if (job->error != ErrorCode::NoError) {
+                error = job->error;
+                return false;
             }
 
             // Update total size
-            maxBytes += (data.size() - fi.uncompressed_size);
+            maxBytes += job->deflated.uncompressedSize - fi.uncompressed_size;
 
-            auto ret2 = MinizipUtils::addFile(zf, curFile, data);
+            auto ret2 = MinizipUtils::addDeflatedFile(zf, curFile,
+                                                      job->deflated);
             if (ret2 != ErrorCode::NoError) {
                 error = ret2;
                 return false;
             }
 
-            bytes += data.size();
+            bytes += job->deflated.uncompressedSize;
+            updateProgress(bytes, maxBytes);
         } else {
             // Directly copy other files to the output zip
 
@@ -443,6 +587,138 @@ bool MultiBootPatcher::Impl::pass1(const std::string &temporaryDir,
     return true;
 }
 
+ErrorCode MultiBootPatcher::Impl::pass1Read(Pass1State *state,
+                                            MinizipUtils::UnzCtx *ctx,
+                                            const std::string &temporaryDir,
+                                            const std::unordered_set<std::string> &exclude)
+{
+    unzFile uf = MinizipUtils::ctxGetUnzFile(ctx);
+
+    int ret = unzGoToFirstFile(uf);
+    if (ret != UNZ_OK) {
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    do {
+        if (cancelled) return ErrorCode::PatchingCancelled;
+
+        unz_file_info64 fi;
+        std::string curFile;
+
+        if (!MinizipUtils::getInfo(uf, &fi, &curFile)) {
+            return ErrorCode::ArchiveReadHeaderError;
+        }
+
+        if (exclude.find(curFile) != exclude.end()) {
+            if (!MinizipUtils::extractFile(uf, temporaryDir)) {
+                return ErrorCode::ArchiveReadDataError;
+            }
+            continue;
+        } else if (!isPatchCandidate(curFile, fi)) {
+            continue;
+        }
+
+        {
+            // Always allow one job so that a large file can't block forever
+            std::unique_lock<std::mutex> lock(state->mutex);
+            state->cv.wait(lock, [&]{
+                return state->stop
+                        || state->queuedSize + fi.uncompressed_size
+                                <= PASS1_MAX_QUEUED_SIZE
+                        || state->ordered.empty();
+            });
+
+            if (state->stop) return ErrorCode::NoError;
+        }
+
+        std::unique_ptr<Pass1Job> job(new Pass1Job());
+        job->name = curFile;
+        job->inputSize = fi.uncompressed_size;
+
+        if (!MinizipUtils::readToMemory(uf, &job->data, nullptr, nullptr)) {
+            return ErrorCode::ArchiveReadDataError;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->queuedSize += job->inputSize;
+            state->pending.push_back(job.get());
+            state->ordered.push_back(std::move(job));
+        }
+        state->cv.notify_all();
+    } while ((ret = unzGoToNextFile(uf)) == UNZ_OK);
+
+    if (ret != UNZ_END_OF_LIST_OF_FILE) {
+        return ErrorCode::ArchiveReadHeaderError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+void MultiBootPatcher::Impl::pass1Reader(Pass1State *state,
+                                         MinizipUtils::UnzCtx *ctx,
+                                         const std::string &temporaryDir,
+                                         const std::unordered_set<std::string> &exclude)
+{
+    ErrorCode ret = pass1Read(state, ctx, temporaryDir, exclude);
+
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->readerDone = true;
+        state->readerError = ret;
+    }
+    state->cv.notify_all();
+}
+
+void MultiBootPatcher::Impl::pass1Worker(Pass1State *state)
+{
+    std::unique_lock<std::mutex> lock(state->mutex);
+
+    while (true) {
+        state->cv.wait(lock, [&]{
+            return state->stop || !state->pending.empty();
+        });
+
+        if (state->stop) {
+            break;
+        }
+
+        // The job is owned by the ordered queue and is not touched by any
+        // other thread until it is marked as done
+        Pass1Job *job = state->pending.front();
+        state->pending.pop_front();
+
+        lock.unlock();
+
+        if (mb_ends_with(job->name.c_str(), ".gz")) {
+            // Some zips build the boot image at install time and the zip just
+            // includes the split out parts of the boot image
+            if (!patchRamdisk(pc, info, &job->data, nullptr)) {
+                // Just ignore for now
+            }
+        } else if (BootImage::isValid(job->data.data(), job->data.size())) {
+            // If the file contains the boot image magic string, then assume it
+            // really is a boot image and patch it
+            patchBootImage(pc, info, &job->data, &job->error);
+        }
+
+        if (job->error == ErrorCode::NoError) {
+            job->error = MinizipUtils::deflateData(
+                    job->data, pc->compressionLevelForFile(job->name),
+                    &job->deflated);
+        }
+
+        // Release the uncompressed data
+        job->data.clear();
+        job->data.shrink_to_fit();
+
+        lock.lock();
+
+        job->done = true;
+        state->cv.notify_all();
+    }
+}
+
 /*!
  * \brief Second pass of patching operation
  *
@@ -469,20 +745,18 @@ bool MultiBootPatcher::Impl::pass2(const std::string &temporaryDir,
     for (auto const &file : files) {
         if (cancelled) return false;
 
-        ErrorCode ret;
-
+        // The compression level is looked up by the name stored in the zip
+        std::string name = file;
         if (file == "META-INF/com/google/android/update-binary") {
-            ret = MinizipUtils::addFile(
-                    zf,
-                    "META-INF/com/google/android/update-binary.orig",
-                    temporaryDir + "/" + file);
-        } else {
-            ret = MinizipUtils::addFile(
-                    zf,
-                    file,
-                    temporaryDir + "/" + file);
+            name = "META-INF/com/google/android/update-binary.orig";
         }
 
+        ErrorCode ret = MinizipUtils::addFile(
+                zf,
+                name,
+                temporaryDir + "/" + file,
+                pc->compressionLevelForFile(name));
+
         if (ret == ErrorCode::FileOpenError) {
             LOGW("File does not exist in temporary directory: %s", file.c_str());
         } else if (ret != ErrorCode::NoError) {
@@ -630,11 +904,271 @@ bool MultiBootPatcher::patchRamdisk(PatcherConfig * const pc,
     return true;
 }
 
+typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedMbFile;
+typedef std::unique_ptr<MbBiReader, decltype(mb_bi_reader_free) *> ScopedReader;
+typedef std::unique_ptr<MbBiWriter, decltype(mb_bi_writer_free) *> ScopedWriter;
+
+/*! \cond INTERNAL */
+// Buffer for mb_file_open_memory_dynamic(), which reallocates it with realloc()
+struct DynamicBuffer
+{
+    void *data = nullptr;
+    size_t size = 0;
+
+    ~DynamicBuffer()
+    {
+        free(data);
+    }
+};
+
+enum class StreamingResult
+{
+    Patched,
+    // Not an error, but the boot image must be patched with BootImage instead
+    Unsupported,
+    Failed,
+};
+/*! \endcond */
+
+/*!
+ * \brief Open boot image in memory with libmbbootimg
+ *
+ * \param data Boot image data (not copied)
+ * \param formatCode Format to use or 0 to detect the Android, bump, loki, and
+ *                   MTK formats
+ *
+ * \return Reader that has read the header or nullptr on failure
+ */
+static ScopedReader openBootImageReader(const std::vector<unsigned char> &data,
+                                        int formatCode, MbBiHeader **header)
+{
+    ScopedReader bir(nullptr, &mb_bi_reader_free);
+    MbFile *file = mb_file_new();
+    if (!file) {
+        return bir;
+    }
+
+    if (mb_file_open_memory_static(file, data.data(), data.size())
+            != MB_FILE_OK) {
+        mb_file_free(file);
+        return bir;
+    }
+
+    bir.reset(mb_bi_reader_new());
+    if (!bir) {
+        mb_file_free(file);
+        return bir;
+    }
+
+    int ret;
+    if (formatCode != 0) {
+        ret = mb_bi_reader_set_format_by_code(bir.get(), formatCode);
+    } else {
+        ret = mb_bi_reader_enable_format_android(bir.get());
+        if (ret == MB_BI_OK) {
+            ret = mb_bi_reader_enable_format_bump(bir.get());
+        }
+        if (ret == MB_BI_OK) {
+            ret = mb_bi_reader_enable_format_loki(bir.get());
+        }
+        // MTK images are also valid Android images, so the MTK reader must
+        // be enabled for them to be detected as such
+        if (ret == MB_BI_OK) {
+            ret = mb_bi_reader_enable_format_mtk(bir.get());
+        }
+    }
+
+    if (ret != MB_BI_OK) {
+        mb_file_free(file);
+        bir.reset();
+        return bir;
+    }
+
+    // The reader takes ownership of the file, even on failure
+    if (mb_bi_reader_open(bir.get(), file, true) != MB_BI_OK
+            || mb_bi_reader_read_header(bir.get(), header) != MB_BI_OK) {
+        bir.reset();
+    }
+
+    return bir;
+}
+
+/*!
+ * \brief Patch boot image without loading its components into separate buffers
+ *
+ * The header and the kernel, second bootloader, and device tree images are
+ * streamed from \p data to a new buffer. Only the ramdisk is loaded and
+ * patched. As with BootImage, loki'd images are written as regular Android
+ * boot images. MTK and other formats are left to BootImage.
+ *
+ * \p data is replaced with the patched boot image only if
+ * StreamingResult::Patched is returned.
+ */
+static StreamingResult patchBootImageStreaming(PatcherConfig * const pc,
+                                               const FileInfo * const info,
+                                               std::vector<unsigned char> *data,
+                                               ErrorCode *errorOut)
+{
+    const std::vector<unsigned char> &input = *data;
+
+    MbBiHeader *header;
+    ScopedReader headerReader = openBootImageReader(input, 0, &header);
+    if (!headerReader) {
+        return StreamingResult::Unsupported;
+    }
+
+    int readerFormat = mb_bi_reader_format_code(headerReader.get());
+
+    // The MTK headers of the kernel and ramdisk would have to be updated
+    if ((readerFormat & MB_BI_FORMAT_BASE_MASK) == MB_BI_FORMAT_MTK) {
+        return StreamingResult::Unsupported;
+    }
+
+    // libmbbootimg's bump writer omits the SEAndroid magic that BumpFormat
+    // writes before the bump magic, so write an Android image and bump it the
+    // same way BootImage does
+    bool isBump = (readerFormat & MB_BI_FORMAT_BASE_MASK) == MB_BI_FORMAT_BUMP;
+
+    // Must outlive the file below
+    DynamicBuffer outBuf;
+
+    ScopedMbFile file(mb_file_new(), &mb_file_free);
+    ScopedWriter biw(mb_bi_writer_new(), &mb_bi_writer_free);
+    if (!file || !biw) {
+        if (errorOut) {
+            *errorOut = ErrorCode::MemoryAllocationError;
+        }
+        return StreamingResult::Failed;
+    }
+
+    if (mb_file_open_memory_dynamic(file.get(), &outBuf.data, &outBuf.size)
+                    != MB_FILE_OK
+            || mb_bi_writer_set_format_android(biw.get()) != MB_BI_OK
+            || mb_bi_writer_open(biw.get(), file.get(), false) != MB_BI_OK
+            || mb_bi_writer_write_header(biw.get(), header) != MB_BI_OK) {
+        LOGW("Failed to write boot image header: %s",
+             mb_bi_writer_error_string(biw.get()));
+        return StreamingResult::Unsupported;
+    }
+
+    std::vector<unsigned char> buf(64 * 1024);
+    MbBiEntry *wEntry;
+    int ret;
+
+    while ((ret = mb_bi_writer_get_entry(biw.get(), &wEntry)) == MB_BI_OK) {
+        int type = mb_bi_entry_type(wEntry);
+
+        // The writer may want the entries in a different order than the
+        // reader returns them, so find each one with a new reader. This only
+        // reparses the header since the data is in memory.
+        MbBiHeader *unused;
+        ScopedReader bir = openBootImageReader(input, readerFormat, &unused);
+        if (!bir) {
+            return StreamingResult::Unsupported;
+        }
+
+        MbBiEntry *rEntry;
+        while ((ret = mb_bi_reader_read_entry(bir.get(), &rEntry)) == MB_BI_OK
+                && mb_bi_entry_type(rEntry) != type);
+        if (ret != MB_BI_OK && ret != MB_BI_EOF) {
+            LOGW("Failed to read boot image entry: %s",
+                 mb_bi_reader_error_string(bir.get()));
+            return StreamingResult::Unsupported;
+        }
+        bool found = ret == MB_BI_OK;
+
+        if (mb_bi_writer_write_entry(biw.get(), wEntry) != MB_BI_OK) {
+            LOGW("Failed to write boot image entry: %s",
+                 mb_bi_writer_error_string(biw.get()));
+            return StreamingResult::Unsupported;
+        }
+
+        if (!found) {
+            continue;
+        }
+
+        size_t n;
+
+        if (type == MB_BI_ENTRY_RAMDISK) {
+            std::vector<unsigned char> ramdisk;
+
+            while ((ret = mb_bi_reader_read_data(bir.get(), buf.data(),
+                                                 buf.size(), &n)) == MB_BI_OK) {
+                ramdisk.insert(ramdisk.end(), buf.data(), buf.data() + n);
+            }
+            if (ret != MB_BI_EOF) {
+                LOGW("Failed to read ramdisk: %s",
+                     mb_bi_reader_error_string(bir.get()));
+                return StreamingResult::Unsupported;
+            }
+
+            if (!MultiBootPatcher::patchRamdisk(pc, info, &ramdisk,
+                                                errorOut)) {
+                return StreamingResult::Failed;
+            }
+
+            if (mb_bi_writer_write_data(biw.get(), ramdisk.data(),
+                                        ramdisk.size(), &n) != MB_BI_OK) {
+                LOGW("Failed to write ramdisk: %s",
+                     mb_bi_writer_error_string(biw.get()));
+                return StreamingResult::Unsupported;
+            }
+        } else {
+            while ((ret = mb_bi_reader_read_data(bir.get(), buf.data(),
+                                                 buf.size(), &n)) == MB_BI_OK) {
+                size_t written;
+                if (mb_bi_writer_write_data(biw.get(), buf.data(), n, &written)
+                        != MB_BI_OK) {
+                    LOGW("Failed to write boot image entry data: %s",
+                         mb_bi_writer_error_string(biw.get()));
+                    return StreamingResult::Unsupported;
+                }
+            }
+            if (ret != MB_BI_EOF) {
+                LOGW("Failed to read boot image entry data: %s",
+                     mb_bi_reader_error_string(bir.get()));
+                return StreamingResult::Unsupported;
+            }
+        }
+    }
+
+    if (ret != MB_BI_EOF || mb_bi_writer_close(biw.get()) != MB_BI_OK) {
+        LOGW("Failed to write boot image: %s",
+             mb_bi_writer_error_string(biw.get()));
+        return StreamingResult::Unsupported;
+    }
+
+    // Release the input before copying so both aren't in memory at once
+    data->clear();
+    data->shrink_to_fit();
+
+    auto ptr = static_cast<const unsigned char *>(outBuf.data);
+    data->assign(ptr, ptr + outBuf.size);
+
+    if (isBump) {
+        BumpPatcher::patchImage(data);
+    }
+
+    return StreamingResult::Patched;
+}
+
 bool MultiBootPatcher::patchBootImage(PatcherConfig * const pc,
                                       const FileInfo * const info,
                                       std::vector<unsigned char> *data,
                                       ErrorCode *errorOut)
 {
+    // Try the streaming path first. It keeps only the input, the output, and
+    // the ramdisk in memory instead of several copies of every component.
+    switch (patchBootImageStreaming(pc, info, data, errorOut)) {
+    case StreamingResult::Patched:
+        return true;
+    case StreamingResult::Failed:
+        return false;
+    case StreamingResult::Unsupported:
+        LOGD("Falling back to BootImage for patching boot image");
+        break;
+    }
+
     BootImage bi;
     if (!bi.load(*data)) {
         if (errorOut) {
@@ -85,6 +85,9 @@ public:
 
     std::unordered_set<std::string> added_files;
 
+    // Number of compression threads (0 to use PatcherConfig's value)
+    unsigned int threads = 0;
+
     // Callbacks
     ProgressUpdatedCallback progressCb;
     DetailsUpdatedCallback detailsCb;
@@ -150,6 +153,16 @@ void OdinPatcher::cancelPatching()
     m_impl->cancelled = true;
 }
 
+/*!
+ * \brief Set number of threads for compressing the system images
+ *
+ * \param threads Number of threads (0 to use PatcherConfig::threads())
+ */
+void OdinPatcher::setThreads(unsigned int threads)
+{
+    m_impl->threads = threads;
+}
+
 bool OdinPatcher::patchFile(ProgressUpdatedCallback progressCb,
                             FilesUpdatedCallback filesCb,
                             DetailsUpdatedCallback detailsCb,
@@ -305,7 +318,9 @@ bool OdinPatcher::Impl::patchTar()
 
         updateDetails(spec.target);
 
-        result = MinizipUtils::addFile(zf, spec.target, spec.source);
+        result = MinizipUtils::addFile(
+                zf, spec.target, spec.source,
+                pc->compressionLevelForFile(spec.target));
         if (result != ErrorCode::NoError) {
             error = result;
             return false;
@@ -320,7 +335,8 @@ bool OdinPatcher::Impl::patchTar()
             MultiBootPatcher::createInfoProp(pc, info->romId());
     result = MinizipUtils::addFile(
             zf, "multiboot/info.prop",
-            std::vector<unsigned char>(infoProp.begin(), infoProp.end()));
+            std::vector<unsigned char>(infoProp.begin(), infoProp.end()),
+            pc->compressionLevelForFile("multiboot/info.prop"));
     if (result != ErrorCode::NoError) {
         error = result;
         return false;
@@ -338,7 +354,8 @@ bool OdinPatcher::Impl::patchTar()
 
     result = MinizipUtils::addFile(
             zf, "multiboot/device.json",
-            std::vector<unsigned char>(json, json + strlen(json)));
+            std::vector<unsigned char>(json, json + strlen(json)),
+            pc->compressionLevelForFile("multiboot/device.json"));
     free(json);
 
     if (result != ErrorCode::NoError) {
@@ -380,7 +397,8 @@ bool OdinPatcher::Impl::processBootImage(archive *a, archive_entry *entry)
     zipFile zf = MinizipUtils::ctxGetZipFile(zOutput);
     const char *name = archive_entry_pathname(entry);
 
-    auto errorRet = MinizipUtils::addFile(zf, name, data);
+    auto errorRet = MinizipUtils::addFile(zf, name, data,
+                                          pc->compressionLevelForFile(name));
     if (errorRet != ErrorCode::NoError) {
         error = errorRet;
         return false;
@@ -399,47 +417,37 @@ bool OdinPatcher::Impl::processSparseFile(archive *a, archive_entry *entry)
     zipName += ".sparse";
 
     // Ha! I'll be impressed if a Samsung firmware image does NOT need zip64
-    int zip64 = archive_entry_size(entry) > ((1ll << 32) - 1);
-
-    zip_fileinfo zi;
-    memset(&zi, 0, sizeof(zi));
+    bool zip64 = archive_entry_size(entry) > ((1ll << 32) - 1);
 
     zipFile zf = MinizipUtils::ctxGetZipFile(zOutput);
 
-    // Open file in output zip
-    int mzRet = zipOpenNewFileInZip2_64(
-        zf,                    // file
-        zipName.c_str(),       // filename
-        &zi,                   // zip_fileinfo
-        nullptr,               // extrafield_local
-        0,                     // size_extrafield_local
-        nullptr,               // extrafield_global
-        0,                     // size_extrafield_global
-        nullptr,               // comment
-        Z_DEFLATED,            // method
-        Z_DEFAULT_COMPRESSION, // level
-        0,                     // raw
-        zip64                  // zip64
-    );
-    if (mzRet != ZIP_OK) {
+    // Compressing multi-gigabyte images dominates the patching time, so
+    // spread the work over multiple threads
+    MinizipUtils::ParallelDeflateCtx *ctx;
+    auto ret = MinizipUtils::openParallelDeflate(
+            zf, zipName, zip64, pc->compressionLevelForFile(zipName),
+            threads != 0 ? threads : pc->threads(), &ctx);
+    if (ret != ErrorCode::NoError) {
         LOGE("minizip: Failed to open new file in output zip: %s",
-             MinizipUtils::zipErrorString(mzRet).c_str());
-        error = ErrorCode::ArchiveWriteHeaderError;
+             zipName.c_str());
+        error = ret;
         return false;
     }
 
     la_ssize_t nRead;
-    char buf[10240];
-    while ((nRead = archive_read_data(a, buf, sizeof(buf))) > 0) {
-        if (cancelled) return false;
+    std::vector<unsigned char> buf(256 * 1024);
+    while ((nRead = archive_read_data(a, buf.data(), buf.size())) > 0) {
+        if (cancelled) {
+            MinizipUtils::closeParallelDeflate(ctx);
+            return false;
+        }
 
-        mzRet = zipWriteInFileInZip(zf, buf, nRead);
-        if (mzRet != ZIP_OK) {
-            LOGE("minizip: Failed to write %s in output zip: %s",
-                 zipName.c_str(),
-                 MinizipUtils::zipErrorString(mzRet).c_str());
-            error = ErrorCode::ArchiveWriteDataError;
-            zipCloseFileInZip(zf);
+        ret = MinizipUtils::writeParallelDeflate(ctx, buf.data(), nRead);
+        if (ret != ErrorCode::NoError) {
+            LOGE("minizip: Failed to write %s in output zip",
+                 zipName.c_str());
+            error = ret;
+            MinizipUtils::closeParallelDeflate(ctx);
             return false;
         }
     }
@@ -448,16 +456,16 @@ bool OdinPatcher::Impl::processSparseFile(archive *a, archive_entry *entry)
         LOGE("libarchive: Failed to read %s: %s",
              name, archive_error_string(a));
         error = ErrorCode::ArchiveReadDataError;
-        zipCloseFileInZip(zf);
+        MinizipUtils::closeParallelDeflate(ctx);
         return false;
     }
 
     // Close file in output zip
-    mzRet = zipCloseFileInZip(zf);
-    if (mzRet != ZIP_OK) {
+    ret = MinizipUtils::closeParallelDeflate(ctx);
+    if (ret != ErrorCode::NoError) {
         LOGE("minizip: Failed to close file in output zip: %s",
-             MinizipUtils::zipErrorString(mzRet).c_str());
-        error = ErrorCode::ArchiveWriteDataError;
+             zipName.c_str());
+        error = ret;
         return false;
     }
 
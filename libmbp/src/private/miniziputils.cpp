@@ -20,6 +20,11 @@
 #include "mbp/private/miniziputils.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #include <cassert>
 #include <cerrno>
@@ -56,6 +61,14 @@
 
 #include "mbp/private/fileutils.h"
 
+// Size of the uncompressed blocks that are compressed independently by
+// the parallel deflate writer. This is the same as pigz's default.
+#define PARALLEL_DEFLATE_BLOCK_SIZE     (128 * 1024)
+// Size of the preset dictionary for each block (the deflate window size)
+#define PARALLEL_DEFLATE_DICT_SIZE      32768
+// Maximum number of blocks in flight per thread
+#define PARALLEL_DEFLATE_BLOCKS_PER_THREAD  2
+
 
 typedef std::unique_ptr<MbFile, decltype(mb_file_free) *> ScopedMbFile;
 
@@ -82,6 +95,33 @@ static std::string zlibErrorString(int ret)
     }
 }
 
+/*!
+ * \brief Get zip compression method and zlib level for a compression level
+ */
+static void compressionParams(CompressionLevel level, int *method,
+                              int *zlibLevel)
+{
+    switch (level) {
+    case CompressionLevel::Store:
+        *method = 0;
+        *zlibLevel = Z_NO_COMPRESSION;
+        break;
+    case CompressionLevel::Fast:
+        *method = Z_DEFLATED;
+        *zlibLevel = Z_BEST_SPEED;
+        break;
+    case CompressionLevel::Max:
+        *method = Z_DEFLATED;
+        *zlibLevel = Z_BEST_COMPRESSION;
+        break;
+    case CompressionLevel::Default:
+    default:
+        *method = Z_DEFLATED;
+        *zlibLevel = Z_DEFAULT_COMPRESSION;
+        break;
+    }
+}
+
 std::string MinizipUtils::unzErrorString(int ret)
 {
     switch (ret) {
@@ -650,11 +690,16 @@ static bool getFileTime(const std::string &filename,
 
 ErrorCode MinizipUtils::addFile(zipFile zf,
                                 const std::string &name,
-                                const std::vector<unsigned char> &contents)
+                                const std::vector<unsigned char> &contents,
+                                CompressionLevel level)
 {
     // Obviously never true, but we'll keep it here just in case
     bool zip64 = (uint64_t) contents.size() >= ((1ull << 32) - 1);
 
+    int method;
+    int zlibLevel;
+    compressionParams(level, &method, &zlibLevel);
+
     zip_fileinfo zi;
     memset(&zi, 0, sizeof(zi));
 
@@ -667,8 +712,8 @@ ErrorCode MinizipUtils::addFile(zipFile zf,
         nullptr,                // extrafield_global
         0,                      // size_extrafield_global
         nullptr,                // comment
-        Z_DEFLATED,             // method
-        Z_DEFAULT_COMPRESSION,  // level
+        method,                 // method
+        zlibLevel,              // level
         0,                      // raw
         zip64                   // zip64
     );
@@ -703,7 +748,8 @@ ErrorCode MinizipUtils::addFile(zipFile zf,
 
 ErrorCode MinizipUtils::addFile(zipFile zf,
                                 const std::string &name,
-                                const std::string &path)
+                                const std::string &path,
+                                CompressionLevel level)
 {
     // Copy file into archive
     ScopedMbFile file{mb_file_new(), &mb_file_free};
@@ -727,6 +773,10 @@ ErrorCode MinizipUtils::addFile(zipFile zf,
 
     bool zip64 = size >= ((1ull << 32) - 1);
 
+    int method;
+    int zlibLevel;
+    compressionParams(level, &method, &zlibLevel);
+
     zip_fileinfo zi;
     memset(&zi, 0, sizeof(zi));
 
@@ -744,8 +794,8 @@ ErrorCode MinizipUtils::addFile(zipFile zf,
         nullptr,                // extrafield_global
         0,                      // size_extrafield_global
         nullptr,                // comment
-        Z_DEFLATED,             // method
-        Z_DEFAULT_COMPRESSION,  // level
+        method,                 // method
+        zlibLevel,              // level
         0,                      // raw
         zip64                   // zip64
     );
@@ -791,4 +841,560 @@ ErrorCode MinizipUtils::addFile(zipFile zf,
     return ErrorCode::NoError;
 }
 
+/*!
+ * \brief Compress data the same way that addFile() does
+ *
+ * This allows the (CPU-bound) compression to happen on a different thread than
+ * the one writing to the zip file. Passing the result to addDeflatedFile()
+ * produces output that is byte-for-byte identical to calling addFile() with
+ * \p contents and \p level.
+ */
+ErrorCode MinizipUtils::deflateData(const std::vector<unsigned char> &contents,
+                                    CompressionLevel level,
+                                    DeflatedData *output)
+{
+    // Keep in sync with the parameters minizip uses in zipOpenNewFileInZip*()
+    static const int memLevel = 8;
+    static const size_t chunkSize = 1024 * 1024;
+
+    int method;
+    int zlibLevel;
+    compressionParams(level, &method, &zlibLevel);
+
+    output->level = level;
+
+    if (method == 0) {
+        output->data = contents;
+        output->uncompressedSize = contents.size();
+        output->crc = crc32(0L, Z_NULL, 0);
+        for (size_t offset = 0; offset < contents.size(); offset += chunkSize) {
+            output->crc = crc32(output->crc, contents.data() + offset,
+                                static_cast<uInt>(std::min(
+                                        chunkSize, contents.size() - offset)));
+        }
+        return ErrorCode::NoError;
+    }
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    int ret = deflateInit2(&strm, zlibLevel, Z_DEFLATED,
+                           -MAX_WBITS, memLevel, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to initialize deflate: %s",
+             zlibErrorString(ret).c_str());
+        return ret == Z_MEM_ERROR
+                ? ErrorCode::MemoryAllocationError
+                : ErrorCode::ArchiveWriteDataError;
+    }
+
+    output->data.clear();
+    output->uncompressedSize = contents.size();
+    output->crc = crc32(0L, Z_NULL, 0);
+
+    size_t inOffset = 0;
+    size_t outOffset = 0;
+
+    // Like minizip, feed all of the input with Z_NO_FLUSH and only finish the
+    // stream once there is no input left
+    do {
+        if (strm.avail_in == 0 && inOffset < contents.size()) {
+            size_t n = std::min(chunkSize, contents.size() - inOffset);
+            strm.next_in = const_cast<unsigned char *>(
+                    contents.data() + inOffset);
+            strm.avail_in = static_cast<uInt>(n);
+            output->crc = crc32(output->crc, strm.next_in, strm.avail_in);
+            inOffset += n;
+        }
+
+        if (output->data.size() - outOffset < chunkSize) {
+            output->data.resize(outOffset + chunkSize);
+        }
+        strm.next_out = output->data.data() + outOffset;
+        strm.avail_out = static_cast<uInt>(output->data.size() - outOffset);
+
+        int flush = (strm.avail_in == 0 && inOffset == contents.size())
+                ? Z_FINISH : Z_NO_FLUSH;
+        ret = deflate(&strm, flush);
+        outOffset = output->data.size() - strm.avail_out;
+    } while (ret == Z_OK || (ret == Z_BUF_ERROR && strm.avail_out == 0));
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        LOGE("zlib: Failed to deflate data: %s", zlibErrorString(ret).c_str());
+        output->data.clear();
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    output->data.resize(outOffset);
+    output->data.shrink_to_fit();
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Add file that was compressed with deflateData()
+ */
+ErrorCode MinizipUtils::addDeflatedFile(zipFile zf,
+                                        const std::string &name,
+                                        const DeflatedData &deflated)
+{
+    bool zip64 = deflated.uncompressedSize >= ((1ull << 32) - 1);
+
+    int method;
+    int zlibLevel;
+    compressionParams(deflated.level, &method, &zlibLevel);
+
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+
+    int ret = zipOpenNewFileInZip2_64(
+        zf,                     // file
+        name.c_str(),           // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        method,                 // method
+        zlibLevel,              // level
+        1,                      // raw
+        zip64                   // zip64
+    );
+
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to open inner file: %s",
+             zipErrorString(ret).c_str());
+
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    // Write compressed data to file
+    ret = zipWriteInFileInZip(zf, deflated.data.data(), deflated.data.size());
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to write inner file data: %s",
+             zipErrorString(ret).c_str());
+        zipCloseFileInZipRaw64(zf, deflated.uncompressedSize, deflated.crc);
+
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    ret = zipCloseFileInZipRaw64(zf, deflated.uncompressedSize, deflated.crc);
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to close inner file: %s",
+             zipErrorString(ret).c_str());
+
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*! \cond INTERNAL */
+struct ParallelDeflateBlock
+{
+    std::vector<unsigned char> input;
+    std::vector<unsigned char> dict;
+    std::vector<unsigned char> output;
+    uint64_t size;
+    uint32_t crc;
+    bool last;
+    bool done = false;
+    bool failed = false;
+};
+
+struct MinizipUtils::ParallelDeflateCtx
+{
+    zipFile zf;
+    // Whether the data is stored without compression (no worker threads)
+    bool store;
+    int level;
+    unsigned int threads;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    // Blocks waiting for a worker thread
+    std::deque<ParallelDeflateBlock *> pending;
+    // All blocks in flight in stream order, waiting to be written
+    std::deque<std::unique_ptr<ParallelDeflateBlock>> ordered;
+    bool stop = false;
+    std::vector<std::thread> workers;
+
+    // Block currently being filled by the caller
+    std::vector<unsigned char> buf;
+    // Last PARALLEL_DEFLATE_DICT_SIZE bytes of input before the current block
+    std::vector<unsigned char> dict;
+
+    uint64_t uncompressedSize = 0;
+    uint32_t crc = 0;
+    ErrorCode error = ErrorCode::NoError;
+};
+/*! \endcond */
+
+static bool deflateBlock(z_stream *strm, ParallelDeflateBlock *block)
+{
+    int ret = deflateReset(strm);
+    if (ret != Z_OK) {
+        LOGE("zlib: Failed to reset deflate: %s",
+             zlibErrorString(ret).c_str());
+        return false;
+    }
+
+    // Prime the window with the end of the previous block so that the
+    // compression ratio is nearly the same as for a single stream
+    if (!block->dict.empty()) {
+        ret = deflateSetDictionary(strm, block->dict.data(),
+                                   static_cast<uInt>(block->dict.size()));
+        if (ret != Z_OK) {
+            LOGE("zlib: Failed to set dictionary: %s",
+                 zlibErrorString(ret).c_str());
+            return false;
+        }
+    }
+
+    strm->next_in = block->input.data();
+    strm->avail_in = static_cast<uInt>(block->input.size());
+
+    // All blocks except the last end with a sync flush. It aligns the output
+    // to a byte boundary without setting the final block bit, so the blocks
+    // can simply be concatenated.
+    int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    size_t outOffset = 0;
+
+    block->output.resize(deflateBound(strm, block->input.size()) + 16);
+
+    while (true) {
+        if (block->output.size() == outOffset) {
+            block->output.resize(outOffset * 2);
+        }
+        strm->next_out = block->output.data() + outOffset;
+        strm->avail_out = static_cast<uInt>(block->output.size() - outOffset);
+
+        ret = deflate(strm, flush);
+        outOffset = block->output.size() - strm->avail_out;
+
+        if (ret == Z_STREAM_ERROR) {
+            LOGE("zlib: Failed to deflate data: %s",
+                 zlibErrorString(ret).c_str());
+            return false;
+        } else if (block->last ? ret == Z_STREAM_END
+                : strm->avail_in == 0 && strm->avail_out != 0) {
+            break;
+        }
+    }
+
+    block->output.resize(outOffset);
+    block->size = block->input.size();
+    block->crc = crc32(crc32(0L, Z_NULL, 0), block->input.data(),
+                       static_cast<uInt>(block->input.size()));
+
+    // Release the input now instead of when the block is written
+    block->input.clear();
+    block->input.shrink_to_fit();
+    block->dict.clear();
+    block->dict.shrink_to_fit();
+
+    return true;
+}
+
+static void parallelDeflateWorker(MinizipUtils::ParallelDeflateCtx *ctx)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    // Same parameters that minizip uses
+    int ret = deflateInit2(&strm, ctx->level, Z_DEFLATED, -MAX_WBITS, 8,
+                           Z_DEFAULT_STRATEGY);
+    bool initialized = ret == Z_OK;
+    if (!initialized) {
+        LOGE("zlib: Failed to initialize deflate: %s",
+             zlibErrorString(ret).c_str());
+    }
+
+    std::unique_lock<std::mutex> lock(ctx->mutex);
+
+    while (true) {
+        ctx->cv.wait(lock, [&]{
+            return ctx->stop || !ctx->pending.empty();
+        });
+
+        if (ctx->pending.empty()) {
+            break;
+        }
+
+        // The block is owned by the ordered queue and is not touched by any
+        // other thread until it is marked as done
+        ParallelDeflateBlock *block = ctx->pending.front();
+        ctx->pending.pop_front();
+
+        lock.unlock();
+        bool success = initialized && deflateBlock(&strm, block);
+        lock.lock();
+
+        block->failed = !success;
+        block->done = true;
+        ctx->cv.notify_all();
+    }
+
+    lock.unlock();
+
+    if (initialized) {
+        deflateEnd(&strm);
+    }
+}
+
+/*!
+ * \brief Write the oldest block in flight to the zip file
+ */
+static ErrorCode parallelDeflateWriteFront(MinizipUtils::ParallelDeflateCtx *ctx)
+{
+    std::unique_ptr<ParallelDeflateBlock> block;
+
+    {
+        std::unique_lock<std::mutex> lock(ctx->mutex);
+        ctx->cv.wait(lock, [&]{
+            return ctx->ordered.front()->done;
+        });
+        block = std::move(ctx->ordered.front());
+        ctx->ordered.pop_front();
+    }
+
+    if (block->failed) {
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    int ret = zipWriteInFileInZip(ctx->zf, block->output.data(),
+                                  block->output.size());
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to write inner file data: %s",
+             MinizipUtils::zipErrorString(ret).c_str());
+        return ErrorCode::ArchiveWriteDataError;
+    }
+
+    ctx->crc = crc32_combine(ctx->crc, block->crc, block->size);
+    ctx->uncompressedSize += block->size;
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Queue the current block for compression
+ */
+static ErrorCode parallelDeflateSubmit(MinizipUtils::ParallelDeflateCtx *ctx,
+                                       bool last)
+{
+    // Bound memory usage by writing out finished blocks first
+    while (ctx->ordered.size()
+            >= ctx->threads * PARALLEL_DEFLATE_BLOCKS_PER_THREAD) {
+        ErrorCode ret = parallelDeflateWriteFront(ctx);
+        if (ret != ErrorCode::NoError) {
+            return ret;
+        }
+    }
+
+    std::unique_ptr<ParallelDeflateBlock> block(new ParallelDeflateBlock());
+    block->input.swap(ctx->buf);
+    block->dict = ctx->dict;
+    block->last = last;
+
+    // The dictionary for the next block is the end of the input so far
+    if (block->input.size() >= PARALLEL_DEFLATE_DICT_SIZE) {
+        ctx->dict.assign(block->input.end() - PARALLEL_DEFLATE_DICT_SIZE,
+                         block->input.end());
+    } else {
+        ctx->dict.insert(ctx->dict.end(), block->input.begin(),
+                         block->input.end());
+        if (ctx->dict.size() > PARALLEL_DEFLATE_DICT_SIZE) {
+            ctx->dict.erase(ctx->dict.begin(), ctx->dict.end()
+                    - PARALLEL_DEFLATE_DICT_SIZE);
+        }
+    }
+
+    ctx->buf.reserve(PARALLEL_DEFLATE_BLOCK_SIZE);
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->mutex);
+        ctx->pending.push_back(block.get());
+        ctx->ordered.push_back(std::move(block));
+    }
+    ctx->cv.notify_all();
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Open a new file in a zip for writing with multithreaded compression
+ *
+ * Like pigz, the input is split into blocks that are compressed independently
+ * on a pool of worker threads. Each block is primed with the last 32 KiB of the
+ * previous block as a preset dictionary and all blocks except the last end on
+ * a byte boundary, so the compressed blocks are concatenated into a single
+ * valid deflate stream. The CRC32 of the blocks are combined with
+ * crc32_combine().
+ *
+ * The output is a valid deflate stream, but is not byte-for-byte identical to
+ * what addFile() would produce.
+ *
+ * If \p level is CompressionLevel::Store, the data is written to the zip
+ * directly without using any threads.
+ *
+ * \param zf Output zip
+ * \param name Filename in the zip
+ * \param zip64 Whether the file needs zip64 extensions
+ * \param level Compression level
+ * \param threads Number of compression threads
+ * \param ctxOut Pointer to store the context. Must be passed to
+ *               closeParallelDeflate() to finish writing the file, even if an
+ *               error occurs.
+ *
+ * \return ErrorCode::NoError if the file was opened
+ */
+ErrorCode MinizipUtils::openParallelDeflate(zipFile zf,
+                                            const std::string &name,
+                                            bool zip64,
+                                            CompressionLevel level,
+                                            unsigned int threads,
+                                            ParallelDeflateCtx **ctxOut)
+{
+    int method;
+    int zlibLevel;
+    compressionParams(level, &method, &zlibLevel);
+
+    bool store = method == 0;
+
+    zip_fileinfo zi;
+    memset(&zi, 0, sizeof(zi));
+
+    int ret = zipOpenNewFileInZip2_64(
+        zf,                     // file
+        name.c_str(),           // filename
+        &zi,                    // zip_fileinfo
+        nullptr,                // extrafield_local
+        0,                      // size_extrafield_local
+        nullptr,                // extrafield_global
+        0,                      // size_extrafield_global
+        nullptr,                // comment
+        method,                 // method
+        zlibLevel,              // level
+        !store,                 // raw
+        zip64                   // zip64
+    );
+
+    if (ret != ZIP_OK) {
+        LOGE("minizip: Failed to open inner file: %s",
+             zipErrorString(ret).c_str());
+
+        return ErrorCode::ArchiveWriteHeaderError;
+    }
+
+    ParallelDeflateCtx *ctx = new ParallelDeflateCtx();
+    ctx->zf = zf;
+    ctx->store = store;
+    ctx->level = zlibLevel;
+    ctx->threads = store ? 0 : std::max(1u, threads);
+    ctx->crc = crc32(0L, Z_NULL, 0);
+    if (!store) {
+        ctx->buf.reserve(PARALLEL_DEFLATE_BLOCK_SIZE);
+    }
+
+    for (unsigned int i = 0; i < ctx->threads; ++i) {
+        ctx->workers.emplace_back(&parallelDeflateWorker, ctx);
+    }
+
+    *ctxOut = ctx;
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Write data to a file opened with openParallelDeflate()
+ */
+ErrorCode MinizipUtils::writeParallelDeflate(ParallelDeflateCtx *ctx,
+                                             const void *buf, size_t size)
+{
+    if (ctx->error != ErrorCode::NoError) {
+        return ctx->error;
+    }
+
+    auto ptr = static_cast<const unsigned char *>(buf);
+
+    if (ctx->store) {
+        // minizip computes the CRC and size when not in raw mode
+        while (size > 0) {
+            unsigned int n = static_cast<unsigned int>(
+                    std::min<size_t>(size, PARALLEL_DEFLATE_BLOCK_SIZE));
+            int ret = zipWriteInFileInZip(ctx->zf, ptr, n);
+            if (ret != ZIP_OK) {
+                LOGE("minizip: Failed to write inner file data: %s",
+                     zipErrorString(ret).c_str());
+                ctx->error = ErrorCode::ArchiveWriteDataError;
+                return ctx->error;
+            }
+            ptr += n;
+            size -= n;
+        }
+        return ErrorCode::NoError;
+    }
+
+    while (size > 0) {
+        size_t n = std::min<size_t>(
+                size, PARALLEL_DEFLATE_BLOCK_SIZE - ctx->buf.size());
+        ctx->buf.insert(ctx->buf.end(), ptr, ptr + n);
+        ptr += n;
+        size -= n;
+
+        if (ctx->buf.size() == PARALLEL_DEFLATE_BLOCK_SIZE) {
+            ctx->error = parallelDeflateSubmit(ctx, false);
+            if (ctx->error != ErrorCode::NoError) {
+                return ctx->error;
+            }
+        }
+    }
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Finish writing a file opened with openParallelDeflate()
+ *
+ * This writes the remaining data, stops the worker threads, closes the file in
+ * the zip, and frees \p ctx.
+ */
+ErrorCode MinizipUtils::closeParallelDeflate(ParallelDeflateCtx *ctx)
+{
+    ErrorCode error = ctx->error;
+
+    if (error == ErrorCode::NoError && !ctx->store) {
+        error = parallelDeflateSubmit(ctx, true);
+    }
+    while (error == ErrorCode::NoError && !ctx->ordered.empty()) {
+        error = parallelDeflateWriteFront(ctx);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ctx->mutex);
+        ctx->pending.clear();
+        ctx->stop = true;
+    }
+    ctx->cv.notify_all();
+
+    for (std::thread &thread : ctx->workers) {
+        thread.join();
+    }
+
+    int ret = ctx->store
+            ? zipCloseFileInZip(ctx->zf)
+            : zipCloseFileInZipRaw64(ctx->zf, ctx->uncompressedSize, ctx->crc);
+    if (ret != ZIP_OK && error == ErrorCode::NoError) {
+        LOGE("minizip: Failed to close inner file: %s",
+             zipErrorString(ret).c_str());
+        error = ErrorCode::ArchiveWriteDataError;
+    }
+
+    delete ctx;
+
+    return error;
+}
+
 }
@@ -40,12 +40,35 @@ typedef bool (*SparseReadCb)(void *buf, uint64_t size, uint64_t *bytesRead,
                              void *userData);
 typedef bool (*SparseSeekCb)(int64_t offset, int whence, void *userData);
 typedef bool (*SparseSkipCb)(uint64_t offset, void *userData);
+typedef bool (*SparseReadAtCb)(void *buf, uint64_t size, uint64_t offset,
+                               void *userData);
+typedef bool (*SparseWriteAtCb)(const void *buf, uint64_t size,
+                                uint64_t offset, void *userData);
+typedef bool (*SparseCopyCb)(uint64_t srcOffset, uint64_t dstOffset,
+                             uint64_t size, void *userData);
+typedef bool (*SparseWriteCb)(const void *buf, uint64_t size, void *userData);
 
 struct SparseCtx;
+struct SparseWriterCtx;
+
+/*! \brief Output range covered by a chunk */
+struct SparseChunk
+{
+    /*! \brief Chunk type (CHUNK_TYPE_RAW, CHUNK_TYPE_FILL, etc.) */
+    uint16_t type;
+    /*! \brief Start of byte range in output file */
+    uint64_t begin;
+    /*! \brief End of byte range in output file */
+    uint64_t end;
+    /*! \brief [CHUNK_TYPE_FILL only] Fill value */
+    uint32_t fillVal;
+};
 
 MB_EXPORT struct SparseCtx * sparseCtxNew();
 MB_EXPORT bool sparseCtxFree(struct SparseCtx *ctx);
 
+MB_EXPORT bool sparseSetVerifyCrc32(struct SparseCtx *ctx, bool verify);
+
 MB_EXPORT bool sparseOpen(struct SparseCtx *ctx, SparseOpenCb openCb,
                           SparseCloseCb closeCb, SparseReadCb readCb,
                           SparseSeekCb seekCb, SparseSkipCb skipCb,
@@ -57,6 +80,45 @@ MB_EXPORT bool sparseSeek(struct SparseCtx *ctx, int64_t offset, int whence);
 MB_EXPORT bool sparseTell(struct SparseCtx *ctx, uint64_t *offset);
 MB_EXPORT bool sparseSize(struct SparseCtx *ctx, uint64_t *size);
 
+MB_EXPORT bool sparseGetChunk(struct SparseCtx *ctx, struct SparseChunk *chunk);
+MB_EXPORT bool sparseSkipChunk(struct SparseCtx *ctx);
+
+MB_EXPORT bool sparseExtractParallel(struct SparseCtx *ctx,
+                                     SparseReadAtCb readAtCb,
+                                     SparseWriteAtCb writeAtCb,
+                                     SparseCopyCb copyCb,
+                                     void *userData, unsigned int jobs);
+
+MB_EXPORT bool sparseBuildIndex(struct SparseCtx *ctx);
+MB_EXPORT bool sparseSaveIndex(struct SparseCtx *ctx, FILE *fp);
+MB_EXPORT bool sparseLoadIndex(struct SparseCtx *ctx, FILE *fp);
+
+MB_EXPORT struct SparseWriterCtx * sparseWriterCtxNew();
+MB_EXPORT bool sparseWriterCtxFree(struct SparseWriterCtx *ctx);
+
+MB_EXPORT bool sparseWriterSetCrc32(struct SparseWriterCtx *ctx, bool enable);
+MB_EXPORT bool sparseWriterSetSkipZeros(struct SparseWriterCtx *ctx,
+                                        bool enable);
+MB_EXPORT bool sparseWriterSetChunkCount(struct SparseWriterCtx *ctx,
+                                         uint32_t count);
+MB_EXPORT bool sparseWriterGetChunkCount(struct SparseWriterCtx *ctx,
+                                         uint32_t *count);
+
+MB_EXPORT bool sparseWriterOpen(struct SparseWriterCtx *ctx,
+                                uint32_t blockSize, uint64_t size,
+                                SparseOpenCb openCb, SparseCloseCb closeCb,
+                                SparseWriteCb writeCb, SparseSeekCb seekCb,
+                                void *userData);
+MB_EXPORT bool sparseWriterClose(struct SparseWriterCtx *ctx);
+MB_EXPORT bool sparseWriterWrite(struct SparseWriterCtx *ctx,
+                                 const void *buf, uint64_t size);
+MB_EXPORT bool sparseWriterAddRaw(struct SparseWriterCtx *ctx,
+                                  const void *buf, uint64_t size);
+MB_EXPORT bool sparseWriterAddFill(struct SparseWriterCtx *ctx,
+                                   uint32_t fillVal, uint64_t size);
+MB_EXPORT bool sparseWriterAddDontCare(struct SparseWriterCtx *ctx,
+                                       uint64_t size);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
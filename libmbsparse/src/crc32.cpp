@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbsparse/crc32_p.h"
+
+#include <cstring>
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+// Standard 802.3 (zlib-compatible) CRC32, as used by the sparse file format.
+//
+// If the compiler targets ARMv8 with the CRC extension, the CRC32 instructions
+// are used. Otherwise, the slicing-by-8 algorithm is used, which processes
+// 8 bytes per iteration with eight lookup tables.
+
+#define CRC32_POLY              0xedb88320
+
+#if !defined(__ARM_FEATURE_CRC32)
+struct Crc32Tables
+{
+    uint32_t table[8][256];
+
+    Crc32Tables()
+    {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ (-(crc & 1) & CRC32_POLY);
+            }
+            table[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int j = 1; j < 8; ++j) {
+                table[j][i] = (table[j - 1][i] >> 8)
+                        ^ table[0][table[j - 1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static const Crc32Tables & getTables()
+{
+    static Crc32Tables tables;
+    return tables;
+}
+#endif
+
+/*!
+ * \brief Update CRC32 checksum with more data
+ *
+ * \param crc Previous CRC32 value (0 for the initial value)
+ * \param buf Input data
+ * \param size Size of input data
+ *
+ * \return New CRC32 value
+ */
+uint32_t sparseCrc32(uint32_t crc, const void *buf, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(buf);
+
+#if defined(__ARM_FEATURE_CRC32)
+    crc = ~crc;
+
+    while (size >= sizeof(uint64_t)) {
+        uint64_t data;
+        memcpy(&data, p, sizeof(data));
+        crc = __crc32d(crc, data);
+        p += sizeof(data);
+        size -= sizeof(data);
+    }
+    while (size > 0) {
+        crc = __crc32b(crc, *p);
+        ++p;
+        --size;
+    }
+
+    return ~crc;
+#else
+    const auto &t = getTables().table;
+
+    crc = ~crc;
+
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (size >= 2 * sizeof(uint32_t)) {
+        uint32_t one;
+        uint32_t two;
+        memcpy(&one, p, sizeof(one));
+        memcpy(&two, p + sizeof(one), sizeof(two));
+        one ^= crc;
+
+        crc = t[7][one & 0xff]
+                ^ t[6][(one >> 8) & 0xff]
+                ^ t[5][(one >> 16) & 0xff]
+                ^ t[4][one >> 24]
+                ^ t[3][two & 0xff]
+                ^ t[2][(two >> 8) & 0xff]
+                ^ t[1][(two >> 16) & 0xff]
+                ^ t[0][two >> 24];
+
+        p += 2 * sizeof(uint32_t);
+        size -= 2 * sizeof(uint32_t);
+    }
+#endif
+
+    while (size > 0) {
+        crc = t[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+        ++p;
+        --size;
+    }
+
+    return ~crc;
+#endif
+}
+
+// Polynomial arithmetic modulo the CRC32 polynomial, used to advance a CRC32
+// past a run of zeros without processing every byte. This is the same approach
+// as zlib's crc32_combine(). Polynomials are bit-reflected, so x^0 is the
+// highest bit.
+
+/*!
+ * \brief Multiply two polynomials modulo the CRC32 polynomial
+ */
+static uint32_t multModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = UINT32_C(1) << 31;
+    uint32_t p = 0;
+
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+/*!
+ * \brief Compute x^(8 * \p size) modulo the CRC32 polynomial
+ */
+static uint32_t xPow8NModP(uint64_t size)
+{
+    // x^(2^3)
+    uint32_t square = UINT32_C(1) << (31 - 8);
+    uint32_t p = UINT32_C(1) << 31;
+
+    while (size) {
+        if (size & 1) {
+            p = multModP(square, p);
+        }
+        size >>= 1;
+        square = multModP(square, square);
+    }
+
+    return p;
+}
+
+/*!
+ * \brief Update CRC32 checksum with a run of zeros
+ *
+ * This is equivalent to calling sparseCrc32() with a buffer of \p size zeros,
+ * but takes O(log(size)) time.
+ *
+ * \param crc Previous CRC32 value (0 for the initial value)
+ * \param size Number of zero bytes
+ *
+ * \return New CRC32 value
+ */
+uint32_t sparseCrc32Zeros(uint32_t crc, uint64_t size)
+{
+    return ~multModP(xPow8NModP(size), ~crc);
+}
+
+/*!
+ * \brief Combine CRC32 checksums of two consecutive blocks of data
+ *
+ * \param crc1 CRC32 of the first block
+ * \param crc2 CRC32 of the second block (starting from 0)
+ * \param size2 Size of the second block
+ *
+ * \return CRC32 of both blocks
+ */
+uint32_t sparseCrc32Combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+    return multModP(xPow8NModP(size2), crc1) ^ crc2;
+}
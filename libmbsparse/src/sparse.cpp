@@ -28,9 +28,13 @@
 // For std::min()
 #include <algorithm>
 
+#include <atomic>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include <cassert>
+#include <cerrno>
 #include <cinttypes>
 #include <cstdint>
 #include <cstring>
@@ -38,6 +42,8 @@
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 
+#include "mbsparse/crc32_p.h"
+
 // Enable debug logging of headers, offsets, etc.?
 #define SPARSE_DEBUG 1
 // Enable debug logging of operations (warning! very verbose!)
@@ -86,6 +92,40 @@ struct ChunkInfo
 
     /*! \brief [CHUNK_TYPE_FILL only] Filler value for the chunk */
     uint32_t fillVal;
+
+    /*! \brief [CHUNK_TYPE_CRC32 only] Expected CRC32 of all preceding data */
+    uint32_t crc32;
+};
+
+#define SPARSE_INDEX_MAGIC      "MBSPIDX"
+#define SPARSE_INDEX_VERSION    2
+
+/*! \brief Header of a persisted chunk index */
+struct SparseIndexHeader
+{
+    /*! \brief SPARSE_INDEX_MAGIC (including the NULL terminator) */
+    char magic[8];
+    /*! \brief SPARSE_INDEX_VERSION */
+    uint32_t version;
+    /*! \brief Number of SparseIndexEntry records following the header */
+    uint32_t count;
+    /*! \brief Copy of the sparse header of the image the index belongs to */
+    SparseHeader shdr;
+};
+
+/*! \brief On-disk representation of a ChunkInfo */
+struct SparseIndexEntry
+{
+    uint16_t type;
+    uint16_t reserved;
+    // ChunkInfo::fillVal or ChunkInfo::crc32, depending on the type
+    uint32_t value;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t srcBegin;
+    uint64_t srcEnd;
+    uint64_t rawBegin;
+    uint64_t rawEnd;
 };
 
 struct SparseCtx
@@ -114,7 +154,11 @@ struct SparseCtx
 
     bool isOpen;
 
-    uint32_t expectedCrc32 = 0;
+    // CRC32 verification
+    bool verifyCrc32 = false;
+    // CRC32 of the output data in the range [0, crc32Offset)
+    uint32_t crc32 = 0;
+    uint64_t crc32Offset = 0;
 
     uint64_t srcOffset = 0;
     uint64_t outOffset = 0;
@@ -124,6 +168,10 @@ struct SparseCtx
 
     std::vector<ChunkInfo> chunks;
     size_t chunk = 0;
+
+    // Output begin offsets of all chunks in \a chunks. Kept separately so that
+    // binary searches only need to touch a compact array
+    std::vector<uint64_t> chunkBegins;
 };
 
 void SparseCtx::setCallbacks(SparseOpenCb openCb, SparseCloseCb closeCb,
@@ -289,6 +337,174 @@ static bool readFully(SparseCtx *ctx, void *buf, std::size_t size)
     return true;
 }
 
+/*!
+ * \brief Fill buffer with a repeating 32-bit pattern
+ *
+ * The pattern is written once and then repeatedly doubled with memcpy(), which
+ * is vectorized by any reasonable libc, instead of storing 4 bytes at a time.
+ *
+ * \param buf Output buffer
+ * \param size Size of output buffer
+ * \param fillVal Fill value
+ * \param offset Offset of \a buf relative to the beginning of the fill data
+ *               (used to start in the middle of the pattern)
+ */
+static void fillPattern(void *buf, uint64_t size, uint32_t fillVal,
+                        uint64_t offset)
+{
+    auto shift = offset % sizeof(uint32_t);
+    unsigned char pattern[sizeof(uint32_t)];
+    for (size_t i = 0; i < sizeof(uint32_t); ++i) {
+        pattern[i] = ((unsigned char *) &fillVal)[(i + shift) % sizeof(uint32_t)];
+    }
+
+    auto *out = static_cast<unsigned char *>(buf);
+    uint64_t filled = std::min<uint64_t>(sizeof(pattern), size);
+    memcpy(out, pattern, filled);
+
+    // Since the filled length is always a multiple of the pattern size (until
+    // the end), copying the filled region keeps the pattern aligned
+    while (filled < size) {
+        uint64_t n = std::min(filled, size - filled);
+        memcpy(out + filled, out, n);
+        filled += n;
+    }
+}
+
+/*!
+ * \brief Compare running CRC32 with the value stored in a CRC32 chunk
+ *
+ * \pre \a ctx->crc32Offset must be equal to \a chunk.begin
+ *
+ * \return Whether the checksums match
+ */
+static bool checkCrc32Chunk(SparseCtx *ctx, const ChunkInfo &chunk)
+{
+    assert(ctx->crc32Offset == chunk.begin);
+
+    if (ctx->crc32 != chunk.crc32) {
+        ERROR("CRC32 of data before offset %" PRIu64 " (0x%08" PRIx32 ")"
+              " does not match expected value (0x%08" PRIx32 ")",
+              chunk.begin, ctx->crc32, chunk.crc32);
+        return false;
+    }
+
+    DEBUG("CRC32 of data before offset %" PRIu64 " matches (0x%08" PRIx32 ")",
+          chunk.begin, ctx->crc32);
+    return true;
+}
+
+/*!
+ * \brief Verify CRC32 chunks immediately following the running CRC32's range
+ *
+ * \param ctx Sparse context
+ * \return False if a CRC32 chunk does not match the data. Otherwise, true.
+ */
+static bool checkFollowingCrc32Chunks(SparseCtx *ctx)
+{
+    for (size_t i = ctx->chunk + 1; i < ctx->chunks.size()
+            && ctx->chunks[i].begin == ctx->crc32Offset; ++i) {
+        if (ctx->chunks[i].type == CHUNK_TYPE_CRC32
+                && !checkCrc32Chunk(ctx, ctx->chunks[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add output data to the running CRC32
+ *
+ * Only data that continues the range already covered by the running CRC32 is
+ * considered. Data that was checksummed before (eg. after seeking backwards) is
+ * skipped and the checksum does not advance past a gap (eg. after seeking
+ * forwards) until the missing data is read. Any CRC32 chunks that were already
+ * read and immediately follow the newly covered range are verified.
+ *
+ * \param ctx Sparse context
+ * \param buf Output data starting at \a ctx->outOffset
+ * \param size Size of output data
+ * \return False if a CRC32 chunk does not match the data. Otherwise, true.
+ */
+static bool updateCrc32(SparseCtx *ctx, const void *buf, uint64_t size)
+{
+    uint64_t begin = ctx->outOffset;
+    uint64_t end = begin + size;
+
+    if (begin > ctx->crc32Offset || end <= ctx->crc32Offset) {
+        return true;
+    }
+
+    uint64_t skip = ctx->crc32Offset - begin;
+    ctx->crc32 = sparseCrc32(ctx->crc32,
+                             static_cast<const char *>(buf) + skip,
+                             size - skip);
+    ctx->crc32Offset = end;
+
+    return checkFollowingCrc32Chunks(ctx);
+}
+
+/*!
+ * \brief Add the current chunk's fill or don't care data to the running CRC32
+ *
+ * Used when a chunk is skipped without materializing its data. The skipped
+ * bytes are not hashed one by one; the checksum is advanced arithmetically.
+ *
+ * \param ctx Sparse context
+ * \param size Number of bytes, starting at \a ctx->outOffset, to add
+ * \return False if a CRC32 chunk does not match the data. Otherwise, true.
+ */
+static bool updateCrc32Skipped(SparseCtx *ctx, uint64_t size)
+{
+    const ChunkInfo &chunk = ctx->chunks[ctx->chunk];
+    uint64_t begin = ctx->outOffset;
+    uint64_t end = begin + size;
+
+    if (begin > ctx->crc32Offset || end <= ctx->crc32Offset) {
+        return true;
+    }
+
+    uint64_t offset = ctx->crc32Offset;
+
+    if (chunk.type == CHUNK_TYPE_FILL && chunk.fillVal != 0) {
+        // The block size is a multiple of the pattern size, so every block has
+        // the same contents. Checksum one block and combine it with itself to
+        // cover runs of 2^i blocks.
+        char buf[4096];
+        uint64_t n = std::min<uint64_t>(sizeof(buf), end - offset);
+        fillPattern(buf, n, chunk.fillVal, offset - chunk.begin);
+
+        uint64_t blocks = (end - offset) / n;
+        uint32_t runCrc32 = sparseCrc32(0, buf, n);
+        uint64_t runSize = n;
+
+        offset += blocks * n;
+
+        while (true) {
+            if (blocks & 1) {
+                ctx->crc32 = sparseCrc32Combine(ctx->crc32, runCrc32, runSize);
+            }
+            blocks >>= 1;
+            if (blocks == 0) {
+                break;
+            }
+            runCrc32 = sparseCrc32Combine(runCrc32, runCrc32, runSize);
+            runSize *= 2;
+        }
+
+        if (offset < end) {
+            ctx->crc32 = sparseCrc32(ctx->crc32, buf, end - offset);
+        }
+    } else {
+        ctx->crc32 = sparseCrc32Zeros(ctx->crc32, end - offset);
+    }
+
+    ctx->crc32Offset = end;
+
+    return checkFollowingCrc32Chunks(ctx);
+}
+
 /*!
  * \brief Read and verify raw chunk header
  *
@@ -434,19 +650,28 @@ static bool processCrc32Chunk(SparseCtx *ctx, ChunkHeader *chunkHeader,
         return false;
     }
 
+    uint64_t srcBegin = ctx->srcOffset - ctx->shdr.chunk_hdr_sz;
+
     if (!readFully(ctx, &expectedCrc32, sizeof(expectedCrc32))) {
         return false;
     }
 
-    ctx->expectedCrc32 = expectedCrc32;
+    uint64_t srcEnd = ctx->srcOffset;
 
     ctx->chunks.emplace_back();
     ChunkInfo &chunk = ctx->chunks.back();
     chunk.type = chunkHeader->chunk_type;
     chunk.begin = outOffset;
     chunk.end = outOffset;
-    chunk.srcBegin = ctx->srcOffset - ctx->shdr.chunk_hdr_sz;
-    chunk.srcEnd = ctx->srcOffset + dataSize;
+    chunk.srcBegin = srcBegin;
+    chunk.srcEnd = srcEnd;
+    chunk.crc32 = expectedCrc32;
+
+    // If all of the preceding data has already been read, verify it now
+    if (ctx->verifyCrc32 && ctx->crc32Offset == outOffset
+            && !checkCrc32Chunk(ctx, chunk)) {
+        return false;
+    }
 
     return true;
 }
@@ -582,9 +807,152 @@ bool processSparseHeader(SparseCtx *ctx)
     return true;
 }
 
+/*!
+ * \brief Read the next unread chunk header and add it to the chunk list
+ *
+ * \pre \a ctx->chunks.size() must be less than \a ctx->shdr.total_chunks
+ *
+ * \return Whether the chunk header was successfully read and is valid
+ */
+static bool readNextChunk(SparseCtx *ctx)
+{
+    size_t index = ctx->chunks.size();
+
+    DEBUG("Reading next chunk (#%" MB_PRIzu ")", index);
+
+    // Get starting offset for chunk in source file and starting offset for
+    // data in the output file
+    uint64_t srcBegin = ctx->shdr.file_hdr_sz;
+    uint64_t outBegin = 0;
+    if (index > 0) {
+        srcBegin = ctx->chunks[index - 1].srcEnd;
+        outBegin = ctx->chunks[index - 1].end;
+    }
+
+    // A seekable source may have been repositioned behind our back (eg. by a
+    // failed sparseLoadIndex() call), so seek backwards if needed
+    if (srcBegin < ctx->srcOffset && ctx->cbSeek
+            && !ctx->seek(srcBegin, SEEK_SET)) {
+        ERROR("- Failed to seek to chunk #%" MB_PRIzu, index);
+        return false;
+    }
+
+    // Skip to srcBegin
+    if (srcBegin < ctx->srcOffset) {
+        ERROR("- Internal error: srcBegin (%" PRIu64 ")"
+              " < srcOffset (%" PRIu64 ")", srcBegin, ctx->srcOffset);
+        return false;
+    }
+
+    uint64_t diff = srcBegin - ctx->srcOffset;
+    if (diff > 0 && !ctx->skipBytes(diff)) {
+        ERROR("- Failed to skip to chunk #%" MB_PRIzu, index);
+        return false;
+    }
+
+    ChunkHeader chunkHeader;
+
+    if (!readFully(ctx, &chunkHeader, sizeof(ChunkHeader))) {
+        ERROR("- Failed to read chunk header for chunk %" MB_PRIzu, index);
+        return false;
+    }
+
+#if SPARSE_DEBUG
+    dumpChunkHeader(&chunkHeader);
+#endif
+
+    // Skip any extra bytes in the chunk header. processSparseHeader() checks
+    // the size to make sure that the value won't underflow
+    diff = ctx->shdr.chunk_hdr_sz - sizeof(ChunkHeader);
+    if (!ctx->skipBytes(diff)) {
+        ERROR("- Failed to skip extra bytes in chunk #%" MB_PRIzu "'s header",
+              index);
+        return false;
+    }
+
+    if (!processChunk(ctx, &chunkHeader, outBegin)) {
+        return false;
+    }
+
+    ChunkInfo &chunk = ctx->chunks.back();
+    ctx->chunkBegins.push_back(chunk.begin);
+
+    OPER("- Chunk #%" MB_PRIzu " covers source range (%" PRIu64 " - %" PRIu64 ")",
+         index, chunk.srcBegin, chunk.srcEnd);
+    OPER("- Chunk #%" MB_PRIzu " covers output range (%" PRIu64 " - %" PRIu64 ")",
+         index, chunk.begin, chunk.end);
+
+    // Make sure the chunk does not end after the header-specified file size
+    if (chunk.end > ctx->fileSize) {
+        ERROR("Chunk #%" MB_PRIzu " ends (%" PRIu64 ") after the file size "
+              "specified in the sparse header (%" PRIu64 ")",
+              index, chunk.end, ctx->fileSize);
+        return false;
+    }
+
+    // If we just read the last chunk, make sure it ends at the same position as
+    // specified in the sparse header
+    if (index == ctx->shdr.total_chunks - 1 && chunk.end != ctx->fileSize) {
+        ERROR("Last chunk does not end (%" PRIu64 ")"
+              " at position specified by sparse header (%" PRIu64 ")",
+              chunk.end, ctx->fileSize);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check whether all chunk headers have been read
+ */
+static inline bool haveAllChunks(SparseCtx *ctx)
+{
+    return ctx->chunks.size() == ctx->shdr.total_chunks;
+}
+
+/*!
+ * \brief Find chunk that is responsible for the specified offset in the index
+ *
+ * \pre All chunk headers must have been read (haveAllChunks() returns true)
+ *
+ * \return Index of the chunk or \a ctx->shdr.total_chunks if the offset is
+ *         beyond the range of all chunks
+ */
+static size_t findChunkInIndex(SparseCtx *ctx, uint64_t offset)
+{
+    // Fast path for sequential reads: the offset is in the current or next
+    // chunk
+    for (size_t i = ctx->chunk; i < ctx->chunk + 2
+            && i < ctx->chunks.size(); ++i) {
+        if (offset >= ctx->chunks[i].begin && offset < ctx->chunks[i].end) {
+            return i;
+        }
+    }
+
+    // Find the last chunk that begins at or before the offset. Zero-sized
+    // chunks (CRC32) share their begin offset with the following chunk, so
+    // picking the last match always skips over them.
+    auto it = std::upper_bound(ctx->chunkBegins.begin(),
+                               ctx->chunkBegins.end(), offset);
+    if (it == ctx->chunkBegins.begin()) {
+        return ctx->shdr.total_chunks;
+    }
+
+    size_t index = static_cast<size_t>(it - ctx->chunkBegins.begin()) - 1;
+    if (offset >= ctx->chunks[index].end) {
+        return ctx->shdr.total_chunks;
+    }
+
+    return index;
+}
+
 /*!
  * \brief Find and move to chunk that is responsible for the specified offset
  *
+ * If all chunk headers have already been read (eg. by sparseBuildIndex()), the
+ * chunk is located with a binary search. Otherwise, the chunk list is walked
+ * and new chunk headers are read on demand.
+ *
  * \warning Always check if the offset exceeds the range of all chunks (EOF) by
  *          testing: "ctx->chunk == ctx->shdr.total_chunks"
  *
@@ -592,6 +960,11 @@ bool processSparseHeader(SparseCtx *ctx)
  */
 bool tryMoveToChunkForOffset(SparseCtx *ctx, uint64_t offset)
 {
+    if (haveAllChunks(ctx)) {
+        ctx->chunk = findChunkInIndex(ctx, offset);
+        return true;
+    }
+
     // If were at EOF, move back one so we can search again
     if (ctx->shdr.total_chunks != 0 && ctx->chunk == ctx->shdr.total_chunks) {
         --ctx->chunk;
@@ -610,91 +983,218 @@ bool tryMoveToChunkForOffset(SparseCtx *ctx, uint64_t offset)
 
     for (; ctx->chunk < ctx->shdr.total_chunks; ++ctx->chunk) {
         // If we don't have the chunk yet, then read it
-        if (ctx->chunk >= ctx->chunks.size()) {
-            DEBUG("Reading next chunk (#%" MB_PRIzu ")", ctx->chunk);
-
-            // Get starting offset for chunk in source file and starting
-            // offset for data in the output file
-            uint64_t srcBegin = ctx->shdr.file_hdr_sz;
-            uint64_t outBegin = 0;
-            if (ctx->chunk > 0) {
-                srcBegin = ctx->chunks[ctx->chunk - 1].srcEnd;
-                outBegin = ctx->chunks[ctx->chunk - 1].end;
-            }
+        if (ctx->chunk >= ctx->chunks.size() && !readNextChunk(ctx)) {
+            return false;
+        }
 
-            // Skip to srcBegin
-            if (srcBegin < ctx->srcOffset) {
-                ERROR("- Internal error: srcBegin (%" PRIu64 ")"
-                      " < srcOffset (%" PRIu64 ")", srcBegin, ctx->srcOffset);
-                return false;
-            }
+        if (offset >= ctx->chunks[ctx->chunk].begin
+                && offset < ctx->chunks[ctx->chunk].end) {
+            // Found matching chunk. Stop looking
+            break;
+        }
+    }
 
-            uint64_t diff = srcBegin - ctx->srcOffset;
-            if (diff > 0 && !ctx->skipBytes(diff)) {
-                ERROR("- Failed to skip to chunk #%" MB_PRIzu, ctx->chunk);
-                return false;
-            }
+    return true;
+}
 
-            ChunkHeader chunkHeader;
+/*!
+ * \brief Check that a chunk list describes a contiguous sparse file
+ *
+ * This is used to validate indexes loaded with sparseLoadIndex().
+ */
+static bool validateChunks(SparseCtx *ctx, const std::vector<ChunkInfo> &chunks)
+{
+    uint64_t srcOffset = ctx->shdr.file_hdr_sz;
+    uint64_t outOffset = 0;
 
-            if (!readFully(ctx, &chunkHeader, sizeof(ChunkHeader))) {
-                ERROR("- Failed to read chunk header for chunk %" MB_PRIzu,
-                      ctx->chunk);
-                return false;
-            }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const ChunkInfo &chunk = chunks[i];
 
-#if SPARSE_DEBUG
-            dumpChunkHeader(&chunkHeader);
-#endif
+        if (chunk.srcBegin != srcOffset || chunk.begin != outOffset
+                || chunk.srcEnd < chunk.srcBegin || chunk.end < chunk.begin) {
+            ERROR("Chunk #%" MB_PRIzu " in index is not contiguous", i);
+            return false;
+        }
 
-            // Skip any extra bytes in the chunk header. processSparseHeader()
-            // checks the size to make sure that the value won't underflow
-            diff = ctx->shdr.chunk_hdr_sz - sizeof(ChunkHeader);
-            if (!ctx->skipBytes(diff)) {
-                ERROR("- Failed to skip extra bytes in chunk #%" MB_PRIzu "'s header",
-                      ctx->chunk);
+        switch (chunk.type) {
+        case CHUNK_TYPE_RAW:
+            if (chunk.rawBegin != chunk.srcBegin + ctx->shdr.chunk_hdr_sz
+                    || chunk.rawEnd != chunk.srcEnd
+                    || chunk.rawEnd - chunk.rawBegin != chunk.end - chunk.begin) {
+                ERROR("Raw chunk #%" MB_PRIzu " in index has invalid bounds",
+                      i);
                 return false;
             }
+            break;
+        case CHUNK_TYPE_FILL:
+        case CHUNK_TYPE_DONT_CARE:
+        case CHUNK_TYPE_CRC32:
+            break;
+        default:
+            ERROR("Unknown chunk type in index: %u", chunk.type);
+            return false;
+        }
 
-            if (!processChunk(ctx, &chunkHeader, outBegin)) {
-                return false;
-            }
+        srcOffset = chunk.srcEnd;
+        outOffset = chunk.end;
+    }
+
+    if (!chunks.empty() && outOffset != ctx->fileSize) {
+        ERROR("Chunks in index do not end (%" PRIu64 ")"
+              " at position specified by sparse header (%" PRIu64 ")",
+              outOffset, ctx->fileSize);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check that the last chunk header in the source matches the index
+ *
+ * This catches most cases where the index was generated for a different sparse
+ * file that happens to have an identical sparse header.
+ */
+static bool verifyLastChunkHeader(SparseCtx *ctx,
+                                  const std::vector<ChunkInfo> &chunks)
+{
+    if (chunks.empty()) {
+        return true;
+    }
+
+    const ChunkInfo &chunk = chunks.back();
+    ChunkHeader chunkHeader;
+
+    if (!ctx->seek(chunk.srcBegin, SEEK_SET)
+            || !readFully(ctx, &chunkHeader, sizeof(chunkHeader))) {
+        return false;
+    }
+
+    if (chunkHeader.chunk_type != chunk.type
+            || chunkHeader.total_sz != chunk.srcEnd - chunk.srcBegin
+            || (uint64_t) chunkHeader.chunk_sz * ctx->shdr.blk_sz
+                    != chunk.end - chunk.begin) {
+        ERROR("Last chunk header in source does not match the index");
+        return false;
+    }
+
+    return true;
+}
+
+/*! \brief Maximum amount of output data handled by one extraction task */
+#define SPARSE_EXTRACT_TASK_SIZE    (8 * 1024 * 1024)
+/*! \brief Size of the per-worker buffer used for extraction */
+#define SPARSE_EXTRACT_BUF_SIZE     (1024 * 1024)
+
+/*! \brief Piece of a raw or fill chunk to be written by an extraction worker */
+struct ExtractTask
+{
+    /*! \brief Chunk containing the output range */
+    const ChunkInfo *chunk;
+    /*! \brief Start of byte range in output file */
+    uint64_t begin;
+    /*! \brief End of byte range in output file */
+    uint64_t end;
+};
+
+/*! \brief State shared between extraction workers */
+struct ExtractState
+{
+    SparseReadAtCb cbReadAt;
+    SparseWriteAtCb cbWriteAt;
+    SparseCopyCb cbCopy;
+    void *cbUserData;
 
-            OPER("- Chunk #%" MB_PRIzu " covers source range (%" PRIu64 " - %" PRIu64 ")",
-                 ctx->chunk, ctx->chunks[ctx->chunk].srcBegin,
-                 ctx->chunks[ctx->chunk].srcEnd);
-            OPER("- Chunk #%" MB_PRIzu " covers output range (%" PRIu64 " - %" PRIu64 ")",
-                 ctx->chunk, ctx->chunks[ctx->chunk].begin,
-                 ctx->chunks[ctx->chunk].end);
-
-            // Make sure the chunk does not end after the header-specified file
-            // size
-            if (ctx->chunks[ctx->chunk].end > ctx->fileSize) {
-                ERROR("Chunk #%" MB_PRIzu " ends (%" PRIu64 ") after the file size "
-                      "specified in the sparse header (%" PRIu64 ")",
-                      ctx->chunk, ctx->chunks[ctx->chunk].end, ctx->fileSize);
+    std::vector<ExtractTask> tasks;
+    std::atomic<size_t> nextTask{0};
+    std::atomic<bool> failed{false};
+};
+
+/*!
+ * \brief Write output data for a single extraction task
+ *
+ * \param state Shared extraction state
+ * \param task Task to process
+ * \param buf Worker buffer of size SPARSE_EXTRACT_BUF_SIZE
+ * \return Whether the output range was successfully written
+ */
+static bool extractTask(ExtractState *state, const ExtractTask &task,
+                        char *buf)
+{
+    const ChunkInfo &chunk = *task.chunk;
+    uint64_t offset = task.begin;
+
+    switch (chunk.type) {
+    case CHUNK_TYPE_RAW: {
+        uint64_t srcOffset = chunk.rawBegin + (task.begin - chunk.begin);
+
+        if (state->cbCopy) {
+            return state->cbCopy(srcOffset, task.begin, task.end - task.begin,
+                                 state->cbUserData);
+        }
+
+        while (offset < task.end) {
+            uint64_t n = std::min<uint64_t>(SPARSE_EXTRACT_BUF_SIZE,
+                                            task.end - offset);
+            if (!state->cbReadAt(buf, n, srcOffset, state->cbUserData)
+                    || !state->cbWriteAt(buf, n, offset, state->cbUserData)) {
                 return false;
             }
-
-            // If we just read the last chunk, make sure it ends at the same
-            // position as specified in the sparse header
-            if (ctx->chunk == ctx->shdr.total_chunks - 1
-                    && ctx->chunks[ctx->chunk].end != ctx->fileSize) {
-                ERROR("Last chunk does not end (%" PRIu64 ")"
-                      " at position specified by sparse header (%" PRIu64 ")",
-                      ctx->chunks[ctx->chunk].end, ctx->fileSize);
+            srcOffset += n;
+            offset += n;
+        }
+        return true;
+    }
+    case CHUNK_TYPE_FILL: {
+        // The buffer size is a multiple of the pattern size, so the same
+        // buffer can be written repeatedly
+        uint64_t n = std::min<uint64_t>(SPARSE_EXTRACT_BUF_SIZE,
+                                        task.end - offset);
+        fillPattern(buf, n, chunk.fillVal, task.begin - chunk.begin);
+
+        while (offset < task.end) {
+            n = std::min<uint64_t>(SPARSE_EXTRACT_BUF_SIZE, task.end - offset);
+            if (!state->cbWriteAt(buf, n, offset, state->cbUserData)) {
                 return false;
             }
+            offset += n;
         }
+        return true;
+    }
+    default:
+        assert(false);
+        return false;
+    }
+}
 
-        if (offset >= ctx->chunks[ctx->chunk].begin
-                && offset < ctx->chunks[ctx->chunk].end) {
-            // Found matching chunk. Stop looking
+/*!
+ * \brief Extraction worker
+ *
+ * Takes tasks from the shared queue until all tasks are done or another worker
+ * fails.
+ */
+static void extractWorker(ExtractState *state)
+{
+    std::unique_ptr<char[]> buf(
+            new(std::nothrow) char[SPARSE_EXTRACT_BUF_SIZE]);
+    if (!buf) {
+        ERROR("Failed to allocate extraction buffer");
+        state->failed = true;
+        return;
+    }
+
+    while (!state->failed) {
+        size_t i = state->nextTask++;
+        if (i >= state->tasks.size()) {
             break;
         }
-    }
 
-    return true;
+        if (!extractTask(state, state->tasks[i], buf.get())) {
+            ERROR("Failed to extract output range [%" PRIu64 ", %" PRIu64 ")",
+                  state->tasks[i].begin, state->tasks[i].end);
+            state->failed = true;
+        }
+    }
 }
 
 extern "C" {
@@ -719,6 +1219,36 @@ bool sparseCtxFree(SparseCtx *ctx)
     return ret;
 }
 
+/*!
+ * \brief Enable or disable CRC32 verification
+ *
+ * If enabled, a running CRC32 checksum of the output data is computed while the
+ * sparse file is read and compared against the value in each CRC32 chunk once
+ * all of the data preceding the chunk has been read. If the checksums do not
+ * match, \a sparseRead() will fail. Data marked as "don't care" is counted as
+ * zeros, like in the libsparse implementation.
+ *
+ * Verification is only possible if the data is read in order. Seeking is
+ * allowed, but the running checksum only advances when data following the
+ * already verified range is read.
+ *
+ * \note This can only be changed while no sparse file is open. The setting
+ *       persists across \a sparseOpen() calls.
+ *
+ * \param ctx Sparse context
+ * \param verify Whether to verify the CRC32 checksums
+ * \return True, unless a sparse file is currently open
+ */
+bool sparseSetVerifyCrc32(SparseCtx *ctx, bool verify)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->verifyCrc32 = verify;
+    return true;
+}
+
 /*!
  * \brief Open sparse file for reading
  *
@@ -813,8 +1343,10 @@ bool sparseClose(SparseCtx *ctx)
     ctx->isOpen = false;
     ctx->srcOffset = 0;
     ctx->outOffset = 0;
-    ctx->expectedCrc32 = 0;
+    ctx->crc32 = 0;
+    ctx->crc32Offset = 0;
     ctx->chunks.clear();
+    ctx->chunkBegins.clear();
     ctx->chunk = 0;
 
     bool ret = true;
@@ -904,28 +1436,11 @@ bool sparseRead(SparseCtx *ctx, void *buf, uint64_t size, uint64_t *bytesRead)
             }
             break;
         }
-        case CHUNK_TYPE_FILL: {
-            assert(sizeof(ctx->chunks[ctx->chunk].fillVal) == sizeof(uint32_t));
-            auto shift = (ctx->outOffset - ctx->chunks[ctx->chunk].begin)
-                    % sizeof(uint32_t);
-            uint32_t fillVal = ctx->chunks[ctx->chunk].fillVal;
-            uint32_t shifted = 0;
-            for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-                ((char *) &shifted)[i] =
-                        ((char *) &fillVal)[(i + shift) % sizeof(uint32_t)];
-                //uint32_t amount = 8 * ((i + shift) % sizeof(uint32_t));
-                //shifted |= (fillVal & (0xff << amount)) >> amount << i * 8;
-            }
-            char *tempBuf = (char *) buf;
-            while (toRead > 0) {
-                size_t toWrite = std::min<size_t>(sizeof(shifted), toRead);
-                memcpy(tempBuf, &shifted, toWrite);
-                nRead += toWrite;
-                toRead -= toWrite;
-                tempBuf += toWrite;
-            }
+        case CHUNK_TYPE_FILL:
+            fillPattern(buf, toRead, ctx->chunks[ctx->chunk].fillVal,
+                        ctx->outOffset - ctx->chunks[ctx->chunk].begin);
+            nRead = toRead;
             break;
-        }
         case CHUNK_TYPE_DONT_CARE:
             memset(buf, 0, toRead);
             nRead = toRead;
@@ -937,6 +1452,11 @@ bool sparseRead(SparseCtx *ctx, void *buf, uint64_t size, uint64_t *bytesRead)
         }
 
         OPER("- Read %" PRIu64 " bytes", nRead);
+
+        if (ctx->verifyCrc32 && !updateCrc32(ctx, buf, nRead)) {
+            return false;
+        }
+
         totalRead += nRead;
         ctx->outOffset += nRead;
         size -= nRead;
@@ -975,6 +1495,12 @@ bool sparseSeek(SparseCtx *ctx, int64_t offset, int whence)
         return false;
     }
 
+    // Random access is expected from here on, so read all of the chunk headers
+    // now instead of walking the chunk list on every seek
+    if (!haveAllChunks(ctx) && !sparseBuildIndex(ctx)) {
+        return false;
+    }
+
     uint64_t newOffset;
     switch (whence) {
     case SEEK_SET:
@@ -1015,6 +1541,379 @@ bool sparseSeek(SparseCtx *ctx, int64_t offset, int whence)
     return true;
 }
 
+/*!
+ * \brief Get information about the chunk at the current position
+ *
+ * This allows callers to handle fill and don't care chunks without
+ * materializing the data with \a sparseRead(). For example, a fill chunk with
+ * a fill value of 0 could be turned into a hole in the output file. The
+ * returned range starts at the current position, which may be in the middle of
+ * the chunk, and ends at the end of the chunk. Use \a sparseSkipChunk() to
+ * move past the chunk or \a sparseRead() to read its data.
+ *
+ * If the current position is at or past the end of the sparse file, the
+ * returned range will be empty (\a chunk->begin == \a chunk->end).
+ *
+ * \param ctx Sparse context
+ * \param chunk Output pointer for chunk information
+ * \return True unless an error occurs or the file is not open
+ */
+bool sparseGetChunk(SparseCtx *ctx, SparseChunk *chunk)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    if (ctx->chunks.empty()
+            || ctx->chunk == ctx->shdr.total_chunks
+            || ctx->outOffset < ctx->chunks[ctx->chunk].begin
+            || ctx->outOffset >= ctx->chunks[ctx->chunk].end) {
+        if (!tryMoveToChunkForOffset(ctx, ctx->outOffset)) {
+            return false;
+        }
+    }
+
+    memset(chunk, 0, sizeof(*chunk));
+
+    if (ctx->chunk == ctx->shdr.total_chunks) {
+        chunk->begin = ctx->outOffset;
+        chunk->end = ctx->outOffset;
+        return true;
+    }
+
+    const ChunkInfo &info = ctx->chunks[ctx->chunk];
+    chunk->type = info.type;
+    chunk->begin = ctx->outOffset;
+    chunk->end = info.end;
+    if (info.type == CHUNK_TYPE_FILL) {
+        chunk->fillVal = info.fillVal;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Move to the end of the chunk at the current position
+ *
+ * This moves the current position to the end of the range returned by
+ * \a sparseGetChunk() without reading any data. Unlike \a sparseSeek(), this
+ * does not require a seek callback.
+ *
+ * \note If CRC32 verification is enabled, the data of skipped fill and don't
+ *       care chunks is still checksummed (without any I/O). Skipping a raw
+ *       chunk prevents verification of all following data.
+ *
+ * \param ctx Sparse context
+ * \return True unless an error occurs or the file is not open
+ */
+bool sparseSkipChunk(SparseCtx *ctx)
+{
+    SparseChunk chunk;
+
+    if (!sparseGetChunk(ctx, &chunk)) {
+        return false;
+    }
+
+    if (ctx->verifyCrc32 && chunk.type != CHUNK_TYPE_RAW
+            && !updateCrc32Skipped(ctx, chunk.end - chunk.begin)) {
+        return false;
+    }
+
+    ctx->outOffset = chunk.end;
+    return true;
+}
+
+/*!
+ * \brief Extract the entire sparse file using multiple threads
+ *
+ * Once all chunk headers are known, the output offset of every chunk is known
+ * as well, so the chunks can be written independently. Raw and fill chunks are
+ * split into tasks of up to 8 MiB, which are distributed among \a jobs worker
+ * threads (including the calling thread). This requires a seek callback since
+ * the chunk index is built with \a sparseBuildIndex() first.
+ *
+ * The callbacks are called concurrently from multiple threads and must be
+ * thread-safe. \a readAtCb and \a writeAtCb must read or write the entire
+ * buffer at the specified offset (eg. with \a pread() and \a pwrite()). A
+ * short read or write must be reported as a failure. If \a copyCb is provided,
+ * it is used instead of \a readAtCb and \a writeAtCb for raw data (eg. with
+ * \a copy_file_range()).
+ *
+ * Don't care chunks and fill chunks with a fill value of 0 are not written.
+ * The output must already read back as zeros in those ranges (eg. a freshly
+ * truncated file, which can then be extended to the size reported by
+ * \a sparseSize()).
+ *
+ * After extraction, the current position is at the end of the sparse file.
+ *
+ * \note CRC32 verification is not supported because the data is not processed
+ *       in order. This function will fail if it is enabled.
+ *
+ * \param ctx Sparse context
+ * \param readAtCb Positional read callback for the source
+ * \param writeAtCb Positional write callback for the output
+ * \param copyCb Copy callback (optional)
+ * \param userData Caller-supplied pointer to pass to callback functions
+ * \param jobs Number of threads to use or 0 to use the number of CPUs
+ * \return Whether the sparse file was extracted successfully
+ */
+bool sparseExtractParallel(SparseCtx *ctx, SparseReadAtCb readAtCb,
+                           SparseWriteAtCb writeAtCb, SparseCopyCb copyCb,
+                           void *userData, unsigned int jobs)
+{
+    if (!ctx->isOpen || !readAtCb || !writeAtCb) {
+        return false;
+    }
+
+    if (ctx->verifyCrc32) {
+        ERROR("CRC32 verification is not supported for parallel extraction");
+        return false;
+    }
+
+    if (!haveAllChunks(ctx) && !sparseBuildIndex(ctx)) {
+        return false;
+    }
+
+    ExtractState state;
+    state.cbReadAt = readAtCb;
+    state.cbWriteAt = writeAtCb;
+    state.cbCopy = copyCb;
+    state.cbUserData = userData;
+
+    for (const ChunkInfo &chunk : ctx->chunks) {
+        if (chunk.type != CHUNK_TYPE_RAW && (chunk.type != CHUNK_TYPE_FILL
+                || chunk.fillVal == 0)) {
+            continue;
+        }
+
+        for (uint64_t begin = chunk.begin; begin < chunk.end;
+                begin += SPARSE_EXTRACT_TASK_SIZE) {
+            state.tasks.push_back({ &chunk, begin, std::min<uint64_t>(
+                    begin + SPARSE_EXTRACT_TASK_SIZE, chunk.end) });
+        }
+    }
+
+    if (jobs == 0) {
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+    jobs = static_cast<unsigned int>(std::max<size_t>(
+            1, std::min<size_t>(jobs, state.tasks.size())));
+
+    DEBUG("Extracting %" MB_PRIzu " tasks with %u threads",
+          state.tasks.size(), jobs);
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < jobs; ++i) {
+        threads.emplace_back(&extractWorker, &state);
+    }
+    extractWorker(&state);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    if (state.failed) {
+        return false;
+    }
+
+    ctx->outOffset = ctx->fileSize;
+    return true;
+}
+
+/*!
+ * \brief Read all chunk headers to allow random access
+ *
+ * This scans the chunk headers of the entire sparse file, seeking over the raw
+ * data, and builds an index that allows \a sparseSeek() and \a sparseRead()
+ * to locate the chunk for an offset with a binary search. \a sparseSeek()
+ * calls this function automatically if the index has not been built yet.
+ *
+ * \note If a seek callback was not provided, then this function will always
+ *       return false;
+ *
+ * \param ctx Sparse context
+ * \return Whether all chunk headers were read and are valid
+ */
+bool sparseBuildIndex(SparseCtx *ctx)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    if (!ctx->cbSeek) {
+        OPER("- Cannot build index because no seek callback is registered");
+        return false;
+    }
+
+    ctx->chunks.reserve(ctx->shdr.total_chunks);
+    ctx->chunkBegins.reserve(ctx->shdr.total_chunks);
+
+    while (!haveAllChunks(ctx)) {
+        if (!readNextChunk(ctx)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Save chunk index to a file
+ *
+ * The index is written to \a fp starting at its current position. It can be
+ * loaded with \a sparseLoadIndex() the next time the same sparse file is
+ * opened to avoid rescanning all of the chunk headers. If the index has not
+ * been built yet, it will be built first.
+ *
+ * \note The index is stored in the host byte order and can only be loaded on
+ *       a host with the same byte order.
+ *
+ * \param ctx Sparse context
+ * \param fp File to write the index to
+ * \return Whether the index was successfully written
+ */
+bool sparseSaveIndex(SparseCtx *ctx, FILE *fp)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    if (!haveAllChunks(ctx) && !sparseBuildIndex(ctx)) {
+        return false;
+    }
+
+    SparseIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPARSE_INDEX_MAGIC, sizeof(SPARSE_INDEX_MAGIC));
+    header.version = SPARSE_INDEX_VERSION;
+    header.count = static_cast<uint32_t>(ctx->chunks.size());
+    header.shdr = ctx->shdr;
+
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        ERROR("Failed to write index header: %s", strerror(errno));
+        return false;
+    }
+
+    for (const ChunkInfo &chunk : ctx->chunks) {
+        SparseIndexEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = chunk.type;
+        if (chunk.type == CHUNK_TYPE_FILL) {
+            entry.value = chunk.fillVal;
+        } else if (chunk.type == CHUNK_TYPE_CRC32) {
+            entry.value = chunk.crc32;
+        }
+        entry.begin = chunk.begin;
+        entry.end = chunk.end;
+        entry.srcBegin = chunk.srcBegin;
+        entry.srcEnd = chunk.srcEnd;
+        if (chunk.type == CHUNK_TYPE_RAW) {
+            entry.rawBegin = chunk.rawBegin;
+            entry.rawEnd = chunk.rawEnd;
+        }
+
+        if (fwrite(&entry, sizeof(entry), 1, fp) != 1) {
+            ERROR("Failed to write index entry: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    if (fflush(fp) != 0) {
+        ERROR("Failed to flush index: %s", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Load chunk index from a file
+ *
+ * Load an index previously written by \a sparseSaveIndex() from the current
+ * position of \a fp. The index is rejected if it was not created for a sparse
+ * file with an identical sparse header, if it is internally inconsistent, or if
+ * the last chunk header in the source does not match the index. If this
+ * function fails, the context is left unchanged and the index can be rebuilt
+ * with \a sparseBuildIndex().
+ *
+ * \note If a seek callback was not provided, then this function will always
+ *       return false;
+ *
+ * \param ctx Sparse context
+ * \param fp File to read the index from
+ * \return Whether the index was successfully loaded
+ */
+bool sparseLoadIndex(SparseCtx *ctx, FILE *fp)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    if (!ctx->cbSeek) {
+        OPER("- Cannot load index because no seek callback is registered");
+        return false;
+    }
+
+    SparseIndexHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1) {
+        ERROR("Failed to read index header");
+        return false;
+    }
+
+    if (memcmp(header.magic, SPARSE_INDEX_MAGIC,
+               sizeof(SPARSE_INDEX_MAGIC)) != 0) {
+        ERROR("Invalid index magic");
+        return false;
+    }
+
+    if (header.version != SPARSE_INDEX_VERSION) {
+        ERROR("Unsupported index version: %" PRIu32, header.version);
+        return false;
+    }
+
+    if (memcmp(&header.shdr, &ctx->shdr, sizeof(SparseHeader)) != 0
+            || header.count != ctx->shdr.total_chunks) {
+        ERROR("Index does not belong to this sparse file");
+        return false;
+    }
+
+    std::vector<ChunkInfo> chunks;
+    std::vector<uint64_t> chunkBegins;
+    chunks.reserve(header.count);
+    chunkBegins.reserve(header.count);
+
+    for (uint32_t i = 0; i < header.count; ++i) {
+        SparseIndexEntry entry;
+        if (fread(&entry, sizeof(entry), 1, fp) != 1) {
+            ERROR("Failed to read index entry #%" PRIu32, i);
+            return false;
+        }
+
+        chunks.emplace_back();
+        ChunkInfo &chunk = chunks.back();
+        chunk.type = entry.type;
+        chunk.begin = entry.begin;
+        chunk.end = entry.end;
+        chunk.srcBegin = entry.srcBegin;
+        chunk.srcEnd = entry.srcEnd;
+        chunk.rawBegin = entry.rawBegin;
+        chunk.rawEnd = entry.rawEnd;
+        chunk.fillVal = entry.value;
+        chunk.crc32 = entry.value;
+
+        chunkBegins.push_back(chunk.begin);
+    }
+
+    if (!validateChunks(ctx, chunks) || !verifyLastChunkHeader(ctx, chunks)) {
+        return false;
+    }
+
+    ctx->chunks.swap(chunks);
+    ctx->chunkBegins.swap(chunkBegins);
+    ctx->chunk = findChunkInIndex(ctx, ctx->outOffset);
+
+    return true;
+}
+
 /*!
  * \brief Get file pointer position in sparse file
  *
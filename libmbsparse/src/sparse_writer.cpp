@@ -0,0 +1,884 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __ANDROID__
+// Android does not support C++11 properly...
+#define __STDC_LIMIT_MACROS
+#endif
+
+#include "mbsparse/sparse.h"
+
+// For std::min()
+#include <algorithm>
+
+#include <iterator>
+#include <new>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#  include <arm_neon.h>
+#endif
+
+#include "mblog/logging.h"
+
+#include "mbsparse/crc32_p.h"
+
+// Enable debug logging of headers, offsets, etc.?
+#define SPARSE_DEBUG 1
+// Enable logging of errors
+#define SPARSE_ERROR 1
+
+#if SPARSE_DEBUG
+#define DEBUG(...) LOGD(__VA_ARGS__)
+#else
+#define DEBUG(...)
+#endif
+
+#if SPARSE_ERROR
+#define ERROR(...) LOGE(__VA_ARGS__)
+#else
+#define ERROR(...)
+#endif
+
+// Maximum amount of raw data buffered before it is written out as a chunk
+#define SPARSE_WRITER_MAX_RAW_CHUNK_SIZE    (4 * 1024 * 1024)
+
+struct SparseWriterCtx
+{
+    // Callbacks
+    SparseOpenCb cbOpen;
+    SparseCloseCb cbClose;
+    SparseWriteCb cbWrite;
+    SparseSeekCb cbSeek;
+    void *cbUserData;
+
+    bool isOpen;
+    // Set when writing to the output fails. The output is incomplete and the
+    // only valid operation is closing the sparse file.
+    bool failed;
+
+    // Settings (persist across sparseWriterOpen() calls)
+    bool writeCrc32 = false;
+    bool skipZeros = false;
+
+    // Expected number of chunks for unseekable output (cleared on close)
+    bool haveExpectedChunks = false;
+    uint32_t expectedChunks = 0;
+
+    SparseHeader shdr;
+    uint64_t fileSize;
+
+    // Number of bytes of the output image passed to the writer, including
+    // pending data
+    uint64_t outOffset;
+
+    // CRC32 of the data in all written and pending chunks
+    uint32_t crc32;
+
+    // Pending chunk. For CHUNK_TYPE_RAW, the data is in \a rawBuf. For the
+    // other types, \a pendingBlocks is the number of blocks.
+    uint16_t pendingType;
+    uint32_t pendingBlocks;
+    uint32_t pendingFillVal;
+    std::vector<unsigned char> rawBuf;
+
+    // Partial block passed to sparseWriterWrite() that has not been classified
+    std::vector<unsigned char> blockBuf;
+
+    void clearCallbacks();
+
+    bool write(const void *buf, uint64_t size);
+    bool writeChunk(uint16_t type, uint32_t blocks, const void *data,
+                    uint32_t dataSize);
+    bool flushPending();
+
+    void updateCrc32Fill(uint32_t fillVal, uint64_t size);
+
+    bool addRaw(const unsigned char *data, uint64_t size);
+    bool addBlocks(uint16_t type, uint32_t fillVal, uint32_t blocks);
+    bool addClassified(const unsigned char *data, uint64_t size);
+};
+
+void SparseWriterCtx::clearCallbacks()
+{
+    cbOpen = nullptr;
+    cbClose = nullptr;
+    cbWrite = nullptr;
+    cbSeek = nullptr;
+    cbUserData = nullptr;
+}
+
+bool SparseWriterCtx::write(const void *buf, uint64_t size)
+{
+    // Only count chunks if there is no output
+    if (!cbWrite) {
+        return true;
+    }
+
+    if (!cbWrite(buf, size, cbUserData)) {
+        ERROR("Failed to write %" PRIu64 " bytes", size);
+        failed = true;
+        return false;
+    }
+    return true;
+}
+
+bool SparseWriterCtx::writeChunk(uint16_t type, uint32_t blocks,
+                                 const void *data, uint32_t dataSize)
+{
+    if (shdr.total_chunks == UINT32_MAX || (!cbSeek && haveExpectedChunks
+            && shdr.total_chunks == expectedChunks)) {
+        ERROR("Too many chunks");
+        failed = true;
+        return false;
+    }
+
+    ChunkHeader chdr;
+    chdr.chunk_type = type;
+    chdr.reserved1 = 0;
+    chdr.chunk_sz = blocks;
+    chdr.total_sz = sizeof(ChunkHeader) + dataSize;
+
+    if (!write(&chdr, sizeof(chdr))
+            || (dataSize > 0 && !write(data, dataSize))) {
+        return false;
+    }
+
+    ++shdr.total_chunks;
+    return true;
+}
+
+/*!
+ * \brief Write the pending chunk
+ *
+ * \pre If the pending chunk is a raw chunk, the size of the pending data must
+ *      be a multiple of the block size
+ */
+bool SparseWriterCtx::flushPending()
+{
+    bool ret;
+
+    switch (pendingType) {
+    case CHUNK_TYPE_RAW:
+        ret = writeChunk(CHUNK_TYPE_RAW, rawBuf.size() / shdr.blk_sz,
+                         rawBuf.data(), rawBuf.size());
+        rawBuf.clear();
+        break;
+    case CHUNK_TYPE_FILL:
+        ret = writeChunk(CHUNK_TYPE_FILL, pendingBlocks,
+                         &pendingFillVal, sizeof(pendingFillVal));
+        break;
+    case CHUNK_TYPE_DONT_CARE:
+        ret = writeChunk(CHUNK_TYPE_DONT_CARE, pendingBlocks, nullptr, 0);
+        break;
+    default:
+        return true;
+    }
+
+    pendingType = 0;
+    pendingBlocks = 0;
+    return ret;
+}
+
+/*!
+ * \brief Add fill or don't care data to the running CRC32
+ *
+ * Like in the libsparse implementation, "don't care" data is counted as zeros.
+ */
+void SparseWriterCtx::updateCrc32Fill(uint32_t fillVal, uint64_t size)
+{
+    uint32_t buf[1024];
+    std::fill(std::begin(buf), std::end(buf), fillVal);
+
+    while (size > 0) {
+        uint64_t n = std::min<uint64_t>(size, sizeof(buf));
+        crc32 = sparseCrc32(crc32, buf, n);
+        size -= n;
+    }
+}
+
+/*!
+ * \brief Append data to the pending raw chunk
+ *
+ * The pending raw chunk is written out once it reaches
+ * \a SPARSE_WRITER_MAX_RAW_CHUNK_SIZE. \a outOffset is not updated.
+ */
+bool SparseWriterCtx::addRaw(const unsigned char *data, uint64_t size)
+{
+    if (writeCrc32) {
+        crc32 = sparseCrc32(crc32, data, size);
+    }
+
+    const uint64_t maxSize = std::max<uint64_t>(shdr.blk_sz,
+            SPARSE_WRITER_MAX_RAW_CHUNK_SIZE
+                    - SPARSE_WRITER_MAX_RAW_CHUNK_SIZE % shdr.blk_sz);
+
+    while (size > 0) {
+        if (pendingType != CHUNK_TYPE_RAW) {
+            if (!flushPending()) {
+                return false;
+            }
+            pendingType = CHUNK_TYPE_RAW;
+        }
+
+        uint64_t n = std::min<uint64_t>(size, maxSize - rawBuf.size());
+
+        rawBuf.insert(rawBuf.end(), data, data + n);
+        data += n;
+        size -= n;
+
+        if (rawBuf.size() == maxSize && !flushPending()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Append fill or don't care blocks to the pending chunk
+ *
+ * Consecutive blocks of the same type (and fill value) are merged into the
+ * same chunk. \a outOffset is not updated.
+ *
+ * \pre The pending data must end on a block boundary
+ */
+bool SparseWriterCtx::addBlocks(uint16_t type, uint32_t fillVal,
+                                uint32_t blocks)
+{
+    if (blocks == 0) {
+        return true;
+    }
+
+    if (pendingType != type
+            || (type == CHUNK_TYPE_FILL && pendingFillVal != fillVal)) {
+        if (!flushPending()) {
+            return false;
+        }
+        pendingType = type;
+        pendingFillVal = fillVal;
+    }
+
+    if (writeCrc32) {
+        updateCrc32Fill(type == CHUNK_TYPE_FILL ? fillVal : 0,
+                        static_cast<uint64_t>(blocks) * shdr.blk_sz);
+    }
+
+    // Can't overflow since the total number of blocks fits in a uint32_t
+    pendingBlocks += blocks;
+    return true;
+}
+
+/*!
+ * \brief Check if a block consists of a repeated 32-bit value
+ *
+ * \param data Block data (must be 4-byte aligned in size)
+ * \param size Size of block
+ * \param[out] fillVal Repeated value if the block is a fill block
+ *
+ * \return Whether every 32-bit word in the block has the same value
+ */
+static bool classifyBlock(const unsigned char *data, size_t size,
+                          uint32_t *fillVal)
+{
+    uint32_t val;
+    memcpy(&val, data, sizeof(val));
+
+    size_t pos = 0;
+
+#if defined(__SSE2__)
+    // Compare 64 bytes per iteration and only check the result once
+    __m128i pattern = _mm_set1_epi32(static_cast<int>(val));
+
+    for (; pos + 64 <= size; pos += 64) {
+        auto p = reinterpret_cast<const __m128i *>(data + pos);
+        __m128i diff = _mm_or_si128(
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p), pattern),
+                             _mm_xor_si128(_mm_loadu_si128(p + 1), pattern)),
+                _mm_or_si128(_mm_xor_si128(_mm_loadu_si128(p + 2), pattern),
+                             _mm_xor_si128(_mm_loadu_si128(p + 3), pattern)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+                != 0xffff) {
+            return false;
+        }
+    }
+#elif defined(__ARM_NEON)
+    uint32x4_t pattern = vdupq_n_u32(val);
+
+    for (; pos + 64 <= size; pos += 64) {
+        auto p = reinterpret_cast<const uint32_t *>(data + pos);
+        uint32x4_t diff = vorrq_u32(
+                vorrq_u32(veorq_u32(vld1q_u32(p), pattern),
+                          veorq_u32(vld1q_u32(p + 4), pattern)),
+                vorrq_u32(veorq_u32(vld1q_u32(p + 8), pattern),
+                          veorq_u32(vld1q_u32(p + 12), pattern)));
+        uint64x2_t diff64 = vreinterpretq_u64_u32(diff);
+        if ((vgetq_lane_u64(diff64, 0) | vgetq_lane_u64(diff64, 1)) != 0) {
+            return false;
+        }
+    }
+#endif
+
+    // Remaining data (or everything without vector instructions)
+    for (; pos < size; pos += sizeof(val)) {
+        uint32_t word;
+        memcpy(&word, data + pos, sizeof(word));
+        if (word != val) {
+            return false;
+        }
+    }
+
+    *fillVal = val;
+    return true;
+}
+
+/*!
+ * \brief Classify whole blocks and append them to the matching chunk types
+ *
+ * \pre \a size must be a multiple of the block size and the pending data must
+ *      end on a block boundary
+ */
+bool SparseWriterCtx::addClassified(const unsigned char *data, uint64_t size)
+{
+    // Consecutive raw blocks are passed to addRaw() together
+    const unsigned char *rawBegin = nullptr;
+    uint32_t fillVal;
+
+    for (uint64_t pos = 0; pos < size; pos += shdr.blk_sz) {
+        if (!classifyBlock(data + pos, shdr.blk_sz, &fillVal)) {
+            if (!rawBegin) {
+                rawBegin = data + pos;
+            }
+            continue;
+        }
+
+        if (rawBegin) {
+            if (!addRaw(rawBegin, data + pos - rawBegin)) {
+                return false;
+            }
+            rawBegin = nullptr;
+        }
+
+        bool ret;
+        if (fillVal == 0 && skipZeros) {
+            ret = addBlocks(CHUNK_TYPE_DONT_CARE, 0, 1);
+        } else {
+            ret = addBlocks(CHUNK_TYPE_FILL, fillVal, 1);
+        }
+        if (!ret) {
+            return false;
+        }
+    }
+
+    return !rawBegin || addRaw(rawBegin, data + size - rawBegin);
+}
+
+extern "C" {
+
+SparseWriterCtx * sparseWriterCtxNew()
+{
+    SparseWriterCtx *ctx = new(std::nothrow) SparseWriterCtx();
+    if (!ctx) {
+        return nullptr;
+    }
+    ctx->clearCallbacks();
+    ctx->isOpen = false;
+    ctx->failed = false;
+    ctx->shdr.total_chunks = 0;
+    return ctx;
+}
+
+/*!
+ * \brief Free sparse writer context
+ *
+ * \note If a sparse file is still open, the close callback is called, but the
+ *       sparse file will be incomplete. Use \a sparseWriterClose() to finish
+ *       writing the sparse file first.
+ *
+ * \param ctx Sparse writer context
+ * \return Return value of the close callback or true if no sparse file was
+ *         open
+ */
+bool sparseWriterCtxFree(SparseWriterCtx *ctx)
+{
+    bool ret = true;
+    if (ctx->isOpen && ctx->cbClose) {
+        ret = ctx->cbClose(ctx->cbUserData);
+    }
+    delete ctx;
+    return ret;
+}
+
+/*!
+ * \brief Enable or disable writing a CRC32 chunk
+ *
+ * If enabled, a CRC32 chunk containing the checksum of the entire image is
+ * written at the end of the sparse file. Like in the libsparse implementation,
+ * "don't care" data is counted as zeros.
+ *
+ * \note This can only be changed while no sparse file is open. The setting
+ *       persists across \a sparseWriterOpen() calls.
+ *
+ * \param ctx Sparse writer context
+ * \param enable Whether to write a CRC32 chunk
+ * \return True, unless a sparse file is currently open
+ */
+bool sparseWriterSetCrc32(SparseWriterCtx *ctx, bool enable)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->writeCrc32 = enable;
+    return true;
+}
+
+/*!
+ * \brief Enable or disable storing zero blocks as "don't care"
+ *
+ * By default, blocks passed to \a sparseWriterWrite() that only contain zeros
+ * are stored as fill chunks. If enabled, they are stored as "don't care" chunks
+ * instead. This should only be used if the sparse file will be extracted to a
+ * target that already reads back as zeros or if the contents of unused blocks
+ * do not matter (eg. free space in a filesystem).
+ *
+ * \note This can only be changed while no sparse file is open. The setting
+ *       persists across \a sparseWriterOpen() calls.
+ *
+ * \param ctx Sparse writer context
+ * \param enable Whether to store zero blocks as "don't care"
+ * \return True, unless a sparse file is currently open
+ */
+bool sparseWriterSetSkipZeros(SparseWriterCtx *ctx, bool enable)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->skipZeros = enable;
+    return true;
+}
+
+/*!
+ * \brief Set the number of chunks for writing to an unseekable output
+ *
+ * Since the main sparse header precedes the chunks, the number of chunks must
+ * be known before writing a sparse file without a seek callback. The number can
+ * be determined by first calling \a sparseWriterOpen() without a write
+ * callback, passing in the same data with the same settings, and calling
+ * \a sparseWriterGetChunkCount() after \a sparseWriterClose().
+ *
+ * \note This can only be set while no sparse file is open. The value only
+ *       applies to the next \a sparseWriterOpen() call.
+ *
+ * \param ctx Sparse writer context
+ * \param count Number of chunks
+ * \return True, unless a sparse file is currently open
+ */
+bool sparseWriterSetChunkCount(SparseWriterCtx *ctx, uint32_t count)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    ctx->haveExpectedChunks = true;
+    ctx->expectedChunks = count;
+    return true;
+}
+
+/*!
+ * \brief Get the number of chunks written
+ *
+ * \param ctx Sparse writer context
+ * \param[out] count Number of chunks written to the currently open sparse file
+ *                   (excluding pending data) or the total number of chunks in
+ *                   the last closed sparse file
+ * \return Always true
+ */
+bool sparseWriterGetChunkCount(SparseWriterCtx *ctx, uint32_t *count)
+{
+    *count = ctx->shdr.total_chunks;
+    return true;
+}
+
+/*!
+ * \brief Open sparse file for writing
+ *
+ * The output, which may not necessarily be a file, is written by calling
+ * functions provided by the caller. The write callback must either write all
+ * of the specified bytes or fail.
+ *
+ * If a seek callback is provided, the main sparse header is rewritten by
+ * \a sparseWriterClose() once the number of chunks is known. Otherwise, the
+ * output is written sequentially and the number of chunks must be set with
+ * \a sparseWriterSetChunkCount() beforehand.
+ *
+ * If no write callback is provided, nothing is written and only the chunks are
+ * counted.
+ *
+ * The open and close callbacks are optional and behave the same way as in
+ * \a sparseOpen().
+ *
+ * \param ctx Sparse writer context
+ * \param blockSize Block size of the sparse file (must be a non-zero multiple
+ *                  of 4)
+ * \param size Size of the non-sparse output image (must be a multiple of
+ *             \a blockSize)
+ * \param openCb Open callback
+ * \param closeCb Close callback
+ * \param writeCb Write callback
+ * \param seekCb Seek callback
+ * \param userData Caller-supplied pointer to pass to callback functions
+ * \return Whether the sparse file was opened and the initial sparse header was
+ *         written
+ */
+bool sparseWriterOpen(SparseWriterCtx *ctx, uint32_t blockSize, uint64_t size,
+                      SparseOpenCb openCb, SparseCloseCb closeCb,
+                      SparseWriteCb writeCb, SparseSeekCb seekCb,
+                      void *userData)
+{
+    if (ctx->isOpen) {
+        return false;
+    }
+
+    if (writeCb && !seekCb && !ctx->haveExpectedChunks) {
+        ERROR("Chunk count must be set for unseekable output");
+        return false;
+    } else if (blockSize == 0 || blockSize % 4 != 0) {
+        ERROR("Invalid block size: %" PRIu32, blockSize);
+        return false;
+    } else if (size % blockSize != 0) {
+        ERROR("Image size %" PRIu64 " is not a multiple of the block size",
+              size);
+        return false;
+    } else if (size / blockSize > UINT32_MAX) {
+        ERROR("Image size %" PRIu64 " is too large", size);
+        return false;
+    }
+
+    ctx->cbOpen = openCb;
+    ctx->cbClose = closeCb;
+    ctx->cbWrite = writeCb;
+    ctx->cbSeek = seekCb;
+    ctx->cbUserData = userData;
+
+    if (ctx->cbOpen && !ctx->cbOpen(ctx->cbUserData)) {
+        ctx->clearCallbacks();
+        return false;
+    }
+
+    ctx->shdr.magic = SPARSE_HEADER_MAGIC;
+    ctx->shdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    ctx->shdr.minor_version = 0;
+    ctx->shdr.file_hdr_sz = sizeof(SparseHeader);
+    ctx->shdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    ctx->shdr.blk_sz = blockSize;
+    ctx->shdr.total_blks = size / blockSize;
+    ctx->shdr.total_chunks = 0;
+    ctx->shdr.image_checksum = 0;
+
+    ctx->fileSize = size;
+    ctx->outOffset = 0;
+    ctx->crc32 = 0;
+    ctx->pendingType = 0;
+    ctx->pendingBlocks = 0;
+    ctx->pendingFillVal = 0;
+    ctx->rawBuf.clear();
+    ctx->blockBuf.clear();
+    ctx->failed = false;
+
+    // The header written here is only final for unseekable output
+    SparseHeader shdr = ctx->shdr;
+    if (!ctx->cbSeek) {
+        shdr.total_chunks = ctx->expectedChunks;
+    }
+
+    if ((ctx->cbSeek && !ctx->cbSeek(0, SEEK_SET, ctx->cbUserData))
+            || !ctx->write(&shdr, sizeof(shdr))) {
+        if (ctx->cbClose) {
+            ctx->cbClose(ctx->cbUserData);
+        }
+        ctx->clearCallbacks();
+        ctx->haveExpectedChunks = false;
+        return false;
+    }
+
+    ctx->isOpen = true;
+
+    return true;
+}
+
+/*!
+ * \brief Close opened sparse file
+ *
+ * Any pending data is written out and the blocks following the last written
+ * data are marked as "don't care". If enabled, the CRC32 chunk is then written.
+ * For seekable output, the main sparse header is rewritten with the final chunk
+ * count.
+ *
+ * \note If the sparse file is open, then no matter what value is returned, the
+ *       sparse file will be closed.
+ *
+ * \param ctx Sparse writer context
+ * \return Whether the sparse file was completely written and the close
+ *         callback (if one was provided) succeeded. Fails if the amount of
+ *         data written is not a multiple of the block size or, for unseekable
+ *         output, if the number of chunks does not match the value passed to
+ *         \a sparseWriterSetChunkCount().
+ */
+bool sparseWriterClose(SparseWriterCtx *ctx)
+{
+    if (!ctx->isOpen) {
+        return false;
+    }
+
+    bool ret = !ctx->failed;
+
+    if (ret && (!ctx->blockBuf.empty()
+            || ctx->outOffset % ctx->shdr.blk_sz != 0)) {
+        ERROR("Data does not end on a block boundary");
+        ret = false;
+    }
+
+    if (ret) {
+        uint32_t remaining = (ctx->fileSize - ctx->outOffset)
+                / ctx->shdr.blk_sz;
+        ctx->outOffset = ctx->fileSize;
+
+        ret = ctx->addBlocks(CHUNK_TYPE_DONT_CARE, 0, remaining)
+                && ctx->flushPending();
+    }
+
+    if (ret && ctx->writeCrc32) {
+        ret = ctx->writeChunk(CHUNK_TYPE_CRC32, 0, &ctx->crc32,
+                              sizeof(ctx->crc32));
+    }
+
+    if (ret) {
+        DEBUG("Wrote %" PRIu32 " chunks for %" PRIu32 " blocks",
+              ctx->shdr.total_chunks, ctx->shdr.total_blks);
+
+        if (ctx->cbSeek) {
+            ret = ctx->cbSeek(0, SEEK_SET, ctx->cbUserData)
+                    && ctx->write(&ctx->shdr, sizeof(ctx->shdr));
+        } else if (ctx->haveExpectedChunks
+                && ctx->shdr.total_chunks != ctx->expectedChunks) {
+            ERROR("Expected %" PRIu32 " chunks, but wrote %" PRIu32,
+                  ctx->expectedChunks, ctx->shdr.total_chunks);
+            ret = false;
+        }
+    }
+
+    if (ctx->cbClose && !ctx->cbClose(ctx->cbUserData)) {
+        ret = false;
+    }
+
+    ctx->isOpen = false;
+    ctx->haveExpectedChunks = false;
+    ctx->rawBuf.clear();
+    ctx->rawBuf.shrink_to_fit();
+    ctx->blockBuf.clear();
+    ctx->blockBuf.shrink_to_fit();
+    ctx->clearCallbacks();
+
+    return ret;
+}
+
+/*!
+ * \brief Append image data to the sparse file
+ *
+ * Each block is classified as it is completed. Blocks consisting of a repeated
+ * 32-bit value are stored as fill chunks (or as "don't care" chunks if the
+ * value is zero and \a sparseWriterSetSkipZeros() is enabled). All other
+ * blocks are stored as raw chunks. Consecutive blocks of the same type are
+ * merged into the same chunk. \a size does not need to be a multiple of the
+ * block size.
+ *
+ * \param ctx Sparse writer context
+ * \param buf Data to append
+ * \param size Size of data
+ * \return Whether the data was appended. Fails if \a size exceeds the
+ *         remaining space in the image or if writing to the output failed.
+ */
+bool sparseWriterWrite(SparseWriterCtx *ctx, const void *buf, uint64_t size)
+{
+    if (!ctx->isOpen || ctx->failed) {
+        return false;
+    }
+
+    if (size > ctx->fileSize - ctx->outOffset) {
+        ERROR("Data exceeds image size");
+        return false;
+    }
+
+    auto data = static_cast<const unsigned char *>(buf);
+    const uint32_t blockSize = ctx->shdr.blk_sz;
+    ctx->outOffset += size;
+
+    // Complete a partial block from sparseWriterAddRaw() as raw data
+    uint64_t partial = (ctx->outOffset - size) % blockSize;
+    if (partial != 0 && ctx->blockBuf.empty()) {
+        uint64_t n = std::min<uint64_t>(size, blockSize - partial);
+        if (!ctx->addRaw(data, n)) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+
+    // Complete a partial block from a previous call
+    if (!ctx->blockBuf.empty()) {
+        uint64_t n = std::min<uint64_t>(
+                size, blockSize - ctx->blockBuf.size());
+        ctx->blockBuf.insert(ctx->blockBuf.end(), data, data + n);
+        data += n;
+        size -= n;
+
+        if (ctx->blockBuf.size() < blockSize) {
+            return true;
+        } else if (!ctx->addClassified(ctx->blockBuf.data(), blockSize)) {
+            return false;
+        }
+        ctx->blockBuf.clear();
+    }
+
+    uint64_t whole = size - size % blockSize;
+    if (!ctx->addClassified(data, whole)) {
+        return false;
+    }
+
+    ctx->blockBuf.assign(data + whole, data + size);
+    return true;
+}
+
+/*!
+ * \brief Append data to the sparse file without classifying it
+ *
+ * The data is stored in raw chunks. Data from consecutive calls is merged into
+ * the same chunk, so \a size does not need to be a multiple of the block size.
+ *
+ * \param ctx Sparse writer context
+ * \param buf Data to append
+ * \param size Size of data
+ * \return Whether the data was appended. Fails if \a size exceeds the
+ *         remaining space in the image or if writing to the output failed.
+ */
+bool sparseWriterAddRaw(SparseWriterCtx *ctx, const void *buf, uint64_t size)
+{
+    if (!ctx->isOpen || ctx->failed) {
+        return false;
+    }
+
+    if (size > ctx->fileSize - ctx->outOffset) {
+        ERROR("Data exceeds image size");
+        return false;
+    }
+
+    // A partial block from sparseWriterWrite() becomes raw data
+    if (!ctx->blockBuf.empty()) {
+        if (!ctx->addRaw(ctx->blockBuf.data(), ctx->blockBuf.size())) {
+            return false;
+        }
+        ctx->blockBuf.clear();
+    }
+
+    if (!ctx->addRaw(static_cast<const unsigned char *>(buf), size)) {
+        return false;
+    }
+
+    ctx->outOffset += size;
+    return true;
+}
+
+/*!
+ * \brief Append blocks filled with a 32-bit value to the sparse file
+ *
+ * \param ctx Sparse writer context
+ * \param fillVal Fill value
+ * \param size Number of bytes to fill (must be a multiple of the block size)
+ * \return Whether the blocks were appended. Fails if the current position or
+ *         \a size is not a multiple of the block size, if \a size exceeds the
+ *         remaining space in the image, or if writing to the output failed.
+ */
+bool sparseWriterAddFill(SparseWriterCtx *ctx, uint32_t fillVal,
+                         uint64_t size)
+{
+    if (!ctx->isOpen || ctx->failed) {
+        return false;
+    }
+
+    if (ctx->outOffset % ctx->shdr.blk_sz != 0
+            || size % ctx->shdr.blk_sz != 0) {
+        ERROR("Fill region is not aligned to the block size");
+        return false;
+    } else if (size > ctx->fileSize - ctx->outOffset) {
+        ERROR("Fill region exceeds image size");
+        return false;
+    }
+
+    if (!ctx->addBlocks(CHUNK_TYPE_FILL, fillVal, size / ctx->shdr.blk_sz)) {
+        return false;
+    }
+
+    ctx->outOffset += size;
+    return true;
+}
+
+/*!
+ * \brief Append "don't care" blocks to the sparse file
+ *
+ * The contents of "don't care" blocks are undefined when the sparse file is
+ * extracted. libmbsparse treats them as zeros.
+ *
+ * \param ctx Sparse writer context
+ * \param size Number of bytes to skip (must be a multiple of the block size)
+ * \return Whether the blocks were appended. Fails if the current position or
+ *         \a size is not a multiple of the block size, if \a size exceeds the
+ *         remaining space in the image, or if writing to the output failed.
+ */
+bool sparseWriterAddDontCare(SparseWriterCtx *ctx, uint64_t size)
+{
+    if (!ctx->isOpen || ctx->failed) {
+        return false;
+    }
+
+    if (ctx->outOffset % ctx->shdr.blk_sz != 0
+            || size % ctx->shdr.blk_sz != 0) {
+        ERROR("\"Don't care\" region is not aligned to the block size");
+        return false;
+    } else if (size > ctx->fileSize - ctx->outOffset) {
+        ERROR("\"Don't care\" region exceeds image size");
+        return false;
+    }
+
+    if (!ctx->addBlocks(CHUNK_TYPE_DONT_CARE, 0, size / ctx->shdr.blk_sz)) {
+        return false;
+    }
+
+    ctx->outOffset += size;
+    return true;
+}
+
+}
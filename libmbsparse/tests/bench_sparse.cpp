@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Measures sparseRead() throughput with and without CRC32 verification.
+//
+// Usage: bench_sparse [output size in MiB] [passes]
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "mblog/base_logger.h"
+#include "mblog/logging.h"
+#include "mbsparse/sparse.h"
+
+#define BLOCK_SIZE      4096
+#define CHUNK_BLOCKS    1024
+
+class NullLogger : public mb::log::BaseLogger
+{
+public:
+    virtual void log(mb::log::LogLevel prio, const char *fmt,
+                     va_list ap) override
+    {
+        (void) prio;
+        (void) fmt;
+        (void) ap;
+    }
+};
+
+struct Source
+{
+    const std::vector<unsigned char> *data;
+    size_t pos;
+};
+
+static bool cbRead(void *buf, uint64_t size, uint64_t *bytesRead,
+                   void *userData)
+{
+    Source *src = static_cast<Source *>(userData);
+    uint64_t canRead = std::min<uint64_t>(size, src->data->size() - src->pos);
+    memcpy(buf, src->data->data() + src->pos, canRead);
+    src->pos += canRead;
+    *bytesRead = canRead;
+    return true;
+}
+
+// Simple reference implementation for building the CRC32 chunk
+static uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t size)
+{
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int j = 0; j < 8; ++j) {
+                c = (c >> 1) ^ (-(c & 1) & 0xedb88320);
+            }
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+template<typename T>
+static void append(std::vector<unsigned char> &data, const T &value)
+{
+    auto const *ptr = reinterpret_cast<const unsigned char *>(&value);
+    data.insert(data.end(), ptr, ptr + sizeof(T));
+}
+
+// Build sparse image with a repeating raw, raw, fill, don't care chunk pattern
+// followed by a CRC32 chunk
+static void buildImage(std::vector<unsigned char> &data, uint32_t chunks)
+{
+    std::mt19937 rng(0);
+    std::vector<unsigned char> raw(CHUNK_BLOCKS * BLOCK_SIZE);
+    std::vector<unsigned char> zeros(CHUNK_BLOCKS * BLOCK_SIZE);
+    uint32_t crc = 0;
+
+    SparseHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    hdr.file_hdr_sz = sizeof(SparseHeader);
+    hdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    hdr.blk_sz = BLOCK_SIZE;
+    hdr.total_blks = chunks * CHUNK_BLOCKS;
+    hdr.total_chunks = chunks + 1;
+    append(data, hdr);
+
+    for (uint32_t i = 0; i < chunks; ++i) {
+        ChunkHeader chdr;
+        memset(&chdr, 0, sizeof(chdr));
+        chdr.chunk_sz = CHUNK_BLOCKS;
+
+        switch (i % 4) {
+        case 0:
+        case 1:
+            for (auto &c : raw) {
+                c = static_cast<unsigned char>(rng());
+            }
+            chdr.chunk_type = CHUNK_TYPE_RAW;
+            chdr.total_sz = sizeof(ChunkHeader) + raw.size();
+            append(data, chdr);
+            data.insert(data.end(), raw.begin(), raw.end());
+            crc = crc32Update(crc, raw.data(), raw.size());
+            break;
+        case 2: {
+            uint32_t fillVal = 0x12345678;
+            std::vector<unsigned char> fill(raw.size());
+            for (size_t j = 0; j < fill.size(); j += sizeof(fillVal)) {
+                memcpy(fill.data() + j, &fillVal, sizeof(fillVal));
+            }
+            chdr.chunk_type = CHUNK_TYPE_FILL;
+            chdr.total_sz = sizeof(ChunkHeader) + sizeof(fillVal);
+            append(data, chdr);
+            append(data, fillVal);
+            crc = crc32Update(crc, fill.data(), fill.size());
+            break;
+        }
+        case 3:
+            chdr.chunk_type = CHUNK_TYPE_DONT_CARE;
+            chdr.total_sz = sizeof(ChunkHeader);
+            append(data, chdr);
+            crc = crc32Update(crc, zeros.data(), zeros.size());
+            break;
+        }
+    }
+
+    ChunkHeader chdr;
+    memset(&chdr, 0, sizeof(chdr));
+    chdr.chunk_type = CHUNK_TYPE_CRC32;
+    chdr.total_sz = sizeof(ChunkHeader) + sizeof(crc);
+    append(data, chdr);
+    append(data, crc);
+}
+
+static bool readAll(const std::vector<unsigned char> &data, bool verify,
+                    double *seconds, uint64_t *total)
+{
+    std::unique_ptr<SparseCtx, bool (*)(SparseCtx *)> ctx(
+            sparseCtxNew(), &sparseCtxFree);
+    Source src{&data, 0};
+    std::vector<char> buf(1024 * 1024);
+    uint64_t n;
+    bool ret;
+
+    *total = 0;
+
+    if (!ctx || !sparseSetVerifyCrc32(ctx.get(), verify)) {
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    if (!sparseOpen(ctx.get(), nullptr, nullptr, &cbRead, nullptr, nullptr,
+                    &src)) {
+        return false;
+    }
+
+    while ((ret = sparseRead(ctx.get(), buf.data(), buf.size(), &n))
+            && n > 0) {
+        *total += n;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    *seconds = std::chrono::duration<double>(end - start).count();
+
+    return ret && sparseClose(ctx.get());
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long sizeMiB = 1024;
+    int passes = 3;
+
+    if (argc > 1) {
+        sizeMiB = strtoul(argv[1], nullptr, 10);
+    }
+    if (argc > 2) {
+        passes = atoi(argv[2]);
+    }
+
+    mb::log::log_set_logger(std::make_shared<NullLogger>());
+
+    uint32_t chunks = std::max<uint32_t>(
+            1, sizeMiB * 1024 * 1024 / (CHUNK_BLOCKS * BLOCK_SIZE));
+
+    std::vector<unsigned char> data;
+    buildImage(data, chunks);
+
+    printf("Output size: %" PRIu64 " MiB (%" PRIu32 " chunks)\n",
+           (uint64_t) chunks * CHUNK_BLOCKS * BLOCK_SIZE / 1024 / 1024, chunks);
+
+    for (bool verify : { false, true }) {
+        double best = 0;
+
+        for (int i = 0; i < passes; ++i) {
+            double seconds;
+            uint64_t total;
+
+            if (!readAll(data, verify, &seconds, &total)) {
+                fprintf(stderr, "Failed to read sparse image\n");
+                return EXIT_FAILURE;
+            }
+
+            double gbps = total / seconds / 1e9;
+            best = std::max(best, gbps);
+        }
+
+        printf("CRC32 verification %-8s %.2f GB/s\n",
+               verify ? "enabled:" : "disabled:", best);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -19,6 +19,9 @@
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <memory>
+
 #include "mbsparse/sparse.h"
 
 struct SparseTest : testing::Test
@@ -26,6 +29,8 @@ struct SparseTest : testing::Test
     SparseCtx *_ctx;
     std::vector<unsigned char> _data;
     size_t _pos = 0;
+    std::vector<char> _output;
+    std::atomic<int> _copies{0};
 
     SparseTest()
     {
@@ -115,6 +120,93 @@ struct SparseTest : testing::Test
         return ::sparseTell(_ctx, offset);
     }
 
+    bool sparseSetVerifyCrc32(bool verify)
+    {
+        return ::sparseSetVerifyCrc32(_ctx, verify);
+    }
+
+    static uint32_t crc32(const void *buf, size_t size)
+    {
+        auto const *p = static_cast<const unsigned char *>(buf);
+        uint32_t crc = 0xffffffff;
+        for (size_t i = 0; i < size; ++i) {
+            crc ^= p[i];
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc >> 1) ^ (-(crc & 1) & 0xedb88320);
+            }
+        }
+        return ~crc;
+    }
+
+    static bool cbReadAt(void *buf, uint64_t size, uint64_t offset,
+                         void *userData)
+    {
+        SparseTest *test = static_cast<SparseTest *>(userData);
+        if (offset > test->_data.size()
+                || size > test->_data.size() - offset) {
+            return false;
+        }
+        memcpy(buf, test->_data.data() + offset, size);
+        return true;
+    }
+
+    static bool cbWriteAt(const void *buf, uint64_t size, uint64_t offset,
+                          void *userData)
+    {
+        SparseTest *test = static_cast<SparseTest *>(userData);
+        if (offset > test->_output.size()
+                || size > test->_output.size() - offset) {
+            return false;
+        }
+        memcpy(test->_output.data() + offset, buf, size);
+        return true;
+    }
+
+    static bool cbCopy(uint64_t srcOffset, uint64_t dstOffset, uint64_t size,
+                       void *userData)
+    {
+        SparseTest *test = static_cast<SparseTest *>(userData);
+        ++test->_copies;
+        std::vector<char> buf(size);
+        return cbReadAt(buf.data(), size, srcOffset, userData)
+                && cbWriteAt(buf.data(), size, dstOffset, userData);
+    }
+
+    static bool cbWrite(const void *buf, uint64_t size, void *userData)
+    {
+        SparseTest *test = static_cast<SparseTest *>(userData);
+        auto const *data = static_cast<const unsigned char *>(buf);
+        if (test->_pos + size > test->_data.size()) {
+            test->_data.resize(test->_pos + size);
+        }
+        memcpy(test->_data.data() + test->_pos, data, size);
+        test->_pos += size;
+        return true;
+    }
+
+    static bool cbWriteFail(const void *buf, uint64_t size, void *userData)
+    {
+        (void) buf;
+        (void) size;
+        (void) userData;
+        return false;
+    }
+
+    bool sparseBuildIndex()
+    {
+        return ::sparseBuildIndex(_ctx);
+    }
+
+    bool sparseSaveIndex(FILE *fp)
+    {
+        return ::sparseSaveIndex(_ctx, fp);
+    }
+
+    bool sparseLoadIndex(FILE *fp)
+    {
+        return ::sparseLoadIndex(_ctx, fp);
+    }
+
     void buildDataHeaderProperSized()
     {
         SparseHeader hdr;
@@ -170,7 +262,7 @@ struct SparseTest : testing::Test
         memcpy(_data.data(), &hdr, sizeof(SparseHeader));
     }
 
-    void buildDataCompleteValid()
+    void buildDataCompleteValid(uint32_t crc32 = 0)
     {
         SparseHeader hdr;
         auto const *hdrPtr = reinterpret_cast<const unsigned char *>(&hdr);
@@ -226,7 +318,6 @@ struct SparseTest : testing::Test
         chdr.total_sz = hdr.chunk_hdr_sz + sizeof(uint32_t);
         _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
         // [4/4] Add CRC32 chunk data
-        uint32_t crc32 = 0;
         auto const *crc32Ptr = reinterpret_cast<const unsigned char *>(&crc32);
         _data.insert(_data.end(), crc32Ptr, crc32Ptr + sizeof(uint32_t));
     }
@@ -377,6 +468,765 @@ TEST_F(SparseTest, ReadValidSparseFileNoSeek)
     ASSERT_TRUE(sparseClose());
 }
 
+TEST_F(SparseTest, RandomSeekWithIndex)
+{
+    char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12,
+        0x78, 0x56, 0x34, 0x12,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    char buf[48];
+    uint64_t bytesRead;
+    buildDataCompleteValid();
+
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseBuildIndex());
+
+    // Read every (offset, size) pair in reverse order so that every seek moves
+    // backwards across chunk boundaries
+    for (int offset = 47; offset >= 0; --offset) {
+        for (size_t size = 1; size <= 48 - (size_t) offset; ++size) {
+            ASSERT_TRUE(sparseSeek(offset, SEEK_SET));
+            ASSERT_TRUE(sparseRead(buf, size, &bytesRead));
+            ASSERT_EQ(bytesRead, size);
+            ASSERT_EQ(memcmp(buf, expected + offset, size), 0);
+        }
+    }
+
+    // Reading past EOF still returns nothing
+    ASSERT_TRUE(sparseSeek(48, SEEK_SET));
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 0);
+
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, BuildIndexNoSeek)
+{
+    buildDataCompleteValid();
+
+    ASSERT_TRUE(sparseOpenNoSeek());
+    ASSERT_FALSE(sparseBuildIndex());
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, SaveAndLoadIndex)
+{
+    char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12,
+        0x78, 0x56, 0x34, 0x12,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    char buf[48];
+    uint64_t bytesRead;
+    buildDataCompleteValid();
+
+    std::unique_ptr<FILE, int (*)(FILE *)> fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!fp);
+
+    // Save index without explicitly building it
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseSaveIndex(fp.get()));
+    ASSERT_TRUE(sparseClose());
+
+    // Load index and make sure that reads don't need to touch the chunk
+    // headers in the source anymore
+    rewind(fp.get());
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseLoadIndex(fp.get()));
+    ASSERT_TRUE(sparseSeek(20, SEEK_SET));
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 28);
+    ASSERT_EQ(memcmp(buf, expected + 20, 28), 0);
+    ASSERT_TRUE(sparseSeek(0, SEEK_SET));
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_EQ(memcmp(buf, expected, 48), 0);
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, LoadStaleIndex)
+{
+    buildDataCompleteValid();
+
+    std::unique_ptr<FILE, int (*)(FILE *)> fp(tmpfile(), &fclose);
+    ASSERT_TRUE(!!fp);
+
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseSaveIndex(fp.get()));
+    ASSERT_TRUE(sparseClose());
+
+    // Change the type of the last chunk while keeping the sparse header intact
+    size_t lastChunkOffset = _data.size() - sizeof(uint32_t)
+            - sizeof(ChunkHeader);
+    ChunkHeader *chdr = reinterpret_cast<ChunkHeader *>(
+            _data.data() + lastChunkOffset);
+    chdr->chunk_type = CHUNK_TYPE_FILL;
+
+    rewind(fp.get());
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_FALSE(sparseLoadIndex(fp.get()));
+    // Chunk headers can still be read from the source
+    char buf[48];
+    uint64_t bytesRead;
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_TRUE(sparseClose());
+
+    // Empty index file
+    std::unique_ptr<FILE, int (*)(FILE *)> empty(tmpfile(), &fclose);
+    ASSERT_TRUE(!!empty);
+
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_FALSE(sparseLoadIndex(empty.get()));
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, IterateChunks)
+{
+    char buf[1024];
+    uint64_t bytesRead;
+    uint64_t pos;
+    SparseChunk chunk;
+    buildDataCompleteValid();
+
+    ASSERT_TRUE(sparseOpenNoSeek());
+
+    // Partially read raw chunk
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_RAW);
+    ASSERT_EQ(chunk.begin, 0);
+    ASSERT_EQ(chunk.end, 16);
+    ASSERT_TRUE(sparseRead(buf, 4, &bytesRead));
+    ASSERT_EQ(bytesRead, 4);
+    ASSERT_EQ(memcmp(buf, "0123", 4), 0);
+
+    // Remaining range of the raw chunk
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_RAW);
+    ASSERT_EQ(chunk.begin, 4);
+    ASSERT_EQ(chunk.end, 16);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+    ASSERT_TRUE(sparseTell(&pos));
+    ASSERT_EQ(pos, 16);
+
+    // Fill chunk
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_FILL);
+    ASSERT_EQ(chunk.begin, 16);
+    ASSERT_EQ(chunk.end, 32);
+    ASSERT_EQ(chunk.fillVal, 0x12345678);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+
+    // Don't care chunk (CRC32 chunk is never returned)
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_DONT_CARE);
+    ASSERT_EQ(chunk.begin, 32);
+    ASSERT_EQ(chunk.end, 48);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+
+    // EOF
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.begin, chunk.end);
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 0);
+
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, SkipChunksWithCrc32)
+{
+    char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12,
+        0x78, 0x56, 0x34, 0x12,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    char buf[1024];
+    uint64_t bytesRead;
+    SparseChunk chunk;
+
+    for (uint32_t crc : { crc32(expected, sizeof(expected)), 0xdeadbeefu }) {
+        _data.clear();
+        _pos = 0;
+        buildDataCompleteValid(crc);
+
+        ASSERT_TRUE(sparseSetVerifyCrc32(true));
+        ASSERT_TRUE(sparseOpenNoSeek());
+
+        // Read raw chunk, but skip fill and don't care chunks
+        ASSERT_TRUE(sparseRead(buf, 16, &bytesRead));
+        ASSERT_EQ(bytesRead, 16);
+        ASSERT_TRUE(sparseSkipChunk(_ctx));
+        ASSERT_TRUE(sparseSkipChunk(_ctx));
+
+        // The CRC32 chunk is reached when looking for the next chunk
+        ASSERT_EQ(sparseGetChunk(_ctx, &chunk), crc != 0xdeadbeefu);
+
+        ASSERT_TRUE(sparseClose());
+    }
+}
+
+TEST_F(SparseTest, SkipLargeChunksWithCrc32)
+{
+    // Skipped chunks span multiple 4 KiB blocks and end with a partial block
+    SparseHeader hdr;
+    auto const *hdrPtr = reinterpret_cast<const unsigned char *>(&hdr);
+
+    memset(&hdr, 0, sizeof(SparseHeader));
+    hdr.magic = SPARSE_HEADER_MAGIC;
+    hdr.major_version = SPARSE_HEADER_MAJOR_VER;
+    hdr.minor_version = 0;
+    hdr.file_hdr_sz = sizeof(SparseHeader);
+    hdr.chunk_hdr_sz = sizeof(ChunkHeader);
+    hdr.blk_sz = 1000;
+    hdr.total_blks = 23;
+    hdr.total_chunks = 4;
+    hdr.image_checksum = 0;
+    _data.insert(_data.end(), hdrPtr, hdrPtr + sizeof(SparseHeader));
+
+    std::vector<unsigned char> expected;
+    ChunkHeader chdr;
+    auto const *chdrPtr = reinterpret_cast<const unsigned char *>(&chdr);
+
+    // [1/4] Raw chunk (1000 bytes)
+    memset(&chdr, 0, sizeof(ChunkHeader));
+    chdr.chunk_type = CHUNK_TYPE_RAW;
+    chdr.chunk_sz = 1;
+    chdr.total_sz = hdr.chunk_hdr_sz + chdr.chunk_sz * hdr.blk_sz;
+    _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
+    for (int i = 0; i < 1000; ++i) {
+        expected.push_back(static_cast<unsigned char>(i));
+    }
+    _data.insert(_data.end(), expected.begin(), expected.end());
+
+    // [2/4] Fill chunk (13000 bytes)
+    memset(&chdr, 0, sizeof(ChunkHeader));
+    chdr.chunk_type = CHUNK_TYPE_FILL;
+    chdr.chunk_sz = 13;
+    chdr.total_sz = hdr.chunk_hdr_sz + sizeof(uint32_t);
+    _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
+    uint32_t fillVal = 0x12345678;
+    auto const *fillValPtr = reinterpret_cast<const unsigned char *>(&fillVal);
+    _data.insert(_data.end(), fillValPtr, fillValPtr + sizeof(uint32_t));
+    for (int i = 0; i < 13000 / 4; ++i) {
+        expected.insert(expected.end(), fillValPtr,
+                        fillValPtr + sizeof(uint32_t));
+    }
+
+    // [3/4] Don't care chunk (9000 bytes)
+    memset(&chdr, 0, sizeof(ChunkHeader));
+    chdr.chunk_type = CHUNK_TYPE_DONT_CARE;
+    chdr.chunk_sz = 9;
+    chdr.total_sz = hdr.chunk_hdr_sz;
+    _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
+    expected.insert(expected.end(), 9000, 0);
+
+    // [4/4] CRC32 chunk
+    memset(&chdr, 0, sizeof(ChunkHeader));
+    chdr.chunk_type = CHUNK_TYPE_CRC32;
+    chdr.chunk_sz = 0;
+    chdr.total_sz = hdr.chunk_hdr_sz + sizeof(uint32_t);
+    _data.insert(_data.end(), chdrPtr, chdrPtr + sizeof(ChunkHeader));
+    uint32_t crc = crc32(expected.data(), expected.size());
+    auto const *crc32Ptr = reinterpret_cast<const unsigned char *>(&crc);
+    _data.insert(_data.end(), crc32Ptr, crc32Ptr + sizeof(uint32_t));
+    size_t crc32Pos = _data.size() - sizeof(uint32_t);
+
+    char buf[1000];
+    uint64_t bytesRead;
+    SparseChunk chunk;
+
+    for (bool valid : { true, false }) {
+        if (!valid) {
+            _data[crc32Pos] ^= 0xff;
+        }
+        _pos = 0;
+
+        ASSERT_TRUE(sparseSetVerifyCrc32(true));
+        ASSERT_TRUE(sparseOpenNoSeek());
+
+        ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+        ASSERT_EQ(bytesRead, sizeof(buf));
+        ASSERT_TRUE(sparseSkipChunk(_ctx));
+        ASSERT_TRUE(sparseSkipChunk(_ctx));
+
+        ASSERT_EQ(sparseGetChunk(_ctx, &chunk), valid);
+
+        ASSERT_TRUE(sparseClose());
+    }
+}
+
+TEST_F(SparseTest, ExtractParallel)
+{
+    char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12,
+        0x78, 0x56, 0x34, 0x12,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    uint64_t pos;
+    buildDataCompleteValid();
+
+    // Positional reads and writes
+    _output.assign(48, 0);
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseExtractParallel(_ctx, &cbReadAt, &cbWriteAt, nullptr,
+                                      this, 4));
+    ASSERT_EQ(memcmp(_output.data(), expected, 48), 0);
+    ASSERT_TRUE(sparseTell(&pos));
+    ASSERT_EQ(pos, 48);
+    ASSERT_TRUE(sparseClose());
+
+    // Raw data is copied with the copy callback if provided
+    _output.assign(48, 0);
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseExtractParallel(_ctx, &cbReadAt, &cbWriteAt, &cbCopy,
+                                      this, 0));
+    ASSERT_EQ(memcmp(_output.data(), expected, 48), 0);
+    ASSERT_EQ(_copies, 1);
+    ASSERT_TRUE(sparseClose());
+
+    // Failed write
+    _output.assign(20, 0);
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_FALSE(sparseExtractParallel(_ctx, &cbReadAt, &cbWriteAt, nullptr,
+                                       this, 2));
+    ASSERT_TRUE(sparseClose());
+
+    // Index cannot be built without a seek callback
+    _pos = 0;
+    ASSERT_TRUE(sparseOpenNoSeek());
+    ASSERT_FALSE(sparseExtractParallel(_ctx, &cbReadAt, &cbWriteAt, nullptr,
+                                       this, 2));
+    ASSERT_TRUE(sparseClose());
+
+    // CRC32 verification is not supported
+    _output.assign(48, 0);
+    _pos = 0;
+    ASSERT_TRUE(sparseSetVerifyCrc32(true));
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_FALSE(sparseExtractParallel(_ctx, &cbReadAt, &cbWriteAt, nullptr,
+                                       this, 2));
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, VerifyCrc32)
+{
+    char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12, 0x78, 0x56, 0x34, 0x12,
+        0x78, 0x56, 0x34, 0x12,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    char buf[1024];
+    uint64_t bytesRead;
+    buildDataCompleteValid(crc32(expected, sizeof(expected)));
+
+    ASSERT_TRUE(sparseSetVerifyCrc32(true));
+
+    // Sequential read with lazily loaded chunks
+    ASSERT_TRUE(sparseOpenNoSeek());
+    ASSERT_FALSE(sparseSetVerifyCrc32(false));
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_EQ(memcmp(buf, expected, 48), 0);
+    ASSERT_TRUE(sparseClose());
+
+    // Read with index built before the data is read, including a backwards
+    // seek that rereads already verified data
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseBuildIndex());
+    ASSERT_TRUE(sparseRead(buf, 20, &bytesRead));
+    ASSERT_EQ(bytesRead, 20);
+    ASSERT_TRUE(sparseSeek(10, SEEK_SET));
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 38);
+    ASSERT_EQ(memcmp(buf, expected + 10, 38), 0);
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, VerifyCrc32Mismatch)
+{
+    char buf[1024];
+    uint64_t bytesRead;
+    buildDataCompleteValid(0xdeadbeef);
+
+    // Data is still returned without verification
+    ASSERT_TRUE(sparseOpenNoSeek());
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_TRUE(sparseClose());
+
+    ASSERT_TRUE(sparseSetVerifyCrc32(true));
+
+    // Data before the CRC32 chunk can be read, but reaching the chunk fails
+    _pos = 0;
+    ASSERT_TRUE(sparseOpenNoSeek());
+    ASSERT_TRUE(sparseRead(buf, 48, &bytesRead));
+    ASSERT_EQ(bytesRead, 48);
+    ASSERT_FALSE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_TRUE(sparseClose());
+
+    // Same with the index built up front
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseBuildIndex());
+    ASSERT_FALSE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, WriteAndReadBack)
+{
+    const char expected[48] = {
+        '0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
+        'a', 'b', 'c', 'd', 'e', 'f',
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+        'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+        0, 0, 0, 0, 0, 0, 0, 0
+    };
+
+    SparseWriterCtx *writer = sparseWriterCtxNew();
+    ASSERT_NE(writer, nullptr);
+
+    ASSERT_TRUE(sparseWriterOpen(writer, 4, 48, nullptr, nullptr, &cbWrite,
+                                 &cbSeek, this));
+    // Unaligned data from consecutive calls is merged into one chunk
+    ASSERT_TRUE(sparseWriterAddRaw(writer, expected, 10));
+    ASSERT_TRUE(sparseWriterAddRaw(writer, expected + 10, 6));
+    ASSERT_TRUE(sparseWriterAddDontCare(writer, 8));
+    ASSERT_TRUE(sparseWriterAddDontCare(writer, 8));
+    ASSERT_TRUE(sparseWriterAddRaw(writer, expected + 32, 8));
+    // The remaining blocks are "don't care"
+    ASSERT_TRUE(sparseWriterClose(writer));
+    ASSERT_TRUE(sparseWriterCtxFree(writer));
+
+    SparseHeader hdr;
+    ASSERT_GE(_data.size(), sizeof(hdr));
+    memcpy(&hdr, _data.data(), sizeof(hdr));
+    ASSERT_EQ(hdr.blk_sz, 4u);
+    ASSERT_EQ(hdr.total_blks, 12u);
+    ASSERT_EQ(hdr.total_chunks, 4u);
+
+    SparseChunk chunk;
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_RAW);
+    ASSERT_EQ(chunk.begin, 0u);
+    ASSERT_EQ(chunk.end, 16u);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_DONT_CARE);
+    ASSERT_EQ(chunk.begin, 16u);
+    ASSERT_EQ(chunk.end, 32u);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_RAW);
+    ASSERT_EQ(chunk.begin, 32u);
+    ASSERT_EQ(chunk.end, 40u);
+    ASSERT_TRUE(sparseSkipChunk(_ctx));
+    ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+    ASSERT_EQ(chunk.type, CHUNK_TYPE_DONT_CARE);
+    ASSERT_EQ(chunk.begin, 40u);
+    ASSERT_EQ(chunk.end, 48u);
+    ASSERT_TRUE(sparseClose());
+
+    char buf[1024];
+    uint64_t bytesRead;
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    ASSERT_TRUE(sparseRead(buf, sizeof(buf), &bytesRead));
+    ASSERT_EQ(bytesRead, 48u);
+    ASSERT_EQ(memcmp(buf, expected, 48), 0);
+    ASSERT_TRUE(sparseClose());
+}
+
+TEST_F(SparseTest, WriteInvalid)
+{
+    const char data[16] = {};
+
+    SparseWriterCtx *writer = sparseWriterCtxNew();
+    ASSERT_NE(writer, nullptr);
+
+    // Seek callback is required unless the chunk count is known
+    ASSERT_FALSE(sparseWriterOpen(writer, 4, 16, nullptr, nullptr, &cbWrite,
+                                  nullptr, this));
+    // Invalid block size
+    ASSERT_FALSE(sparseWriterOpen(writer, 6, 12, nullptr, nullptr, &cbWrite,
+                                  &cbSeek, this));
+    // Size is not a multiple of the block size
+    ASSERT_FALSE(sparseWriterOpen(writer, 4, 18, nullptr, nullptr, &cbWrite,
+                                  &cbSeek, this));
+
+    ASSERT_TRUE(sparseWriterOpen(writer, 4, 16, nullptr, nullptr, &cbWrite,
+                                 &cbSeek, this));
+    // Data exceeds image size
+    ASSERT_FALSE(sparseWriterAddRaw(writer, data, 17));
+    ASSERT_TRUE(sparseWriterAddRaw(writer, data, 2));
+    // "Don't care" region must be aligned
+    ASSERT_FALSE(sparseWriterAddDontCare(writer, 4));
+    ASSERT_TRUE(sparseWriterAddRaw(writer, data, 2));
+    ASSERT_FALSE(sparseWriterAddDontCare(writer, 2));
+    ASSERT_FALSE(sparseWriterAddDontCare(writer, 16));
+    // Data must end on a block boundary
+    ASSERT_TRUE(sparseWriterAddRaw(writer, data, 1));
+    ASSERT_FALSE(sparseWriterClose(writer));
+
+    // Failed write
+    _data.clear();
+    _pos = 0;
+    ASSERT_FALSE(sparseWriterOpen(writer, 4, 16, nullptr, nullptr,
+                                  &cbWriteFail, &cbSeek, this));
+
+    ASSERT_TRUE(sparseWriterCtxFree(writer));
+}
+
+struct SparseWriterTest : SparseTest
+{
+    SparseWriterCtx *_writer;
+
+    // Block size that is not a multiple of the vector size, so both the vector
+    // and scalar parts of the block classifier are used
+    static constexpr uint32_t blockSize = 68;
+    std::vector<unsigned char> _image;
+
+    SparseWriterTest()
+    {
+        _writer = sparseWriterCtxNew();
+
+        auto addBlock = [&](uint32_t fillVal) {
+            for (uint32_t i = 0; i < blockSize; i += 4) {
+                auto p = reinterpret_cast<const unsigned char *>(&fillVal);
+                _image.insert(_image.end(), p, p + 4);
+            }
+        };
+
+        // [0, 2) Zeros
+        addBlock(0);
+        addBlock(0);
+        // [2, 4) Fill
+        addBlock(0x12345678);
+        addBlock(0x12345678);
+        // [4, 5) Fill with another value
+        addBlock(0xdeadbeef);
+        // [5, 7) Raw with the difference in the vectorized part and in the
+        //        scalar part of the block
+        addBlock(0x12345678);
+        _image[_image.size() - blockSize + 40] = 0;
+        addBlock(0x12345678);
+        _image.back() = 0;
+        // [7, 8) Zeros
+        addBlock(0);
+    }
+
+    virtual ~SparseWriterTest()
+    {
+        sparseWriterCtxFree(_writer);
+    }
+
+    // Write the image in small, unaligned pieces
+    bool writeImage()
+    {
+        for (size_t pos = 0; pos < _image.size(); pos += 7) {
+            if (!sparseWriterWrite(_writer, _image.data() + pos, std::min<size_t>(
+                    7, _image.size() - pos))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void checkChunk(uint16_t type, uint64_t beginBlock, uint64_t endBlock,
+                    uint32_t fillVal = 0)
+    {
+        SparseChunk chunk;
+        ASSERT_TRUE(sparseGetChunk(_ctx, &chunk));
+        ASSERT_EQ(chunk.type, type);
+        ASSERT_EQ(chunk.begin, beginBlock * blockSize);
+        ASSERT_EQ(chunk.end, endBlock * blockSize);
+        if (type == CHUNK_TYPE_FILL) {
+            ASSERT_EQ(chunk.fillVal, fillVal);
+        }
+        ASSERT_TRUE(sparseSkipChunk(_ctx));
+    }
+
+    void checkImage(uint64_t size)
+    {
+        std::vector<unsigned char> buf(size + 1);
+        uint64_t bytesRead;
+
+        _pos = 0;
+        ASSERT_TRUE(sparseOpen());
+        ASSERT_TRUE(sparseRead(buf.data(), buf.size(), &bytesRead));
+        ASSERT_EQ(bytesRead, size);
+        ASSERT_EQ(memcmp(buf.data(), _image.data(), _image.size()), 0);
+        for (uint64_t i = _image.size(); i < size; ++i) {
+            ASSERT_EQ(buf[i], 0);
+        }
+        ASSERT_TRUE(sparseClose());
+    }
+};
+
+constexpr uint32_t SparseWriterTest::blockSize;
+
+TEST_F(SparseWriterTest, ClassifyBlocks)
+{
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, &cbSeek, this));
+    ASSERT_TRUE(writeImage());
+    ASSERT_TRUE(sparseWriterClose(_writer));
+
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    checkChunk(CHUNK_TYPE_FILL, 0, 2, 0);
+    checkChunk(CHUNK_TYPE_FILL, 2, 4, 0x12345678);
+    checkChunk(CHUNK_TYPE_FILL, 4, 5, 0xdeadbeef);
+    checkChunk(CHUNK_TYPE_RAW, 5, 7);
+    checkChunk(CHUNK_TYPE_FILL, 7, 8, 0);
+    checkChunk(CHUNK_TYPE_DONT_CARE, 8, 10);
+    ASSERT_TRUE(sparseClose());
+
+    checkImage(10 * blockSize);
+}
+
+TEST_F(SparseWriterTest, SkipZeros)
+{
+    ASSERT_TRUE(sparseWriterSetSkipZeros(_writer, true));
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, &cbSeek, this));
+    ASSERT_FALSE(sparseWriterSetSkipZeros(_writer, false));
+    ASSERT_TRUE(writeImage());
+    ASSERT_TRUE(sparseWriterClose(_writer));
+
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    checkChunk(CHUNK_TYPE_DONT_CARE, 0, 2);
+    checkChunk(CHUNK_TYPE_FILL, 2, 4, 0x12345678);
+    checkChunk(CHUNK_TYPE_FILL, 4, 5, 0xdeadbeef);
+    checkChunk(CHUNK_TYPE_RAW, 5, 7);
+    // Merged with the trailing "don't care" blocks
+    checkChunk(CHUNK_TYPE_DONT_CARE, 7, 10);
+    ASSERT_TRUE(sparseClose());
+
+    checkImage(10 * blockSize);
+}
+
+TEST_F(SparseWriterTest, MixedApis)
+{
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, &cbSeek, this));
+    // A partial block from sparseWriterWrite() is completed as raw data
+    ASSERT_TRUE(sparseWriterWrite(_writer, _image.data(), 10));
+    ASSERT_TRUE(sparseWriterAddRaw(_writer, _image.data() + 10,
+                                   blockSize - 10));
+    // And the other way around
+    ASSERT_TRUE(sparseWriterAddRaw(_writer, _image.data() + blockSize, 10));
+    ASSERT_TRUE(sparseWriterWrite(_writer, _image.data() + blockSize + 10,
+                                  blockSize - 10));
+    // Fill chunks are merged
+    ASSERT_FALSE(sparseWriterAddFill(_writer, 0, blockSize + 1));
+    ASSERT_TRUE(sparseWriterAddFill(_writer, 0x12345678, blockSize));
+    ASSERT_TRUE(sparseWriterWrite(_writer, _image.data() + 3 * blockSize,
+                                  blockSize));
+    ASSERT_TRUE(sparseWriterClose(_writer));
+
+    _image.resize(4 * blockSize);
+
+    _pos = 0;
+    ASSERT_TRUE(sparseOpen());
+    checkChunk(CHUNK_TYPE_RAW, 0, 2);
+    checkChunk(CHUNK_TYPE_FILL, 2, 4, 0x12345678);
+    checkChunk(CHUNK_TYPE_DONT_CARE, 4, 10);
+    ASSERT_TRUE(sparseClose());
+
+    checkImage(10 * blockSize);
+}
+
+TEST_F(SparseWriterTest, WriteCrc32)
+{
+    ASSERT_TRUE(sparseWriterSetCrc32(_writer, true));
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, &cbSeek, this));
+    ASSERT_TRUE(writeImage());
+    ASSERT_TRUE(sparseWriterClose(_writer));
+
+    std::vector<unsigned char> expected(_image);
+    expected.resize(10 * blockSize);
+    uint32_t expectedCrc = crc32(expected.data(), expected.size());
+
+    uint32_t actualCrc;
+    ASSERT_GE(_data.size(), sizeof(actualCrc));
+    memcpy(&actualCrc, _data.data() + _data.size() - sizeof(actualCrc),
+           sizeof(actualCrc));
+    ASSERT_EQ(actualCrc, expectedCrc);
+
+    ASSERT_TRUE(sparseSetVerifyCrc32(true));
+    checkImage(10 * blockSize);
+}
+
+TEST_F(SparseWriterTest, WriteSequential)
+{
+    uint32_t count;
+
+    ASSERT_TRUE(sparseWriterSetCrc32(_writer, true));
+
+    // Chunk count is required
+    ASSERT_FALSE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                  nullptr, &cbWrite, nullptr, this));
+
+    // Count chunks without writing anything
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, nullptr, nullptr, nullptr));
+    ASSERT_TRUE(writeImage());
+    ASSERT_TRUE(sparseWriterClose(_writer));
+    ASSERT_TRUE(sparseWriterGetChunkCount(_writer, &count));
+    ASSERT_EQ(count, 7u);
+    ASSERT_TRUE(_data.empty());
+
+    ASSERT_TRUE(sparseWriterSetChunkCount(_writer, count));
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, nullptr, this));
+    ASSERT_TRUE(writeImage());
+    ASSERT_TRUE(sparseWriterClose(_writer));
+
+    ASSERT_TRUE(sparseSetVerifyCrc32(true));
+    checkImage(10 * blockSize);
+
+    // Too few chunks
+    _data.clear();
+    _pos = 0;
+    ASSERT_TRUE(sparseWriterSetChunkCount(_writer, count + 1));
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, nullptr, this));
+    ASSERT_TRUE(writeImage());
+    ASSERT_FALSE(sparseWriterClose(_writer));
+
+    // Too many chunks
+    _data.clear();
+    _pos = 0;
+    ASSERT_TRUE(sparseWriterSetChunkCount(_writer, count - 1));
+    ASSERT_TRUE(sparseWriterOpen(_writer, blockSize, 10 * blockSize, nullptr,
+                                 nullptr, &cbWrite, nullptr, this));
+    ASSERT_TRUE(writeImage());
+    ASSERT_FALSE(sparseWriterClose(_writer));
+}
+
 int main(int argc, char *argv[])
 {
     testing::InitGoogleTest(&argc, argv);
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <archive.h>
@@ -30,6 +31,8 @@ namespace mb
 namespace util
 {
 
+class ChunkStore;
+
 struct extract_info {
     std::string from;
     std::string to;
@@ -45,7 +48,8 @@ enum class compression_type
     NONE,
     LZ4,
     GZIP,
-    XZ
+    XZ,
+    ZSTD
 };
 
 int libarchive_copy_data(archive *in, archive *out, archive_entry *entry);
@@ -56,11 +60,24 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
 bool libarchive_tar_extract(const std::string &filename,
                             const std::string &target,
                             const std::vector<std::string> &patterns,
-                            compression_type compression);
+                            compression_type compression,
+                            unsigned int threads);
 bool libarchive_tar_create(const std::string &filename,
                            const std::string &base_dir,
                            const std::vector<std::string> &paths,
-                           compression_type compression);
+                           compression_type compression,
+                           unsigned int threads);
+bool libarchive_tar_extract_dedup(const std::string &filename,
+                                  const std::string &target,
+                                  ChunkStore *store,
+                                  unsigned int threads);
+bool libarchive_tar_create_dedup(const std::string &filename,
+                                 const std::string &base_dir,
+                                 const std::vector<std::string> &paths,
+                                 ChunkStore *store,
+                                 const std::string &parent);
+bool libarchive_tar_get_chunks(const std::string &filename,
+                               std::unordered_set<std::string> *hashes);
 
 bool extract_archive(const std::string &filename, const std::string &target);
 bool extract_files(const std::string &filename, const std::string &target,
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <cstddef>
+#include <cstdint>
+
+// Content-defined chunk size limits. With the boundary mask used by Chunker,
+// chunks average a bit over 1 MiB.
+#define CHUNK_MIN_SIZE                  (256 * 1024)
+#define CHUNK_MAX_SIZE                  (4 * 1024 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+struct ChunkRef
+{
+    // Lowercase hex SHA-256 digest of the uncompressed chunk
+    std::string hash;
+    uint32_t size;
+};
+
+/*!
+ * \brief Content-addressed store of file chunks
+ *
+ * Chunks are stored once under `<root>/chunks/<first 2 hex digits>/<hash>`,
+ * where the hash is the SHA-256 digest of the uncompressed chunk. A chunk file
+ * contains either the raw chunk (if its size matches the chunk size) or an LZ4
+ * compressed block. Chunks are written to `<root>/tmp` and renamed into place
+ * after being synced, so a chunk that exists is always complete.
+ *
+ * Users of the store hold a shared lock on `<root>/lock` for as long as the
+ * store is open. Garbage collection requires an exclusive lock so that chunks
+ * written by a backup in progress (and not yet referenced by any manifest) are
+ * never removed.
+ */
+class ChunkStore
+{
+public:
+    ChunkStore();
+    ~ChunkStore();
+
+    ChunkStore(const ChunkStore &) = delete;
+    ChunkStore & operator=(const ChunkStore &) = delete;
+
+    bool open(const std::string &root, bool exclusive);
+    void close();
+
+    const std::string & root() const;
+
+    bool add(const void *data, size_t size, std::string *hash);
+    bool exists(const std::string &hash);
+    bool read(const ChunkRef &chunk, std::vector<unsigned char> *buf);
+
+    bool remove_unreferenced(const std::unordered_set<std::string> &referenced,
+                             uint64_t *count, uint64_t *bytes);
+
+    uint64_t chunks_added() const;
+    uint64_t bytes_added() const;
+    uint64_t bytes_stored() const;
+    uint64_t chunks_reused() const;
+    uint64_t bytes_reused() const;
+
+private:
+    std::string chunk_path(const std::string &hash) const;
+
+    std::string _root;
+    int _lock_fd;
+    bool _exclusive;
+    // Chunks known to exist in the store
+    std::unordered_set<std::string> _known;
+    std::vector<unsigned char> _buf;
+
+    uint64_t _chunks_added;
+    uint64_t _bytes_added;
+    uint64_t _bytes_stored;
+    uint64_t _chunks_reused;
+    uint64_t _bytes_reused;
+};
+
+/*!
+ * \brief Content-defined chunker
+ *
+ * Splits a stream into chunks of \a CHUNK_MIN_SIZE to \a CHUNK_MAX_SIZE bytes
+ * using a gear rolling hash. Boundaries only depend on the preceding 64 bytes,
+ * so an insertion or deletion in a large file only changes the chunks around
+ * the edit.
+ */
+class Chunker
+{
+public:
+    typedef std::function<bool(const void *data, size_t size)> ChunkCallback;
+
+    Chunker(ChunkCallback cb);
+
+    bool update(const void *data, size_t size);
+    bool finish();
+
+private:
+    ChunkCallback _cb;
+    std::vector<unsigned char> _buf;
+    uint64_t _hash;
+};
+
+std::string format_chunk_list(const std::vector<ChunkRef> &chunks);
+bool parse_chunk_list(const void *data, size_t size,
+                      std::vector<ChunkRef> *chunks);
+
+}
+}
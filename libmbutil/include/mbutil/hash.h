@@ -30,6 +30,8 @@ namespace util
 
 bool sha512_hash(const std::string &path,
                  unsigned char digest[SHA512_DIGEST_LENGTH]);
+bool sha512_hash_copy(const std::string &source, const std::string &target,
+                      unsigned char digest[SHA512_DIGEST_LENGTH]);
 
 }
 }
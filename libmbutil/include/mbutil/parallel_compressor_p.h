@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+
+#include <archive.h>
+#include <lzma.h>
+
+#include "mbutil/archive.h"
+
+// Amount of uncompressed data in each independently compressed gzip member,
+// lz4 frame, or zstd frame
+#define PARALLEL_COMPRESSOR_BLOCK_SIZE  (1024 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Multithreaded output stage for libarchive writers
+ *
+ * This sits between libarchive's tar serialization and the output file. For
+ * gzip, lz4, and zstd, the uncompressed stream is split into blocks of
+ * \a PARALLEL_COMPRESSOR_BLOCK_SIZE bytes, which are compressed by a pool of
+ * worker threads into independent gzip members or lz4/zstd frames and written
+ * out in order. Concatenated members and frames are valid gzip, lz4, and zstd
+ * streams, so the output can be read by the standard command line tools (and
+ * by libarchive, except for zstd, which is read with ZstdDecompressor). For
+ * xz, liblzma's multithreaded encoder is used, which produces a regular
+ * multi-block xz stream.
+ *
+ * The object must outlive the libarchive writer that it is attached to.
+ */
+class ParallelCompressor
+{
+public:
+    ParallelCompressor(compression_type compression, unsigned int threads);
+    ~ParallelCompressor();
+
+    ParallelCompressor(const ParallelCompressor &) = delete;
+    ParallelCompressor & operator=(const ParallelCompressor &) = delete;
+
+    bool open(archive *a, const std::string &filename);
+
+    uint64_t bytes_out() const;
+
+private:
+    struct Job
+    {
+        std::vector<unsigned char> in;
+        std::vector<unsigned char> out;
+        bool done;
+        bool failed;
+    };
+
+    static int open_cb(archive *a, void *userdata);
+    static la_ssize_t write_cb(archive *a, void *userdata,
+                               const void *buf, size_t size);
+    static int close_cb(archive *a, void *userdata);
+
+    bool start(archive *a);
+    bool write(archive *a, const void *buf, size_t size);
+    bool finish(archive *a);
+
+    bool submit_job(archive *a);
+    bool write_completed_job(archive *a);
+    void stop_workers();
+    void worker();
+    bool compress_job(Job *job);
+
+    bool xz_code(archive *a, const void *buf, size_t size, lzma_action action);
+
+    bool write_output(archive *a, const void *buf, size_t size);
+
+    compression_type _compression;
+    unsigned int _threads;
+    std::string _filename;
+    int _fd;
+    uint64_t _bytes_out;
+
+    // gzip, lz4, and zstd
+    std::mutex _mutex;
+    std::condition_variable _cv_pending;
+    std::condition_variable _cv_done;
+    // Jobs that have not been picked up by a worker
+    std::deque<Job *> _pending;
+    // All submitted jobs in output order
+    std::deque<std::unique_ptr<Job>> _in_flight;
+    // Completed jobs whose buffers can be reused
+    std::vector<std::unique_ptr<Job>> _free;
+    std::unique_ptr<Job> _current;
+    std::vector<std::thread> _workers;
+    bool _stop;
+
+    // xz
+    lzma_stream _xz;
+    bool _xz_initialized;
+    std::vector<unsigned char> _xz_buf;
+};
+
+}
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+
+#include <archive.h>
+#include <archive_entry.h>
+
+#include "mbutil/chunk_store.h"
+
+// Regular files up to this size are buffered and written by the worker threads.
+// Larger files are bound by bandwidth rather than by per-file syscalls, so they
+// are streamed to disk by the reader thread instead.
+#define PARALLEL_EXTRACTOR_MAX_FILE_SIZE        (1024 * 1024)
+// Maximum amount of file data buffered for the worker threads
+#define PARALLEL_EXTRACTOR_MAX_QUEUED_SIZE      (32 * 1024 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Multithreaded write stage for archive extraction
+ *
+ * Restoring a backup of many small files is bound by the latency of the
+ * syscalls needed to create each file and set its contents, ownership,
+ * permissions, xattrs (including SELinux labels), and timestamps. This class
+ * lets the thread that decompresses and parses the archive hand off small
+ * regular files to a pool of worker threads, each of which has its own
+ * libarchive disk writer.
+ *
+ * The caller is responsible for the ordering constraints:
+ * - Directories, symlinks, and other non-regular entries should be extracted
+ *   by the caller, so they exist before any files are created in them.
+ * - Before extracting a hard link, the caller must call wait() to ensure that
+ *   the link target has been written.
+ * - Directory metadata is applied when the caller's disk writer is closed,
+ *   which must happen after finish().
+ */
+class ParallelExtractor
+{
+public:
+    ParallelExtractor(unsigned int threads, int flags);
+    ~ParallelExtractor();
+
+    ParallelExtractor(const ParallelExtractor &) = delete;
+    ParallelExtractor & operator=(const ParallelExtractor &) = delete;
+
+    bool start();
+
+    bool submit(archive *in, archive_entry *entry);
+    bool submit(archive_entry *entry, ChunkStore *store,
+                const std::vector<ChunkRef> &chunks);
+
+    bool wait();
+    bool finish();
+
+private:
+    struct Block
+    {
+        int64_t offset;
+        size_t size;
+    };
+
+    struct Job
+    {
+        archive_entry *entry;
+        std::vector<unsigned char> data;
+        std::vector<Block> blocks;
+
+        Job();
+        ~Job();
+    };
+
+    bool enqueue(std::unique_ptr<Job> job);
+    void stop_workers();
+    void worker(archive *out);
+    bool write_job(archive *out, Job *job);
+
+    unsigned int _threads;
+    int _flags;
+
+    std::mutex _mutex;
+    std::condition_variable _cv_pending;
+    std::condition_variable _cv_done;
+    std::deque<std::unique_ptr<Job>> _pending;
+    // Number of jobs being written by workers
+    unsigned int _active;
+    // Size of file data in pending and active jobs
+    size_t _queued_size;
+    bool _failed;
+    bool _stop;
+
+    std::vector<archive *> _writers;
+    std::vector<std::thread> _workers;
+};
+
+}
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include <archive.h>
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief zstd input stage for libarchive readers
+ *
+ * The version of libarchive we use does not have a zstd read filter, so this
+ * decompresses the input file (which may contain multiple concatenated zstd
+ * frames, as written by ParallelCompressor) and feeds the result to libarchive.
+ *
+ * The object must outlive the libarchive reader that it is attached to.
+ */
+class ZstdDecompressor
+{
+public:
+    ZstdDecompressor();
+    ~ZstdDecompressor();
+
+    ZstdDecompressor(const ZstdDecompressor &) = delete;
+    ZstdDecompressor & operator=(const ZstdDecompressor &) = delete;
+
+    bool open(archive *a, const std::string &filename);
+
+private:
+    struct State;
+
+    static int open_cb(archive *a, void *userdata);
+    static la_ssize_t read_cb(archive *a, void *userdata, const void **buf);
+    static int close_cb(archive *a, void *userdata);
+
+    bool start(archive *a);
+    la_ssize_t read(archive *a, const void **buf);
+    bool finish(archive *a);
+
+    std::string _filename;
+    int _fd;
+    std::unique_ptr<State> _state;
+};
+
+}
+}
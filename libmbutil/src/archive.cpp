@@ -20,15 +20,27 @@
 #include "mbutil/archive.h"
 
 #include <algorithm>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <cerrno>
+#include <cinttypes>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 
 #include "mblog/logging.h"
 #include "mbutil/autoclose/archive.h"
+#include "mbutil/chunk_store.h"
 #include "mbutil/directory.h"
 #include "mbutil/finally.h"
+#include "mbutil/parallel_compressor_p.h"
+#include "mbutil/parallel_extractor_p.h"
 #include "mbutil/path.h"
+#include "mbutil/time.h"
+#include "mbutil/zstd_decompressor_p.h"
 
 #define LIBARCHIVE_DISK_WRITER_FLAGS \
     ARCHIVE_EXTRACT_TIME \
@@ -45,6 +57,15 @@
 #define LIBARCHIVE_DISK_READER_FLAGS \
     ARCHIVE_READDISK_MAC_COPYFILE
 
+// Extended attribute holding the chunk list of a file in a manifest. It is not
+// a valid Linux xattr name, so it cannot clash with any attribute on disk.
+#define CHUNK_LIST_XATTR        "mbutil.chunks"
+// Extended attribute holding the inode number of a file in a manifest. pax
+// archives store the ctime, but libarchive does not write the inode number.
+#define CHUNK_INODE_XATTR       "mbutil.ino"
+
+#define MANIFEST_COMPRESSION    compression_type::GZIP
+
 namespace mb
 {
 namespace util
@@ -163,6 +184,292 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
     return ret;
 }
 
+struct ParentFile
+{
+    uint64_t size;
+    time_t mtime;
+    long mtime_nsec;
+    time_t ctime;
+    long ctime_nsec;
+    int64_t ino;
+    std::vector<ChunkRef> chunks;
+};
+
+struct DedupContext
+{
+    ChunkStore *store;
+    // Files in the parent manifest, keyed by path
+    std::unordered_map<std::string, ParentFile> parent;
+    uint64_t files_unchanged;
+    uint64_t bytes_unchanged;
+};
+
+/*!
+ * \brief Get (and remove) the chunk list of a manifest entry
+ *
+ * \param[in] entry Archive entry
+ * \param[out] chunks Chunks making up the file contents
+ * \param[out] found Whether the entry has a chunk list
+ * \param[out] ino Inode number of the file when it was backed up or -1 if the
+ *                 manifest does not record it
+ *
+ * \return False if the chunk list is invalid. Otherwise, true.
+ */
+static bool take_chunk_list(archive_entry *entry,
+                            std::vector<ChunkRef> *chunks, bool *found,
+                            int64_t *ino)
+{
+    std::vector<std::pair<std::string, std::string>> xattrs;
+    const char *name;
+    const void *value;
+    size_t size;
+    bool found_ino = false;
+
+    *found = false;
+    *ino = -1;
+
+    archive_entry_xattr_reset(entry);
+    while (archive_entry_xattr_next(entry, &name, &value, &size)
+            == ARCHIVE_OK) {
+        if (strcmp(name, CHUNK_LIST_XATTR) == 0) {
+            if (!*found && !parse_chunk_list(value, size, chunks)) {
+                return false;
+            }
+            *found = true;
+        } else if (strcmp(name, CHUNK_INODE_XATTR) == 0) {
+            std::string str(static_cast<const char *>(value), size);
+            char *end;
+            errno = 0;
+            long long n = strtoll(str.c_str(), &end, 10);
+            if (errno == 0 && !str.empty() && *end == '\0' && n >= 0) {
+                *ino = n;
+            }
+            found_ino = true;
+        } else {
+            xattrs.emplace_back(name, std::string(
+                    static_cast<const char *>(value), size));
+        }
+    }
+
+    // The disk writer would fail to set the attributes, so remove them
+    if (*found || found_ino) {
+        archive_entry_xattr_clear(entry);
+        for (auto const &xattr : xattrs) {
+            archive_entry_xattr_add_entry(entry, xattr.first.c_str(),
+                                          xattr.second.data(),
+                                          xattr.second.size());
+        }
+    }
+
+    return true;
+}
+
+static bool read_manifest(const std::string &filename,
+                          const std::function<bool(archive_entry *,
+                                                   std::vector<ChunkRef> &,
+                                                   int64_t)> &cb)
+{
+    autoclose::archive in(archive_read_new(), archive_read_free);
+    if (!in) {
+        LOGE("%s: Out of memory when creating archive reader", __FUNCTION__);
+        return false;
+    }
+
+    archive_read_support_format_tar(in.get());
+    archive_read_support_filter_gzip(in.get());
+
+    if (archive_read_open_filename(in.get(), filename.c_str(), 10240)
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open file: %s",
+             filename.c_str(), archive_error_string(in.get()));
+        return false;
+    }
+
+    archive_entry *entry;
+    std::vector<ChunkRef> chunks;
+    bool found;
+    int64_t ino;
+    int ret;
+
+    while ((ret = archive_read_next_header(in.get(), &entry)) == ARCHIVE_OK) {
+        if (!take_chunk_list(entry, &chunks, &found, &ino)) {
+            LOGE("%s: %s: Invalid chunk list", filename.c_str(),
+                 archive_entry_pathname(entry));
+            return false;
+        }
+
+        if (found && !cb(entry, chunks, ino)) {
+            return false;
+        }
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: Failed to read header: %s",
+             filename.c_str(), archive_error_string(in.get()));
+        return false;
+    }
+
+    return true;
+}
+
+static bool feed_zeros(Chunker *chunker, int64_t size)
+{
+    static const char zeros[64 * 1024] = {};
+
+    while (size > 0) {
+        size_t n = std::min<int64_t>(size, sizeof(zeros));
+        if (!chunker->update(zeros, n)) {
+            return false;
+        }
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Add the contents of a file on disk to the chunk store
+ *
+ * Holes in sparse files are stored as zeros. The disk writer recreates them
+ * when restoring because of ARCHIVE_EXTRACT_SPARSE.
+ *
+ * \param[in] in Disk reader positioned at \a entry
+ * \param[in] entry Archive entry
+ * \param[in] ctx Deduplication context
+ * \param[out] list Serialized chunk list of the file
+ *
+ * \return Whether the file was successfully stored
+ */
+static bool store_file_data(archive *in, archive_entry *entry,
+                            DedupContext *ctx, std::string *list)
+{
+    const char *path = archive_entry_pathname(entry);
+    int64_t size = archive_entry_size(entry);
+
+    // Skip the file if it is unchanged since the parent backup. The mtime alone
+    // is not enough since files installed by a zip all share the same mtime.
+    // Changing the contents in any way changes the ctime and replacing the
+    // file changes the inode number.
+    auto it = ctx->parent.find(path);
+    if (it != ctx->parent.end()
+            && it->second.ino >= 0
+            && archive_entry_ino_is_set(entry)
+            && archive_entry_ctime_is_set(entry)
+            && it->second.size == static_cast<uint64_t>(size)
+            && it->second.mtime == archive_entry_mtime(entry)
+            && it->second.mtime_nsec == archive_entry_mtime_nsec(entry)
+            && it->second.ctime == archive_entry_ctime(entry)
+            && it->second.ctime_nsec == archive_entry_ctime_nsec(entry)
+            && it->second.ino == archive_entry_ino64(entry)
+            && std::all_of(it->second.chunks.begin(), it->second.chunks.end(),
+                           [&](const ChunkRef &chunk) {
+                return ctx->store->exists(chunk.hash);
+            })) {
+        *list = format_chunk_list(it->second.chunks);
+        ++ctx->files_unchanged;
+        ctx->bytes_unchanged += size;
+        return true;
+    }
+
+    std::vector<ChunkRef> chunks;
+
+    Chunker chunker([&](const void *data, size_t size) {
+        ChunkRef chunk;
+        chunk.size = size;
+        if (!ctx->store->add(data, size, &chunk.hash)) {
+            return false;
+        }
+        chunks.push_back(std::move(chunk));
+        return true;
+    });
+
+    const void *buf;
+    size_t bytes_read;
+    int64_t offset;
+    int64_t progress = 0;
+    int ret;
+
+    while ((ret = archive_read_data_block(
+            in, &buf, &bytes_read, &offset)) == ARCHIVE_OK) {
+        if (!feed_zeros(&chunker, offset - progress)
+                || !chunker.update(buf, bytes_read)) {
+            LOGE("%s: Failed to store file data", path);
+            return false;
+        }
+        progress = offset + bytes_read;
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: %s", path, archive_error_string(in));
+        return false;
+    }
+
+    // Trailing hole
+    if (!feed_zeros(&chunker, size - progress) || !chunker.finish()) {
+        LOGE("%s: Failed to store file data", path);
+        return false;
+    }
+
+    *list = format_chunk_list(chunks);
+    return true;
+}
+
+/*!
+ * \brief Write a file from the chunk store to disk
+ *
+ * \param out Disk writer
+ * \param entry Archive entry (with the chunk list already removed)
+ * \param store Chunk store
+ * \param chunks Chunks making up the file contents
+ *
+ * \return Whether the file was successfully written
+ */
+static bool extract_chunked_file(archive *out, archive_entry *entry,
+                                 ChunkStore *store,
+                                 const std::vector<ChunkRef> &chunks)
+{
+    int64_t size = 0;
+    for (const ChunkRef &chunk : chunks) {
+        size += chunk.size;
+    }
+
+    archive_entry_set_size(entry, size);
+
+    if (archive_write_header(out, entry) != ARCHIVE_OK) {
+        LOGE("%s: %s", archive_entry_pathname(entry),
+             archive_error_string(out));
+        return false;
+    }
+
+    std::vector<unsigned char> buf;
+    int64_t offset = 0;
+
+    for (const ChunkRef &chunk : chunks) {
+        if (!store->read(chunk, &buf)) {
+            LOGE("%s: Failed to read chunk %s",
+                 archive_entry_pathname(entry), chunk.hash.c_str());
+            return false;
+        }
+
+        if (archive_write_data_block(out, buf.data(), buf.size(), offset)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to write data: %s",
+                 archive_entry_pathname(entry), archive_error_string(out));
+            return false;
+        }
+
+        offset += chunk.size;
+    }
+
+    if (archive_write_finish_entry(out) != ARCHIVE_OK) {
+        LOGE("%s: %s", archive_entry_pathname(entry),
+             archive_error_string(out));
+        return false;
+    }
+
+    return true;
+}
+
 /*
  * The following libarchive functions are based on code from bsdtar. The main
  * difference is that they will not try to extract/add as many files as possible
@@ -170,16 +477,31 @@ int libarchive_copy_header_and_data(archive *in, archive *out,
  * warning because an incomplete archive is useless for backup and restoring.
  */
 
-bool libarchive_tar_extract(const std::string &filename,
-                            const std::string &target,
-                            const std::vector<std::string> &patterns,
-                            compression_type compression)
+static bool tar_extract(const std::string &filename,
+                        const std::string &target,
+                        const std::vector<std::string> &patterns,
+                        compression_type compression,
+                        unsigned int threads,
+                        ChunkStore *store)
 {
     if (target.empty()) {
         LOGE("%s: Invalid target path for extraction", target.c_str());
         return false;
     }
 
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Must be destroyed after the archive reader, which may still call into it
+    std::unique_ptr<ZstdDecompressor> decompressor;
+    if (compression == compression_type::ZSTD) {
+        decompressor.reset(new ZstdDecompressor());
+    }
+
     autoclose::archive matcher(archive_match_new(), archive_match_free);
     if (!matcher) {
         LOGE("%s: Out of memory when creating matcher", __FUNCTION__);
@@ -221,6 +543,9 @@ bool libarchive_tar_extract(const std::string &filename,
     case compression_type::XZ:
         archive_read_support_filter_xz(in.get());
         break;
+    case compression_type::ZSTD:
+        // Handled by ZstdDecompressor
+        break;
     default:
         LOGE("Invalid compression type");
         return false;
@@ -230,8 +555,20 @@ bool libarchive_tar_extract(const std::string &filename,
     archive_write_disk_set_standard_lookup(out.get());
     archive_write_disk_set_options(out.get(), LIBARCHIVE_DISK_WRITER_FLAGS);
 
-    if (archive_read_open_filename(
-            in.get(), filename.c_str(), 10240) != ARCHIVE_OK) {
+    // Must be destroyed before the disk writer, which sets the directory
+    // metadata when it is closed
+    std::unique_ptr<ParallelExtractor> extractor;
+    if (threads > 1) {
+        extractor.reset(new ParallelExtractor(
+                threads, LIBARCHIVE_DISK_WRITER_FLAGS));
+        if (!extractor->start()) {
+            return false;
+        }
+    }
+
+    if (decompressor ? !decompressor->open(in.get(), filename)
+            : archive_read_open_filename(in.get(), filename.c_str(), 10240)
+                    != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(in.get()));
         return false;
@@ -240,6 +577,8 @@ bool libarchive_tar_extract(const std::string &filename,
     archive_entry *entry;
     int ret;
     std::string target_path;
+    std::vector<ChunkRef> chunks;
+    uint64_t entries = 0;
 
     while (true) {
         ret = archive_read_next_header(in.get(), &entry);
@@ -271,11 +610,71 @@ bool libarchive_tar_extract(const std::string &filename,
 
         archive_entry_set_pathname(entry, target_path.c_str());
 
+        // Hard link targets are relative to the archive root too
+        const char *hardlink = archive_entry_hardlink(entry);
+        if (hardlink && *hardlink != '/') {
+            target_path = target;
+            if (target_path.back() != '/') {
+                target_path += '/';
+            }
+            target_path += hardlink;
+
+            archive_entry_set_hardlink(entry, target_path.c_str());
+        }
+
         // Check pattern matches
         if (archive_match_excluded(matcher.get(), entry)) {
             continue;
         }
 
+        ++entries;
+
+        // Check if the contents are in the chunk store
+        bool chunked = false;
+        uint64_t size = archive_entry_size(entry);
+
+        if (store) {
+            int64_t ino;
+            if (!take_chunk_list(entry, &chunks, &chunked, &ino)) {
+                LOGE("%s: Invalid chunk list", archive_entry_pathname(entry));
+                return false;
+            }
+
+            if (chunked) {
+                size = 0;
+                for (const ChunkRef &chunk : chunks) {
+                    size += chunk.size;
+                }
+            }
+        }
+
+        // Small regular files are written by the worker threads. Everything
+        // else is extracted here, which ensures that directories exist before
+        // any of their children are queued.
+        if (extractor) {
+            if (archive_entry_hardlink(entry)) {
+                // The link target may still be queued
+                if (!extractor->wait()) {
+                    return false;
+                }
+            } else if (archive_entry_filetype(entry) == AE_IFREG
+                    && size <= PARALLEL_EXTRACTOR_MAX_FILE_SIZE) {
+                if (chunked ? !extractor->submit(entry, store, chunks)
+                        : !extractor->submit(in.get(), entry)) {
+                    return false;
+                }
+                continue;
+            }
+        }
+
+        // Extract file whose contents are in the chunk store
+        if (chunked) {
+            if (!extract_chunked_file(out.get(), entry, store, chunks)) {
+                return false;
+            }
+            continue;
+        }
+
         // Extract file
         ret = archive_read_extract2(in.get(), entry, out.get());
         if (ret != ARCHIVE_OK) {
@@ -290,6 +689,18 @@ bool libarchive_tar_extract(const std::string &filename,
         return false;
     }
 
+    if (extractor && !extractor->finish()) {
+        return false;
+    }
+
+    // Set the directory permissions and timestamps now that nothing else will
+    // be written to them
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to set directory metadata: %s",
+             target.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
     // Check that all patterns were matched
     const char *pattern;
     while ((ret = archive_match_path_unmatched_inclusions_next(
@@ -301,13 +712,93 @@ bool libarchive_tar_extract(const std::string &filename,
         return false;
     }
 
-    return archive_match_path_unmatched_inclusions(matcher.get()) == 0;
+    if (archive_match_path_unmatched_inclusions(matcher.get()) != 0) {
+        return false;
+    }
+
+    struct timespec end;
+    struct timespec diff;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    timespec_diff(start, end, &diff);
+
+    LOGI("%s: Extracted %" PRIu64 " entries in %.1fs [%u threads]",
+         filename.c_str(), entries, diff.tv_sec + diff.tv_nsec / 1e9,
+         extractor ? threads : 1);
+
+    return true;
+}
+
+/*!
+ * \brief Extract pax archive with all metadata
+ *
+ * If more than one thread is used, small regular files are written to disk in
+ * parallel by ParallelExtractor while the archive is being decompressed and
+ * parsed.
+ *
+ * \param filename Source archive path
+ * \param target Target directory
+ * \param patterns List of patterns to extract (or empty list to extract all)
+ * \param compression Compression type
+ * \param threads Number of writer threads (0 for the number of CPUs)
+ *
+ * \return Whether the extraction was successful
+ */
+bool libarchive_tar_extract(const std::string &filename,
+                            const std::string &target,
+                            const std::vector<std::string> &patterns,
+                            compression_type compression,
+                            unsigned int threads)
+{
+    return tar_extract(filename, target, patterns, compression, threads,
+                       nullptr);
+}
+
+/*!
+ * \brief Extract a manifest created by libarchive_tar_create_dedup()
+ *
+ * \param filename Manifest path
+ * \param target Target directory
+ * \param store Chunk store containing the file contents
+ * \param threads Number of writer threads (0 for the number of CPUs)
+ *
+ * \return Whether the extraction was successful
+ */
+bool libarchive_tar_extract_dedup(const std::string &filename,
+                                  const std::string &target,
+                                  ChunkStore *store,
+                                  unsigned int threads)
+{
+    return tar_extract(filename, target, {}, MANIFEST_COMPRESSION, threads,
+                       store);
 }
 
-static bool write_file(archive *in, archive *out, archive_entry *entry)
+static bool write_file(archive *in, archive *out, archive_entry *entry,
+                       DedupContext *ctx)
 {
     int ret;
 
+    if (ctx && archive_entry_filetype(entry) == AE_IFREG
+            && archive_entry_size(entry) > 0) {
+        std::string list;
+
+        if (!store_file_data(in, entry, ctx, &list)) {
+            return false;
+        }
+
+        // The contents are in the chunk store, so only the metadata and the
+        // chunk list are written to the manifest
+        archive_entry_sparse_clear(entry);
+        archive_entry_set_size(entry, 0);
+        archive_entry_xattr_add_entry(entry, CHUNK_LIST_XATTR,
+                                      list.data(), list.size());
+
+        if (archive_entry_ino_is_set(entry)) {
+            std::string ino = std::to_string(archive_entry_ino64(entry));
+            archive_entry_xattr_add_entry(entry, CHUNK_INODE_XATTR,
+                                          ino.data(), ino.size());
+        }
+    }
+
     ret = archive_write_header(out, entry);
     if (ret != ARCHIVE_OK) {
         LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(out));
@@ -335,22 +826,46 @@ static int metadata_filter(archive *a, void *data, archive_entry *entry)
 /*!
  * \brief Create pax archive with all metadata
  *
+ * If more than one thread is used, the archive is compressed in parallel by
+ * ParallelCompressor instead of libarchive's (single-threaded) filters. The
+ * output remains readable by libarchive and by the standard tools. zstd
+ * compression is always handled by ParallelCompressor since libarchive does not
+ * support it.
+ *
  * \param filename Target archive path
  * \param base_dir Base directory for \a paths
  * \param paths List of paths to add to the archive
+ * \param compression Compression type
+ * \param threads Number of compression threads (0 for the number of CPUs)
  *
  * \return Whether the archive creation was successful
  */
-bool libarchive_tar_create(const std::string &filename,
-                           const std::string &base_dir,
-                           const std::vector<std::string> &paths,
-                           compression_type compression)
+static bool tar_create(const std::string &filename,
+                       const std::string &base_dir,
+                       const std::vector<std::string> &paths,
+                       compression_type compression,
+                       unsigned int threads,
+                       DedupContext *ctx)
 {
     if (base_dir.empty() && paths.empty()) {
         LOGE("%s: No base directory or paths specified", filename.c_str());
         return false;
     }
 
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Must be destroyed after the archive writer, which may still call into it
+    std::unique_ptr<ParallelCompressor> compressor;
+    if ((threads > 1 && compression != compression_type::NONE)
+            || compression == compression_type::ZSTD) {
+        compressor.reset(new ParallelCompressor(compression, threads));
+    }
+
     autoclose::archive in(archive_read_disk_new(), archive_read_free);
     if (!in) {
         LOGE("%s: Out of memory when creating disk reader", __FUNCTION__);
@@ -389,7 +904,12 @@ bool libarchive_tar_create(const std::string &filename,
     archive_write_set_format_pax_restricted(out.get());
     archive_write_set_bytes_per_block(out.get(), 10240);
 
-    switch (compression) {
+    if (compressor) {
+        // Like libarchive's compression filters, don't pad the last block
+        archive_write_set_bytes_in_last_block(out.get(), 1);
+    }
+
+    switch (compressor ? compression_type::NONE : compression) {
     case compression_type::NONE:
         break;
     case compression_type::LZ4:
@@ -411,7 +931,9 @@ bool libarchive_tar_create(const std::string &filename,
                                             archive_format(out.get()));
 
     // Open output file
-    if (archive_write_open_filename(out.get(), filename.c_str()) != ARCHIVE_OK) {
+    if (compressor ? !compressor->open(out.get(), filename)
+            : archive_write_open_filename(out.get(), filename.c_str())
+                    != ARCHIVE_OK) {
         LOGE("%s: Failed to open file: %s",
              filename.c_str(), archive_error_string(out.get()));
         return false;
@@ -496,7 +1018,7 @@ bool libarchive_tar_create(const std::string &filename,
             archive_entry_linkify(resolver.get(), &entry, &sparse_entry);
 
             if (entry) {
-                if (!write_file(in.get(), out.get(), entry)) {
+                if (!write_file(in.get(), out.get(), entry, ctx)) {
                     archive_entry_free(entry);
                     return false;
                 }
@@ -504,7 +1026,7 @@ bool libarchive_tar_create(const std::string &filename,
                 entry = nullptr;
             }
             if (sparse_entry) {
-                if (!write_file(in.get(), out.get(), sparse_entry)) {
+                if (!write_file(in.get(), out.get(), sparse_entry, ctx)) {
                     archive_entry_free(sparse_entry);
                     return false;
                 }
@@ -548,7 +1070,7 @@ bool libarchive_tar_create(const std::string &filename,
             return false;
         }
 
-        if (!write_file(in.get(), out.get(), entry)) {
+        if (!write_file(in.get(), out.get(), entry, ctx)) {
             archive_entry_free(entry);
             return false;
         }
@@ -563,9 +1085,161 @@ bool libarchive_tar_create(const std::string &filename,
         return false;
     }
 
+    if (ctx) {
+        // libarchive_tar_create_dedup() reports the chunk statistics instead
+        return true;
+    }
+
+    struct timespec end;
+    struct timespec diff;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    timespec_diff(start, end, &diff);
+
+    // Filter 0 receives the uncompressed tar stream
+    double seconds = diff.tv_sec + diff.tv_nsec / 1e9;
+    double mib_in = archive_filter_bytes(out.get(), 0) / 1024.0 / 1024.0;
+    double mib_out = (compressor ? compressor->bytes_out()
+            : archive_filter_bytes(out.get(), -1)) / 1024.0 / 1024.0;
+
+    LOGI("%s: Archived %.1f MiB (%.1f MiB compressed) in %.1fs"
+         " [%.1f MiB/s, %u threads]", filename.c_str(), mib_in, mib_out,
+         seconds, seconds > 0 ? mib_in / seconds : 0.0,
+         compressor ? threads : 1);
+
+    return true;
+}
+
+bool libarchive_tar_create(const std::string &filename,
+                           const std::string &base_dir,
+                           const std::vector<std::string> &paths,
+                           compression_type compression,
+                           unsigned int threads)
+{
+    return tar_create(filename, base_dir, paths, compression, threads,
+                      nullptr);
+}
+
+/*!
+ * \brief Create a deduplicated backup manifest
+ *
+ * This works like libarchive_tar_create(), except that the contents of regular
+ * files are split into content-defined chunks and stored in \a store. The
+ * resulting archive (the manifest) is a gzip-compressed pax archive containing
+ * only the metadata of each file and the list of chunks that make up its
+ * contents (in the \a CHUNK_LIST_XATTR extended attribute).
+ *
+ * If \a parent is specified, files whose size, modification time, change time,
+ * and inode number match the file with the same path in the parent manifest are
+ * not read again and their existing chunk list is reused. All other files are
+ * fully chunked and hashed. The inode number is recorded in the
+ * \a CHUNK_INODE_XATTR extended attribute since pax archives do not store it.
+ *
+ * \param filename Target manifest path
+ * \param base_dir Base directory for \a paths
+ * \param paths List of paths to add to the archive
+ * \param store Chunk store for the file contents
+ * \param parent Path to the manifest of a previous backup (or empty string)
+ *
+ * \return Whether the manifest creation was successful
+ */
+bool libarchive_tar_create_dedup(const std::string &filename,
+                                 const std::string &base_dir,
+                                 const std::vector<std::string> &paths,
+                                 ChunkStore *store,
+                                 const std::string &parent)
+{
+    DedupContext ctx;
+    ctx.store = store;
+    ctx.files_unchanged = 0;
+    ctx.bytes_unchanged = 0;
+
+    if (!parent.empty()) {
+        bool ret = read_manifest(parent, [&](archive_entry *entry,
+                                             std::vector<ChunkRef> &chunks,
+                                             int64_t ino) {
+            ParentFile &file = ctx.parent[archive_entry_pathname(entry)];
+            file.mtime = archive_entry_mtime(entry);
+            file.mtime_nsec = archive_entry_mtime_nsec(entry);
+            file.ino = ino;
+            if (archive_entry_ctime_is_set(entry)) {
+                file.ctime = archive_entry_ctime(entry);
+                file.ctime_nsec = archive_entry_ctime_nsec(entry);
+            } else {
+                // Without the ctime, the file can never be skipped
+                file.ino = -1;
+            }
+            file.size = 0;
+            for (const ChunkRef &chunk : chunks) {
+                file.size += chunk.size;
+            }
+            file.chunks = std::move(chunks);
+            return true;
+        });
+        if (ret) {
+            LOGD("%s: Using %s as parent", filename.c_str(), parent.c_str());
+        } else {
+            // The parent only lets us skip reading unchanged files
+            LOGW("%s: Ignoring unusable parent manifest", parent.c_str());
+            ctx.parent.clear();
+        }
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t chunks_added = store->chunks_added();
+    uint64_t bytes_added = store->bytes_added();
+    uint64_t bytes_stored = store->bytes_stored();
+    uint64_t bytes_reused = store->bytes_reused();
+
+    if (!tar_create(filename, base_dir, paths, MANIFEST_COMPRESSION, 1,
+                    &ctx)) {
+        return false;
+    }
+
+    struct timespec end;
+    struct timespec diff;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    timespec_diff(start, end, &diff);
+
+    double seconds = diff.tv_sec + diff.tv_nsec / 1e9;
+    double mib_new = (store->bytes_added() - bytes_added) / 1024.0 / 1024.0;
+    double mib_stored = (store->bytes_stored() - bytes_stored) / 1024.0 / 1024.0;
+    double mib_reused = (store->bytes_reused() - bytes_reused) / 1024.0 / 1024.0;
+    double mib_unchanged = ctx.bytes_unchanged / 1024.0 / 1024.0;
+
+    LOGI("%s: Stored %.1f MiB in %" PRIu64 " new chunks (%.1f MiB compressed),"
+         " reused %.1f MiB of existing chunks, skipped %" PRIu64 " unchanged"
+         " files (%.1f MiB) in %.1fs", filename.c_str(), mib_new,
+         store->chunks_added() - chunks_added, mib_stored, mib_reused,
+         ctx.files_unchanged, mib_unchanged, seconds);
+
     return true;
 }
 
+/*!
+ * \brief Get the chunks referenced by a manifest
+ *
+ * \param[in] filename Manifest created by libarchive_tar_create_dedup()
+ * \param[out] hashes Set to add the chunk hashes to
+ *
+ * \return Whether the manifest was successfully read
+ */
+bool libarchive_tar_get_chunks(const std::string &filename,
+                               std::unordered_set<std::string> *hashes)
+{
+    return read_manifest(filename, [&](archive_entry *entry,
+                                       std::vector<ChunkRef> &chunks,
+                                       int64_t ino) {
+        (void) entry;
+        (void) ino;
+        for (const ChunkRef &chunk : chunks) {
+            hashes->insert(chunk.hash);
+        }
+        return true;
+    });
+}
+
 static bool set_up_input(archive *in, const std::string &filename)
 {
     // Add more as needed
@@ -0,0 +1,668 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/chunk_store.h"
+
+#include <utility>
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <lz4.h>
+#include <openssl/sha.h>
+
+#include "mblog/logging.h"
+#include "mbutil/autoclose/dir.h"
+#include "mbutil/directory.h"
+#include "mbutil/finally.h"
+#include "mbutil/integer.h"
+#include "mbutil/string.h"
+
+// A boundary is declared when the top 20 bits of the gear hash are zero. The
+// top bit depends on the last 64 bytes of input.
+#define CHUNK_BOUNDARY_MASK             0xfffff00000000000ull
+
+#define CHUNK_HASH_LENGTH               (SHA256_DIGEST_LENGTH * 2)
+
+namespace mb
+{
+namespace util
+{
+
+struct GearTable
+{
+    uint64_t values[256];
+
+    GearTable()
+    {
+        // splitmix64 with a fixed seed. Changing the table changes all chunk
+        // boundaries, which would make new backups share nothing with old ones.
+        uint64_t x = 0x6d62746f6f6c2121ull;
+
+        for (uint64_t &value : values) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            value = z ^ (z >> 31);
+        }
+    }
+};
+
+static const GearTable gear;
+
+static bool write_fully(int fd, const void *buf, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool read_fully(int fd, void *buf, size_t size)
+{
+    auto p = static_cast<unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = ::read(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static std::string sha256_hex(const void *data, size_t size)
+{
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256(static_cast<const unsigned char *>(data), size, digest);
+    return hex_string(digest, sizeof(digest));
+}
+
+ChunkStore::ChunkStore()
+    : _lock_fd(-1)
+    , _exclusive(false)
+    , _chunks_added(0)
+    , _bytes_added(0)
+    , _bytes_stored(0)
+    , _chunks_reused(0)
+    , _bytes_reused(0)
+{
+}
+
+ChunkStore::~ChunkStore()
+{
+    close();
+}
+
+/*!
+ * \brief Open (and create, if needed) a chunk store
+ *
+ * \param root Chunk store directory
+ * \param exclusive Whether to take an exclusive lock (for garbage collection)
+ *                  instead of a shared one
+ *
+ * \return Whether the store was successfully opened and locked. If the store
+ *         is locked by another process, false is returned with errno set to
+ *         `EWOULDBLOCK`.
+ */
+bool ChunkStore::open(const std::string &root, bool exclusive)
+{
+    close();
+
+    std::string chunks_dir(root);
+    chunks_dir += "/chunks";
+    std::string tmp_dir(root);
+    tmp_dir += "/tmp";
+
+    if (!mkdir_recursive(chunks_dir, 0700)
+            || !mkdir_recursive(tmp_dir, 0700)) {
+        LOGE("%s: Failed to create chunk store: %s",
+             root.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string lock_path(root);
+    lock_path += "/lock";
+
+    int fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", lock_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (flock(fd, (exclusive ? LOCK_EX : LOCK_SH) | LOCK_NB) < 0) {
+        int saved_errno = errno;
+        if (errno == EWOULDBLOCK) {
+            LOGE("%s: Chunk store is in use", root.c_str());
+        } else {
+            LOGE("%s: Failed to lock: %s",
+                 lock_path.c_str(), strerror(errno));
+        }
+        ::close(fd);
+        errno = saved_errno;
+        return false;
+    }
+
+    _root = root;
+    _lock_fd = fd;
+    _exclusive = exclusive;
+
+    return true;
+}
+
+void ChunkStore::close()
+{
+    if (_lock_fd >= 0) {
+        // Closing the file releases the lock
+        ::close(_lock_fd);
+        _lock_fd = -1;
+    }
+
+    _root.clear();
+    _known.clear();
+}
+
+const std::string & ChunkStore::root() const
+{
+    return _root;
+}
+
+std::string ChunkStore::chunk_path(const std::string &hash) const
+{
+    std::string path(_root);
+    path += "/chunks/";
+    path.append(hash, 0, 2);
+    path += '/';
+    path += hash;
+    return path;
+}
+
+/*!
+ * \brief Add a chunk to the store
+ *
+ * If a chunk with the same contents already exists, nothing is written.
+ *
+ * \param[in] data Chunk data
+ * \param[in] size Chunk size
+ * \param[out] hash Hash of the chunk
+ *
+ * \return Whether the chunk exists in the store
+ */
+bool ChunkStore::add(const void *data, size_t size, std::string *hash)
+{
+    *hash = sha256_hex(data, size);
+
+    if (exists(*hash)) {
+        ++_chunks_reused;
+        _bytes_reused += size;
+        return true;
+    }
+
+    // Keep the compressed block only if it is actually smaller. This also
+    // allows read() to tell the two apart by the file size.
+    const void *out_data = data;
+    size_t out_size = size;
+
+    _buf.resize(LZ4_compressBound(size));
+    int n = LZ4_compress_default(static_cast<const char *>(data),
+                                 reinterpret_cast<char *>(_buf.data()),
+                                 size, _buf.size());
+    if (n > 0 && static_cast<size_t>(n) < size) {
+        out_data = _buf.data();
+        out_size = n;
+    }
+
+    std::string dir(_root);
+    dir += "/chunks/";
+    dir.append(*hash, 0, 2);
+
+    if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        LOGE("%s: Failed to create directory: %s",
+             dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string tmp_path(_root);
+    tmp_path += "/tmp/";
+    tmp_path += *hash;
+    tmp_path += ".XXXXXX";
+
+    int fd = mkstemp(&tmp_path[0]);
+    if (fd < 0) {
+        LOGE("%s: Failed to create temporary file: %s",
+             tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool renamed = false;
+
+    auto close_fd = finally([&]{
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        if (!renamed) {
+            unlink(tmp_path.c_str());
+        }
+    });
+
+    // The chunk must be durable before it becomes visible. Otherwise, a torn
+    // chunk left behind by a crash would be reused by every later backup.
+    if (!write_fully(fd, out_data, out_size) || fdatasync(fd) < 0) {
+        LOGE("%s: Failed to write chunk: %s",
+             tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    int ret = ::close(fd);
+    fd = -1;
+    if (ret < 0) {
+        LOGE("%s: Failed to close: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string path = chunk_path(*hash);
+
+    if (rename(tmp_path.c_str(), path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s",
+             tmp_path.c_str(), path.c_str(), strerror(errno));
+        return false;
+    }
+    renamed = true;
+
+    _known.insert(*hash);
+    ++_chunks_added;
+    _bytes_added += size;
+    _bytes_stored += out_size;
+
+    return true;
+}
+
+/*!
+ * \brief Check if a chunk exists in the store
+ */
+bool ChunkStore::exists(const std::string &hash)
+{
+    if (_known.find(hash) != _known.end()) {
+        return true;
+    }
+
+    struct stat sb;
+    if (stat(chunk_path(hash).c_str(), &sb) == 0) {
+        _known.insert(hash);
+        return true;
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Read and verify a chunk from the store
+ *
+ * \param[in] chunk Chunk to read
+ * \param[out] buf Buffer to store the uncompressed chunk
+ *
+ * \return Whether the chunk was read and matches its hash
+ */
+bool ChunkStore::read(const ChunkRef &chunk, std::vector<unsigned char> *buf)
+{
+    std::string path = chunk_path(chunk.hash);
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open chunk: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        ::close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (static_cast<uint64_t>(sb.st_size)
+            > static_cast<uint64_t>(LZ4_compressBound(CHUNK_MAX_SIZE))) {
+        LOGE("%s: Chunk is too large", path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    buf->resize(chunk.size);
+
+    if (static_cast<uint64_t>(sb.st_size) == chunk.size) {
+        if (!read_fully(fd, buf->data(), buf->size())) {
+            LOGE("%s: Failed to read chunk: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+    } else {
+        _buf.resize(sb.st_size);
+
+        if (!read_fully(fd, _buf.data(), _buf.size())) {
+            LOGE("%s: Failed to read chunk: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        int n = LZ4_decompress_safe(reinterpret_cast<const char *>(_buf.data()),
+                                    reinterpret_cast<char *>(buf->data()),
+                                    _buf.size(), buf->size());
+        if (n < 0 || static_cast<size_t>(n) != chunk.size) {
+            LOGE("%s: Failed to decompress chunk", path.c_str());
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    if (sha256_hex(buf->data(), buf->size()) != chunk.hash) {
+        LOGE("%s: Chunk does not match its hash", path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Remove all chunks that are not referenced
+ *
+ * The store must have been opened with an exclusive lock. Temporary files left
+ * behind by interrupted backups are removed as well.
+ *
+ * \param[in] referenced Hashes of chunks to keep
+ * \param[out] count Number of chunks removed
+ * \param[out] bytes Number of bytes freed
+ *
+ * \return Whether all unreferenced chunks were removed
+ */
+bool ChunkStore::remove_unreferenced(
+        const std::unordered_set<std::string> &referenced,
+        uint64_t *count, uint64_t *bytes)
+{
+    *count = 0;
+    *bytes = 0;
+
+    if (!_exclusive) {
+        LOGE("%s: Chunk store is not exclusively locked", _root.c_str());
+        errno = EPERM;
+        return false;
+    }
+
+    std::string chunks_dir(_root);
+    chunks_dir += "/chunks";
+
+    autoclose::dir dp(autoclose::opendir(chunks_dir.c_str()));
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             chunks_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    dirent *ent;
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        std::string subdir(chunks_dir);
+        subdir += '/';
+        subdir += ent->d_name;
+
+        autoclose::dir dp2(autoclose::opendir(subdir.c_str()));
+        if (!dp2) {
+            LOGE("%s: Failed to open directory: %s",
+                 subdir.c_str(), strerror(errno));
+            return false;
+        }
+
+        dirent *ent2;
+        while ((ent2 = readdir(dp2.get()))) {
+            if (strcmp(ent2->d_name, ".") == 0
+                    || strcmp(ent2->d_name, "..") == 0
+                    || referenced.find(ent2->d_name) != referenced.end()) {
+                continue;
+            }
+
+            std::string path(subdir);
+            path += '/';
+            path += ent2->d_name;
+
+            struct stat sb;
+            if (lstat(path.c_str(), &sb) == 0) {
+                *bytes += sb.st_size;
+            }
+
+            if (unlink(path.c_str()) < 0) {
+                LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+                return false;
+            }
+
+            _known.erase(ent2->d_name);
+            ++*count;
+        }
+
+        // Fails if the directory is not empty, which is fine
+        rmdir(subdir.c_str());
+    }
+
+    std::string tmp_dir(_root);
+    tmp_dir += "/tmp";
+
+    dp = autoclose::opendir(tmp_dir.c_str());
+    if (!dp) {
+        LOGE("%s: Failed to open directory: %s",
+             tmp_dir.c_str(), strerror(errno));
+        return false;
+    }
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+            continue;
+        }
+
+        std::string path(tmp_dir);
+        path += '/';
+        path += ent->d_name;
+
+        if (unlink(path.c_str()) < 0) {
+            LOGW("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+        }
+    }
+
+    return true;
+}
+
+uint64_t ChunkStore::chunks_added() const
+{
+    return _chunks_added;
+}
+
+uint64_t ChunkStore::bytes_added() const
+{
+    return _bytes_added;
+}
+
+uint64_t ChunkStore::bytes_stored() const
+{
+    return _bytes_stored;
+}
+
+uint64_t ChunkStore::chunks_reused() const
+{
+    return _chunks_reused;
+}
+
+uint64_t ChunkStore::bytes_reused() const
+{
+    return _bytes_reused;
+}
+
+Chunker::Chunker(ChunkCallback cb)
+    : _cb(std::move(cb))
+    , _hash(0)
+{
+    // The buffer is not reserved up front. A chunker is created for every
+    // file and most files are much smaller than CHUNK_MAX_SIZE.
+}
+
+/*!
+ * \brief Add data to the stream
+ *
+ * The callback is invoked for every chunk completed by the new data.
+ *
+ * \return Whether all invocations of the callback succeeded
+ */
+bool Chunker::update(const void *data, size_t size)
+{
+    auto p = static_cast<const unsigned char *>(data);
+
+    while (size > 0) {
+        size_t len = _buf.size();
+        size_t i = 0;
+        bool boundary = false;
+
+        while (i < size) {
+            _hash = (_hash << 1) + gear.values[p[i]];
+            ++i;
+            ++len;
+
+            if ((len >= CHUNK_MIN_SIZE && (_hash & CHUNK_BOUNDARY_MASK) == 0)
+                    || len == CHUNK_MAX_SIZE) {
+                boundary = true;
+                break;
+            }
+        }
+
+        _buf.insert(_buf.end(), p, p + i);
+        p += i;
+        size -= i;
+
+        if (boundary) {
+            if (!_cb(_buf.data(), _buf.size())) {
+                return false;
+            }
+            _buf.clear();
+            _hash = 0;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Emit the final (possibly short) chunk
+ */
+bool Chunker::finish()
+{
+    bool ret = true;
+
+    if (!_buf.empty()) {
+        ret = _cb(_buf.data(), _buf.size());
+        _buf.clear();
+    }
+    _hash = 0;
+
+    return ret;
+}
+
+/*!
+ * \brief Serialize a chunk list
+ *
+ * Each chunk is written on its own line as `<hash> <size>`.
+ */
+std::string format_chunk_list(const std::vector<ChunkRef> &chunks)
+{
+    std::string result;
+
+    for (const ChunkRef &chunk : chunks) {
+        result += chunk.hash;
+        result += ' ';
+        result += std::to_string(chunk.size);
+        result += '\n';
+    }
+
+    return result;
+}
+
+/*!
+ * \brief Parse a chunk list created by format_chunk_list()
+ *
+ * \return Whether the list is valid. If false is returned, errno is set to
+ *         `EINVAL`.
+ */
+bool parse_chunk_list(const void *data, size_t size,
+                      std::vector<ChunkRef> *chunks)
+{
+    std::string list(static_cast<const char *>(data), size);
+    ChunkRef chunk;
+
+    chunks->clear();
+
+    for (const std::string &line : split(list, "\n")) {
+        if (line.empty()) {
+            continue;
+        }
+
+        if (line.size() <= CHUNK_HASH_LENGTH + 1
+                || line[CHUNK_HASH_LENGTH] != ' '
+                || line.find_first_not_of("0123456789abcdef")
+                        != CHUNK_HASH_LENGTH
+                || !str_to_unum(line.c_str() + CHUNK_HASH_LENGTH + 1, 10,
+                                &chunk.size)
+                || chunk.size == 0 || chunk.size > CHUNK_MAX_SIZE) {
+            errno = EINVAL;
+            return false;
+        }
+
+        chunk.hash = line.substr(0, CHUNK_HASH_LENGTH);
+        chunks->push_back(std::move(chunk));
+    }
+
+    return true;
+}
+
+}
+}
@@ -20,12 +20,17 @@
 #include "mbutil/hash.h"
 
 #include <memory>
+#include <vector>
 
 #include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "mblog/logging.h"
 #include "mbutil/autoclose/file.h"
+#include "mbutil/finally.h"
 
 namespace mb
 {
@@ -83,5 +88,97 @@ bool sha512_hash(const std::string &path,
     return true;
 }
 
+/*!
+ * \brief Compute SHA512 hash of a file while copying it
+ *
+ * This reads \p source only once, which makes it considerably faster than
+ * calling sha512_hash() and copy_contents() when \p source is a large block
+ * device. \p target will be created or truncated, but its metadata will not be
+ * changed.
+ *
+ * \param source Path to file to hash
+ * \param target Path to write copy of \p source to
+ * \param digest `unsigned char` array of size `SHA512_DIGEST_LENGTH` to store
+ *               computed hash value
+ *
+ * \return true on success, false on failure and errno set appropriately
+ */
+bool sha512_hash_copy(const std::string &source, const std::string &target,
+                      unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    int fd_source = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_source < 0) {
+        LOGE("%s: Failed to open: %s", source.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_source_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd_source);
+        errno = saved_errno;
+    });
+
+    int fd_target = open(target.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd_target < 0) {
+        LOGE("%s: Failed to open: %s", target.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_target_fd = finally([&] {
+        int saved_errno = errno;
+        close(fd_target);
+        errno = saved_errno;
+    });
+
+    std::vector<unsigned char> buf(1024 * 1024);
+    ssize_t n;
+
+    SHA512_CTX ctx;
+    if (!SHA512_Init(&ctx)) {
+        LOGE("openssl: SHA512_Init() failed");
+        errno = EIO;
+        return false;
+    }
+
+    while ((n = read(fd_source, buf.data(), buf.size())) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("%s: Failed to read file: %s",
+                 source.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (!SHA512_Update(&ctx, buf.data(), n)) {
+            LOGE("openssl: SHA512_Update() failed");
+            errno = EIO;
+            return false;
+        }
+
+        for (ssize_t written = 0; written < n;) {
+            ssize_t m = write(fd_target, buf.data() + written, n - written);
+            if (m < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOGE("%s: Failed to write file: %s",
+                     target.c_str(), strerror(errno));
+                return false;
+            }
+            written += m;
+        }
+    }
+
+    if (!SHA512_Final(digest, &ctx)) {
+        LOGE("openssl: SHA512_Final() failed");
+        errno = EIO;
+        return false;
+    }
+
+    return true;
+}
+
 }
 }
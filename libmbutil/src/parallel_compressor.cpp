@@ -0,0 +1,481 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/parallel_compressor_p.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lz4frame.h>
+#include <zlib.h>
+#ifdef MB_HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#include "mblog/logging.h"
+#include "mbutil/archive_p.h"
+
+// Same defaults as libarchive's gzip, lz4, and xz write filters
+#define GZIP_COMPRESSION_LEVEL          Z_DEFAULT_COMPRESSION
+#define LZ4_COMPRESSION_LEVEL           1
+#define XZ_COMPRESSION_PRESET           6
+// Same default as the zstd command line tool
+#define ZSTD_COMPRESSION_LEVEL          3
+
+// Size of the buffer for xz output
+#define XZ_OUTPUT_BUFFER_SIZE           (256 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+ParallelCompressor::ParallelCompressor(compression_type compression,
+                                       unsigned int threads)
+    : _compression(compression)
+    , _threads(std::max(1u, threads))
+    , _fd(-1)
+    , _bytes_out(0)
+    , _stop(false)
+    , _xz(LZMA_STREAM_INIT)
+    , _xz_initialized(false)
+{
+}
+
+ParallelCompressor::~ParallelCompressor()
+{
+    stop_workers();
+
+    if (_xz_initialized) {
+        lzma_end(&_xz);
+    }
+
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+/*!
+ * \brief Attach to a libarchive writer and open the output file
+ *
+ * This should be called instead of archive_write_open_filename(). No
+ * compression filters should be added to \p a.
+ *
+ * \param a libarchive writer
+ * \param filename Output file
+ *
+ * \return Whether the output file was successfully opened
+ */
+bool ParallelCompressor::open(archive *a, const std::string &filename)
+{
+    _filename = filename;
+
+    return archive_write_open(a, this, &open_cb, &write_cb, &close_cb)
+            == ARCHIVE_OK;
+}
+
+/*!
+ * \brief Number of compressed bytes written to the output file
+ */
+uint64_t ParallelCompressor::bytes_out() const
+{
+    return _bytes_out;
+}
+
+int ParallelCompressor::open_cb(archive *a, void *userdata)
+{
+    return static_cast<ParallelCompressor *>(userdata)->start(a)
+            ? ARCHIVE_OK : ARCHIVE_FATAL;
+}
+
+la_ssize_t ParallelCompressor::write_cb(archive *a, void *userdata,
+                                        const void *buf, size_t size)
+{
+    return static_cast<ParallelCompressor *>(userdata)->write(a, buf, size)
+            ? static_cast<la_ssize_t>(size) : -1;
+}
+
+int ParallelCompressor::close_cb(archive *a, void *userdata)
+{
+    return static_cast<ParallelCompressor *>(userdata)->finish(a)
+            ? ARCHIVE_OK : ARCHIVE_FATAL;
+}
+
+bool ParallelCompressor::start(archive *a)
+{
+    _fd = ::open(_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0666);
+    if (_fd < 0) {
+        archive_set_error(a, errno, "Failed to open '%s'", _filename.c_str());
+        return false;
+    }
+
+    switch (_compression) {
+    case compression_type::ZSTD:
+#ifndef MB_HAVE_ZSTD
+        archive_set_error(a, ARCHIVE_ERROR_MISC,
+                          "zstd support was not enabled at build time");
+        return false;
+#endif
+    case compression_type::GZIP:
+    case compression_type::LZ4:
+        for (unsigned int i = 0; i < _threads; ++i) {
+            _workers.emplace_back(&ParallelCompressor::worker, this);
+        }
+        return true;
+
+    case compression_type::XZ: {
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.threads = _threads;
+        mt.preset = XZ_COMPRESSION_PRESET;
+        mt.check = LZMA_CHECK_CRC64;
+
+        // Each thread needs around 100 MiB with the default preset. Don't let
+        // the encoder use more than a quarter of the RAM.
+        uint64_t mem_limit = lzma_physmem() / 4;
+        while (mt.threads > 1
+                && lzma_stream_encoder_mt_memusage(&mt) > mem_limit) {
+            --mt.threads;
+        }
+        if (mt.threads != _threads) {
+            LOGW("%s: Limiting xz encoder to %u threads due to memory usage",
+                 _filename.c_str(), mt.threads);
+        }
+
+        lzma_ret ret = lzma_stream_encoder_mt(&_xz, &mt);
+        if (ret != LZMA_OK) {
+            archive_set_error(a, ARCHIVE_ERROR_MISC,
+                              "Failed to initialize xz encoder: %d", ret);
+            return false;
+        }
+        _xz_initialized = true;
+        _xz_buf.resize(XZ_OUTPUT_BUFFER_SIZE);
+        return true;
+    }
+
+    case compression_type::NONE:
+        return true;
+
+    default:
+        archive_set_error(a, ARCHIVE_ERROR_MISC, "Invalid compression type");
+        return false;
+    }
+}
+
+bool ParallelCompressor::write(archive *a, const void *buf, size_t size)
+{
+    switch (_compression) {
+    case compression_type::GZIP:
+    case compression_type::LZ4:
+    case compression_type::ZSTD:
+        break;
+    case compression_type::XZ:
+        return xz_code(a, buf, size, LZMA_RUN);
+    default:
+        return write_output(a, buf, size);
+    }
+
+    auto ptr = static_cast<const unsigned char *>(buf);
+
+    while (size > 0) {
+        if (!_current) {
+            if (_free.empty()) {
+                _current.reset(new Job());
+                _current->in.reserve(PARALLEL_COMPRESSOR_BLOCK_SIZE);
+            } else {
+                _current = std::move(_free.back());
+                _free.pop_back();
+            }
+            _current->in.clear();
+        }
+
+        size_t n = std::min(size, static_cast<size_t>(
+                PARALLEL_COMPRESSOR_BLOCK_SIZE - _current->in.size()));
+        _current->in.insert(_current->in.end(), ptr, ptr + n);
+        ptr += n;
+        size -= n;
+
+        if (_current->in.size() == PARALLEL_COMPRESSOR_BLOCK_SIZE
+                && !submit_job(a)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ParallelCompressor::finish(archive *a)
+{
+    bool ret = true;
+
+    switch (_compression) {
+    case compression_type::GZIP:
+    case compression_type::LZ4:
+    case compression_type::ZSTD:
+        if (_current && !_current->in.empty()) {
+            ret = submit_job(a);
+        }
+        while (ret && !_in_flight.empty()) {
+            ret = write_completed_job(a);
+        }
+        stop_workers();
+        break;
+    case compression_type::XZ:
+        ret = xz_code(a, nullptr, 0, LZMA_FINISH);
+        break;
+    default:
+        break;
+    }
+
+    if (_fd >= 0) {
+        if (::close(_fd) < 0 && ret) {
+            archive_set_error(a, errno, "Failed to close '%s'",
+                              _filename.c_str());
+            ret = false;
+        }
+        _fd = -1;
+    }
+
+    return ret;
+}
+
+/*!
+ * \brief Queue the current block for compression
+ *
+ * To bound memory usage, this will block and write out the oldest job if there
+ * are too many jobs in flight.
+ */
+bool ParallelCompressor::submit_job(archive *a)
+{
+    Job *job = _current.get();
+    job->done = false;
+    job->failed = false;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _in_flight.push_back(std::move(_current));
+        _pending.push_back(job);
+    }
+    _cv_pending.notify_one();
+
+    while (_in_flight.size() >= 2 * _threads) {
+        if (!write_completed_job(a)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Wait for the oldest job to complete and write it to the output file
+ */
+bool ParallelCompressor::write_completed_job(archive *a)
+{
+    std::unique_ptr<Job> job;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv_done.wait(lock, [&]{
+            return _in_flight.front()->done;
+        });
+        job = std::move(_in_flight.front());
+        _in_flight.pop_front();
+    }
+
+    if (job->failed) {
+        archive_set_error(a, ARCHIVE_ERROR_MISC, "Failed to compress data");
+        return false;
+    }
+
+    if (!write_output(a, job->out.data(), job->out.size())) {
+        return false;
+    }
+
+    _free.push_back(std::move(job));
+    return true;
+}
+
+void ParallelCompressor::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv_pending.notify_all();
+
+    for (std::thread &thread : _workers) {
+        thread.join();
+    }
+    _workers.clear();
+}
+
+void ParallelCompressor::worker()
+{
+    while (true) {
+        Job *job;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv_pending.wait(lock, [&]{
+                return _stop || !_pending.empty();
+            });
+            if (_pending.empty()) {
+                return;
+            }
+            job = _pending.front();
+            _pending.pop_front();
+        }
+
+        bool ret = compress_job(job);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            job->failed = !ret;
+            job->done = true;
+        }
+        _cv_done.notify_all();
+    }
+}
+
+/*!
+ * \brief Compress a block into a complete gzip member, lz4 frame, or zstd frame
+ */
+bool ParallelCompressor::compress_job(Job *job)
+{
+    if (_compression == compression_type::GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+
+        // Add 16 to the window bits for a gzip header and trailer
+        if (deflateInit2(&zs, GZIP_COMPRESSION_LEVEL, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+
+        job->out.resize(deflateBound(&zs, job->in.size()));
+
+        zs.next_in = job->in.data();
+        zs.avail_in = job->in.size();
+        zs.next_out = job->out.data();
+        zs.avail_out = job->out.size();
+
+        int ret = deflate(&zs, Z_FINISH);
+        job->out.resize(zs.total_out);
+        deflateEnd(&zs);
+
+        return ret == Z_STREAM_END;
+    } else if (_compression == compression_type::ZSTD) {
+#ifdef MB_HAVE_ZSTD
+        job->out.resize(ZSTD_compressBound(job->in.size()));
+
+        size_t n = ZSTD_compress(job->out.data(), job->out.size(),
+                                 job->in.data(), job->in.size(),
+                                 ZSTD_COMPRESSION_LEVEL);
+        if (ZSTD_isError(n)) {
+            return false;
+        }
+
+        job->out.resize(n);
+        return true;
+#else
+        return false;
+#endif
+    } else {
+        LZ4F_preferences_t prefs;
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+        prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+        prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+        prefs.compressionLevel = LZ4_COMPRESSION_LEVEL;
+
+        job->out.resize(LZ4F_compressFrameBound(job->in.size(), &prefs));
+
+        size_t n = LZ4F_compressFrame(job->out.data(), job->out.size(),
+                                      job->in.data(), job->in.size(), &prefs);
+        if (LZ4F_isError(n)) {
+            return false;
+        }
+
+        job->out.resize(n);
+        return true;
+    }
+}
+
+bool ParallelCompressor::xz_code(archive *a, const void *buf, size_t size,
+                                 lzma_action action)
+{
+    _xz.next_in = static_cast<const uint8_t *>(buf);
+    _xz.avail_in = size;
+
+    while (true) {
+        _xz.next_out = _xz_buf.data();
+        _xz.avail_out = _xz_buf.size();
+
+        lzma_ret ret = lzma_code(&_xz, action);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
+            archive_set_error(a, ARCHIVE_ERROR_MISC,
+                              "Failed to compress data: %d", ret);
+            return false;
+        }
+
+        if (!write_output(a, _xz_buf.data(),
+                          _xz_buf.size() - _xz.avail_out)) {
+            return false;
+        }
+
+        if (action == LZMA_FINISH) {
+            if (ret == LZMA_STREAM_END) {
+                return true;
+            }
+        } else if (_xz.avail_in == 0 && _xz.avail_out != 0) {
+            return true;
+        }
+    }
+}
+
+bool ParallelCompressor::write_output(archive *a, const void *buf, size_t size)
+{
+    auto ptr = static_cast<const unsigned char *>(buf);
+
+    while (size > 0) {
+        ssize_t n = ::write(_fd, ptr, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            archive_set_error(a, errno, "Failed to write to '%s'",
+                              _filename.c_str());
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        _bytes_out += n;
+    }
+
+    return true;
+}
+
+}
+}
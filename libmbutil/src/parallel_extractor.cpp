@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/parallel_extractor_p.h"
+
+#include <algorithm>
+
+#include "mblog/logging.h"
+
+namespace mb
+{
+namespace util
+{
+
+ParallelExtractor::Job::Job()
+    : entry(nullptr)
+{
+}
+
+ParallelExtractor::Job::~Job()
+{
+    archive_entry_free(entry);
+}
+
+ParallelExtractor::ParallelExtractor(unsigned int threads, int flags)
+    : _threads(std::max(1u, threads))
+    , _flags(flags)
+    , _active(0)
+    , _queued_size(0)
+    , _failed(false)
+    , _stop(false)
+{
+}
+
+ParallelExtractor::~ParallelExtractor()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _pending.clear();
+    }
+
+    stop_workers();
+
+    for (archive *a : _writers) {
+        archive_write_free(a);
+    }
+}
+
+/*!
+ * \brief Create the disk writers and start the worker threads
+ *
+ * \return Whether all disk writers were successfully created
+ */
+bool ParallelExtractor::start()
+{
+    for (unsigned int i = 0; i < _threads; ++i) {
+        archive *a = archive_write_disk_new();
+        if (!a) {
+            LOGE("%s: Out of memory when creating disk writer", __FUNCTION__);
+            return false;
+        }
+        _writers.push_back(a);
+
+        archive_write_disk_set_standard_lookup(a);
+        archive_write_disk_set_options(a, _flags);
+    }
+
+    for (archive *a : _writers) {
+        _workers.emplace_back(&ParallelExtractor::worker, this, a);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Queue a regular file from an archive for writing
+ *
+ * The file contents are read from \p in into memory before returning.
+ *
+ * \param in libarchive reader positioned at \p entry
+ * \param entry Archive entry (with the target path already set)
+ *
+ * \return Whether the file was queued. False is returned if reading the file
+ *         contents failed or if a worker thread previously failed to write a
+ *         file.
+ */
+bool ParallelExtractor::submit(archive *in, archive_entry *entry)
+{
+    std::unique_ptr<Job> job(new Job());
+
+    const void *buf;
+    size_t size;
+    int64_t offset;
+    int ret;
+
+    while ((ret = archive_read_data_block(in, &buf, &size, &offset))
+            == ARCHIVE_OK) {
+        auto data = static_cast<const unsigned char *>(buf);
+
+        // Merge contiguous blocks. Only holes in sparse files need their own
+        // block.
+        if (!job->blocks.empty() && job->blocks.back().offset
+                + static_cast<int64_t>(job->blocks.back().size) == offset) {
+            job->blocks.back().size += size;
+        } else {
+            job->blocks.push_back({ offset, size });
+        }
+
+        job->data.insert(job->data.end(), data, data + size);
+    }
+
+    if (ret != ARCHIVE_EOF) {
+        LOGE("%s: %s", archive_entry_pathname(entry), archive_error_string(in));
+        return false;
+    }
+
+    job->entry = archive_entry_clone(entry);
+    if (!job->entry) {
+        LOGE("%s: Out of memory when cloning entry", __FUNCTION__);
+        return false;
+    }
+
+    return enqueue(std::move(job));
+}
+
+/*!
+ * \brief Queue a regular file from a chunk store for writing
+ *
+ * \param entry Archive entry (with the target path already set and the chunk
+ *              list removed)
+ * \param store Chunk store
+ * \param chunks Chunks making up the file contents
+ *
+ * \return Whether the file was queued. False is returned if reading a chunk
+ *         failed or if a worker thread previously failed to write a file.
+ */
+bool ParallelExtractor::submit(archive_entry *entry, ChunkStore *store,
+                               const std::vector<ChunkRef> &chunks)
+{
+    std::unique_ptr<Job> job(new Job());
+    std::vector<unsigned char> buf;
+
+    for (const ChunkRef &chunk : chunks) {
+        if (!store->read(chunk, &buf)) {
+            LOGE("%s: Failed to read chunk %s",
+                 archive_entry_pathname(entry), chunk.hash.c_str());
+            return false;
+        }
+        job->data.insert(job->data.end(), buf.begin(), buf.end());
+    }
+
+    if (!job->data.empty()) {
+        job->blocks.push_back({ 0, job->data.size() });
+    }
+
+    job->entry = archive_entry_clone(entry);
+    if (!job->entry) {
+        LOGE("%s: Out of memory when cloning entry", __FUNCTION__);
+        return false;
+    }
+
+    archive_entry_set_size(job->entry, job->data.size());
+
+    return enqueue(std::move(job));
+}
+
+/*!
+ * \brief Wait for all queued files to be written
+ *
+ * \return Whether all files were successfully written
+ */
+bool ParallelExtractor::wait()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv_done.wait(lock, [&]{
+        return _pending.empty() && _active == 0;
+    });
+    return !_failed;
+}
+
+/*!
+ * \brief Write all queued files and stop the worker threads
+ *
+ * \return Whether all files were successfully written
+ */
+bool ParallelExtractor::finish()
+{
+    bool ret = wait();
+
+    stop_workers();
+
+    for (archive *a : _writers) {
+        if (archive_write_close(a) != ARCHIVE_OK) {
+            LOGE("Failed to close disk writer: %s", archive_error_string(a));
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+bool ParallelExtractor::enqueue(std::unique_ptr<Job> job)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Always allow one job so that a single file can't block forever
+    _cv_done.wait(lock, [&]{
+        return _failed
+                || _queued_size + job->data.size()
+                        <= PARALLEL_EXTRACTOR_MAX_QUEUED_SIZE
+                || (_pending.empty() && _active == 0);
+    });
+
+    if (_failed) {
+        return false;
+    }
+
+    _queued_size += job->data.size();
+    _pending.push_back(std::move(job));
+    _cv_pending.notify_one();
+
+    return true;
+}
+
+void ParallelExtractor::stop_workers()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv_pending.notify_all();
+
+    for (std::thread &thread : _workers) {
+        thread.join();
+    }
+    _workers.clear();
+}
+
+void ParallelExtractor::worker(archive *out)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _cv_pending.wait(lock, [&]{
+            return _stop || !_pending.empty();
+        });
+
+        if (_pending.empty()) {
+            break;
+        }
+
+        std::unique_ptr<Job> job = std::move(_pending.front());
+        _pending.pop_front();
+        ++_active;
+
+        // Don't bother writing anything more once a file failed
+        bool skip = _failed;
+
+        lock.unlock();
+        bool ret = skip || write_job(out, job.get());
+        lock.lock();
+
+        --_active;
+        _queued_size -= job->data.size();
+        if (!ret) {
+            _failed = true;
+        }
+
+        // Free the entry and data outside of the lock
+        lock.unlock();
+        job.reset();
+        lock.lock();
+
+        _cv_done.notify_all();
+    }
+}
+
+bool ParallelExtractor::write_job(archive *out, Job *job)
+{
+    const char *path = archive_entry_pathname(job->entry);
+
+    if (archive_write_header(out, job->entry) != ARCHIVE_OK) {
+        LOGE("%s: %s", path, archive_error_string(out));
+        return false;
+    }
+
+    const unsigned char *data = job->data.data();
+
+    for (const Block &block : job->blocks) {
+        if (archive_write_data_block(out, data, block.size, block.offset)
+                != ARCHIVE_OK) {
+            LOGE("%s: Failed to write data: %s",
+                 path, archive_error_string(out));
+            return false;
+        }
+        data += block.size;
+    }
+
+    if (archive_write_finish_entry(out) != ARCHIVE_OK) {
+        LOGE("%s: %s", path, archive_error_string(out));
+        return false;
+    }
+
+    return true;
+}
+
+}
+}
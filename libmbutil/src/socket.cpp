@@ -19,10 +19,13 @@
 
 #include "mbutil/socket.h"
 
+#include <cerrno>
 #include <climits>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace mb
@@ -93,25 +96,51 @@ bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
         return false;
     }
 
-    std::vector<uint8_t> buf(len);
+    // Read directly into the caller's buffer so that its allocation can be
+    // reused across messages. The contents are unspecified on failure.
+    result->resize(len);
 
-    if (socket_read(fd, buf.data(), len) == (ssize_t) len) {
-        result->swap(buf);
-        return true;
-    }
-    return false;
+    return socket_read(fd, result->data(), len) == (ssize_t) len;
 }
 
 bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
 {
-    if (!socket_write_int32(fd, len)) {
+    if (len > INT32_MAX) {
+        errno = EINVAL;
         return false;
     }
 
-    if (socket_write(fd, data, len) == (ssize_t) len) {
-        return true;
+    int32_t len32 = len;
+
+    // Send the length and data with a single syscall if possible
+    struct iovec iov[2];
+    iov[0].iov_base = &len32;
+    iov[0].iov_len = sizeof(len32);
+    iov[1].iov_base = const_cast<uint8_t *>(data);
+    iov[1].iov_len = len;
+
+    struct iovec *cur = iov;
+    int count = 2;
+
+    while (count > 0) {
+        ssize_t n = writev(fd, cur, count);
+        if (n <= 0) {
+            return false;
+        }
+
+        // Skip over what was written
+        while (count > 0 && static_cast<size_t>(n) >= cur->iov_len) {
+            n -= cur->iov_len;
+            ++cur;
+            --count;
+        }
+        if (count > 0) {
+            cur->iov_base = static_cast<char *>(cur->iov_base) + n;
+            cur->iov_len -= n;
+        }
     }
-    return false;
+
+    return true;
 }
 
 template<typename TYPE>
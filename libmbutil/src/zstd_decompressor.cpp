@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2017  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mbutil/zstd_decompressor_p.h"
+
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef MB_HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#include "mbutil/archive_p.h"
+
+namespace mb
+{
+namespace util
+{
+
+struct ZstdDecompressor::State
+{
+#ifdef MB_HAVE_ZSTD
+    ZSTD_DStream *dstream = nullptr;
+    std::vector<unsigned char> in_buf;
+    std::vector<unsigned char> out_buf;
+    ZSTD_inBuffer in = { nullptr, 0, 0 };
+    // Return value of the last ZSTD_decompressStream() call. This is 0 only if
+    // a frame was fully decoded and flushed.
+    size_t last_ret = 0;
+    bool eof = false;
+
+    ~State()
+    {
+        ZSTD_freeDStream(dstream);
+    }
+#endif
+};
+
+ZstdDecompressor::ZstdDecompressor()
+    : _fd(-1)
+{
+}
+
+ZstdDecompressor::~ZstdDecompressor()
+{
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+/*!
+ * \brief Attach to a libarchive reader and open the input file
+ *
+ * This should be called instead of archive_read_open_filename(). No
+ * decompression filters need to be enabled for \p a.
+ *
+ * \param a libarchive reader
+ * \param filename Input file
+ *
+ * \return Whether the input file was successfully opened
+ */
+bool ZstdDecompressor::open(archive *a, const std::string &filename)
+{
+    _filename = filename;
+
+    return archive_read_open(a, this, &open_cb, &read_cb, &close_cb)
+            == ARCHIVE_OK;
+}
+
+int ZstdDecompressor::open_cb(archive *a, void *userdata)
+{
+    return static_cast<ZstdDecompressor *>(userdata)->start(a)
+            ? ARCHIVE_OK : ARCHIVE_FATAL;
+}
+
+la_ssize_t ZstdDecompressor::read_cb(archive *a, void *userdata,
+                                     const void **buf)
+{
+    return static_cast<ZstdDecompressor *>(userdata)->read(a, buf);
+}
+
+int ZstdDecompressor::close_cb(archive *a, void *userdata)
+{
+    return static_cast<ZstdDecompressor *>(userdata)->finish(a)
+            ? ARCHIVE_OK : ARCHIVE_FATAL;
+}
+
+bool ZstdDecompressor::start(archive *a)
+{
+#ifdef MB_HAVE_ZSTD
+    _fd = ::open(_filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+        archive_set_error(a, errno, "Failed to open '%s'", _filename.c_str());
+        return false;
+    }
+
+    _state.reset(new State());
+    _state->dstream = ZSTD_createDStream();
+    if (!_state->dstream) {
+        archive_set_error(a, ENOMEM, "Failed to create zstd stream");
+        return false;
+    }
+
+    size_t ret = ZSTD_initDStream(_state->dstream);
+    if (ZSTD_isError(ret)) {
+        archive_set_error(a, ARCHIVE_ERROR_MISC,
+                          "Failed to initialize zstd stream: %s",
+                          ZSTD_getErrorName(ret));
+        return false;
+    }
+
+    _state->in_buf.resize(ZSTD_DStreamInSize());
+    _state->out_buf.resize(ZSTD_DStreamOutSize());
+
+    return true;
+#else
+    archive_set_error(a, ARCHIVE_ERROR_MISC,
+                      "zstd support was not enabled at build time");
+    return false;
+#endif
+}
+
+la_ssize_t ZstdDecompressor::read(archive *a, const void **buf)
+{
+#ifdef MB_HAVE_ZSTD
+    State &s = *_state;
+
+    while (true) {
+        if (s.in.pos == s.in.size && !s.eof) {
+            ssize_t n;
+            do {
+                n = ::read(_fd, s.in_buf.data(), s.in_buf.size());
+            } while (n < 0 && errno == EINTR);
+
+            if (n < 0) {
+                archive_set_error(a, errno, "Failed to read '%s'",
+                                  _filename.c_str());
+                return -1;
+            } else if (n == 0) {
+                s.eof = true;
+            }
+
+            s.in = { s.in_buf.data(), static_cast<size_t>(n), 0 };
+        }
+
+        ZSTD_outBuffer out = { s.out_buf.data(), s.out_buf.size(), 0 };
+
+        // Keep calling the decoder at EOF until all buffered data is flushed
+        if (s.in.pos < s.in.size || !s.eof || s.last_ret != 0) {
+            s.last_ret = ZSTD_decompressStream(s.dstream, &out, &s.in);
+            if (ZSTD_isError(s.last_ret)) {
+                archive_set_error(a, ARCHIVE_ERROR_MISC,
+                                  "Failed to decompress '%s': %s",
+                                  _filename.c_str(),
+                                  ZSTD_getErrorName(s.last_ret));
+                return -1;
+            }
+        }
+
+        if (out.pos > 0) {
+            *buf = s.out_buf.data();
+            return out.pos;
+        } else if (s.eof && s.in.pos == s.in.size) {
+            if (s.last_ret != 0) {
+                archive_set_error(a, ARCHIVE_ERROR_MISC,
+                                  "'%s' is truncated", _filename.c_str());
+                return -1;
+            }
+            return 0;
+        }
+    }
+#else
+    (void) buf;
+    archive_set_error(a, ARCHIVE_ERROR_MISC,
+                      "zstd support was not enabled at build time");
+    return -1;
+#endif
+}
+
+bool ZstdDecompressor::finish(archive *a)
+{
+    _state.reset();
+
+    if (_fd >= 0) {
+        int ret = ::close(_fd);
+        _fd = -1;
+
+        if (ret < 0) {
+            archive_set_error(a, errno, "Failed to close '%s'",
+                              _filename.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+}
+}
@@ -56,7 +56,7 @@ namespace fb = flatbuffers;
 class MbtoolInterfaceV3 : public MbtoolInterface
 {
 public:
-    MbtoolInterfaceV3(int fd) : _fd(fd)
+    MbtoolInterfaceV3(int fd) : _fd(fd), _next_id(1)
     {
     }
 
@@ -334,10 +334,13 @@ private:
                       v3::ResponseType expected_type,
                       const void **result)
     {
+        uint32_t id = _next_id++;
+
         // Build request table
         v3::RequestBuilder rb(*builder);
         rb.add_request_type(request_type);
         rb.add_request(fb_request);
+        rb.add_id(id);
         builder->Finish(rb.Finish());
 
         // Send request
@@ -362,6 +365,13 @@ private:
         const v3::Response *response = v3::GetResponse(buf->data());
         v3::ResponseType type = response->response_type();
 
+        // Older daemons don't send the request ID back
+        if (response->id() != 0 && response->id() != id) {
+            LOGE("Unexpected response ID (actual=%u, expected=%u)",
+                 response->id(), id);
+            return false;
+        }
+
         if (type == v3::ResponseType_Unsupported) {
             LOGE("Daemon does not support request type: %d", request_type);
             return false;
@@ -379,6 +389,7 @@ private:
     }
 
     int _fd;
+    uint32_t _next_id;
 };
 
 MbtoolConnection::MbtoolConnection() : _fd(-1), _iface(nullptr)
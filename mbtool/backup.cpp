@@ -20,15 +20,19 @@
 #include "backup.h"
 
 #include <algorithm>
+#include <cinttypes>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <unordered_set>
 #include <vector>
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <sys/mount.h>
+#include <unistd.h>
 
 #include <archive.h>
 #include <archive_entry.h>
@@ -36,13 +40,17 @@
 #include "mblog/logging.h"
 #include "mbp/bootimage.h"
 #include "mbp/cpiofile.h"
+#include "mbsparse/sparse.h"
 #include "mbutil/autoclose/archive.h"
 #include "mbutil/autoclose/dir.h"
 #include "mbutil/archive.h"
+#include "mbutil/chunk_store.h"
 #include "mbutil/copy.h"
+#include "mbutil/delete.h"
 #include "mbutil/directory.h"
 #include "mbutil/file.h"
 #include "mbutil/finally.h"
+#include "mbutil/integer.h"
 #include "mbutil/mount.h"
 #include "mbutil/path.h"
 #include "mbutil/selinux.h"
@@ -77,6 +85,18 @@ namespace mb
 #define BACKUP_NAME_CONFIG              "config.json"
 #define BACKUP_NAME_THUMBNAIL           "thumbnail.webp"
 
+// Chunk store shared by all incremental backups in a backup directory
+#define BACKUP_STORE_NAME               ".store"
+#define BACKUP_MANIFEST_EXTENSION       ".manifest"
+// ID of the ROM an incremental backup was created from
+#define BACKUP_NAME_ROM_ID              "romid"
+
+// Image-based partitions backed up as Android sparse images
+#define BACKUP_SPARSE_IMAGE_EXTENSION   ".sparse.img"
+// Block size to use if the ext4 block size cannot be determined
+#define BACKUP_SPARSE_BLOCK_SIZE        4096
+#define BACKUP_SPARSE_BUF_SIZE          (1024 * 1024)
+
 enum class Result
 {
     SUCCEEDED,
@@ -85,6 +105,16 @@ enum class Result
     BOOT_IMAGE_UNPATCHED
 };
 
+enum class BackupFormat
+{
+    // Compressed tar archive
+    ARCHIVE,
+    // Incremental backup manifest with file contents in the chunk store
+    MANIFEST,
+    // Sparse image of an image-based partition
+    SPARSE_IMAGE
+};
+
 struct compression_map {
     util::compression_type type;
     const char *name;
@@ -94,9 +124,16 @@ struct compression_map {
     { util::compression_type::LZ4,  "lz4",   ".tar.lz4" },
     { util::compression_type::GZIP, "gzip",  ".tar.gz" },
     { util::compression_type::XZ,   "xz",    ".tar.xz" },
+    { util::compression_type::ZSTD, "zstd",  ".tar.zst" },
     { util::compression_type::NONE, nullptr, nullptr }
 };
 
+#ifdef MB_HAVE_ZSTD
+#  define BACKUP_COMPRESSION_TYPES "none, lz4, gzip, xz, zstd"
+#else
+#  define BACKUP_COMPRESSION_TYPES "none, lz4, gzip, xz"
+#endif
+
 static int parse_targets_string(const std::string &targets)
 {
     std::vector<std::string> targets_list = util::split(targets, ",");
@@ -127,6 +164,13 @@ static bool parse_compression_type(const char *type,
                                    util::compression_type *compression)
 {
     for (auto i = compression_map; i->name; ++i) {
+#ifndef MB_HAVE_ZSTD
+        // Still listed in compression_map so that restoring an existing zstd
+        // backup fails with a clear error instead of not finding the backup
+        if (i->type == util::compression_type::ZSTD) {
+            continue;
+        }
+#endif
         if (strcmp(type, i->name) == 0) {
             *compression = i->type;
             return true;
@@ -165,10 +209,126 @@ static std::string find_compressed_backup(const std::string &backup_dir,
     return std::string();
 }
 
+static std::string get_backup_name(const std::string &name,
+                                   BackupFormat format,
+                                   util::compression_type compression)
+{
+    switch (format) {
+    case BackupFormat::MANIFEST:
+        return name + BACKUP_MANIFEST_EXTENSION;
+    case BackupFormat::SPARSE_IMAGE:
+        return name + BACKUP_SPARSE_IMAGE_EXTENSION;
+    case BackupFormat::ARCHIVE:
+    default:
+        return get_compressed_backup_name(name, compression);
+    }
+}
+
+/*!
+ * \brief Find backup archive, incremental backup manifest, or sparse image
+ *
+ * \param[in] backup_dir Backup directory
+ * \param[in] name Backup name without the extension
+ * \param[out] format Format of the backup
+ * \param[out] compression Compression type if the backup is an archive
+ *
+ * \return Backup filename or empty string if it was not found
+ */
+static std::string find_backup(const std::string &backup_dir,
+                               const std::string &name,
+                               BackupFormat *format,
+                               util::compression_type *compression)
+{
+    for (BackupFormat f : { BackupFormat::MANIFEST,
+                            BackupFormat::SPARSE_IMAGE }) {
+        std::string filename = get_backup_name(
+                name, f, util::compression_type::NONE);
+
+        std::string full_path(backup_dir);
+        full_path += "/";
+        full_path += filename;
+
+        if (access(full_path.c_str(), R_OK) == 0) {
+            *format = f;
+            return filename;
+        }
+    }
+
+    *format = BackupFormat::ARCHIVE;
+    return find_compressed_backup(backup_dir, name, compression);
+}
+
+/*!
+ * \brief Find the most recent manifest with the same name in another backup
+ *
+ * Only backups of the same ROM are considered. Backups of other ROMs are
+ * unlikely to share much and their files may coincidentally have matching
+ * metadata.
+ *
+ * \param backup_dir Directory of the backup being created
+ * \param manifest Manifest filename
+ *
+ * \return Path to manifest or empty string if no other backup has one
+ */
+static std::string find_parent_manifest(const std::string &backup_dir,
+                                        const std::string &manifest)
+{
+    std::string backups_dir = util::dir_name(backup_dir);
+    std::string current = util::base_name(backup_dir);
+    std::string rom_id;
+    std::string other_rom_id;
+
+    if (!util::file_first_line(backup_dir + "/" BACKUP_NAME_ROM_ID, &rom_id)) {
+        return std::string();
+    }
+
+    autoclose::dir dp(autoclose::opendir(backups_dir.c_str()));
+    if (!dp) {
+        return std::string();
+    }
+
+    std::string parent;
+    time_t parent_mtime = 0;
+    std::string path;
+    struct stat sb;
+    dirent *ent;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strcmp(ent->d_name, ".") == 0
+                || strcmp(ent->d_name, "..") == 0
+                || strcmp(ent->d_name, BACKUP_STORE_NAME) == 0
+                || current == ent->d_name) {
+            continue;
+        }
+
+        path = backups_dir;
+        path += '/';
+        path += ent->d_name;
+        path += '/';
+
+        if (!util::file_first_line(path + BACKUP_NAME_ROM_ID, &other_rom_id)
+                || other_rom_id != rom_id) {
+            continue;
+        }
+
+        path += manifest;
+
+        if (stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode)
+                && (parent.empty() || sb.st_mtime > parent_mtime)) {
+            parent = path;
+            parent_mtime = sb.st_mtime;
+        }
+    }
+
+    return parent;
+}
+
 static bool backup_directory(const std::string &output_file,
                              const std::string &directory,
                              const std::vector<std::string> &exclusions,
-                             util::compression_type compression)
+                             util::compression_type compression,
+                             unsigned int threads,
+                             util::ChunkStore *store)
 {
     autoclose::dir dp(autoclose::opendir(directory.c_str()));
     if (!dp) {
@@ -197,27 +357,515 @@ static bool backup_directory(const std::string &output_file,
         return false;
     }
 
+    if (store) {
+        return util::libarchive_tar_create_dedup(
+                output_file, directory, contents, store,
+                find_parent_manifest(util::dir_name(output_file),
+                                     util::base_name(output_file)));
+    }
+
     return util::libarchive_tar_create(output_file, directory, contents,
-                                       compression);
+                                       compression, threads);
 }
 
 static bool restore_directory(const std::string &input_file,
                               const std::string &directory,
                               const std::vector<std::string> &exclusions,
-                              util::compression_type compression)
+                              util::compression_type compression,
+                              unsigned int threads,
+                              util::ChunkStore *store)
 {
     if (!wipe_directory(directory, exclusions)) {
         return false;
     }
 
-    return util::libarchive_tar_extract(input_file, directory, {}, compression);
+    if (store) {
+        return util::libarchive_tar_extract_dedup(input_file, directory, store,
+                                                  threads);
+    }
+
+    return util::libarchive_tar_extract(input_file, directory, {}, compression,
+                                        threads);
+}
+
+struct SparseFiles
+{
+    int in_fd;
+    int out_fd;
+};
+
+static bool sparse_read_cb(void *buf, uint64_t size, uint64_t *bytes_read,
+                           void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    uint64_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(files->in_fd, static_cast<char *>(buf) + total,
+                         size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    *bytes_read = total;
+    return true;
+}
+
+static bool sparse_read_at_cb(void *buf, uint64_t size, uint64_t offset,
+                              void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    uint64_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(files->in_fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool sparse_write_cb(const void *buf, uint64_t size, void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    uint64_t total = 0;
+
+    while (total < size) {
+        ssize_t n = write(files->out_fd,
+                          static_cast<const char *>(buf) + total,
+                          size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool sparse_write_at_cb(const void *buf, uint64_t size,
+                               uint64_t offset, void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    uint64_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pwrite64(files->out_fd,
+                             static_cast<const char *>(buf) + total,
+                             size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static bool sparse_seek_in_cb(int64_t offset, int whence, void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    return lseek64(files->in_fd, offset, whence) >= 0;
+}
+
+static bool sparse_seek_out_cb(int64_t offset, int whence, void *userdata)
+{
+    auto files = static_cast<SparseFiles *>(userdata);
+    return lseek64(files->out_fd, offset, whence) >= 0;
+}
+
+/*!
+ * \brief Find the end of the data or hole that \a offset is in
+ *
+ * \param[in] fd File descriptor
+ * \param[in] offset Offset in file
+ * \param[in] size Size of file
+ * \param[out] is_data Whether \a offset is in a data region
+ *
+ * \return Offset of the next hole (if \a is_data) or the next data region (if
+ *         not \a is_data), or \a size if there is none. If the filesystem does
+ *         not report holes, the entire file is considered to be data.
+ */
+static uint64_t find_extent_end(int fd, uint64_t offset, uint64_t size,
+                                bool *is_data)
+{
+    off64_t data = lseek64(fd, offset, SEEK_DATA);
+    if (data < 0) {
+        // ENXIO means that there is no more data. Any other error means that
+        // SEEK_DATA is unsupported.
+        *is_data = errno != ENXIO;
+        return size;
+    } else if (static_cast<uint64_t>(data) > offset) {
+        *is_data = false;
+        return data;
+    }
+
+    off64_t hole = lseek64(fd, offset, SEEK_HOLE);
+    *is_data = true;
+    return hole < 0 ? size : std::min<uint64_t>(hole, size);
+}
+
+/*!
+ * \brief Back up the used blocks of an ext4 image as an Android sparse image
+ *
+ * Blocks that are not allocated in the ext4 block bitmaps or are holes in the
+ * image file are stored as "don't care" chunks. If the block bitmaps cannot be
+ * read, only the holes are skipped.
+ *
+ * \param output_file Output sparse image
+ * \param image ext4 image
+ *
+ * \return Whether the sparse image was successfully written
+ */
+/*!
+ * \brief Check if an image is attached to a loop device
+ *
+ * \param image Image path
+ *
+ * \return Whether any loop device is backed by \a image
+ */
+static bool is_image_attached(const std::string &image)
+{
+    struct stat sb;
+    if (stat(image.c_str(), &sb) < 0) {
+        return false;
+    }
+
+    autoclose::dir dp(autoclose::opendir("/sys/block"));
+    if (!dp) {
+        return false;
+    }
+
+    struct stat backing_sb;
+    std::string backing_file;
+    dirent *ent;
+
+    while ((ent = readdir(dp.get()))) {
+        if (strncmp(ent->d_name, "loop", 4) != 0) {
+            continue;
+        }
+
+        std::string path("/sys/block/");
+        path += ent->d_name;
+        path += "/loop/backing_file";
+
+        if (util::file_first_line(path, &backing_file)
+                && stat(backing_file.c_str(), &backing_sb) == 0
+                && backing_sb.st_dev == sb.st_dev
+                && backing_sb.st_ino == sb.st_ino) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool backup_sparse_image(const std::string &output_file,
+                                const std::string &image)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // The image can change while it is being copied and neither its block
+    // bitmaps nor its contents can be trusted
+    if (is_image_attached(image)) {
+        LOGE("%s: Image is attached to a loop device and may be mounted",
+             image.c_str());
+        return false;
+    }
+
+    // The block bitmaps are only trusted if the filesystem is consistent
+    bool use_bitmaps = fsck_ext4_image(image);
+    if (!use_bitmaps) {
+        LOGW("%s: e2fsck failed; copying all allocated data", image.c_str());
+    }
+
+    SparseFiles files;
+
+    files.in_fd = open64(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (files.in_fd < 0) {
+        LOGE("%s: Failed to open: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_in_fd = util::finally([&]{
+        close(files.in_fd);
+    });
+
+    struct stat sb;
+    if (fstat(files.in_fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    uint64_t size = sb.st_size;
+    uint32_t block_size = BACKUP_SPARSE_BLOCK_SIZE;
+    std::vector<bool> used;
+
+    if (use_bitmaps
+            && !get_ext4_image_used_blocks(files.in_fd, &block_size, &used)) {
+        LOGW("%s: Failed to read ext4 block bitmaps; "
+             "copying all allocated data", image.c_str());
+        block_size = BACKUP_SPARSE_BLOCK_SIZE;
+        used.clear();
+    }
+
+    if (size % block_size != 0) {
+        LOGE("%s: Size (%" PRIu64 ") is not a multiple of the block size"
+             " (%" PRIu32 ")", image.c_str(), size, block_size);
+        return false;
+    }
+
+    files.out_fd = open64(output_file.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (files.out_fd < 0) {
+        LOGE("%s: Failed to open: %s", output_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_out_fd = util::finally([&]{
+        if (files.out_fd >= 0) {
+            close(files.out_fd);
+        }
+    });
+
+    SparseWriterCtx *ctx = sparseWriterCtxNew();
+    if (!ctx) {
+        LOGE("Failed to allocate sparse writer context");
+        return false;
+    }
+
+    auto free_ctx = util::finally([&]{
+        sparseWriterCtxFree(ctx);
+    });
+
+    if (!sparseWriterOpen(ctx, block_size, size, nullptr, nullptr,
+                          &sparse_write_cb, &sparse_seek_out_cb, &files)) {
+        LOGE("%s: Failed to open sparse image for writing",
+             output_file.c_str());
+        return false;
+    }
+
+    std::vector<unsigned char> buf(BACKUP_SPARSE_BUF_SIZE);
+    uint64_t blocks = size / block_size;
+    uint64_t data_bytes = 0;
+    uint64_t extent_end = 0;
+    bool extent_is_data = false;
+    uint64_t block = 0;
+
+    while (block < blocks) {
+        uint64_t offset = block * block_size;
+
+        if (offset >= extent_end) {
+            extent_end = find_extent_end(files.in_fd, offset, size,
+                                         &extent_is_data);
+            // Holes that are not block-aligned are treated as data
+            if (!extent_is_data) {
+                extent_end -= extent_end % block_size;
+                if (extent_end <= offset) {
+                    extent_is_data = true;
+                    extent_end = offset + block_size;
+                }
+            }
+        }
+
+        // Find the run of blocks with the same state within the extent
+        uint64_t extent_end_block = (extent_end + block_size - 1) / block_size;
+        auto is_used = [&](uint64_t b) {
+            return extent_is_data && (b >= used.size() || used[b]);
+        };
+        bool run_is_data = is_used(block);
+        uint64_t run_end = block + 1;
+
+        while (run_end < extent_end_block && is_used(run_end) == run_is_data) {
+            ++run_end;
+        }
+
+        uint64_t run_size = (run_end - block) * block_size;
+
+        if (!run_is_data) {
+            if (!sparseWriterAddDontCare(ctx, run_size)) {
+                LOGE("%s: Failed to write sparse image", output_file.c_str());
+                return false;
+            }
+        } else {
+            uint64_t run_offset = offset;
+            uint64_t remaining = run_size;
+
+            while (remaining > 0) {
+                uint64_t n = std::min<uint64_t>(remaining, buf.size());
+
+                if (!sparse_read_at_cb(buf.data(), n, run_offset, &files)) {
+                    LOGE("%s: Failed to read: %s",
+                         image.c_str(), strerror(errno));
+                    return false;
+                }
+
+                if (!sparseWriterAddRaw(ctx, buf.data(), n)) {
+                    LOGE("%s: Failed to write sparse image",
+                         output_file.c_str());
+                    return false;
+                }
+
+                run_offset += n;
+                remaining -= n;
+            }
+
+            data_bytes += run_size;
+        }
+
+        block = run_end;
+    }
+
+    if (!sparseWriterClose(ctx)) {
+        LOGE("%s: Failed to finish sparse image", output_file.c_str());
+        return false;
+    }
+
+    if (fdatasync(files.out_fd) < 0 || close(files.out_fd) < 0) {
+        files.out_fd = -1;
+        LOGE("%s: Failed to close: %s", output_file.c_str(), strerror(errno));
+        return false;
+    }
+    files.out_fd = -1;
+
+    struct timespec end;
+    struct timespec diff;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    util::timespec_diff(start, end, &diff);
+
+    LOGI("%s: Stored %" PRIu64 " of %" PRIu64 " bytes in %.1fs",
+         image.c_str(), data_bytes, size,
+         diff.tv_sec + diff.tv_nsec / 1e9);
+
+    return true;
+}
+
+/*!
+ * \brief Restore an ext4 image from an Android sparse image
+ *
+ * The image is recreated from scratch. "Don't care" regions are left as holes.
+ *
+ * \param input_file Sparse image
+ * \param image ext4 image
+ * \param threads Number of writer threads (0 for the number of CPUs)
+ *
+ * \return Whether the image was successfully restored
+ */
+static bool restore_sparse_image(const std::string &input_file,
+                                 const std::string &image,
+                                 unsigned int threads)
+{
+    SparseFiles files;
+
+    files.in_fd = open64(input_file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (files.in_fd < 0) {
+        LOGE("%s: Failed to open: %s", input_file.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_in_fd = util::finally([&]{
+        close(files.in_fd);
+    });
+
+    SparseCtx *ctx = sparseCtxNew();
+    if (!ctx) {
+        LOGE("Failed to allocate sparse context");
+        return false;
+    }
+
+    auto free_ctx = util::finally([&]{
+        sparseCtxFree(ctx);
+    });
+
+    if (!sparseOpen(ctx, nullptr, nullptr, &sparse_read_cb,
+                    &sparse_seek_in_cb, nullptr, &files)) {
+        LOGE("%s: Failed to open sparse image", input_file.c_str());
+        return false;
+    }
+
+    uint64_t size;
+    if (!sparseSize(ctx, &size)) {
+        LOGE("%s: Failed to get sparse image size", input_file.c_str());
+        return false;
+    }
+
+    if (!util::mkdir_parent(image, S_IRWXU)) {
+        LOGE("%s: Failed to create parent directory: %s",
+             image.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Truncate first so that the "don't care" regions become holes
+    files.out_fd = open64(image.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (files.out_fd < 0) {
+        LOGE("%s: Failed to open: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_out_fd = util::finally([&]{
+        if (files.out_fd >= 0) {
+            close(files.out_fd);
+        }
+    });
+
+    if (ftruncate64(files.out_fd, size) < 0) {
+        LOGE("%s: Failed to truncate: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!sparseExtractParallel(ctx, &sparse_read_at_cb, &sparse_write_at_cb,
+                               nullptr, &files, threads)) {
+        LOGE("%s: Failed to extract sparse image", input_file.c_str());
+        return false;
+    }
+
+    if (fsync(files.out_fd) < 0 || close(files.out_fd) < 0) {
+        files.out_fd = -1;
+        LOGE("%s: Failed to close: %s", image.c_str(), strerror(errno));
+        return false;
+    }
+    files.out_fd = -1;
+
+    return true;
 }
 
 static bool backup_image(const std::string &output_file,
                          const std::string &image,
                          const std::vector<std::string> &exclusions,
-                         util::compression_type compression)
+                         BackupFormat format,
+                         util::compression_type compression,
+                         unsigned int threads,
+                         util::ChunkStore *store)
 {
+    if (format == BackupFormat::SPARSE_IMAGE) {
+        return backup_sparse_image(output_file, image);
+    }
+
     if (!util::mkdir_recursive(BACKUP_MNT_DIR, 0755) && errno != EEXIST) {
         LOGE("%s: Failed to create directory: %s",
              BACKUP_MNT_DIR, strerror(errno));
@@ -233,7 +881,7 @@ static bool backup_image(const std::string &output_file,
     }
 
     bool ret = backup_directory(output_file, BACKUP_MNT_DIR, exclusions,
-                                compression);
+                                compression, threads, store);
 
     if (!util::umount(BACKUP_MNT_DIR)) {
         LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
@@ -249,8 +897,15 @@ static bool restore_image(const std::string &input_file,
                           const std::string &image,
                           uint64_t size,
                           const std::vector<std::string> &exclusions,
-                          util::compression_type compression)
+                          BackupFormat format,
+                          util::compression_type compression,
+                          unsigned int threads,
+                          util::ChunkStore *store)
 {
+    if (format == BackupFormat::SPARSE_IMAGE) {
+        return restore_sparse_image(input_file, image, threads);
+    }
+
     if (!util::mkdir_parent(image, S_IRWXU)) {
         LOGE("%s: Failed to create parent directory: %s",
              image.c_str(), strerror(errno));
@@ -285,7 +940,7 @@ static bool restore_image(const std::string &input_file,
     }
 
     bool ret = restore_directory(input_file, BACKUP_MNT_DIR, exclusions,
-                                 compression);
+                                 compression, threads, store);
 
     if (!util::umount(BACKUP_MNT_DIR)) {
         LOGE("Failed to unmount %s: %s", BACKUP_MNT_DIR, strerror(errno));
@@ -508,6 +1163,11 @@ static Result restore_configs(const std::shared_ptr<Rom> &rom,
  * \param archive_name Backup archive name
  * \param is_image Whether \a path is an ext4 image
  * \param exclusions List of top-level directories to exclude from the backup
+ * \param format Backup format (BackupFormat::SPARSE_IMAGE is only valid if
+ *               \a is_image is true)
+ * \param compression Compression type
+ * \param threads Number of compression threads (0 for the number of CPUs)
+ * \param store Chunk store if \a format is BackupFormat::MANIFEST
  *
  * \return Result::SUCCEEDED if the directory/image was successfully backed up
  *         Result::FAILED if an error occured
@@ -518,7 +1178,10 @@ static Result backup_partition(const std::string &path,
                                const std::string &archive_name,
                                bool is_image,
                                const std::vector<std::string> &exclusions,
-                               util::compression_type compression)
+                               BackupFormat format,
+                               util::compression_type compression,
+                               unsigned int threads,
+                               util::ChunkStore *store)
 {
     std::string archive(backup_dir);
     archive += '/';
@@ -530,9 +1193,11 @@ static Result backup_partition(const std::string &path,
     if (stat(path.c_str(), &sb) == 0) {
         LOGI("=== Backing up %s ===", path.c_str());
         if (is_image) {
-            ret = backup_image(archive, path, exclusions, compression);
+            ret = backup_image(archive, path, exclusions, format,
+                               compression, threads, store);
         } else {
-            ret = backup_directory(archive, path, exclusions, compression);
+            ret = backup_directory(archive, path, exclusions, compression,
+                                   threads, store);
         }
     } else {
         LOGW("=== %s does not exist ===", path.c_str());
@@ -549,8 +1214,13 @@ static Result backup_partition(const std::string &path,
  * \param backup_dir Backup directory
  * \param archive_name Backup archive name
  * \param is_image Whether \a path is an ext4 image
+ * \param image_size Size of the image to create if \a path does not exist
  * \param exclusions List of top-level directories to exclude from the wipe
  *                   process before restoring
+ * \param format Format of the backup
+ * \param compression Compression type if \a format is BackupFormat::ARCHIVE
+ * \param threads Number of writer threads (0 for the number of CPUs)
+ * \param store Chunk store if \a format is BackupFormat::MANIFEST
  *
  * \return Result::SUCCEEDED if the directory/image was successfully restored
  *         Result::FAILED if an error occured
@@ -563,7 +1233,10 @@ static Result restore_partition(const std::string &path,
                                 bool is_image,
                                 uint64_t image_size,
                                 const std::vector<std::string> &exclusions,
-                                util::compression_type compression)
+                                BackupFormat format,
+                                util::compression_type compression,
+                                unsigned int threads,
+                                util::ChunkStore *store)
 {
     std::string archive(backup_dir);
     archive += '/';
@@ -576,9 +1249,13 @@ static Result restore_partition(const std::string &path,
         LOGI("=== Restoring to %s ===", path.c_str());
         if (is_image) {
             ret = restore_image(archive, path, image_size, exclusions,
-                                compression);
+                                format, compression, threads, store);
+        } else if (format == BackupFormat::SPARSE_IMAGE) {
+            LOGE("%s: Sparse image can only be restored to an image-based"
+                 " partition", archive.c_str());
         } else {
-            ret = restore_directory(archive, path, exclusions, compression);
+            ret = restore_directory(archive, path, exclusions, compression,
+                                    threads, store);
         }
     } else {
         LOGW("=== %s does not exist ===", archive.c_str());
@@ -590,7 +1267,10 @@ static Result restore_partition(const std::string &path,
 
 static bool backup_rom(const std::shared_ptr<Rom> &rom,
                        const std::string &output_dir, int targets,
-                       util::compression_type compression)
+                       util::compression_type compression,
+                       unsigned int threads,
+                       util::ChunkStore *store,
+                       bool sparse_images)
 {
     if (!targets) {
         LOGE("No backup targets specified");
@@ -624,13 +1304,45 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
         LOGI("             %s", thumbnail_path.c_str());
     }
     LOGI("- Backup directory: %s", output_dir.c_str());
+    if (store) {
+        LOGI("- Chunk store: %s", store->root().c_str());
+    }
 
-    std::string output_system = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_SYSTEM, compression);
-    std::string output_cache = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_CACHE, compression);
-    std::string output_data = get_compressed_backup_name(
-            BACKUP_NAME_PREFIX_DATA, compression);
+    auto get_format = [&](bool is_image) {
+        if (is_image && sparse_images) {
+            return BackupFormat::SPARSE_IMAGE;
+        } else if (store) {
+            return BackupFormat::MANIFEST;
+        } else {
+            return BackupFormat::ARCHIVE;
+        }
+    };
+
+    BackupFormat format_system = get_format(rom->system_is_image);
+    BackupFormat format_cache = get_format(rom->cache_is_image);
+    BackupFormat format_data = get_format(rom->data_is_image);
+
+    std::string output_system = get_backup_name(
+            BACKUP_NAME_PREFIX_SYSTEM, format_system, compression);
+    std::string output_cache = get_backup_name(
+            BACKUP_NAME_PREFIX_CACHE, format_cache, compression);
+    std::string output_data = get_backup_name(
+            BACKUP_NAME_PREFIX_DATA, format_data, compression);
+
+    // Record the ROM ID so later incremental backups only use this backup as
+    // their parent if they are of the same ROM
+    if (store) {
+        std::string rom_id_file(output_dir);
+        rom_id_file += "/";
+        rom_id_file += BACKUP_NAME_ROM_ID;
+
+        if (!util::file_write_data(rom_id_file, rom->id.data(),
+                                   rom->id.size())) {
+            LOGE("%s: Failed to write ROM ID: %s",
+                 rom_id_file.c_str(), strerror(errno));
+            return false;
+        }
+    }
 
     // Backup boot image
     if (targets & BACKUP_TARGET_BOOT
@@ -648,7 +1360,8 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
     if (targets & BACKUP_TARGET_SYSTEM) {
         Result ret = backup_partition(
                 system_path, output_dir, output_system,
-                rom->system_is_image, { "multiboot" }, compression);
+                rom->system_is_image, { "multiboot" }, format_system,
+                compression, threads, store);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -658,7 +1371,8 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
     if (targets & BACKUP_TARGET_CACHE) {
         Result ret = backup_partition(
                 cache_path, output_dir, output_cache,
-                rom->cache_is_image, { "multiboot" }, compression);
+                rom->cache_is_image, { "multiboot" }, format_cache,
+                compression, threads, store);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -668,7 +1382,8 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
     if (targets & BACKUP_TARGET_DATA) {
         Result ret = backup_partition(
                 data_path, output_dir, output_data,
-                rom->data_is_image, { "media", "multiboot" }, compression);
+                rom->data_is_image, { "media", "multiboot" }, format_data,
+                compression, threads, store);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -678,7 +1393,8 @@ static bool backup_rom(const std::shared_ptr<Rom> &rom,
 }
 
 static bool restore_rom(const std::shared_ptr<Rom> &rom,
-                        const std::string &input_dir, int targets)
+                        const std::string &input_dir, int targets,
+                        unsigned int threads, util::ChunkStore *store)
 {
     if (!targets) {
         LOGE("No restore targets specified");
@@ -745,17 +1461,23 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
             return false;
         }
 
+        BackupFormat format;
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &compression);
+        std::string path = find_backup(
+                input_dir, BACKUP_NAME_PREFIX_SYSTEM, &format, &compression);
         if (path.empty()) {
             LOGE("Backup of /system not found");
             return false;
+        } else if (format == BackupFormat::MANIFEST && !store) {
+            LOGE("Chunk store for incremental backup of /system not found");
+            return false;
         }
 
         Result ret = restore_partition(
                 system_path, input_dir, path,
-                rom->system_is_image, image_size, {}, compression);
+                rom->system_is_image, image_size, {}, format,
+                compression, threads,
+                format == BackupFormat::MANIFEST ? store : nullptr);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -763,17 +1485,23 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
     // Restore cache
     if (targets & BACKUP_TARGET_CACHE) {
+        BackupFormat format;
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_CACHE, &compression);
+        std::string path = find_backup(
+                input_dir, BACKUP_NAME_PREFIX_CACHE, &format, &compression);
         if (path.empty()) {
             LOGE("Backup of /cache not found");
             return false;
+        } else if (format == BackupFormat::MANIFEST && !store) {
+            LOGE("Chunk store for incremental backup of /cache not found");
+            return false;
         }
 
         Result ret = restore_partition(
                 cache_path, input_dir, path,
-                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, compression);
+                rom->cache_is_image, DEFAULT_IMAGE_SIZE, {}, format,
+                compression, threads,
+                format == BackupFormat::MANIFEST ? store : nullptr);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -781,17 +1509,23 @@ static bool restore_rom(const std::shared_ptr<Rom> &rom,
 
     // Restore data
     if (targets & BACKUP_TARGET_DATA) {
+        BackupFormat format;
         util::compression_type compression;
-        std::string path = find_compressed_backup(
-                input_dir, BACKUP_NAME_PREFIX_DATA, &compression);
+        std::string path = find_backup(
+                input_dir, BACKUP_NAME_PREFIX_DATA, &format, &compression);
         if (path.empty()) {
             LOGE("Backup of /data not found");
             return false;
+        } else if (format == BackupFormat::MANIFEST && !store) {
+            LOGE("Chunk store for incremental backup of /data not found");
+            return false;
         }
 
         Result ret = restore_partition(
                 data_path, input_dir, path,
-                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, compression);
+                rom->data_is_image, DEFAULT_IMAGE_SIZE, { "media" }, format,
+                compression, threads,
+                format == BackupFormat::MANIFEST ? store : nullptr);
         if (ret == Result::FAILED) {
             return false;
         }
@@ -828,7 +1562,8 @@ static bool is_valid_backup_name(const std::string &name)
     return !name.empty()                            // Must be non-empty
             && name.find('/') == std::string::npos  // and contain no slashes
             && name != "."                          // and not current directory
-            && name != "..";                        // and not parent directory
+            && name != ".."                         // and not parent directory
+            && name != BACKUP_STORE_NAME;           // and not the chunk store
 }
 
 static void warn_selinux_context()
@@ -860,8 +1595,19 @@ static void backup_usage(FILE *stream)
             "                   Name of backup\n"
             "                   (Default: YYYY.MM.DD-HH.MM.SS)\n"
             "  -c, --compression <compression type>\n"
-            "                   Compression type (none, lz4, gzip, xz)\n"
+            "                   Compression type (" BACKUP_COMPRESSION_TYPES ")\n"
             "                   (Default: lz4)\n"
+            "  -T, --threads <count>\n"
+            "                   Number of compression threads\n"
+            "                   (Default: number of CPUs)\n"
+            "  -i, --incremental\n"
+            "                   Store file contents in the deduplicating chunk\n"
+            "                   store shared by all incremental backups\n"
+            "                   (Compression option is ignored)\n"
+            "  -s, --sparse     Back up image-based partitions as sparse images\n"
+            "                   containing only the used blocks instead of\n"
+            "                   mounting them and archiving their files\n"
+            "                   (Other options are ignored for these)\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory to store backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
@@ -887,6 +1633,9 @@ static void restore_usage(FILE *stream)
             "                   (Default: 'all')\n"
             "  -n, --name <name>\n"
             "                   Name of backup to restore\n"
+            "  -T, --threads <count>\n"
+            "                   Number of threads for writing files\n"
+            "                   (Default: number of CPUs)\n"
             "  -d, --backupdir <directory>\n"
             "                   Directory containing backups\n"
             "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
@@ -899,16 +1648,36 @@ static void restore_usage(FILE *stream)
             "have not yet been finalized.\n");
 }
 
+static void backup_gc_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: backup-gc [OPTION...]\n\n"
+            "Remove chunks that are no longer used by any incremental backup.\n\n"
+            "Options:\n"
+            "  -k, --keep <count>\n"
+            "                   Delete all but the <count> most recent\n"
+            "                   incremental backups first\n"
+            "  -d, --backupdir <directory>\n"
+            "                   Directory containing backups\n"
+            "                   (Default: " MULTIBOOT_BACKUP_DIR ")\n"
+            "  -h, --help       Display this help message\n"
+            "\n"
+            "Regular (non-incremental) backups are never deleted.\n");
+}
+
 int backup_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:c:d:fh";
+    static const char *short_options = "r:t:n:c:T:isd:fh";
     static struct option long_options[] = {
         {"romid",       required_argument, 0, 'r'},
         {"targets",     required_argument, 0, 't'},
         {"name",        required_argument, 0, 'n'},
         {"compression", required_argument, 0, 'c'},
+        {"threads",     required_argument, 0, 'T'},
+        {"incremental", no_argument,       0, 'i'},
+        {"sparse",      no_argument,       0, 's'},
         {"backupdir",   required_argument, 0, 'd'},
         {"force",       no_argument,       0, 'f'},
         {"help",        no_argument,       0, 'h'},
@@ -922,6 +1691,9 @@ int backup_main(int argc, char *argv[])
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
     util::compression_type compression = util::compression_type::LZ4;
+    unsigned int threads = 0;
+    bool incremental = false;
+    bool sparse_images = false;
     bool force = false;
 
     if (!util::format_time("%Y.%m.%d-%H.%M.%S", &name)) {
@@ -947,6 +1719,18 @@ int backup_main(int argc, char *argv[])
                 return EXIT_FAILURE;
             }
             break;
+        case 'T':
+            if (!util::str_to_unum(optarg, 10, &threads) || threads == 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i':
+            incremental = true;
+            break;
+        case 's':
+            sparse_images = true;
+            break;
         case 'd':
             backupdir = optarg;
             break;
@@ -1016,7 +1800,21 @@ int backup_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = backup_rom(rom, output_dir, targets, compression);
+    util::ChunkStore store;
+    if (incremental) {
+        std::string store_dir(backupdir);
+        store_dir += "/";
+        store_dir += BACKUP_STORE_NAME;
+
+        if (!store.open(store_dir, false)) {
+            fprintf(stderr, "%s: Failed to open chunk store: %s\n",
+                    store_dir.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ret = backup_rom(rom, output_dir, targets, compression, threads,
+                          incremental ? &store : nullptr, sparse_images);
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -1030,11 +1828,12 @@ int restore_main(int argc, char *argv[])
 {
     int opt;
 
-    static const char *short_options = "r:t:n:d:h";
+    static const char *short_options = "r:t:n:T:d:h";
     static struct option long_options[] = {
         {"romid",     required_argument, 0, 'r'},
         {"targets",   required_argument, 0, 't'},
         {"name",      required_argument, 0, 'n'},
+        {"threads",   required_argument, 0, 'T'},
         {"backupdir", required_argument, 0, 'd'},
         {"help",      no_argument,       0, 'h'},
         {0, 0, 0, 0}
@@ -1046,6 +1845,7 @@ int restore_main(int argc, char *argv[])
     std::string targets_str("all");
     std::string name;
     std::string backupdir(MULTIBOOT_BACKUP_DIR);
+    unsigned int threads = 0;
 
     while ((opt = getopt_long(argc, argv, short_options,
             long_options, &long_index)) != -1) {
@@ -1059,6 +1859,12 @@ int restore_main(int argc, char *argv[])
         case 'n':
             name = optarg;
             break;
+        case 'T':
+            if (!util::str_to_unum(optarg, 10, &threads) || threads == 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         case 'd':
             backupdir = optarg;
             break;
@@ -1120,7 +1926,21 @@ int restore_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    bool ret = restore_rom(rom, input_dir, targets);
+    // Only needed for incremental backups
+    std::string store_dir(backupdir);
+    store_dir += "/";
+    store_dir += BACKUP_STORE_NAME;
+
+    util::ChunkStore store;
+    bool have_store = stat(store_dir.c_str(), &sb) == 0;
+    if (have_store && !store.open(store_dir, false)) {
+        fprintf(stderr, "%s: Failed to open chunk store: %s\n",
+                store_dir.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    bool ret = restore_rom(rom, input_dir, targets, threads,
+                           have_store ? &store : nullptr);
     if (ret) {
         LOGI("=== Finished ===");
         return EXIT_SUCCESS;
@@ -1130,4 +1950,170 @@ int restore_main(int argc, char *argv[])
     }
 }
 
+int backup_gc_main(int argc, char *argv[])
+{
+    int opt;
+
+    static const char *short_options = "k:d:h";
+    static struct option long_options[] = {
+        {"keep",      required_argument, 0, 'k'},
+        {"backupdir", required_argument, 0, 'd'},
+        {"help",      no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    std::string backupdir(MULTIBOOT_BACKUP_DIR);
+    unsigned int keep = 0;
+    bool have_keep = false;
+
+    while ((opt = getopt_long(argc, argv, short_options,
+            long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'k':
+            if (!util::str_to_unum(optarg, 10, &keep)) {
+                fprintf(stderr, "Invalid backup count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            have_keep = true;
+            break;
+        case 'd':
+            backupdir = optarg;
+            break;
+        case 'h':
+            backup_gc_usage(stdout);
+            return EXIT_SUCCESS;
+        default:
+            backup_gc_usage(stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // There should be no other arguments
+    if (argc - optind != 0) {
+        backup_gc_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::string store_dir(backupdir);
+    store_dir += "/";
+    store_dir += BACKUP_STORE_NAME;
+
+    struct stat sb;
+    if (stat(store_dir.c_str(), &sb) < 0) {
+        LOGI("No incremental backups in %s", backupdir.c_str());
+        return EXIT_SUCCESS;
+    }
+
+    // Fails if a backup or restore is in progress
+    util::ChunkStore store;
+    if (!store.open(store_dir, true)) {
+        fprintf(stderr, "%s: Failed to open chunk store: %s\n",
+                store_dir.c_str(), strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    struct Backup
+    {
+        std::string name;
+        time_t mtime;
+        std::vector<std::string> manifests;
+    };
+
+    std::vector<Backup> backups;
+
+    {
+        autoclose::dir dp(autoclose::opendir(backupdir.c_str()));
+        if (!dp) {
+            fprintf(stderr, "%s: Failed to open directory: %s\n",
+                    backupdir.c_str(), strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        dirent *ent;
+        while ((ent = readdir(dp.get()))) {
+            if (!is_valid_backup_name(ent->d_name)) {
+                continue;
+            }
+
+            Backup backup;
+            backup.name = ent->d_name;
+            backup.mtime = 0;
+
+            for (auto const &prefix : { BACKUP_NAME_PREFIX_SYSTEM,
+                                        BACKUP_NAME_PREFIX_CACHE,
+                                        BACKUP_NAME_PREFIX_DATA }) {
+                std::string path(backupdir);
+                path += '/';
+                path += ent->d_name;
+                path += '/';
+                path += prefix;
+                path += BACKUP_MANIFEST_EXTENSION;
+
+                if (stat(path.c_str(), &sb) == 0) {
+                    backup.manifests.push_back(path);
+                    backup.mtime = std::max(backup.mtime, sb.st_mtime);
+                }
+            }
+
+            if (!backup.manifests.empty()) {
+                backups.push_back(std::move(backup));
+            }
+        }
+    }
+
+    // Apply retention policy
+    if (have_keep && backups.size() > keep) {
+        std::sort(backups.begin(), backups.end(),
+                  [](const Backup &a, const Backup &b) {
+            return a.mtime > b.mtime;
+        });
+
+        for (auto it = backups.begin() + keep; it != backups.end(); ++it) {
+            std::string path(backupdir);
+            path += '/';
+            path += it->name;
+
+            LOGI("Deleting backup: %s", it->name.c_str());
+
+            if (!util::delete_recursive(path)) {
+                fprintf(stderr, "%s: Failed to delete: %s\n",
+                        path.c_str(), strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+
+        backups.erase(backups.begin() + keep, backups.end());
+    }
+
+    // If any manifest cannot be read, nothing can be safely removed
+    std::unordered_set<std::string> referenced;
+
+    for (const Backup &backup : backups) {
+        for (const std::string &manifest : backup.manifests) {
+            if (!util::libarchive_tar_get_chunks(manifest, &referenced)) {
+                fprintf(stderr, "%s: Failed to read manifest\n",
+                        manifest.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    uint64_t count;
+    uint64_t bytes;
+
+    if (!store.remove_unreferenced(referenced, &count, &bytes)) {
+        LOGI("=== Failed ===");
+        return EXIT_FAILURE;
+    }
+
+    LOGI("Removed %" PRIu64 " unused chunks (%.1f MiB); %zu chunks are used by"
+         " %zu incremental backups", count, bytes / 1024.0 / 1024.0,
+         referenced.size(), backups.size());
+    LOGI("=== Finished ===");
+
+    return EXIT_SUCCESS;
+}
+
 }
@@ -19,11 +19,16 @@
 
 #include "daemon_v3.h"
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <fcntl.h>
 #include <sys/mount.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -62,29 +67,54 @@ namespace mb
 namespace v3 = mbtool::daemon::v3;
 namespace fb = flatbuffers;
 
+// Maximum number of threads per connection for long-running requests
+#define V3_WORKER_THREADS       4
+
+// Largest FileReadRequest buffer or received message buffer that is kept around
+// for the next request
+#define V3_MAX_KEPT_READ_BUFFER (1024 * 1024)
+
 static std::unordered_map<int, int> fd_map;
 static int fd_count = 0;
 
+// Responses may be sent from the worker threads
+static std::mutex send_mutex;
+
 static bool v3_send_response(int fd, const fb::FlatBufferBuilder &builder)
 {
+    std::lock_guard<std::mutex> lock(send_mutex);
     return util::socket_write_bytes(
             fd, builder.GetBufferPointer(), builder.GetSize());
 }
 
-static bool v3_send_response_invalid(int fd)
+// Send response followed by a file descriptor. The client must receive the
+// file descriptor immediately after reading the response.
+static bool v3_send_response_with_fd(int fd,
+                                     const fb::FlatBufferBuilder &builder,
+                                     int send_fd)
+{
+    std::lock_guard<std::mutex> lock(send_mutex);
+    return util::socket_write_bytes(
+            fd, builder.GetBufferPointer(), builder.GetSize())
+            && util::socket_send_fds(fd, { send_fd });
+}
+
+static bool v3_send_response_invalid(int fd, const v3::Request *msg)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Invalid,
-                                       v3::CreateInvalid(builder).Union());
+                                       v3::CreateInvalid(builder).Union(),
+                                       msg->id());
     builder.Finish(response);
     return v3_send_response(fd, builder);
 }
 
-static bool v3_send_response_unsupported(int fd)
+static bool v3_send_response_unsupported(int fd, const v3::Request *msg)
 {
     fb::FlatBufferBuilder builder;
     auto response = v3::CreateResponse(builder, v3::ResponseType_Unsupported,
-                                       v3::CreateUnsupported(builder).Union());
+                                       v3::CreateUnsupported(builder).Union(),
+                                       msg->id());
     builder.Finish(response);
     return v3_send_response(fd, builder);
 }
@@ -94,7 +124,7 @@ static bool v3_crypto_decrypt(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::CryptoDecryptRequest *>(
             msg->request());
     if (!request->password()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -107,7 +137,8 @@ static bool v3_crypto_decrypt(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_CryptoDecryptResponse, response.Union()));
+            builder, v3::ResponseType_CryptoDecryptResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -137,7 +168,7 @@ static bool v3_crypto_get_pw_type(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_CryptoGetPwTypeResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -146,7 +177,7 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileChmodRequest *>(msg->request());
     if (fd_map.find(request->id()) == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = fd_map[request->id()];
@@ -155,7 +186,7 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -174,7 +205,8 @@ static bool v3_file_chmod(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileChmodResponse, response.Union()));
+            builder, v3::ResponseType_FileChmodResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -184,7 +216,7 @@ static bool v3_file_close(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileCloseRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Remove ID from map
@@ -207,7 +239,8 @@ static bool v3_file_close(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileCloseResponse, response.Union()));
+            builder, v3::ResponseType_FileCloseResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -216,7 +249,7 @@ static bool v3_file_open(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::FileOpenRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int flags = O_CLOEXEC;
@@ -257,14 +290,20 @@ static bool v3_file_open(int fd, const v3::Request *msg)
                 builder, saved_errno, strerror(saved_errno));
     }
 
+    bool has_fd = ffd >= 0 && request->send_fd();
+
     auto response = v3::CreateFileOpenResponseDirect(
             builder, ffd >= 0, ffd >= 0 ? nullptr : strerror(saved_errno), id,
-            error);
+            error, has_fd);
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileOpenResponse, response.Union()));
+            builder, v3::ResponseType_FileOpenResponse,
+            response.Union(), msg->id()));
 
+    if (has_fd) {
+        return v3_send_response_with_fd(fd, builder, ffd);
+    }
     return v3_send_response(fd, builder);
 }
 
@@ -273,14 +312,23 @@ static bool v3_file_read(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileReadRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
 
-    std::vector<unsigned char> buf(request->count());
+    // File requests are only handled by the connection's thread, so the read
+    // buffer can be reused for every request
+    static std::vector<unsigned char> buf;
+    buf.resize(request->count());
 
-    fb::FlatBufferBuilder builder;
+    // Reserve space for the data up front so the builder doesn't need to grow
+    size_t initial_size = 1024;
+    if (buf.size() <= INT32_MAX - initial_size) {
+        initial_size += buf.size();
+    }
+
+    fb::FlatBufferBuilder builder(initial_size);
     fb::Offset<v3::FileReadError> error;
     fb::Offset<fb::Vector<unsigned char>> data;
 
@@ -294,6 +342,13 @@ static bool v3_file_read(int fd, const v3::Request *msg)
                 builder, saved_errno, strerror(saved_errno));
     }
 
+    // Don't hold on to the memory for an unusually large read for the rest of
+    // the connection
+    if (buf.capacity() > V3_MAX_KEPT_READ_BUFFER) {
+        buf.clear();
+        buf.shrink_to_fit();
+    }
+
     auto response = v3::CreateFileReadResponse(
             builder, ret >= 0,
             ret >= 0 ? 0 : builder.CreateString(strerror(saved_errno)),
@@ -301,7 +356,8 @@ static bool v3_file_read(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileReadResponse, response.Union()));
+            builder, v3::ResponseType_FileReadResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -311,7 +367,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileSeekRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -325,7 +381,7 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
     } else if (request->whence() == v3::FileSeekWhence_SEEK_END) {
         whence = SEEK_END;
     } else {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -348,7 +404,8 @@ static bool v3_file_seek(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileSeekResponse, response.Union()));
+            builder, v3::ResponseType_FileSeekResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -359,7 +416,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
             msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -383,7 +440,7 @@ static bool v3_file_selinux_get_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -394,7 +451,7 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
             msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end() || !request->label()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -416,7 +473,7 @@ static bool v3_file_selinux_set_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_FileSELinuxSetLabelResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -426,7 +483,7 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileStatRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -466,7 +523,8 @@ static bool v3_file_stat(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileStatResponse, response.Union()));
+            builder, v3::ResponseType_FileStatResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -476,7 +534,7 @@ static bool v3_file_write(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::FileWriteRequest *>(msg->request());
     auto it = fd_map.find(request->id());
     if (it == fd_map.end() || !request->data()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     int ffd = it->second;
@@ -498,7 +556,8 @@ static bool v3_file_write(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_FileWriteResponse, response.Union()));
+            builder, v3::ResponseType_FileWriteResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -507,14 +566,14 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathChmodRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -533,7 +592,8 @@ static bool v3_path_chmod(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathChmodResponse, response.Union()));
+            builder, v3::ResponseType_PathChmodResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -542,7 +602,7 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathCopyRequest *>(msg->request());
     if (!request->source() || !request->target()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -562,7 +622,8 @@ static bool v3_path_copy(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathCopyResponse, response.Union()));
+            builder, v3::ResponseType_PathCopyResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -571,7 +632,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathDeleteRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     bool ret;
@@ -595,7 +656,7 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
         saved_errno = errno;
         break;
     default:
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -611,7 +672,8 @@ static bool v3_path_delete(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathDeleteResponse, response.Union()));
+            builder, v3::ResponseType_PathDeleteResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -620,14 +682,14 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathMkdirRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -651,7 +713,8 @@ static bool v3_path_mkdir(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathMkdirResponse, response.Union()));
+            builder, v3::ResponseType_PathMkdirResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -660,7 +723,7 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::PathReadlinkRequest *>(msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string target;
@@ -680,7 +743,8 @@ static bool v3_path_readlink(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_PathReadlinkResponse, response.Union()));
+            builder, v3::ResponseType_PathReadlinkResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -690,7 +754,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::PathSELinuxGetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string label;
@@ -717,7 +781,7 @@ static bool v3_path_selinux_get_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxGetLabelResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -727,7 +791,7 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::PathSELinuxSetLabelRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     bool ret;
@@ -754,7 +818,7 @@ static bool v3_path_selinux_set_label(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathSELinuxSetLabelResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -813,7 +877,7 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::PathGetDirectorySizeRequest *>(
             msg->request());
     if (!request->path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::vector<std::string> exclusions;
@@ -842,17 +906,22 @@ static bool v3_path_get_directory_size(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_PathGetDirectorySizeResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
 
+struct SignedExecOutputCtx
+{
+    int fd;
+    uint32_t id;
+};
+
 static void signed_exec_output_cb(const char *line, bool error, void *userdata)
 {
     (void) error;
 
-    int *fd_ptr = (int *) userdata;
-    // TODO: Send line
+    auto ctx = static_cast<SignedExecOutputCtx *>(userdata);
 
     fb::FlatBufferBuilder builder;
     fb::Offset<fb::String> line_id = builder.CreateString(line);
@@ -863,9 +932,9 @@ static void signed_exec_output_cb(const char *line, bool error, void *userdata)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_SignedExecOutputResponse,
-            response.Union()));
+            response.Union(), ctx->id));
 
-    if (!v3_send_response(*fd_ptr, builder)) {
+    if (!v3_send_response(ctx->fd, builder)) {
         // Can't kill the connection from this callback (yet...)
         LOGE("Failed to send output line: %s", strerror(errno));
     }
@@ -875,7 +944,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::SignedExecRequest *>(msg->request());
     if (!request->binary_path() || !request->signature_path()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     static const char *temp_dir = "/mbtool_exec_tmp";
@@ -892,6 +961,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     std::string error_msg;
     int exit_status = -1;
     int term_sig = -1;
+    SignedExecOutputCtx output_ctx{fd, msg->id()};
 
     target_binary = temp_dir;
     target_binary += "/binary";
@@ -1048,7 +1118,7 @@ static bool v3_signed_exec(int fd, const v3::Request *msg)
     //       Right now, if the connection is broken, the command will continue
     //       executing.
     status = util::run_command(target_binary.c_str(), argv, nullptr, nullptr,
-                               &signed_exec_output_cb, &fd);
+                               &signed_exec_output_cb, &output_ctx);
 
     free(argv);
 
@@ -1085,7 +1155,8 @@ done:
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_SignedExecResponse, response.Union()));
+            builder, v3::ResponseType_SignedExecResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1107,7 +1178,7 @@ static bool v3_mb_get_booted_rom_id(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetBootedRomIdResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1175,7 +1246,7 @@ static bool v3_mb_get_installed_roms(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetInstalledRomsResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1192,7 +1263,8 @@ static bool v3_mb_get_version(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbGetVersionResponse, response.Union()));
+            builder, v3::ResponseType_MbGetVersionResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1201,7 +1273,7 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbSetKernelRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     fb::FlatBufferBuilder builder;
@@ -1219,7 +1291,8 @@ static bool v3_mb_set_kernel(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbSetKernelResponse, response.Union()));
+            builder, v3::ResponseType_MbSetKernelResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1228,7 +1301,7 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbSwitchRomRequest *>(msg->request());
     if (!request->rom_id() || !request->boot_blockdev()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::vector<const char *> block_dev_dirs;
@@ -1276,7 +1349,8 @@ static bool v3_mb_switch_rom(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbSwitchRomResponse, response.Union()));
+            builder, v3::ResponseType_MbSwitchRomResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1285,7 +1359,7 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
 {
     auto request = static_cast<const v3::MbWipeRomRequest *>(msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Find and verify ROM is installed
@@ -1296,14 +1370,14 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
     if (!rom) {
         LOGE("Tried to wipe non-installed or invalid ROM ID: %s",
              request->rom_id()->c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // The GUI should check this, but we'll enforce it here
     auto current_rom = Roms::get_current_rom();
     if (current_rom && current_rom->id == rom->id) {
         LOGE("Cannot wipe currently booted ROM: %s", rom->id.c_str());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Wipe the selected targets
@@ -1350,7 +1424,8 @@ static bool v3_mb_wipe_rom(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_MbWipeRomResponse, response.Union()));
+            builder, v3::ResponseType_MbWipeRomResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1360,7 +1435,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     auto request = static_cast<const v3::MbGetPackagesCountRequest *>(
             msg->request());
     if (!request->rom_id()) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     // Find and verify ROM is installed
@@ -1369,7 +1444,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
 
     auto rom = roms.find_by_id(request->rom_id()->c_str());
     if (!rom) {
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     std::string packages_xml(rom->full_data_path());
@@ -1409,7 +1484,7 @@ static bool v3_mb_get_packages_count(int fd, const v3::Request *msg)
     // Wrap response
     builder.Finish(v3::CreateResponse(
             builder, v3::ResponseType_MbGetPackagesCountResponse,
-            response.Union()));
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1441,7 +1516,7 @@ static bool v3_reboot(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid reboot type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     if (!ret) {
@@ -1453,7 +1528,8 @@ static bool v3_reboot(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_RebootResponse, response.Union()));
+            builder, v3::ResponseType_RebootResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1477,7 +1553,7 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
         break;
     default:
         LOGE("Invalid shutdown type: %d", request->type());
-        return v3_send_response_invalid(fd);
+        return v3_send_response_invalid(fd, msg);
     }
 
     if (!ret) {
@@ -1489,7 +1565,8 @@ static bool v3_shutdown(int fd, const v3::Request *msg)
 
     // Wrap response
     builder.Finish(v3::CreateResponse(
-            builder, v3::ResponseType_ShutdownResponse, response.Union()));
+            builder, v3::ResponseType_ShutdownResponse,
+            response.Union(), msg->id()));
 
     return v3_send_response(fd, builder);
 }
@@ -1535,6 +1612,192 @@ static RequestMap request_map[] = {
     { v3::RequestType_NONE, nullptr }
 };
 
+// Requests that can take a long time to complete. These are handled by worker
+// threads so that they don't hold up other requests on the same connection.
+// Responses to these may be sent after the responses to requests that were
+// received later.
+
+// Read-only requests, which may run in parallel with each other
+static v3::RequestType parallel_request_types[] = {
+    v3::RequestType_PathGetDirectorySizeRequest,
+    v3::RequestType_MbGetPackagesCountRequest,
+};
+
+// Requests that modify ROMs or the boot partition. These run one at a time in
+// the order they were received.
+static v3::RequestType serial_request_types[] = {
+    v3::RequestType_MbSetKernelRequest,
+    v3::RequestType_MbSwitchRomRequest,
+    v3::RequestType_MbWipeRomRequest,
+};
+
+// Requests handled on the connection thread that depend on or undo the effects
+// of the serial requests. These wait for all queued serial requests to finish.
+static v3::RequestType after_serial_request_types[] = {
+    v3::RequestType_SignedExecRequest,
+    v3::RequestType_MbGetBootedRomIdRequest,
+    v3::RequestType_MbGetInstalledRomsRequest,
+    v3::RequestType_RebootRequest,
+    v3::RequestType_ShutdownRequest,
+};
+
+template<size_t N>
+static bool is_request_type(const v3::RequestType (&types)[N],
+                            v3::RequestType type)
+{
+    for (auto t : types) {
+        if (t == type) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*!
+ * \brief Thread pool for running long request handlers
+ *
+ * Threads are only started once the first request is submitted, so clients
+ * that never send long-running requests don't pay for them.
+ *
+ * If \p finish_pending is true, requests that are still queued when the
+ * connection ends are run anyway. Otherwise, they are discarded.
+ */
+class RequestWorkers
+{
+public:
+    RequestWorkers(int fd, unsigned int threads, bool finish_pending)
+        : _fd(fd)
+        , _threads(threads)
+        , _finish_pending(finish_pending)
+        , _active(0)
+        , _failed(false)
+        , _stop(false)
+    {
+    }
+
+    ~RequestWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_pending.empty()) {
+                if (_finish_pending) {
+                    // The client asked for these changes, even though it
+                    // won't see the results
+                    LOGW("Finishing %zu queued requests after the connection"
+                         " ended", _pending.size());
+                } else {
+                    LOGW("Discarding %zu queued requests after the connection"
+                         " ended", _pending.size());
+                    _pending.clear();
+                }
+            }
+            _stop = true;
+        }
+        _cv.notify_all();
+
+        for (std::thread &thread : _workers) {
+            thread.join();
+        }
+    }
+
+    RequestWorkers(const RequestWorkers &) = delete;
+    RequestWorkers & operator=(const RequestWorkers &) = delete;
+
+    /*!
+     * \brief Queue request for a worker thread
+     *
+     * \return False if a worker thread previously failed to send a response
+     */
+    bool submit(request_handler_fn fn, std::vector<uint8_t> data)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_failed) {
+            return false;
+        }
+
+        if (_workers.size() < _threads
+                && _pending.size() + 1 > _workers.size() - _active) {
+            _workers.emplace_back(&RequestWorkers::worker, this);
+        }
+
+        _pending.push_back({ fn, std::move(data) });
+        _cv.notify_one();
+
+        return true;
+    }
+
+    /*!
+     * \brief Wait for all queued requests to finish
+     *
+     * \return False if a worker thread failed to send a response
+     */
+    bool drain()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _idle_cv.wait(lock, [&]{
+            return _failed || (_pending.empty() && _active == 0);
+        });
+
+        return !_failed;
+    }
+
+private:
+    struct Job
+    {
+        request_handler_fn fn;
+        std::vector<uint8_t> data;
+    };
+
+    void worker()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        while (true) {
+            _cv.wait(lock, [&]{
+                return _stop || !_pending.empty();
+            });
+
+            if (_pending.empty()) {
+                break;
+            }
+
+            Job job = std::move(_pending.front());
+            _pending.pop_front();
+            ++_active;
+
+            lock.unlock();
+            bool ret = job.fn(_fd, v3::GetRequest(job.data.data()));
+            lock.lock();
+
+            --_active;
+            if (!ret) {
+                _failed = true;
+                // Wake up the main thread, which is blocked reading from the
+                // socket
+                ::shutdown(_fd, SHUT_RD);
+            }
+            _idle_cv.notify_all();
+        }
+    }
+
+    int _fd;
+    unsigned int _threads;
+    bool _finish_pending;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Signaled when a job finishes
+    std::condition_variable _idle_cv;
+    std::deque<Job> _pending;
+    std::vector<std::thread> _workers;
+    // Number of jobs being handled by workers
+    size_t _active;
+    bool _failed;
+    bool _stop;
+};
+
 bool connection_version_3(int fd)
 {
     std::string command;
@@ -1547,8 +1810,15 @@ bool connection_version_3(int fd)
         fd_map.clear();
     });
 
+    // Read-only requests are useless once the client is gone
+    RequestWorkers parallel_workers(fd, V3_WORKER_THREADS, false);
+    // A single thread keeps the requests in order
+    RequestWorkers serial_workers(fd, 1, true);
+
+    // Reused for every request that isn't handed off to a worker thread
+    std::vector<uint8_t> data;
+
     while (1) {
-        std::vector<uint8_t> data;
         if (!util::socket_read_bytes(fd, &data)) {
             return false;
         }
@@ -1574,16 +1844,32 @@ bool connection_version_3(int fd)
         //       command failure!
         bool ret = true;
 
-        if (fn) {
-            ret = fn(fd, request);
+        if (fn && is_request_type(parallel_request_types, type)) {
+            ret = parallel_workers.submit(fn, std::move(data));
+        } else if (fn && is_request_type(serial_request_types, type)) {
+            ret = serial_workers.submit(fn, std::move(data));
+        } else if (fn) {
+            if (is_request_type(after_serial_request_types, type)) {
+                ret = serial_workers.drain();
+            }
+            if (ret) {
+                ret = fn(fd, request);
+            }
         } else {
             // Invalid command; allow further commands
-            ret = v3_send_response_unsupported(fd);
+            ret = v3_send_response_unsupported(fd, request);
         }
 
         if (!ret) {
             return false;
         }
+
+        // Don't hold on to the memory for an unusually large message for the
+        // rest of the connection
+        if (data.capacity() > V3_MAX_KEPT_READ_BUFFER) {
+            data.clear();
+            data.shrink_to_fit();
+        }
     }
 
     return true;
@@ -19,10 +19,17 @@
 
 #include "image.h"
 
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
+#include "mbcommon/endian.h"
 #include "mbcommon/string.h"
 #include "mblog/logging.h"
 #include "mbutil/command.h"
@@ -31,6 +38,21 @@
 #include "mbutil/path.h"
 #include "mbutil/string.h"
 
+// Subset of the ext4 on-disk format needed to read the block bitmaps
+#define EXT4_SUPERBLOCK_OFFSET                  1024
+#define EXT4_SUPERBLOCK_SIZE                    1024
+#define EXT4_SUPER_MAGIC                        0xef53
+
+#define EXT4_FEATURE_INCOMPAT_META_BG           0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT             0x0080
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM         0x0010
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM    0x0400
+
+#define EXT4_BG_BLOCK_UNINIT                    0x0002
+
+#define EXT4_MIN_DESC_SIZE                      32
+#define EXT4_MIN_DESC_SIZE_64BIT                64
+
 namespace mb
 {
 
@@ -94,4 +116,176 @@ bool fsck_ext4_image(const std::string &image)
     return true;
 }
 
+static bool pread_fully(int fd, void *buf, size_t size, uint64_t offset)
+{
+    size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+static inline uint16_t get_le16(const unsigned char *p)
+{
+    uint16_t val;
+    memcpy(&val, p, sizeof(val));
+    return mb_le16toh(val);
+}
+
+static inline uint32_t get_le32(const unsigned char *p)
+{
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return mb_le32toh(val);
+}
+
+/*!
+ * \brief Find the blocks of an ext4 image that are in use
+ *
+ * The block bitmaps of all block groups are read directly from the image. For
+ * groups whose bitmap was never initialized, all blocks are considered to be in
+ * use. The image should be fsck'ed and must not be mounted read-write.
+ *
+ * \param[in] fd File descriptor of the image
+ * \param[out] block_size Block size of the filesystem
+ * \param[out] used Whether each block of the filesystem is in use
+ *
+ * \return Whether the block bitmaps were successfully read. Fails if the image
+ *         is not an ext4 filesystem or uses an unsupported layout.
+ */
+bool get_ext4_image_used_blocks(int fd, uint32_t *block_size,
+                                std::vector<bool> *used)
+{
+    unsigned char sb[EXT4_SUPERBLOCK_SIZE];
+
+    if (!pread_fully(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET)) {
+        LOGE("Failed to read ext4 superblock: %s", strerror(errno));
+        return false;
+    }
+
+    if (get_le16(sb + 0x38) != EXT4_SUPER_MAGIC) {
+        LOGE("Invalid ext4 superblock magic");
+        return false;
+    }
+
+    uint32_t log_block_size = get_le32(sb + 0x18);
+    uint32_t first_data_block = get_le32(sb + 0x14);
+    uint32_t blocks_per_group = get_le32(sb + 0x20);
+    uint32_t feature_incompat = get_le32(sb + 0x60);
+    uint32_t feature_ro_compat = get_le32(sb + 0x64);
+    uint64_t blocks_count = get_le32(sb + 0x04);
+    uint32_t desc_size = EXT4_MIN_DESC_SIZE;
+
+    if (feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks_count |= static_cast<uint64_t>(get_le32(sb + 0x150)) << 32;
+        desc_size = get_le16(sb + 0xfe);
+        if (desc_size < EXT4_MIN_DESC_SIZE_64BIT) {
+            LOGE("Invalid ext4 group descriptor size: %" PRIu32, desc_size);
+            return false;
+        }
+    }
+
+    if (log_block_size > 6) {
+        LOGE("Invalid ext4 block size shift: %" PRIu32, log_block_size);
+        return false;
+    }
+
+    uint32_t bs = 1024u << log_block_size;
+
+    if (feature_incompat & EXT4_FEATURE_INCOMPAT_META_BG) {
+        LOGE("ext4 images with meta_bg are not supported");
+        return false;
+    } else if (blocks_per_group == 0 || blocks_per_group > bs * 8) {
+        LOGE("Invalid ext4 blocks per group: %" PRIu32, blocks_per_group);
+        return false;
+    } else if (first_data_block >= blocks_count) {
+        LOGE("Invalid ext4 first data block: %" PRIu32, first_data_block);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        LOGE("Failed to stat image: %s", strerror(errno));
+        return false;
+    } else if (blocks_count > static_cast<uint64_t>(st.st_size) / bs) {
+        LOGE("ext4 filesystem is larger than the image");
+        return false;
+    }
+
+    // The bitmaps are only allowed to be uninitialized if the group
+    // descriptors are checksummed
+    bool uninit_allowed = feature_ro_compat
+            & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM
+                    | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+
+    uint64_t groups = (blocks_count - first_data_block + blocks_per_group - 1)
+            / blocks_per_group;
+
+    std::vector<unsigned char> gdt(groups * desc_size);
+    if (!pread_fully(fd, gdt.data(), gdt.size(),
+                     (static_cast<uint64_t>(first_data_block) + 1) * bs)) {
+        LOGE("Failed to read ext4 group descriptors: %s", strerror(errno));
+        return false;
+    }
+
+    // Blocks before the first data block (the boot sector for 1K blocks) are
+    // not tracked by the bitmaps
+    used->assign(blocks_count, false);
+    std::fill(used->begin(), used->begin() + first_data_block, true);
+
+    std::vector<unsigned char> bitmap(blocks_per_group / 8 + 1);
+
+    for (uint64_t group = 0; group < groups; ++group) {
+        const unsigned char *desc = gdt.data() + group * desc_size;
+        uint64_t begin = first_data_block + group * blocks_per_group;
+        uint64_t end = std::min<uint64_t>(begin + blocks_per_group,
+                                          blocks_count);
+
+        if (uninit_allowed && (get_le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)) {
+            std::fill(used->begin() + begin, used->begin() + end, true);
+            continue;
+        }
+
+        uint64_t bitmap_block = get_le32(desc);
+        if (desc_size >= EXT4_MIN_DESC_SIZE_64BIT) {
+            bitmap_block |= static_cast<uint64_t>(get_le32(desc + 0x20)) << 32;
+        }
+
+        if (bitmap_block >= blocks_count) {
+            LOGE("Invalid ext4 block bitmap location for group %" PRIu64,
+                 group);
+            return false;
+        }
+
+        if (!pread_fully(fd, bitmap.data(), (end - begin + 7) / 8,
+                         bitmap_block * bs)) {
+            LOGE("Failed to read ext4 block bitmap for group %" PRIu64 ": %s",
+                 group, strerror(errno));
+            return false;
+        }
+
+        for (uint64_t i = 0; i < end - begin; ++i) {
+            if (bitmap[i / 8] & (1 << (i % 8))) {
+                (*used)[begin + i] = true;
+            }
+        }
+    }
+
+    *block_size = bs;
+    return true;
+}
+
 }
@@ -20,6 +20,9 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 #define DEFAULT_IMAGE_SIZE ((uint64_t) 4 * 1024 * 1024 * 1024)
 
@@ -36,5 +39,7 @@ enum class CreateImageResult
 
 CreateImageResult create_ext4_image(const std::string &path, uint64_t size);
 bool fsck_ext4_image(const std::string &image);
+bool get_ext4_image_used_blocks(int fd, uint32_t *block_size,
+                                std::vector<bool> *used);
 
 }
\ No newline at end of file
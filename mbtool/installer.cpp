@@ -1536,21 +1536,18 @@ Installer::ProceedState Installer::install_stage_set_up_chroot()
 {
     LOGD("[Installer] Chroot set up stage");
 
-    // Calculate SHA512 hash of the boot partition
-    if (!util::sha512_hash(_boot_block_dev, _boot_hash)) {
-        display_msg("Failed to compute sha512sum of boot partition");
+    // Calculate SHA512 hash of the boot partition and save a copy of the boot
+    // image that we'll restore if the installation fails. Both are done in a
+    // single pass since reading the boot partition can be slow.
+    if (!util::sha512_hash_copy(_boot_block_dev, _temp + "/boot.orig",
+                                _boot_hash)) {
+        display_msg("Failed to backup boot partition");
         return ProceedState::Fail;
     }
 
     std::string digest = util::hex_string(_boot_hash, SHA512_DIGEST_LENGTH);
     LOGD("Boot partition SHA512sum: %s", digest.c_str());
 
-    // Save a copy of the boot image that we'll restore if the installation fails
-    if (!util::copy_contents(_boot_block_dev, _temp + "/boot.orig")) {
-        display_msg("Failed to backup boot partition");
-        return ProceedState::Fail;
-    }
-
     // Switch to target ROM if possible
     std::string boot_image_path(_rom->boot_image_path());
     if (access(boot_image_path.c_str(), R_OK) == 0) {
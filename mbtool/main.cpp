@@ -68,6 +68,7 @@ struct tool tools[] = {
 #ifdef RECOVERY
     { "backup", mb::backup_main },
     { "restore", mb::restore_main },
+    { "backup-gc", mb::backup_gc_main },
     { "rom-installer", mb::rom_installer_main },
     { "updater", mb::update_binary_main }, // TWRP
     { "update_binary", mb::update_binary_main }, // CWM, Philz
@@ -82,11 +82,13 @@ struct FileOpenRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_PATH = 4,
     VT_FLAGS = 6,
-    VT_PERMS = 8
+    VT_PERMS = 8,
+    VT_SEND_FD = 10
   };
   const flatbuffers::String *path() const { return GetPointer<const flatbuffers::String *>(VT_PATH); }
   const flatbuffers::Vector<int16_t> *flags() const { return GetPointer<const flatbuffers::Vector<int16_t> *>(VT_FLAGS); }
   uint32_t perms() const { return GetField<uint32_t>(VT_PERMS, 0); }
+  bool send_fd() const { return GetField<uint8_t>(VT_SEND_FD, 0) != 0; }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_PATH) &&
@@ -94,6 +96,7 @@ struct FileOpenRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_FLAGS) &&
            verifier.Verify(flags()) &&
            VerifyField<uint32_t>(verifier, VT_PERMS) &&
+           VerifyField<uint8_t>(verifier, VT_SEND_FD) &&
            verifier.EndTable();
   }
 };
@@ -104,10 +107,11 @@ struct FileOpenRequestBuilder {
   void add_path(flatbuffers::Offset<flatbuffers::String> path) { fbb_.AddOffset(FileOpenRequest::VT_PATH, path); }
   void add_flags(flatbuffers::Offset<flatbuffers::Vector<int16_t>> flags) { fbb_.AddOffset(FileOpenRequest::VT_FLAGS, flags); }
   void add_perms(uint32_t perms) { fbb_.AddElement<uint32_t>(FileOpenRequest::VT_PERMS, perms, 0); }
+  void add_send_fd(bool send_fd) { fbb_.AddElement<uint8_t>(FileOpenRequest::VT_SEND_FD, static_cast<uint8_t>(send_fd), 0); }
   FileOpenRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   FileOpenRequestBuilder &operator=(const FileOpenRequestBuilder &);
   flatbuffers::Offset<FileOpenRequest> Finish() {
-    auto o = flatbuffers::Offset<FileOpenRequest>(fbb_.EndTable(start_, 3));
+    auto o = flatbuffers::Offset<FileOpenRequest>(fbb_.EndTable(start_, 4));
     return o;
   }
 };
@@ -115,19 +119,22 @@ struct FileOpenRequestBuilder {
 inline flatbuffers::Offset<FileOpenRequest> CreateFileOpenRequest(flatbuffers::FlatBufferBuilder &_fbb,
     flatbuffers::Offset<flatbuffers::String> path = 0,
     flatbuffers::Offset<flatbuffers::Vector<int16_t>> flags = 0,
-    uint32_t perms = 0) {
+    uint32_t perms = 0,
+    bool send_fd = false) {
   FileOpenRequestBuilder builder_(_fbb);
   builder_.add_perms(perms);
   builder_.add_flags(flags);
   builder_.add_path(path);
+  builder_.add_send_fd(send_fd);
   return builder_.Finish();
 }
 
 inline flatbuffers::Offset<FileOpenRequest> CreateFileOpenRequestDirect(flatbuffers::FlatBufferBuilder &_fbb,
     const char *path = nullptr,
     const std::vector<int16_t> *flags = nullptr,
-    uint32_t perms = 0) {
-  return CreateFileOpenRequest(_fbb, path ? _fbb.CreateString(path) : 0, flags ? _fbb.CreateVector<int16_t>(*flags) : 0, perms);
+    uint32_t perms = 0,
+    bool send_fd = false) {
+  return CreateFileOpenRequest(_fbb, path ? _fbb.CreateString(path) : 0, flags ? _fbb.CreateVector<int16_t>(*flags) : 0, perms, send_fd);
 }
 
 struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
@@ -135,12 +142,14 @@ struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
     VT_SUCCESS = 4,
     VT_ERROR_MSG = 6,
     VT_ID = 8,
-    VT_ERROR = 10
+    VT_ERROR = 10,
+    VT_HAS_FD = 12
   };
   bool success() const { return GetField<uint8_t>(VT_SUCCESS, 0) != 0; }
   const flatbuffers::String *error_msg() const { return GetPointer<const flatbuffers::String *>(VT_ERROR_MSG); }
   int32_t id() const { return GetField<int32_t>(VT_ID, 0); }
   const FileOpenError *error() const { return GetPointer<const FileOpenError *>(VT_ERROR); }
+  bool has_fd() const { return GetField<uint8_t>(VT_HAS_FD, 0) != 0; }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_SUCCESS) &&
@@ -149,6 +158,7 @@ struct FileOpenResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            VerifyField<int32_t>(verifier, VT_ID) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_ERROR) &&
            verifier.VerifyTable(error()) &&
+           VerifyField<uint8_t>(verifier, VT_HAS_FD) &&
            verifier.EndTable();
   }
 };
@@ -160,10 +170,11 @@ struct FileOpenResponseBuilder {
   void add_error_msg(flatbuffers::Offset<flatbuffers::String> error_msg) { fbb_.AddOffset(FileOpenResponse::VT_ERROR_MSG, error_msg); }
   void add_id(int32_t id) { fbb_.AddElement<int32_t>(FileOpenResponse::VT_ID, id, 0); }
   void add_error(flatbuffers::Offset<FileOpenError> error) { fbb_.AddOffset(FileOpenResponse::VT_ERROR, error); }
+  void add_has_fd(bool has_fd) { fbb_.AddElement<uint8_t>(FileOpenResponse::VT_HAS_FD, static_cast<uint8_t>(has_fd), 0); }
   FileOpenResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   FileOpenResponseBuilder &operator=(const FileOpenResponseBuilder &);
   flatbuffers::Offset<FileOpenResponse> Finish() {
-    auto o = flatbuffers::Offset<FileOpenResponse>(fbb_.EndTable(start_, 4));
+    auto o = flatbuffers::Offset<FileOpenResponse>(fbb_.EndTable(start_, 5));
     return o;
   }
 };
@@ -172,11 +183,13 @@ inline flatbuffers::Offset<FileOpenResponse> CreateFileOpenResponse(flatbuffers:
     bool success = false,
     flatbuffers::Offset<flatbuffers::String> error_msg = 0,
     int32_t id = 0,
-    flatbuffers::Offset<FileOpenError> error = 0) {
+    flatbuffers::Offset<FileOpenError> error = 0,
+    bool has_fd = false) {
   FileOpenResponseBuilder builder_(_fbb);
   builder_.add_error(error);
   builder_.add_id(id);
   builder_.add_error_msg(error_msg);
+  builder_.add_has_fd(has_fd);
   builder_.add_success(success);
   return builder_.Finish();
 }
@@ -185,8 +198,9 @@ inline flatbuffers::Offset<FileOpenResponse> CreateFileOpenResponseDirect(flatbu
     bool success = false,
     const char *error_msg = nullptr,
     int32_t id = 0,
-    flatbuffers::Offset<FileOpenError> error = 0) {
-  return CreateFileOpenResponse(_fbb, success, error_msg ? _fbb.CreateString(error_msg) : 0, id, error);
+    flatbuffers::Offset<FileOpenError> error = 0,
+    bool has_fd = false) {
+  return CreateFileOpenResponse(_fbb, success, error_msg ? _fbb.CreateString(error_msg) : 0, id, error, has_fd);
 }
 
 }  // namespace v3
@@ -88,15 +88,18 @@ inline bool VerifyRequestType(flatbuffers::Verifier &verifier, const void *union
 struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_REQUEST_TYPE = 4,
-    VT_REQUEST = 6
+    VT_REQUEST = 6,
+    VT_ID = 8
   };
   RequestType request_type() const { return static_cast<RequestType>(GetField<uint8_t>(VT_REQUEST_TYPE, 0)); }
   const void *request() const { return GetPointer<const void *>(VT_REQUEST); }
+  uint32_t id() const { return GetField<uint32_t>(VT_ID, 0); }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_REQUEST_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_REQUEST) &&
            VerifyRequestType(verifier, request(), request_type()) &&
+           VerifyField<uint32_t>(verifier, VT_ID) &&
            verifier.EndTable();
   }
 };
@@ -106,18 +109,21 @@ struct RequestBuilder {
   flatbuffers::uoffset_t start_;
   void add_request_type(RequestType request_type) { fbb_.AddElement<uint8_t>(Request::VT_REQUEST_TYPE, static_cast<uint8_t>(request_type), 0); }
   void add_request(flatbuffers::Offset<void> request) { fbb_.AddOffset(Request::VT_REQUEST, request); }
+  void add_id(uint32_t id) { fbb_.AddElement<uint32_t>(Request::VT_ID, id, 0); }
   RequestBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   RequestBuilder &operator=(const RequestBuilder &);
   flatbuffers::Offset<Request> Finish() {
-    auto o = flatbuffers::Offset<Request>(fbb_.EndTable(start_, 2));
+    auto o = flatbuffers::Offset<Request>(fbb_.EndTable(start_, 3));
     return o;
   }
 };
 
 inline flatbuffers::Offset<Request> CreateRequest(flatbuffers::FlatBufferBuilder &_fbb,
     RequestType request_type = RequestType_NONE,
-    flatbuffers::Offset<void> request = 0) {
+    flatbuffers::Offset<void> request = 0,
+    uint32_t id = 0) {
   RequestBuilder builder_(_fbb);
+  builder_.add_id(id);
   builder_.add_request(request);
   builder_.add_request_type(request_type);
   return builder_.Finish();
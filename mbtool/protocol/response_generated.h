@@ -141,15 +141,18 @@ inline flatbuffers::Offset<Unsupported> CreateUnsupported(flatbuffers::FlatBuffe
 struct Response FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   enum {
     VT_RESPONSE_TYPE = 4,
-    VT_RESPONSE = 6
+    VT_RESPONSE = 6,
+    VT_ID = 8
   };
   ResponseType response_type() const { return static_cast<ResponseType>(GetField<uint8_t>(VT_RESPONSE_TYPE, 0)); }
   const void *response() const { return GetPointer<const void *>(VT_RESPONSE); }
+  uint32_t id() const { return GetField<uint32_t>(VT_ID, 0); }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<uint8_t>(verifier, VT_RESPONSE_TYPE) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, VT_RESPONSE) &&
            VerifyResponseType(verifier, response(), response_type()) &&
+           VerifyField<uint32_t>(verifier, VT_ID) &&
            verifier.EndTable();
   }
 };
@@ -159,18 +162,21 @@ struct ResponseBuilder {
   flatbuffers::uoffset_t start_;
   void add_response_type(ResponseType response_type) { fbb_.AddElement<uint8_t>(Response::VT_RESPONSE_TYPE, static_cast<uint8_t>(response_type), 0); }
   void add_response(flatbuffers::Offset<void> response) { fbb_.AddOffset(Response::VT_RESPONSE, response); }
+  void add_id(uint32_t id) { fbb_.AddElement<uint32_t>(Response::VT_ID, id, 0); }
   ResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   ResponseBuilder &operator=(const ResponseBuilder &);
   flatbuffers::Offset<Response> Finish() {
-    auto o = flatbuffers::Offset<Response>(fbb_.EndTable(start_, 2));
+    auto o = flatbuffers::Offset<Response>(fbb_.EndTable(start_, 3));
     return o;
   }
 };
 
 inline flatbuffers::Offset<Response> CreateResponse(flatbuffers::FlatBufferBuilder &_fbb,
     ResponseType response_type = ResponseType_NONE,
-    flatbuffers::Offset<void> response = 0) {
+    flatbuffers::Offset<void> response = 0,
+    uint32_t id = 0) {
   ResponseBuilder builder_(_fbb);
+  builder_.add_id(id);
   builder_.add_response(response);
   builder_.add_response_type(response_type);
   return builder_.Finish();
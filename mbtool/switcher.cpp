@@ -19,10 +19,16 @@
 
 #include "switcher.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -42,6 +48,10 @@
 #include "roms.h"
 
 #define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+#define STAGING_DIR "/data/multiboot"
+
+// Images are hashed, compared, and flashed in blocks of this size
+#define FLASH_BLOCK_SIZE (128 * 1024)
 
 namespace mb
 {
@@ -176,10 +186,331 @@ struct Flashable
     std::string block_dev;
     std::string expected_hash;
     std::string hash;
-    unsigned char *data = nullptr;
-    std::size_t size = 0;
+    // Size of the image
+    uint64_t size = 0;
+    // Offsets of the blocks that differ from the target
+    std::vector<uint64_t> dirty_blocks;
+    // Whether the target is a regular file that needs to be truncated
+    bool truncate = false;
+    // File that the dirty blocks are flashed from. If the image is staged,
+    // this is an unlinked file containing only the dirty blocks, in order.
+    // Otherwise, this is the image itself.
+    int data_fd = -1;
+    bool staged = false;
 };
 
+static bool read_fully(int fd, void *buf, std::size_t size,
+                       std::size_t *bytes_read)
+{
+    std::size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = read(fd, static_cast<char *>(buf) + total, size - total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    *bytes_read = total;
+    return true;
+}
+
+static bool pread_fully(int fd, void *buf, std::size_t size, uint64_t offset,
+                        std::size_t *bytes_read)
+{
+    std::size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pread64(fd, static_cast<char *>(buf) + total,
+                            size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+        total += n;
+    }
+
+    *bytes_read = total;
+    return true;
+}
+
+static bool pwrite_fully(int fd, const void *buf, std::size_t size,
+                         uint64_t offset)
+{
+    std::size_t total = 0;
+
+    while (total < size) {
+        ssize_t n = pwrite64(fd, static_cast<const char *>(buf) + total,
+                             size - total, offset + total);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = ENOSPC;
+            return false;
+        }
+        total += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create an unlinked, root-only file for staging image data
+ *
+ * \return File descriptor if successful. Otherwise, -1.
+ */
+static int create_staging_file()
+{
+    std::string dir = get_raw_path(STAGING_DIR);
+    std::string path(dir);
+    path += "/.flash.XXXXXX";
+
+    if (!util::mkdir_recursive(dir, 0755)) {
+        LOGE("%s: Failed to create directory: %s",
+             dir.c_str(), strerror(errno));
+        return -1;
+    }
+
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) {
+        LOGE("%s: Failed to create staging file: %s",
+             path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    // Nothing else can open the file once it has been unlinked
+    if (unlink(path.c_str()) < 0) {
+        LOGE("%s: Failed to unlink staging file: %s",
+             path.c_str(), strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/*!
+ * \brief Hash an image and find the blocks that differ from its target
+ *
+ * The image is read exactly once, in blocks of \a FLASH_BLOCK_SIZE. Each block
+ * is hashed and compared to the corresponding block of the target. If
+ * \p stage is true, the differing blocks are copied to an unlinked staging
+ * file, so that the data flashed by flash_image() is guaranteed to be the data
+ * that was hashed, even if the image is modified in the meantime. Otherwise,
+ * the blocks will be read from the image again when flashing.
+ *
+ * On success, \a hash, \a size, \a dirty_blocks, \a truncate, and \a data_fd
+ * of \p f are set.
+ *
+ * \param f Flashable with \a image and \a block_dev set
+ * \param stage Whether to copy the differing blocks to a staging file
+ *
+ * \return True if successful. Otherwise, false.
+ */
+static bool stage_image(Flashable *f, bool stage)
+{
+    int fd_source = open(f->image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_source < 0) {
+        LOGE("%s: Failed to open image: %s",
+             f->image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_source = util::finally([&]{
+        if (fd_source >= 0) {
+            close(fd_source);
+        }
+    });
+
+    // A missing target is treated as if every block differs
+    int fd_target = open(f->block_dev.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_target < 0 && errno != ENOENT) {
+        LOGE("%s: Failed to open target: %s",
+             f->block_dev.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_target = util::finally([&]{
+        if (fd_target >= 0) {
+            close(fd_target);
+        }
+    });
+
+    struct stat sb;
+    bool target_is_reg = false;
+    uint64_t target_size = 0;
+
+    if (fd_target >= 0) {
+        if (fstat(fd_target, &sb) < 0) {
+            LOGE("%s: Failed to stat target: %s",
+                 f->block_dev.c_str(), strerror(errno));
+            return false;
+        }
+        target_is_reg = S_ISREG(sb.st_mode);
+        target_size = sb.st_size;
+    }
+
+    std::vector<unsigned char> buf_source(FLASH_BLOCK_SIZE);
+    std::vector<unsigned char> buf_target(FLASH_BLOCK_SIZE);
+    uint64_t offset = 0;
+
+    SHA512_CTX ctx;
+    SHA512_Init(&ctx);
+
+    while (true) {
+        std::size_t n_source;
+        std::size_t n_target = 0;
+
+        if (!read_fully(fd_source, buf_source.data(), buf_source.size(),
+                        &n_source)) {
+            LOGE("%s: Failed to read image: %s",
+                 f->image.c_str(), strerror(errno));
+            return false;
+        } else if (n_source == 0) {
+            break;
+        }
+
+        SHA512_Update(&ctx, buf_source.data(), n_source);
+
+        if (fd_target >= 0 && !pread_fully(fd_target, buf_target.data(),
+                                           n_source, offset, &n_target)) {
+            LOGE("%s: Failed to read target: %s",
+                 f->block_dev.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (n_target != n_source
+                || memcmp(buf_source.data(), buf_target.data(),
+                          n_source) != 0) {
+            if (stage) {
+                if (f->data_fd < 0) {
+                    f->data_fd = create_staging_file();
+                    if (f->data_fd < 0) {
+                        return false;
+                    }
+                    f->staged = true;
+                }
+
+                if (!pwrite_fully(f->data_fd, buf_source.data(), n_source,
+                                  f->dirty_blocks.size() * FLASH_BLOCK_SIZE)) {
+                    LOGE("%s: Failed to stage image: %s",
+                         f->image.c_str(), strerror(errno));
+                    return false;
+                }
+            }
+
+            f->dirty_blocks.push_back(offset);
+        }
+
+        offset += n_source;
+
+        if (n_source < buf_source.size()) {
+            break;
+        }
+    }
+
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+    SHA512_Final(digest, &ctx);
+    f->hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+
+    f->size = offset;
+    f->truncate = target_is_reg && target_size != offset;
+
+    if (!stage) {
+        f->data_fd = fd_source;
+        fd_source = -1;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Flash the differing blocks found by stage_image() to the target
+ *
+ * The target is not opened for writing at all if it is already identical to
+ * the image. Otherwise, it is synced once after all blocks have been written.
+ *
+ * \param f Flashable that was passed to stage_image()
+ *
+ * \return True if successful. Otherwise, false.
+ */
+static bool flash_image(const Flashable &f)
+{
+    if (f.dirty_blocks.empty() && !f.truncate) {
+        LOGD("%s: Already up to date", f.block_dev.c_str());
+        return true;
+    }
+
+    int fd = open(f.block_dev.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        LOGE("%s: Failed to open for writing: %s",
+             f.block_dev.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    std::vector<unsigned char> buf(FLASH_BLOCK_SIZE);
+
+    for (std::size_t i = 0; i < f.dirty_blocks.size(); ++i) {
+        uint64_t offset = f.dirty_blocks[i];
+        uint64_t data_offset = f.staged ? i * FLASH_BLOCK_SIZE : offset;
+        std::size_t size = static_cast<std::size_t>(std::min<uint64_t>(
+                FLASH_BLOCK_SIZE, f.size - offset));
+        std::size_t n;
+
+        if (!pread_fully(f.data_fd, buf.data(), size, data_offset, &n)) {
+            LOGE("%s: Failed to read image data: %s",
+                 f.image.c_str(), strerror(errno));
+            return false;
+        } else if (n != size) {
+            LOGE("%s: Image data was truncated", f.image.c_str());
+            return false;
+        }
+
+        if (!pwrite_fully(fd, buf.data(), size, offset)) {
+            LOGE("%s: Failed to write image: %s",
+                 f.block_dev.c_str(), strerror(errno));
+            return false;
+        }
+    }
+
+    if (f.truncate && ftruncate64(fd, f.size) < 0) {
+        LOGE("%s: Failed to truncate file: %s",
+             f.block_dev.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fsync(fd) < 0) {
+        LOGE("%s: Failed to sync: %s",
+             f.block_dev.c_str(), strerror(errno));
+        return false;
+    }
+
+    LOGD("%s: Wrote %zu of %" PRIu64 " blocks", f.block_dev.c_str(),
+         f.dirty_blocks.size(),
+         (f.size + FLASH_BLOCK_SIZE - 1) / FLASH_BLOCK_SIZE);
+
+    return true;
+}
+
 /*!
  * \brief Perform non-recursive search for a block device
  *
@@ -328,14 +659,17 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
         return SwitchRomResult::FAILED;
     }
 
-    // We'll read the files we want to flash into memory so a malicious app
-    // can't change the file between the hash verification step and flashing
-    // step.
+    // The blocks we want to flash are copied to unlinked staging files as the
+    // images are hashed so a malicious app can't change the file between the
+    // hash verification step and flashing step. Only blocks that differ from
+    // the target are copied (and later flashed).
 
     std::vector<Flashable> flashables;
-    auto free_flashables = util::finally([&]{
+    auto close_flashables = util::finally([&]{
         for (Flashable &f : flashables) {
-            free(f.data);
+            if (f.data_fd >= 0) {
+                close(f.data_fd);
+            }
         }
     });
 
@@ -351,20 +685,11 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
     checksums_read(&props);
 
     for (Flashable &f : flashables) {
-        // If memory becomes an issue, an alternative method is to create a
-        // temporary directory in /data/multiboot/ that's only writable by root
-        // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
-            LOGE("%s: Failed to read image: %s",
-                 f.image.c_str(), strerror(errno));
+        // Get actual sha512sum
+        if (!stage_image(&f, true)) {
             return SwitchRomResult::FAILED;
         }
 
-        // Get actual sha512sum
-        unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(f.data, f.size, digest);
-        f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
-
         if (force_update_checksums) {
             checksums_update(&props, id, util::base_name(f.image), f.hash);
         }
@@ -396,11 +721,7 @@ SwitchRomResult switch_rom(const char *id, const char *boot_blockdev,
 
     // Now we can flash the images
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
-            LOGE("%s: Failed to write image: %s",
-                 f.block_dev.c_str(), strerror(errno));
+        if (!flash_image(f)) {
             return SwitchRomResult::FAILED;
         }
     }
@@ -456,42 +777,42 @@ bool set_kernel(const char *id, const char *boot_blockdev)
         return false;
     }
 
-    unsigned char *data;
-    std::size_t size;
-
-    if (!util::file_read_all(boot_blockdev, &data, &size)) {
-        LOGE("%s: Failed to read block device: %s",
-             boot_blockdev, strerror(errno));
-        return false;
-    }
+    // The boot partition can't be modified by apps, so there's no need to
+    // stage the data before writing it
+    Flashable f;
+    f.image = boot_blockdev;
+    f.block_dev = bootimg_path;
 
-    auto free_data = util::finally([&]{
-        free(data);
+    auto close_data = util::finally([&]{
+        if (f.data_fd >= 0) {
+            close(f.data_fd);
+        }
     });
 
-    // Get actual sha512sum
-    unsigned char digest[SHA512_DIGEST_LENGTH];
-    SHA512(data, size, digest);
-    std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    if (!stage_image(&f, false)) {
+        return false;
+    }
 
     // Add to checksums.prop
     std::unordered_map<std::string, std::string> props;
     checksums_read(&props);
-    checksums_update(&props, id, "boot.img", hash);
+
+    std::string old_hash;
+    bool checksum_changed = checksums_get(&props, id, "boot.img", &old_hash)
+            != ChecksumsGetResult::FOUND || old_hash != f.hash;
+    checksums_update(&props, id, "boot.img", f.hash);
 
     // NOTE: This function isn't responsible for updating the checksums for
     //       any extra images. We don't want to mask any malicious changes.
 
-    // Cast is okay. The data is just passed to fwrite (ie. no signed
-    // extension issues)
-    if (!util::file_write_data(bootimg_path, (char *) data, size)) {
-        LOGE("%s: Failed to write image: %s",
-             bootimg_path.c_str(), strerror(errno));
+    if (!flash_image(f)) {
         return false;
     }
 
-    LOGD("Updating checksums file");
-    checksums_write(props);
+    if (checksum_changed) {
+        LOGD("Updating checksums file");
+        checksums_write(props);
+    }
 
     if (!fix_multiboot_permissions()) {
         //return false;
@@ -4,6 +4,7 @@
 
 #include <cerrno>
 #include <cinttypes>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -29,6 +30,7 @@
 #endif
 
 static char source_fd_path[50];
+static const char *index_path;
 static uint64_t sparse_size;
 
 struct context
@@ -104,6 +106,47 @@ static bool cb_seek(int64_t offset, int whence, void *userData)
     return true;
 }
 
+/*!
+ * \brief Load chunk index from the sidecar file (if one was specified)
+ */
+static bool load_index(context *ctx)
+{
+    if (!index_path) {
+        return false;
+    }
+
+    FILE *fp = fopen(index_path, "rb");
+    if (!fp) {
+        return false;
+    }
+
+    bool ret = sparseLoadIndex(ctx->sctx, fp);
+    fclose(fp);
+    return ret;
+}
+
+/*!
+ * \brief Build chunk index and write it to the sidecar file
+ */
+static bool save_index(context *ctx)
+{
+    FILE *fp = fopen(index_path, "wb");
+    if (!fp) {
+        fprintf(stderr, "%s: Failed to open for writing: %s\n",
+                index_path, strerror(errno));
+        return false;
+    }
+
+    bool ret = sparseSaveIndex(ctx->sctx, fp);
+    if (fclose(fp) != 0) {
+        ret = false;
+    }
+    if (!ret) {
+        fprintf(stderr, "%s: Failed to write index\n", index_path);
+    }
+    return ret;
+}
+
 /*!
  * \brief Open callback for fuse
  */
@@ -141,6 +184,9 @@ static int fuse_open(const char *path, fuse_file_info *fi)
         return -EIO;
     }
 
+    // If there is no usable index, sparseSeek() will build one on demand
+    load_index(ctx);
+
     fi->fh = reinterpret_cast<uint64_t>(ctx);
 
     return 0;
@@ -251,6 +297,12 @@ static int get_sparse_file_size()
         return -EIO;
     }
 
+    // Create or refresh the sidecar index so that every subsequent open only
+    // needs to load it
+    if (index_path && !load_index(ctx)) {
+        save_index(ctx);
+    }
+
     sparseCtxFree(ctx->sctx);
     mb_file_free(ctx->file);
     delete ctx;
@@ -261,6 +313,7 @@ struct arg_ctx
 {
     char *source_file = nullptr;
     char *target_file = nullptr;
+    char *index_file = nullptr;
     bool show_help = false;
 };
 
@@ -273,6 +326,7 @@ static fuse_opt fuse_opts[] =
 {
     FUSE_OPT_KEY("-h",     KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
+    { "index=%s", offsetof(arg_ctx, index_file), 0 },
     FUSE_OPT_END
 };
 
@@ -284,6 +338,9 @@ static void usage(FILE *stream, const char *progname)
             "general options:\n"
             "    -o opt,[opt...]        comma-separated list of mount options\n"
             "    -h   --help            show this help message\n"
+            "\n"
+            "fuse-sparse options:\n"
+            "    -o index=FILE          load/save chunk index from/to FILE\n"
             "\n",
             progname);
 }
@@ -342,6 +399,7 @@ int main(int argc, char *argv[])
         }
         snprintf(source_fd_path, sizeof(source_fd_path),
                  "/proc/self/fd/%d", fd);
+        index_path = arg_ctx.index_file;
 
         if (get_sparse_file_size() < 0) {
             close(fd);
@@ -365,6 +423,7 @@ int main(int argc, char *argv[])
     fuse_opt_free_args(&args);
     free(arg_ctx.source_file);
     free(arg_ctx.target_file);
+    free(arg_ctx.index_file);
 
     return fuse_ret;
 }
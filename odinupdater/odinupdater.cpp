@@ -17,6 +17,7 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <vector>
 
 #include <cerrno>
@@ -26,9 +27,12 @@
 #include <cstring>
 
 #include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <unistd.h>
 
 // libmbsparse
 #include "mbsparse/sparse.h"
@@ -66,6 +70,10 @@
 
 #define EFS_SALES_CODE_FILE     "/efs/imei/mps_code.dat"
 
+#ifndef BLKZEROOUT
+#define BLKZEROOUT              _IO(0x12, 127)
+#endif
+
 #define PROP_SYSTEM_DEV         "system"
 #define PROP_BOOT_DEV           "boot"
 
@@ -356,6 +364,71 @@ static bool cb_zip_read(void *buf, uint64_t size, uint64_t *bytes_read,
     return true;
 }
 
+/*!
+ * \brief Write all data in a buffer to a file descriptor
+ */
+static bool write_fully(int fd, const char *out_filename,
+                        const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0) {
+            error("%s: Failed to write: %s", out_filename, strerror(errno));
+            return false;
+        }
+
+        size -= n;
+        buf += n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Handle a range of zeros in the output without writing the zeros
+ *
+ * For regular files (which are truncated when opened), the range is simply
+ * skipped and becomes a hole. For block devices, don't care ranges are skipped
+ * and zero-filled ranges are zeroed with the BLKZEROOUT ioctl, which lets the
+ * kernel and the storage controller do the work. If the ioctl is not
+ * supported, zeros are written the usual way.
+ *
+ * \post The file position is at \a offset + \a size
+ */
+static bool write_zero_range(int fd, const char *out_filename, bool is_blkdev,
+                             bool dont_care, uint64_t offset, uint64_t size)
+{
+    if (is_blkdev && !dont_care) {
+        uint64_t range[2] = { offset, size };
+
+        if (ioctl(fd, BLKZEROOUT, &range) < 0) {
+            static const char zeros[65536] = {};
+
+            if (lseek64(fd, offset, SEEK_SET) < 0) {
+                error("%s: Failed to seek: %s", out_filename, strerror(errno));
+                return false;
+            }
+
+            while (size > 0) {
+                size_t n = std::min<uint64_t>(sizeof(zeros), size);
+                if (!write_fully(fd, out_filename, zeros, n)) {
+                    return false;
+                }
+                size -= n;
+            }
+
+            return true;
+        }
+    }
+
+    if (lseek64(fd, offset + size, SEEK_SET) < 0) {
+        error("%s: Failed to seek: %s", out_filename, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
 #if DEBUG_SKIP_FLASH_SYSTEM
 MB_UNUSED
 #endif
@@ -363,10 +436,12 @@ static bool extract_sparse_file(const char *zip_filename,
                                 const char *out_filename)
 {
     struct SparseCtx *ctx;
+    SparseChunk chunk;
     char buf[10240];
     uint64_t n;
-    bool sparse_ret;
     int fd;
+    struct stat sb;
+    bool is_blkdev;
     uint64_t cur_bytes = 0;
     uint64_t max_bytes = 0;
     uint64_t old_bytes = 0;
@@ -394,6 +469,9 @@ static bool extract_sparse_file(const char *zip_filename,
         goto error_la_allocated;
     }
 
+    // Refuse to flash corrupted images
+    sparseSetVerifyCrc32(ctx, true);
+
     if (!sparseOpen(ctx, nullptr, nullptr, &cb_zip_read, nullptr, nullptr, a)) {
         error("Failed to open sparse file");
         goto error_sparse_allocated;
@@ -406,11 +484,17 @@ static bool extract_sparse_file(const char *zip_filename,
         goto error_sparse_allocated;
     }
 
+    if (fstat(fd, &sb) < 0) {
+        error("%s: Failed to stat: %s", out_filename, strerror(errno));
+        goto error_fd_opened;
+    }
+    is_blkdev = S_ISBLK(sb.st_mode);
+
     sparseSize(ctx, &max_bytes);
 
     set_progress(0);
 
-    while ((sparse_ret = sparseRead(ctx, buf, sizeof(buf), &n)) && n > 0) {
+    while (true) {
         // Rate limit: update progress only after difference exceeds 0.1%
         old_ratio = (double) old_bytes / max_bytes;
         new_ratio = (double) cur_bytes / max_bytes;
@@ -419,23 +503,51 @@ static bool extract_sparse_file(const char *zip_filename,
             old_bytes = cur_bytes;
         }
 
-        char *out_ptr = buf;
-        ssize_t nwritten;
+        if (!sparseGetChunk(ctx, &chunk)) {
+            error("Failed to read sparse file %s", zip_filename);
+            goto error_fd_opened;
+        } else if (chunk.begin == chunk.end) {
+            // EOF
+            break;
+        }
 
-        do {
-            if ((nwritten = write(fd, out_ptr, n)) < 0) {
-                error("%s: Failed to write: %s",
-                      out_filename, strerror(errno));
+        // Don't write out zeros
+        if (chunk.type == CHUNK_TYPE_DONT_CARE
+                || (chunk.type == CHUNK_TYPE_FILL && chunk.fillVal == 0)) {
+            if (!sparseSkipChunk(ctx)) {
+                error("Failed to read sparse file %s", zip_filename);
                 goto error_fd_opened;
             }
 
-            n -= nwritten;
-            out_ptr += nwritten;
-            cur_bytes += nwritten;
-        } while (n > 0);
+            if (!write_zero_range(fd, out_filename, is_blkdev,
+                                  chunk.type == CHUNK_TYPE_DONT_CARE,
+                                  chunk.begin, chunk.end - chunk.begin)) {
+                goto error_fd_opened;
+            }
+
+            cur_bytes += chunk.end - chunk.begin;
+            continue;
+        }
+
+        if (!sparseRead(ctx, buf, std::min<uint64_t>(
+                sizeof(buf), chunk.end - chunk.begin), &n)) {
+            error("Failed to read sparse file %s", zip_filename);
+            goto error_fd_opened;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!write_fully(fd, out_filename, buf, n)) {
+            goto error_fd_opened;
+        }
+
+        cur_bytes += n;
     }
-    if (!sparse_ret) {
-        error("Failed to read sparse file %s", zip_filename);
+
+    // Extend regular files that end with a hole
+    if (!is_blkdev && ftruncate64(fd, max_bytes) < 0) {
+        error("%s: Failed to set file size: %s",
+              out_filename, strerror(errno));
         goto error_fd_opened;
     }
 